@@ -27,25 +27,44 @@
 #include "libtarmac/parser.hh"
 #include "libtarmac/registers.hh"
 
+#include <algorithm>
 #include <climits>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <exception>
 #include <functional>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+using std::condition_variable;
+using std::deque;
 using std::exception;
+using std::find;
 using std::invalid_argument;
 using std::istringstream;
+using std::list;
+using std::lock_guard;
+using std::make_shared;
 using std::make_unique;
 using std::max;
 using std::min;
+using std::mutex;
 using std::ostringstream;
+using std::pair;
 using std::ref;
+using std::shared_ptr;
 using std::string;
+using std::thread;
+using std::unique_lock;
+using std::unordered_map;
 using std::vector;
 
 inline int FoldStatePayload::cmp(const FoldStatePayload &rhs) const
@@ -59,9 +78,9 @@ class FoldStateSearchOutOfRangeException : exception {
 };
 
 struct FoldStateByPhysLineSearcher {
-    unsigned target, vislines_before;
+    LineNo target, vislines_before;
 
-    FoldStateByPhysLineSearcher(unsigned target)
+    FoldStateByPhysLineSearcher(LineNo target)
         : target(target), vislines_before(0)
     {
     }
@@ -94,9 +113,9 @@ struct FoldStateByPhysLineSearcher {
 };
 
 struct FoldStateByVisLineSearcher {
-    unsigned target, vislines_before, physlines_before;
+    LineNo target, vislines_before, physlines_before;
 
-    FoldStateByVisLineSearcher(unsigned target)
+    FoldStateByVisLineSearcher(LineNo target)
         : target(target), vislines_before(0), physlines_before(0)
     {
     }
@@ -130,8 +149,24 @@ struct FoldStateByVisLineSearcher {
     }
 };
 
+struct FoldStateAtPhysLineSearcher {
+    FoldStatePayload key;
+
+    FoldStateAtPhysLineSearcher(LineNo physline)
+    {
+        key.first_physical_line = key.last_physical_line = physline;
+    }
+    FoldStateAtPhysLineSearcher(const FoldStateAtPhysLineSearcher &) = delete;
+
+    int operator()(FoldStateAnnotation *, FoldStatePayload &here,
+                   FoldStateAnnotation *)
+    {
+        return key.cmp(here);
+    }
+};
+
 struct FoldStateEndOfListSearcher {
-    unsigned vislines_before = 0;
+    LineNo vislines_before = 0;
 
     FoldStateEndOfListSearcher() = default;
     FoldStateEndOfListSearcher(const FoldStateEndOfListSearcher &) = delete;
@@ -344,7 +379,156 @@ void HighlightedLine::replace_instruction(Browser &br)
     display_len = text.size();
 }
 
-Browser::TraceView::TraceView(Browser &br) : br(br), index(br.index)
+/*
+ * Cache of highlighted trace lines for a TraceView, keyed by the first
+ * physical line of the node they came from, keeping the most recently
+ * used HIGHLIGHT_CACHE_NODES nodes. A worker thread, started the first
+ * time it's needed, fills in nodes queued by prefetch() while the user
+ * is looking at the screen.
+ *
+ * Everything in the cache is made with the same display parameters.
+ * If a caller asks for different ones, the cache is emptied, and
+ * 'generation' is incremented so that the worker can tell if the
+ * lines it was working on are no longer wanted.
+ */
+class HighlightedLineCache {
+    using Lines = Browser::TraceView::HighlightedLines;
+    static const size_t HIGHLIGHT_CACHE_NODES = 4096;
+
+    Browser &br;
+
+    mutex mtx;
+    condition_variable wakeup;
+    size_t display_len = 0;
+    bool substitute = false;
+    unsigned generation = 0;
+    list<pair<LineNo, shared_ptr<const Lines>>> lru; // most recent first
+    unordered_map<LineNo, decltype(lru)::iterator> nodes;
+    deque<SeqOrderPayload> queue;
+    bool stopping = false;
+    thread worker;
+
+    shared_ptr<const Lines> make_lines(const SeqOrderPayload &node,
+                                       size_t display_len, bool substitute)
+    {
+        auto lines = make_shared<Lines>();
+        for (const StringSpan &span : br.index.get_trace_line_spans(node)) {
+            string text = span.str();
+            lines->emplace_back(text, br.index.parseParams(),
+                                display_len ? display_len : text.size());
+            if (substitute)
+                lines->back().replace_instruction(br);
+        }
+        return lines;
+    }
+
+    // Both of these must be called with the mutex held.
+    shared_ptr<const Lines> lookup(LineNo key)
+    {
+        auto it = nodes.find(key);
+        if (it == nodes.end())
+            return nullptr;
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->second;
+    }
+    void insert(LineNo key, shared_ptr<const Lines> lines)
+    {
+        if (nodes.count(key))
+            return;
+        lru.emplace_front(key, lines);
+        nodes[key] = lru.begin();
+        if (lru.size() > HIGHLIGHT_CACHE_NODES) {
+            nodes.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+
+    void run_worker()
+    {
+        unique_lock<mutex> lock(mtx);
+        while (true) {
+            wakeup.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (stopping)
+                return;
+
+            SeqOrderPayload node = queue.front();
+            queue.pop_front();
+            if (nodes.count(node.trace_file_firstline))
+                continue;
+
+            size_t dl = display_len;
+            bool sub = substitute;
+            unsigned gen = generation;
+            lock.unlock();
+            shared_ptr<const Lines> lines = make_lines(node, dl, sub);
+            lock.lock();
+            if (gen == generation)
+                insert(node.trace_file_firstline, lines);
+        }
+    }
+
+  public:
+    HighlightedLineCache(Browser &br) : br(br) {}
+
+    ~HighlightedLineCache()
+    {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        if (worker.joinable())
+            worker.join();
+    }
+
+    shared_ptr<const Lines> get(const SeqOrderPayload &node,
+                                size_t display_len_, bool substitute_)
+    {
+        LineNo key = node.trace_file_firstline;
+        {
+            lock_guard<mutex> lock(mtx);
+            if (display_len_ != display_len || substitute_ != substitute) {
+                display_len = display_len_;
+                substitute = substitute_;
+                generation++;
+                lru.clear();
+                nodes.clear();
+                queue.clear();
+            }
+            if (auto lines = lookup(key))
+                return lines;
+        }
+
+        shared_ptr<const Lines> lines =
+            make_lines(node, display_len_, substitute_);
+        lock_guard<mutex> lock(mtx);
+        if (display_len_ == display_len && substitute_ == substitute)
+            insert(key, lines);
+        return lines;
+    }
+
+    // Replace the queue of nodes for the worker thread to fill in.
+    void prefetch(const vector<SeqOrderPayload> &todo)
+    {
+        {
+            lock_guard<mutex> lock(mtx);
+            queue.clear();
+            for (const SeqOrderPayload &node : todo)
+                if (!nodes.count(node.trace_file_firstline))
+                    queue.push_back(node);
+            if (queue.empty())
+                return;
+            if (!worker.joinable())
+                worker = thread(&HighlightedLineCache::run_worker, this);
+        }
+        wakeup.notify_one();
+    }
+};
+
+Browser::TraceView::TraceView(Browser &br)
+    : br(br), index(br.index),
+      line_cache(make_shared<HighlightedLineCache>(br)),
+      last_prefetch_visline(0)
 {
     // Populate fold_states with a single initial entry covering
     // the whole file.
@@ -355,10 +539,30 @@ Browser::TraceView::TraceView(Browser &br) : br(br), index(br.index)
     }
 }
 
-void Browser::TraceView::set_fold_state(unsigned firstline, unsigned lastline,
+void Browser::TraceView::set_fold_state(LineNo firstline, LineNo lastline,
                                         unsigned mindepth, unsigned maxdepth)
 {
     FoldStatePayload fsp, fsp_found;
+
+    /*
+     * If the regions either side of the new one have the same depth
+     * range, extend it to swallow them, so that folding and unfolding
+     * calls one at a time doesn't leave the tree fragmented into
+     * more and more regions.
+     */
+    if (firstline > 1) {
+        FoldStateAtPhysLineSearcher searcher(firstline - 1);
+        if (fold_states.search(ref(searcher), &fsp_found) &&
+            fsp_found.mindepth == mindepth && fsp_found.maxdepth == maxdepth)
+            firstline = fsp_found.first_physical_line;
+    }
+    {
+        FoldStateAtPhysLineSearcher searcher(lastline + 1);
+        if (fold_states.search(ref(searcher), &fsp_found) &&
+            fsp_found.mindepth == mindepth && fsp_found.maxdepth == maxdepth)
+            lastline = fsp_found.last_physical_line;
+    }
+
     fsp.first_physical_line = firstline;
     fsp.last_physical_line = lastline;
     fsp.mindepth = mindepth;
@@ -371,8 +575,23 @@ void Browser::TraceView::set_fold_state(unsigned firstline, unsigned lastline,
          fsp.first_quasivis_line);
 
     /*
-     * Clear space for the new fsp in the tree, by deleting any
-     * previous entry overlapping its space, and reinserting the
+     * The regions always cover the whole file between them, so if
+     * there isn't one either side of the new region, it supersedes
+     * all of them, and we can throw them away wholesale instead of
+     * removing each one from the tree in turn. This makes folding or
+     * unfolding everything cheap however many regions there were.
+     */
+    FoldStateAtPhysLineSearcher before(firstline - 1), after(lastline + 1);
+    if (!fold_states.search(ref(before), nullptr) &&
+        !fold_states.search(ref(after), nullptr)) {
+        fold_states.clear();
+        fold_states.insert(fsp);
+        return;
+    }
+
+    /*
+     * Otherwise, clear space for the new fsp in the tree, by deleting
+     * any previous entry overlapping its space, and reinserting the
      * non-superseded parts if it only partly overlapped.
      */
     while (fold_states.remove(fsp, &fsp_found)) {
@@ -391,7 +610,7 @@ void Browser::TraceView::set_fold_state(unsigned firstline, unsigned lastline,
             fsp_part.first_physical_line = fsp.last_physical_line + 1;
             fsp_part.n_physical_lines = (fsp_part.last_physical_line -
                                          fsp_part.first_physical_line + 1);
-            unsigned first_quasivis_line_after =
+            LineNo first_quasivis_line_after =
                 fsp_part.first_quasivis_line + fsp_part.n_visible_lines;
             fsp_part.n_visible_lines = br.lrt_translate_range(
                 fsp_part.first_physical_line - 1, fsp_part.last_physical_line,
@@ -404,8 +623,9 @@ void Browser::TraceView::set_fold_state(unsigned firstline, unsigned lastline,
     fold_states.insert(fsp);
 }
 
-unsigned Browser::TraceView::visible_to_physical_line(unsigned visline)
+LineNo Browser::TraceView::visible_to_physical_line(LineNo visline)
 {
+    QueryStats::Timer timer(QueryStats::FoldLookup);
     FoldStatePayload fsp;
 
     /*
@@ -413,19 +633,23 @@ unsigned Browser::TraceView::visible_to_physical_line(unsigned visline)
      */
     FoldStateByVisLineSearcher searcher(visline);
     bool ret = fold_states.search(ref(searcher), &fsp);
-    unsigned physline = 1 + searcher.physlines_before;
-    if (ret)
-        physline += br.lrt_translate_range(
-            fsp.first_quasivis_line,
-            fsp.first_quasivis_line + visline - searcher.vislines_before,
-            fsp.mindepth, fsp.maxdepth, 0, UINT_MAX);
-    return physline;
+    if (!ret)
+        return 1 + searcher.physlines_before;
+
+    // Translate straight from the quasi-visible line number to the
+    // physical one, rather than counting from the start of the
+    // region, which is only right if the region's first line is
+    // itself visible.
+    return 1 + br.lrt_translate(fsp.first_quasivis_line + visline -
+                                    searcher.vislines_before,
+                                fsp.mindepth, fsp.maxdepth, 0, UINT_MAX);
 }
 
-unsigned Browser::TraceView::physical_to_visible_line(unsigned physline)
+LineNo Browser::TraceView::physical_to_visible_line(LineNo physline)
 {
+    QueryStats::Timer timer(QueryStats::FoldLookup);
     FoldStatePayload fsp;
-    unsigned vislines_before;
+    LineNo vislines_before;
 
     /*
      * Find which fold_states range we're in.
@@ -440,14 +664,21 @@ unsigned Browser::TraceView::physical_to_visible_line(unsigned physline)
     return vislines_before;
 }
 
-unsigned Browser::TraceView::total_visible_lines()
+LineNo Browser::TraceView::total_visible_lines()
 {
     FoldStateEndOfListSearcher searcher;
     fold_states.search(ref(searcher), nullptr);
     return searcher.vislines_before;
 }
 
-bool Browser::get_node_by_physline(unsigned physline, SeqOrderPayload *node,
+void Browser::prepare_index(bool prefault)
+{
+    index.advise(AccessPattern::Random);
+    if (prefault)
+        index.prefault(max(1U, thread::hardware_concurrency()));
+}
+
+bool Browser::get_node_by_physline(LineNo physline, SeqOrderPayload *node,
                                    unsigned *offset_within_node)
 {
     bool ret = node_at_line(physline, node);
@@ -456,7 +687,7 @@ bool Browser::get_node_by_physline(unsigned physline, SeqOrderPayload *node,
     return ret;
 }
 
-bool Browser::TraceView::get_node_by_visline(unsigned visline,
+bool Browser::TraceView::get_node_by_visline(LineNo visline,
                                              SeqOrderPayload *node,
                                              unsigned *offset_within_node)
 {
@@ -464,15 +695,54 @@ bool Browser::TraceView::get_node_by_visline(unsigned visline,
                                    offset_within_node);
 }
 
+shared_ptr<const Browser::TraceView::HighlightedLines>
+Browser::TraceView::get_highlighted_lines(const SeqOrderPayload &node,
+                                          size_t display_len,
+                                          bool substitute_branch_targets)
+{
+    return line_cache->get(node, display_len,
+                           substitute_branch_targets && br.has_image());
+}
+
+void Browser::TraceView::prefetch_around(LineNo visline, unsigned height)
+{
+    LineNo total = total_visible_lines();
+    LineNo before = visline > height ? visline - height : 0;
+    LineNo after = min(total, visline + height);
+    LineNo after_end = min(total, after + height);
+
+    // Find the nodes covering a range of visible lines.
+    vector<SeqOrderPayload> nodes;
+    auto add_nodes = [&](LineNo start, LineNo end) {
+        SeqOrderPayload node;
+        unsigned offset;
+        for (LineNo line = start;
+             line < end && get_node_by_visline(line, &node, &offset);
+             line += node.trace_file_lines - offset)
+            nodes.push_back(node);
+    };
+
+    if (visline < last_prefetch_visline) {
+        add_nodes(before, visline);
+        add_nodes(after, after_end);
+    } else {
+        add_nodes(after, after_end);
+        add_nodes(before, visline);
+    }
+    last_prefetch_visline = visline;
+
+    line_cache->prefetch(nodes);
+}
+
 void Browser::TraceView::update_visible_node()
 {
     // visline_of_next_node is the first visible node after this
     // one.
-    unsigned visline_of_next_node =
+    LineNo visline_of_next_node =
         physical_to_visible_line(curr_logical_node.trace_file_firstline +
                                  curr_logical_node.trace_file_lines);
     if (visline_of_next_node >= 1) {
-        unsigned physline_of_prev_node =
+        LineNo physline_of_prev_node =
             visible_to_physical_line(visline_of_next_node - 1);
         bool ret = br.node_at_line(physline_of_prev_node, &curr_visible_node);
         (void)ret; // squash compiler warning if asserts compiled out
@@ -485,9 +755,9 @@ void Browser::TraceView::update_visible_node()
 void Browser::TraceView::visible_to_logical_node(SeqOrderPayload &visnode,
                                                  SeqOrderPayload *lognode)
 {
-    unsigned curr_last_visline = physical_to_visible_line(
+    LineNo curr_last_visline = physical_to_visible_line(
         visnode.trace_file_firstline + visnode.trace_file_lines - 1);
-    unsigned physline_of_target_node =
+    LineNo physline_of_target_node =
         visible_to_physical_line(curr_last_visline + 1) - 1;
     bool ret = br.node_at_line(physline_of_target_node, lognode);
     (void)ret; // squash compiler warning if asserts compiled out
@@ -507,7 +777,7 @@ bool Browser::TraceView::goto_time(Time t)
     return true;
 }
 
-bool Browser::TraceView::goto_physline(unsigned line)
+bool Browser::TraceView::goto_physline(LineNo line)
 {
     if (!br.node_at_line(line, &curr_logical_node))
         return false;
@@ -515,7 +785,7 @@ bool Browser::TraceView::goto_physline(unsigned line)
     return true;
 }
 
-bool Browser::TraceView::goto_visline(unsigned line)
+bool Browser::TraceView::goto_visline(LineNo line)
 {
     bool ok = false;
 
@@ -576,8 +846,8 @@ bool Browser::TraceView::lookup_register(const RegisterId &r, uint64_t &out)
      */
     if (r == REG_pc) {
         SeqOrderPayload next_logical_node;
-        unsigned target_line = (curr_logical_node.trace_file_firstline +
-                                curr_logical_node.trace_file_lines);
+        LineNo target_line = (curr_logical_node.trace_file_firstline +
+                              curr_logical_node.trace_file_lines);
         bool got_next_node = br.node_at_line(target_line, &next_logical_node);
         if (got_next_node)
             out = next_logical_node.pc;
@@ -606,8 +876,19 @@ bool Browser::TraceView::lookup_register(const RegisterId &r, uint64_t &out)
     return true;
 }
 
+bool Browser::TraceView::lookup_memory(Addr addr, size_t size, uint64_t &out)
+{
+    auto val = br.get_mem_value(curr_logical_node.memory_root, addr, size);
+    if (!val.first)
+        throw invalid_argument(
+            format(_("memory at address {:#x} is not defined"), addr));
+    out = val.second;
+    return true;
+}
+
 bool Browser::TraceView::goto_pc(unsigned long long pc, int dir)
 {
+    QueryStats::Timer timer(QueryStats::GotoPC);
     pc &= ~(unsigned long long)1;
     ByPCPayload pcfinder, pcfound;
     pcfinder.pc = pc;
@@ -634,17 +915,63 @@ bool Browser::TraceView::goto_pc(unsigned long long pc, int dir)
      * likely wanted to look at the register and stack arguments
      * set up by the caller.)
      */
-    unsigned target_line = pcfound.trace_file_firstline;
+    LineNo target_line = pcfound.trace_file_firstline;
     if (target_line > 0)
         target_line--;
     return goto_physline(target_line);
 }
 
+bool Browser::TraceView::goto_condition(Expression &cond, int dir)
+{
+    SeqOrderPayload found;
+    if (!br.find_condition(curr_logical_node, cond, dir, &found))
+        return false;
+    return goto_physline(found.trace_file_firstline);
+}
+
 bool Browser::TraceView::goto_cpu_exception(int dir)
 {
     return goto_pc(CPU_EXCEPTION_PC, dir);
 }
 
+bool Browser::TraceView::goto_search_match(const TraceSearch &search, int dir)
+{
+    // Search from the last line of the current node going forwards,
+    // or its first line going backwards, so as not to find a match in
+    // the node we're already at.
+    LineNo line = curr_visible_node.trace_file_firstline;
+    if (dir > 0)
+        line += curr_visible_node.trace_file_lines - 1;
+    LineNo total_vislines = total_visible_lines();
+
+    while (true) {
+        LineNo match;
+        if (!search.find(line + index.lineno_offset, dir, &match) ||
+            match <= index.lineno_offset)
+            return false; // no match, or only in the header before the trace
+        match -= index.lineno_offset;
+
+        // physical_to_visible_line of a hidden line gives the visible
+        // line after it, so converting back again tells us whether the
+        // match is visible, and if not, how far to skip to get out of
+        // the folded region containing it.
+        LineNo visline = physical_to_visible_line(match);
+        if (visline < total_vislines &&
+            visible_to_physical_line(visline) == match)
+            return goto_physline(match);
+
+        if (dir > 0) {
+            if (visline >= total_vislines)
+                return false;
+            line = visible_to_physical_line(visline) - 1;
+        } else {
+            if (visline == 0)
+                return false;
+            line = visible_to_physical_line(visline - 1) + 1;
+        }
+    }
+}
+
 struct TraceParseContext : ParseContext {
     Browser &br;
     TraceParseContext(Browser &br) : br(br) {}
@@ -668,6 +995,58 @@ struct TraceExecutionContext : ExecutionContext {
     {
         return vu.lookup_register(reg, out);
     }
+
+    bool lookup_memory(uint64_t addr, size_t size, uint64_t &out) const
+    {
+        return vu.lookup_memory(addr, size, out);
+    }
+};
+
+// Execution context for evaluating a parsed expression repeatedly,
+// e.g. as the address of a memory window following the current
+// position. All the registers the expression uses are fetched up
+// front by a single get_regs call, instead of one search of the
+// memory tree for each.
+struct PrefetchedExecutionContext : ExecutionContext {
+    Browser::TraceView &vu;
+    vector<RegisterId> regs;
+    vector<RegisterValue> values;
+
+    PrefetchedExecutionContext(Browser::TraceView &vu, const Expression &expr)
+        : vu(vu)
+    {
+        vector<RegisterId> used;
+        expr.collect_registers(used);
+        for (const RegisterId &r : used)
+            if (!(r == REG_pc) &&
+                find(regs.begin(), regs.end(), r) == regs.end())
+                regs.push_back(r);
+        if (!regs.empty())
+            values = vu.br.get_regs(vu.curr_logical_node.memory_root, regs);
+    }
+
+    bool lookup_register(const RegisterId &reg, uint64_t &out) const
+    {
+        auto it = find(regs.begin(), regs.end(), reg);
+        if (it == regs.end())
+            return vu.lookup_register(reg, out); // e.g. the PC
+
+        // Same interpretation as TraceView::lookup_register.
+        const RegisterValue &value = values[it - regs.begin()];
+        out = 0;
+        for (size_t j = value.val.size(); j-- > 0;) {
+            if (!value.def[j])
+                throw invalid_argument(format(_("register {} is not defined"),
+                                              reg_name(reg)));
+            out = (out << 8) | value.val[j];
+        }
+        return true;
+    }
+
+    bool lookup_memory(uint64_t addr, size_t size, uint64_t &out) const
+    {
+        return vu.lookup_memory(addr, size, out);
+    }
 };
 
 static Addr evaluate_inner(ExprPtr expr, const ExecutionContext &ec)
@@ -713,8 +1092,10 @@ Addr Browser::evaluate_expression_addr(ExprPtr expr)
 
 ExprPtr Browser::parse_expression(const string &line, ostringstream &error)
 {
+    // Expressions parsed here are kept and re-evaluated every time
+    // the view moves, so any constant arithmetic is done once now.
     TraceParseContext pc(*this);
-    return ::parse_expression(line, pc, error);
+    return simplify_expression(::parse_expression(line, pc, error));
 }
 
 Addr Browser::TraceView::evaluate_expression_addr(const string &line)
@@ -726,7 +1107,11 @@ Addr Browser::TraceView::evaluate_expression_addr(const string &line)
 
 Addr Browser::TraceView::evaluate_expression_addr(ExprPtr expr)
 {
-    TraceExecutionContext ec(*this);
+    if (expr->is_constant()) {
+        TrivialExecutionContext ec;
+        return evaluate_inner(expr, ec);
+    }
+    PrefetchedExecutionContext ec(*this, *expr);
     return evaluate_inner(expr, ec);
 }
 
@@ -747,8 +1132,8 @@ bool Browser::TraceView::get_current_pc(unsigned long long &pc)
      * _before_ the execution of.
      */
     SeqOrderPayload next_logical_node;
-    unsigned target_line = (curr_logical_node.trace_file_firstline +
-                            curr_logical_node.trace_file_lines);
+    LineNo target_line = (curr_logical_node.trace_file_firstline +
+                          curr_logical_node.trace_file_lines);
     if (!br.node_at_line(target_line, &next_logical_node))
         return false;
     pc = next_logical_node.pc;
@@ -758,7 +1143,7 @@ bool Browser::TraceView::get_current_pc(unsigned long long &pc)
 bool Browser::TraceView::next_visible_node(SeqOrderPayload &node,
                                            SeqOrderPayload *ret)
 {
-    unsigned curr_last_visline = physical_to_visible_line(
+    LineNo curr_last_visline = physical_to_visible_line(
         node.trace_file_firstline + node.trace_file_lines - 1);
     return get_node_by_visline(curr_last_visline + 1, ret);
 }
@@ -766,7 +1151,7 @@ bool Browser::TraceView::next_visible_node(SeqOrderPayload &node,
 bool Browser::TraceView::prev_visible_node(SeqOrderPayload &node,
                                            SeqOrderPayload *ret)
 {
-    unsigned curr_first_visline =
+    LineNo curr_first_visline =
         physical_to_visible_line(node.trace_file_firstline);
     return (curr_first_visline > 1 &&
             get_node_by_visline(curr_first_visline - 1, ret));
@@ -783,7 +1168,7 @@ bool Browser::TraceView::prev_visible_node(SeqOrderPayload *ret)
 }
 
 bool Browser::TraceView::physline_range_for_containing_function(
-    SeqOrderPayload &node, unsigned *firstline, unsigned *lastline,
+    SeqOrderPayload &node, LineNo *firstline, LineNo *lastline,
     unsigned *depth)
 {
     // First, find out the depth of the function in question.
@@ -805,13 +1190,13 @@ bool Browser::TraceView::physline_range_for_containing_function(
 
     // Now find the limits of the function at this depth, by searching
     // for the next/previous node at less than fold_depth.
-    unsigned physlinehere = node.trace_file_firstline + node.trace_file_lines;
+    LineNo physlinehere = node.trace_file_firstline + node.trace_file_lines;
 
-    unsigned foldedlineafter =
+    LineNo foldedlineafter =
         br.lrt_translate(physlinehere - 1, 0, UINT_MAX, 0, fold_depth);
-    unsigned physlineafter =
+    LineNo physlineafter =
         br.lrt_translate(foldedlineafter, 0, fold_depth, 0, UINT_MAX) + 1;
-    unsigned physlinefirstwithin =
+    LineNo physlinefirstwithin =
         br.lrt_translate(foldedlineafter - 1, 0, fold_depth, 0, UINT_MAX) + 2;
 
     *firstline = physlinefirstwithin;
@@ -821,7 +1206,7 @@ bool Browser::TraceView::physline_range_for_containing_function(
 }
 
 bool Browser::TraceView::physline_range_for_folded_function_after(
-    SeqOrderPayload &visnode, unsigned *firstline, unsigned *lastline,
+    SeqOrderPayload &visnode, LineNo *firstline, LineNo *lastline,
     unsigned *depth)
 {
     SeqOrderPayload lognode;
@@ -838,6 +1223,7 @@ bool Browser::TraceView::physline_range_for_folded_function_after(
 
 auto Browser::TraceView::node_fold_state(SeqOrderPayload &node) -> NodeFoldState
 {
+    QueryStats::Timer timer(QueryStats::FoldState);
     SeqOrderPayload succ;
     if (br.get_next_node(node, &succ) && succ.call_depth > node.call_depth) {
         // This node's physical successor is at a higher call depth,
@@ -883,13 +1269,18 @@ size_t format_reg_length(const RegisterId &r)
 
 void Browser::format_reg(string &dispstr, string &disptype, const RegisterId &r,
                          OFF_T memroot, OFF_T diff_memroot,
-                         unsigned diff_minline)
+                         LineNo diff_minline)
+{
+    vector<RegisterValue> values =
+        get_regs(memroot, {r}, diff_memroot, diff_minline);
+    format_reg(dispstr, disptype, r, values[0]);
+}
+
+void Browser::format_reg(string &dispstr, string &disptype, const RegisterId &r,
+                         const RegisterValue &value)
 {
-    unsigned iflags = get_iflags(memroot);
-    Addr roffset = reg_offset(r, iflags);
     size_t rsize = reg_size(r);
-    vector<unsigned char> val(rsize), def(rsize);
-    getmem(memroot, 'r', roffset, rsize, &val[0], &def[0]);
+    const vector<unsigned char> &val = value.val, &def = value.def;
 
     dispstr = disptype = "";
     dispstr += reg_name(r);
@@ -899,16 +1290,7 @@ void Browser::format_reg(string &dispstr, string &disptype, const RegisterId &r,
 
     size_t valstart = dispstr.size();
 
-    bool highlight_diff = false;
-    if (diff_memroot) {
-        Addr diff_lo, diff_hi;
-        if (find_next_mod(diff_memroot, 'r', roffset, diff_minline, +1, diff_lo,
-                          diff_hi) &&
-            diff_lo < roffset + rsize)
-            highlight_diff = true;
-    }
-
-    int dh = highlight_diff ? 'A' - 'a' : 0;
+    int dh = value.changed ? 'A' - 'a' : 0;
     bool all_defined = true;
     unsigned long long intval = 0;
 
@@ -1011,7 +1393,7 @@ void Browser::format_memory_split(string &dispaddr, string &typeaddr,
                                   Addr addr, bool addr_known,
                                   int bytes_per_line, int addr_chars,
                                   OFF_T memroot, OFF_T diff_memroot,
-                                  unsigned diff_minline)
+                                  LineNo diff_minline)
 {
     dispaddr.clear();
     typeaddr.clear();
@@ -1039,10 +1421,22 @@ void Browser::format_memory_split(string &dispaddr, string &typeaddr,
 
     Addr diff_lo, diff_hi;
     bool got_diff =
-        addr_known
-            ? false
-            : diff_memroot && find_next_mod(diff_memroot, 'm', addr,
-                                            diff_minline, +1, diff_lo, diff_hi);
+        addr_known && diff_memroot &&
+        find_next_mod(diff_memroot, 'm', addr, diff_minline, +1, diff_lo,
+                      diff_hi);
+
+    // Read the whole line's worth of memory in one walk of the tree,
+    // rather than looking up each byte separately.
+    vector<unsigned char> vals(bytes_per_line), defs(bytes_per_line);
+    if (addr_known) {
+        Addr line_addr = addr;
+        visit_mem(memroot, 'm', line_addr, bytes_per_line,
+                  [&](const MemoryExtent &ext) {
+                      memcpy(&vals[ext.addr - line_addr], ext.data, ext.size);
+                      memset(&defs[ext.addr - line_addr], 1, ext.size);
+                      return true;
+                  });
+    }
 
     int prev_dh = 0;
     for (int b = 0; b < bytes_per_line; b++) {
@@ -1051,11 +1445,7 @@ void Browser::format_memory_split(string &dispaddr, string &typeaddr,
                                      diff_lo, diff_hi);
         }
 
-        unsigned char val, def;
-        if (addr_known)
-            getmem(memroot, 'm', addr, 1, &val, &def);
-        else
-            def = 0;
+        unsigned char val = vals[b], def = defs[b];
         int dh =
             (got_diff && addr >= diff_lo && addr <= diff_hi ? 'A' - 'a' : 0);
 
@@ -1093,7 +1483,7 @@ void Browser::format_memory_split(string &dispaddr, string &typeaddr,
 void Browser::format_memory(string &line, string &type, Addr addr,
                             bool addr_known, int bytes_per_line, int addr_chars,
                             size_t &hexpos, OFF_T memroot, OFF_T diff_memroot,
-                            unsigned diff_minline)
+                            LineNo diff_minline)
 {
     string dispaddr, typeaddr, disphex, typehex, dispchars, typechars;
 
@@ -25,24 +25,26 @@
 #include "libtarmac/misc.hh"
 #include "libtarmac/parser.hh"
 #include "libtarmac/registers.hh"
+#include "libtarmac/search.hh"
 
 #include <memory>
 #include <utility>
+#include <vector>
 
 struct FoldStatePayload {
-    unsigned first_physical_line, last_physical_line;
+    LineNo first_physical_line, last_physical_line;
     // first_quasivis_line gives the indiex of what _would_ be the
     // first visible line in this region, if the entire buffer was at
     // this particular min/max depth. In other words, this is a value
     // you can pass to lrt_translate_range to compute offsets within
     // this region.
-    unsigned first_quasivis_line;
+    LineNo first_quasivis_line;
     unsigned mindepth, maxdepth;
-    unsigned n_physical_lines, n_visible_lines;
+    LineNo n_physical_lines, n_visible_lines;
     int cmp(const FoldStatePayload &rhs) const;
 };
 struct FoldStateAnnotation {
-    unsigned n_physical_lines{0}, n_visible_lines{0};
+    LineNo n_physical_lines{0}, n_visible_lines{0};
     FoldStateAnnotation() = default;
     FoldStateAnnotation(const FoldStateAnnotation &) = default;
     FoldStateAnnotation(const FoldStatePayload &payload)
@@ -58,6 +60,9 @@ struct FoldStateAnnotation {
     }
 };
 
+class HighlightedLine;
+class HighlightedLineCache;
+
 class Browser : public IndexNavigator {
     using IndexNavigator::IndexNavigator;
 
@@ -65,6 +70,7 @@ class Browser : public IndexNavigator {
     class TraceView {
         friend class Browser;
         friend struct TraceExecutionContext;
+        friend struct PrefetchedExecutionContext;
 
       public:
         Browser &br;
@@ -96,23 +102,58 @@ class Browser : public IndexNavigator {
                                      SeqOrderPayload *lognode);
 
         bool lookup_register(const RegisterId &r, uint64_t &out);
+        bool lookup_memory(Addr addr, size_t size, uint64_t &out);
+
+        // Lines of the trace that have already been highlighted for
+        // display, and the visible line at the top of the screen the
+        // last time prefetch_around was called, to tell which way
+        // we're scrolling.
+        std::shared_ptr<HighlightedLineCache> line_cache;
+        LineNo last_prefetch_visline;
 
       public:
         TraceView(Browser &br);
 
-        unsigned visible_to_physical_line(unsigned visline);
-        unsigned physical_to_visible_line(unsigned physline);
-        unsigned total_visible_lines();
-        bool get_node_by_visline(unsigned visline, SeqOrderPayload *node,
+        LineNo visible_to_physical_line(LineNo visline);
+        LineNo physical_to_visible_line(LineNo physline);
+        LineNo total_visible_lines();
+        bool get_node_by_visline(LineNo visline, SeqOrderPayload *node,
                                  unsigned *offset_within_node = NULL);
 
+        // Return the lines of a node as HighlightedLines, made with
+        // the given display_len (or 0 to use the length of each line),
+        // and with replace_instruction called on them if
+        // substitute_branch_targets is set and we have an image.
+        // Lines are cached, so redrawing the same part of the trace
+        // again doesn't have to read and parse it again.
+        using HighlightedLines = std::vector<HighlightedLine>;
+        std::shared_ptr<const HighlightedLines>
+        get_highlighted_lines(const SeqOrderPayload &node, size_t display_len,
+                              bool substitute_branch_targets);
+
+        // Call this after displaying 'height' visible lines starting
+        // at 'visline'. It sets a background thread highlighting the
+        // screenfuls either side of them (with the display parameters
+        // of the last get_highlighted_lines call), starting with the
+        // one in the direction we last scrolled, so that they're
+        // ready in the cache if we scroll there.
+        void prefetch_around(LineNo visline, unsigned height);
+
         bool goto_time(Time t);
-        bool goto_physline(unsigned line);
-        bool goto_visline(unsigned line);
+        bool goto_physline(LineNo line);
+        bool goto_visline(LineNo line);
         bool goto_buffer_limit(bool end);
         bool goto_pc(unsigned long long pc, int dir);
         bool goto_cpu_exception(int dir);
 
+        // Jump to the next / previous line of the trace matching a
+        // search, skipping any lines hidden by folding.
+        bool goto_search_match(const TraceSearch &search, int dir);
+
+        // Jump to the next / previous point at which a condition
+        // becomes true (see IndexNavigator::find_condition).
+        bool goto_condition(Expression &cond, int dir);
+
         bool position_hidden();
         bool get_current_pc(unsigned long long &pc);
 
@@ -138,15 +179,15 @@ class Browser : public IndexNavigator {
         // function in question being unfolded, and none of its
         // subfunctions.
         bool physline_range_for_containing_function(SeqOrderPayload &node,
-                                                    unsigned *firstline,
-                                                    unsigned *lastline,
+                                                    LineNo *firstline,
+                                                    LineNo *lastline,
                                                     unsigned *depth);
         bool physline_range_for_folded_function_after(SeqOrderPayload &node,
-                                                      unsigned *firstline,
-                                                      unsigned *lastline,
+                                                      LineNo *firstline,
+                                                      LineNo *lastline,
                                                       unsigned *depth);
 
-        void set_fold_state(unsigned firstline, unsigned lastline,
+        void set_fold_state(LineNo firstline, LineNo lastline,
                             unsigned mindepth, unsigned maxdepth);
 
         // This function can evaluate an expression which refers to
@@ -159,7 +200,13 @@ class Browser : public IndexNavigator {
     Browser(const Browser &) = delete;
     Browser(Browser &&) = delete;
 
-    bool get_node_by_physline(unsigned physline, SeqOrderPayload *node,
+    // Tell the index that it's about to be browsed, which means
+    // random access. If 'prefault' is true, also read the whole index
+    // into memory now, so that moving around a trace whose index
+    // isn't already cached doesn't keep waiting for the disk.
+    void prepare_index(bool prefault);
+
+    bool get_node_by_physline(LineNo physline, SeqOrderPayload *node,
                               unsigned *offset_within_node = NULL);
 
     // Fills in dispstr with a string of the form 'regname=value',
@@ -174,7 +221,13 @@ class Browser : public IndexNavigator {
     //           changed its value between memroot and diff_memroot.
     void format_reg(std::string &dispstr, std::string &disptype,
                     const RegisterId &r, OFF_T memroot, OFF_T diff_memroot = 0,
-                    unsigned diff_minline = 0);
+                    LineNo diff_minline = 0);
+
+    // Format a register whose value has already been read, e.g. by
+    // get_regs, which is faster than calling the above for each one
+    // of a long list of registers.
+    void format_reg(std::string &dispstr, std::string &disptype,
+                    const RegisterId &r, const RegisterValue &value);
 
     // Similar, but fills in the same output variables with a hex dump
     // of memory. One extra value pair can occur in disptype:
@@ -197,13 +250,13 @@ class Browser : public IndexNavigator {
     void format_memory(std::string &dispstr, std::string &disptype, Addr addr,
                        bool addr_known, int bytes_per_line, int addr_chars,
                        size_t &hexpos, OFF_T memroot, OFF_T diff_memroot = 0,
-                       unsigned diff_minline = 0);
+                       LineNo diff_minline = 0);
     void format_memory_split(std::string &dispaddr, std::string &typeaddr,
                              std::string &disphex, std::string &typehex,
                              std::string &dispchars, std::string &typechars,
                              Addr addr, bool addr_known, int bytes_per_line,
                              int addr_chars, OFF_T memroot,
-                             OFF_T diff_memroot = 0, unsigned diff_minline = 0);
+                             OFF_T diff_memroot = 0, LineNo diff_minline = 0);
 
     bool lookup_register(const std::string &name, RegisterId &r);
 
@@ -265,6 +318,7 @@ class HighlightedLine : public ParseReceiver {
   private:
     virtual void highlight(size_t start, size_t end,
                            HighlightClass hc) override;
+    virtual bool wants_highlights() const override { return true; }
     virtual void got_event(InstructionEvent &ev) override;
 };
 
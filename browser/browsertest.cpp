@@ -0,0 +1,141 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Test of the parts of the browser that don't depend on any user
+ * interface. At present, this checks that the highlighted lines a
+ * TraceView hands out from its cache (including those made in
+ * advance by its prefetch thread) are the same as highlighting the
+ * trace lines directly, while the display parameters keep changing
+ * underneath it.
+ */
+
+#include "browse.hh"
+#include "libtarmac/argparse.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/tarmacutil.hh"
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+static bool same_line(const HighlightedLine &a, const HighlightedLine &b)
+{
+    return a.text == b.text && a.display_len == b.display_len &&
+           a.disassembly_start == b.disassembly_start &&
+           a.highlights == b.highlights &&
+           a.non_executed_instruction == b.non_executed_instruction;
+}
+
+struct DisplayParams {
+    size_t display_len;
+    bool substitute;
+};
+
+// Walk every node of the trace, fetching its highlighted lines through
+// the TraceView with one set of display parameters, and check each
+// one against highlighting the same lines directly. Every so often,
+// set the prefetch thread going on the screenfuls either side, so
+// that later nodes come from its work; and every other time, at once
+// ask for a node with different parameters, so that the cache is
+// emptied while the prefetch thread is likely to be in the middle of
+// highlighting a node with the old ones.
+static void check_params(Browser &br, Browser::TraceView &vu,
+                         const DisplayParams &params,
+                         const DisplayParams &other)
+{
+    const unsigned screen_height = 24;
+    bool substitute = params.substitute && br.has_image();
+    unsigned long long nodes = 0, lines = 0, mismatches = 0;
+
+    SeqOrderPayload node;
+    unsigned offset;
+    for (LineNo visline = 0; vu.get_node_by_visline(visline, &node, &offset);
+         visline += node.trace_file_lines - offset) {
+        if (nodes % 16 == 0) {
+            vu.prefetch_around(visline, screen_height);
+            if (nodes % 32 == 16)
+                vu.get_highlighted_lines(node, other.display_len,
+                                         other.substitute);
+        }
+
+        auto cached = vu.get_highlighted_lines(node, params.display_len,
+                                               params.substitute);
+        vector<StringSpan> spans = br.index.get_trace_line_spans(node);
+        if (cached->size() != spans.size()) {
+            cout << "node at line " << node.trace_file_firstline << ": "
+                 << cached->size() << " cached lines, expected "
+                 << spans.size() << endl;
+            mismatches++;
+        } else {
+            for (size_t i = 0; i < spans.size(); i++) {
+                string text = spans[i].str();
+                HighlightedLine direct(
+                    text, br.index.parseParams(),
+                    params.display_len ? params.display_len : text.size());
+                if (substitute)
+                    direct.replace_instruction(br);
+                if (!same_line((*cached)[i], direct)) {
+                    cout << "line " << node.trace_file_firstline + i
+                         << ": cached highlighting differs" << endl;
+                    mismatches++;
+                }
+                lines++;
+            }
+        }
+        nodes++;
+    }
+
+    cout << "display_len " << params.display_len << ", substitute "
+         << (params.substitute ? "yes" : "no") << ": " << nodes
+         << " nodes, " << lines << " lines, " << mismatches
+         << " mismatches" << endl;
+}
+
+int main(int argc, char **argv)
+{
+    gettext_setup(true);
+
+    Argparse ap("browsertest", argc, argv);
+    TarmacUtility tu;
+    tu.add_options(ap);
+    ap.parse();
+    tu.setup();
+
+    Browser br(tu.trace, tu.image_filename, tu.load_offset);
+    br.prepare_index(false);
+    Browser::TraceView vu(br);
+
+    const vector<DisplayParams> param_sets = {
+        {0, false}, {80, false}, {30, false}, {80, true}, {0, false},
+    };
+    for (size_t i = 0; i < param_sets.size(); i++)
+        check_params(br, vu, param_sets[i],
+                     param_sets[(i + 1) % param_sets.size()]);
+
+    return 0;
+}
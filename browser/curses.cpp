@@ -28,12 +28,16 @@
 #include "libtarmac/parser.hh"
 #include "libtarmac/registers.hh"
 #include "libtarmac/reporter.hh"
+#include "libtarmac/search.hh"
 #include "libtarmac/tarmacutil.hh"
 
 #include <climits>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <regex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -50,6 +54,7 @@
 #endif
 
 using std::invalid_argument;
+using std::map;
 using std::max;
 using std::min;
 using std::ostringstream;
@@ -452,6 +457,31 @@ class Screen : public Window {
             return true;
         }
 
+        // F12 is deliberately left out of the help text: it's for
+        // diagnosing the browser's own performance. The first press
+        // starts collecting statistics about index queries (unless
+        // --stats already did), and later ones show what's been
+        // collected so far.
+        if (c == KEY_F(12)) {
+            if (!QueryStats::enabled()) {
+                QueryStats::enable();
+                minibuf_info(_("Recording index query statistics"));
+                return true;
+            }
+
+            ostringstream oss;
+            QueryStats::report(oss);
+            vector<HelpItem> report;
+            std::istringstream iss(oss.str());
+            string line;
+            while (std::getline(iss, line))
+                report.push_back({line, ""});
+
+            win_help = new HelpWindow(report);
+            resize_wins();
+            return true;
+        }
+
         if (c == KEY_F(1) || c == KEY_F(10)) {
             vector<HelpItem> help;
 
@@ -644,7 +674,7 @@ class TraceBuffer : public Window {
     // _physical_ lines in the trace file are numbered from 1. But
     // visible lines are numbered from zero, because that's more
     // sensible in the absence of conventions saying otherwise.
-    unsigned visline_scrtop;
+    LineNo visline_scrtop;
 
     // Highlighted individual event (trace line) within the current
     // visible node, if any. Indexed from 0 (first event of the node)
@@ -659,6 +689,8 @@ class TraceBuffer : public Window {
     MVERegisterDisplay *mvedisp;
     vector<MemoryDisplay *> mdisps;
     char minibuf_reqtype;
+    std::unique_ptr<TraceSearch> search;
+    ExprPtr condition;
 
     int last_keystroke;
     int ctrl_l_state;
@@ -701,9 +733,9 @@ class TraceBuffer : public Window {
         // than the whole screen.
         //
         // These two values form a [top,bot) half-open interval.
-        unsigned visline_top = vu.physical_to_visible_line(
+        LineNo visline_top = vu.physical_to_visible_line(
             vu.curr_visible_node.trace_file_firstline);
-        unsigned visline_bot =
+        LineNo visline_bot =
             visline_top +
             min((unsigned)hm1, (unsigned)vu.curr_visible_node.trace_file_lines);
 
@@ -716,7 +748,7 @@ class TraceBuffer : public Window {
         // We do need to recentre, in which case, use posn and posd to
         // work out how many visible lines we want to place above
         // visline_top.
-        unsigned linesabove = (hm1 - (visline_bot - visline_top)) * posn / posd;
+        LineNo linesabove = (hm1 - (visline_bot - visline_top)) * posn / posd;
         // Special case to avoid going off the top of the file.
         linesabove = min(linesabove, visline_top);
 
@@ -743,7 +775,7 @@ class TraceBuffer : public Window {
     void add_mdisp(MemoryDisplayStartAddr address);
     void remove_mdisp(MemoryDisplay *mdisp);
     void update_other_windows();
-    void update_other_windows_diff(unsigned prev_line);
+    void update_other_windows_diff(LineNo prev_line);
 
     void goto_time(Time t)
     {
@@ -754,7 +786,7 @@ class TraceBuffer : public Window {
         }
     }
 
-    void goto_physline(unsigned t)
+    void goto_physline(LineNo t)
     {
         if (vu.goto_physline(t)) {
             selected_event = UINT_MAX;
@@ -790,6 +822,63 @@ class TraceBuffer : public Window {
         }
     }
 
+    void goto_search_match(int dir)
+    {
+        if (!search) {
+            screen->minibuf_error(_("No search to repeat"));
+        } else if (vu.goto_search_match(*search, dir)) {
+            selected_event = UINT_MAX;
+            update_scrtop(false, 1, 2);
+            update_other_windows();
+        } else {
+            screen->minibuf_error(dir > 0 ? _("No more matches after here")
+                                          : _("No more matches before here"));
+        }
+    }
+
+    void goto_condition(const string &text, int dir)
+    {
+        // An empty reply repeats the last condition.
+        if (!is_empty_expression(text)) {
+            ostringstream error;
+            ExprPtr expr = br.parse_expression(text, error);
+            if (!expr) {
+                screen->minibuf_error(
+                    format(_("Error parsing expression: {}"), error.str()));
+                return;
+            }
+            condition = expr;
+        }
+
+        if (!condition) {
+            screen->minibuf_error(_("No condition to repeat"));
+        } else if (vu.goto_condition(*condition, dir)) {
+            selected_event = UINT_MAX;
+            update_scrtop(false, 1, 2);
+            update_other_windows();
+        } else {
+            screen->minibuf_error(dir > 0
+                                      ? _("Condition never becomes true "
+                                          "after here")
+                                      : _("Condition never becomes true "
+                                          "before here"));
+        }
+    }
+
+    void start_search(const string &pattern, int dir)
+    {
+        SearchParams params;
+        params.pattern = pattern;
+        params.regex = true;
+        try {
+            search.reset(new TraceSearch(br.index.trace_source(), params));
+        } catch (std::regex_error &) {
+            screen->minibuf_error(_("Invalid regular expression"));
+            return;
+        }
+        goto_search_match(dir);
+    }
+
     void draw(int x, int y, cursorpos *cp)
     {
         cp->visible = false;
@@ -829,27 +918,26 @@ class TraceBuffer : public Window {
 
         ok = vu.get_node_by_visline(visline_scrtop, &payload, &lineoffset);
         while (ok) {
-            vector<string> tracelines = br.index.get_trace_lines(payload);
-
-            for (unsigned i = lineoffset; i < tracelines.size(); i++) {
-                string &line = tracelines[i];
+            auto hls = vu.get_highlighted_lines(payload, w,
+                                                substitute_branch_targets);
 
-                HighlightedLine hl(line, br.index.parseParams(), w);
-                if (br.has_image() && substitute_branch_targets)
-                    hl.replace_instruction(br);
+            for (unsigned i = lineoffset; i < hls->size(); i++) {
+                const HighlightedLine &hl = (*hls)[i];
 
                 bool selected = (payload.cmp(vu.curr_visible_node) == 0 &&
                                  i == selected_event);
                 bool underlined = (payload.cmp(vu.curr_visible_node) == 0 &&
-                                   i == tracelines.size() - 1);
+                                   i == hls->size() - 1);
 
                 move(y + yy, x);
                 curses_hl_display(hl, syntax_highlighting, selected,
                                   underlined);
                 yy++;
                 if (yy >= hm1)
-                    return;
+                    break;
             }
+            if (yy >= hm1)
+                break;
 
             ok = vu.get_node_by_visline(visline_scrtop + yy, &payload,
                                         &lineoffset);
@@ -863,6 +951,8 @@ class TraceBuffer : public Window {
             addstr(blank.c_str());
             yy++;
         }
+
+        vu.prefetch_around(visline_scrtop, hm1);
     }
 
     vector<HelpItem> help_text()
@@ -877,6 +967,10 @@ class TraceBuffer : public Window {
             {"l", _("Jump to a specified line number of the trace file")},
             {"p, P", _("Jump to the next / previous visit to a PC location")},
             {"e, E", _("Jump to the next / previous CPU exception, if any")},
+            {"/, ?", _("Search forwards / backwards for a regular expression")},
+            {"f, F", _("Jump to the next / previous match of the last search")},
+            {"w, W", _("Jump to the next / previous point where a condition "
+                       "becomes true")},
             {"", ""},
             {"r", _("Toggle display of the core registers")},
             {"S, D", _("Toggle display of the single / double FP registers")},
@@ -907,7 +1001,7 @@ class TraceBuffer : public Window {
         last_keystroke = c;
 
         if (c == KEY_DOWN) {
-            unsigned prev_line = vu.curr_logical_node.trace_file_firstline;
+            LineNo prev_line = vu.curr_logical_node.trace_file_firstline;
             if (vu.next_visible_node(&vu.curr_visible_node)) {
                 vu.update_logical_node();
                 update_scrtop(false, 1, 1);
@@ -917,7 +1011,7 @@ class TraceBuffer : public Window {
             }
             return true;
         } else if (c == KEY_UP) {
-            unsigned prev_line = vu.curr_logical_node.trace_file_firstline;
+            LineNo prev_line = vu.curr_logical_node.trace_file_firstline;
             if (vu.prev_visible_node(&vu.curr_visible_node)) {
                 vu.update_logical_node();
                 update_scrtop(false, 0, 1);
@@ -963,7 +1057,7 @@ class TraceBuffer : public Window {
             DecodedTraceLine dtl(
                 br.index.parseParams(),
                 br.index.get_trace_line(vu.curr_visible_node, selected_event));
-            unsigned line = 0;
+            LineNo line = 0;
             if (dtl.mev) {
                 line = br.getmem(ref_node.memory_root, 'm', dtl.mev->addr,
                                  dtl.mev->size, NULL, NULL);
@@ -988,7 +1082,8 @@ class TraceBuffer : public Window {
             // itself visible; ']' completely unfolds everything from
             // the start to the end of this function's execution.
 
-            unsigned firstline, lastline, depth;
+            LineNo firstline, lastline;
+            unsigned depth;
             if (!vu.physline_range_for_containing_function(
                     vu.curr_visible_node, &firstline, &lastline, &depth)) {
                 screen->minibuf_error(_("No function call to fold up here"));
@@ -1014,7 +1109,8 @@ class TraceBuffer : public Window {
             return true;
         } else if (c == '+' || c == '=') {
             // Unfold one function call at the cursor position.
-            unsigned firstline, lastline, depth;
+            LineNo firstline, lastline;
+            unsigned depth;
             if (!vu.physline_range_for_folded_function_after(
                     vu.curr_visible_node, &firstline, &lastline, &depth)) {
                 screen->minibuf_error(_("No function call to unfold here"));
@@ -1093,6 +1189,22 @@ class TraceBuffer : public Window {
         } else if (c == 'e' || c == 'E') {
             goto_cpu_exception(c == 'e' ? +1 : -1);
             return true;
+        } else if (c == '/' || c == '?') {
+            screen->minibuf_ask(
+                (c == '?' ? _("Search backwards for: ") : _("Search for: ")),
+                this);
+            minibuf_reqtype = c;
+            return true;
+        } else if (c == 'f' || c == 'F') {
+            goto_search_match(c == 'f' ? +1 : -1);
+            return true;
+        } else if (c == 'w' || c == 'W') {
+            screen->minibuf_ask(
+                (c == 'W' ? _("Go back to where condition became true: ")
+                          : _("Go to where condition becomes true: ")),
+                this);
+            minibuf_reqtype = c;
+            return true;
         } else if (c == 'r') {
             // Toggle core register display window on/off
             set_crdisp(crdisp == NULL);
@@ -1165,6 +1277,15 @@ class TraceBuffer : public Window {
             case 'P':
                 goto_pc(vu.evaluate_expression_addr(text), -1);
                 break;
+            case '/':
+            case '?':
+                if (text.size() > 0)
+                    start_search(text, minibuf_reqtype == '/' ? +1 : -1);
+                break;
+            case 'w':
+            case 'W':
+                goto_condition(text, minibuf_reqtype == 'w' ? +1 : -1);
+                break;
             case 'm': {
                 MemoryDisplayStartAddr addr;
                 ostringstream error;
@@ -1197,7 +1318,7 @@ class RegisterDisplay : public Window {
     bool interpret_address;
     bool locked;
     OFF_T memroot, ext_memroot;
-    unsigned line, ext_line;
+    LineNo line, ext_line;
     int w, h;
     int reg_selected;
     TraceBuffer *tbuf;
@@ -1205,7 +1326,32 @@ class RegisterDisplay : public Window {
     int top_line;
     vector<int> regs_per_line, reg_to_line;
     OFF_T diff_memroot;
-    unsigned diff_minline;
+    LineNo diff_minline;
+
+    // What each register looked like the last time it was drawn, so
+    // that stepping through the trace only has to format the ones
+    // whose value (or diff highlighting) has changed since.
+    struct ShadowReg {
+        RegisterId reg;
+        RegisterValue value;
+        string dispstr, disptype;
+    };
+    vector<ShadowReg> shadow;
+
+    const ShadowReg &format_reg(size_t i, const RegisterValue &value)
+    {
+        if (shadow.size() != regs.size())
+            shadow.resize(regs.size());
+        ShadowReg &sr = shadow[i];
+        if (sr.dispstr.empty() || sr.reg != regs[i] ||
+            sr.value.val != value.val || sr.value.def != value.def ||
+            sr.value.changed != value.changed) {
+            sr.reg = regs[i];
+            sr.value = value;
+            br.format_reg(sr.dispstr, sr.disptype, regs[i], value);
+        }
+        return sr;
+    }
 
   protected:
     vector<RegisterId> regs;
@@ -1227,7 +1373,7 @@ class RegisterDisplay : public Window {
         top_line = 0;
     }
 
-    void set_memroot(OFF_T memroot_, unsigned line_)
+    void set_memroot(OFF_T memroot_, LineNo line_)
     {
         ext_memroot = memroot_;
         ext_line = line_;
@@ -1238,7 +1384,7 @@ class RegisterDisplay : public Window {
         }
     }
 
-    void goto_physline(unsigned line_)
+    void goto_physline(LineNo line_)
     {
         SeqOrderPayload found_node;
         if (br.node_at_line(line_, &found_node)) {
@@ -1258,9 +1404,9 @@ class RegisterDisplay : public Window {
         }
     }
 
-    void setup_diff_lines(unsigned line1, unsigned line2)
+    void setup_diff_lines(LineNo line1, LineNo line2)
     {
-        unsigned linemin = min(line1, line2), linemax = max(line1, line2);
+        LineNo linemin = min(line1, line2), linemax = max(line1, line2);
         SeqOrderPayload found_node;
         if (linemin != linemax && br.node_at_line(linemax, &found_node)) {
             diff_memroot = found_node.memory_root;
@@ -1270,7 +1416,7 @@ class RegisterDisplay : public Window {
         }
     }
 
-    void diff_against_if_not_locked(unsigned line_)
+    void diff_against_if_not_locked(LineNo line_)
     {
         if (!locked)
             setup_diff_lines(line_, line);
@@ -1339,12 +1485,13 @@ class RegisterDisplay : public Window {
         regs_per_line.clear();
         reg_to_line.clear();
 
+        vector<RegisterValue> values =
+            br.get_regs(memroot, regs, diff_memroot, diff_minline);
+
         for (unsigned i = 0; i < regs.size(); i++) {
             const RegisterId &r = regs[i];
-            string dispstr, disptype;
-
-            br.format_reg(dispstr, disptype, r, memroot, diff_memroot,
-                          diff_minline);
+            const ShadowReg &sr = format_reg(i, values[i]);
+            const string &dispstr = sr.dispstr, &disptype = sr.disptype;
             size_t valstart = dispstr.size() - format_reg_length(r);
 
             if (currline.size() == 0) {
@@ -1519,8 +1666,8 @@ class RegisterDisplay : public Window {
         } else if (c == '\r' || c == '\n') {
             const RegisterId &r = regs[reg_selected];
             unsigned iflags = br.get_iflags(memroot);
-            unsigned line = br.getmem(memroot, 'r', reg_offset(r, iflags),
-                                      reg_size(r), NULL, NULL);
+            LineNo line = br.getmem(memroot, 'r', reg_offset(r, iflags),
+                                    reg_size(r), NULL, NULL);
             if (line)
                 tbuf->goto_physline(line);
             return true;
@@ -1659,7 +1806,7 @@ class MemoryDisplay : public Window {
     Browser &br;
     bool locked;
     OFF_T memroot, ext_memroot;
-    unsigned line, ext_line;
+    LineNo line, ext_line;
     int w, h;
     Addr start_addr, cursor_addr;
     bool addrs_known;
@@ -1670,7 +1817,65 @@ class MemoryDisplay : public Window {
     int desired_height;
     char minibuf_reqtype;
     OFF_T diff_memroot;
-    unsigned diff_minline;
+    LineNo diff_minline;
+
+    // The lines of memory drawn last time, by address, and the state
+    // of memory each one was formatted from. A line can be drawn again
+    // without reformatting it if nothing in it was written between
+    // that state and this one, and it had no diff highlighting then
+    // and needs none now. Finding that out takes a search of the
+    // memory tree for modifications, which is much cheaper than
+    // reading the line's contents again and formatting them.
+    struct ShadowLine {
+        OFF_T memroot;
+        LineNo line;
+        bool highlighted;
+        string text, type;
+        size_t hexpos;
+    };
+    map<Addr, ShadowLine> shadow;
+
+    // Return true if anything in the line at 'addr' was written at or
+    // after 'minline', in the state given by 'root'.
+    bool line_modified(OFF_T root, Addr addr, LineNo minline)
+    {
+        Addr lo, hi;
+        return br.find_next_mod(root, 'm', addr, minline, +1, lo, hi) &&
+               lo <= addr + (bytes_per_line - 1);
+    }
+
+    const ShadowLine &format_line(map<Addr, ShadowLine> &old_shadow,
+                                  Addr addr)
+    {
+        auto it = old_shadow.find(addr);
+        if (it != old_shadow.end() && !it->second.highlighted) {
+            const ShadowLine &old = it->second;
+            bool same = old.memroot == memroot;
+            if (!same) {
+                // The state later in the trace is the one whose
+                // memory tree knows about the writes in between.
+                bool later = line > old.line;
+                same = !line_modified(later ? memroot : old.memroot, addr,
+                                      min(line, old.line) + 1);
+            }
+            if (same &&
+                !(diff_memroot && line_modified(diff_memroot, addr,
+                                                diff_minline))) {
+                ShadowLine &sl = shadow[addr] = std::move(it->second);
+                sl.memroot = memroot;
+                sl.line = line;
+                return sl;
+            }
+        }
+
+        ShadowLine &sl = shadow[addr];
+        br.format_memory(sl.text, sl.type, addr, true, bytes_per_line, 8,
+                         sl.hexpos, memroot, diff_memroot, diff_minline);
+        sl.memroot = memroot;
+        sl.line = line;
+        sl.highlighted = sl.type.find_first_of("UVC") != string::npos;
+        return sl;
+    }
 
   public:
     MemoryDisplay(Browser &br, TraceBuffer *tbuf, MemoryDisplayStartAddr addr)
@@ -1746,7 +1951,7 @@ class MemoryDisplay : public Window {
         h = h_;
     }
 
-    void set_memroot(OFF_T memroot_, unsigned line_)
+    void set_memroot(OFF_T memroot_, LineNo line_)
     {
         ext_memroot = memroot_;
         ext_line = line_;
@@ -1760,7 +1965,7 @@ class MemoryDisplay : public Window {
             compute_cursor_addr();
     }
 
-    void goto_physline(unsigned line_)
+    void goto_physline(LineNo line_)
     {
         SeqOrderPayload found_node;
         if (br.node_at_line(line_, &found_node)) {
@@ -1780,9 +1985,9 @@ class MemoryDisplay : public Window {
         }
     }
 
-    void setup_diff_lines(unsigned line1, unsigned line2)
+    void setup_diff_lines(LineNo line1, LineNo line2)
     {
-        Time linemin = min(line1, line2), linemax = max(line1, line2);
+        LineNo linemin = min(line1, line2), linemax = max(line1, line2);
         SeqOrderPayload found_node;
         if (linemin != linemax && br.node_at_line(linemax, &found_node)) {
             diff_memroot = found_node.memory_root;
@@ -1792,7 +1997,7 @@ class MemoryDisplay : public Window {
         }
     }
 
-    void diff_against_if_not_locked(unsigned line_)
+    void diff_against_if_not_locked(LineNo line_)
     {
         if (!locked)
             setup_diff_lines(line_, line);
@@ -1811,12 +2016,23 @@ class MemoryDisplay : public Window {
         cp->visible = false;
         assert(memroot);
 
+        map<Addr, ShadowLine> old_shadow;
+        old_shadow.swap(shadow);
+
         for (int yy = 0; yy < h - 1; yy++) {
             string line, type;
             size_t hexpos;
 
-            br.format_memory(line, type, addr, addrs_known, bytes_per_line, 8,
-                             hexpos, memroot, diff_memroot, diff_minline);
+            if (addrs_known) {
+                const ShadowLine &sl = format_line(old_shadow, addr);
+                line = sl.text;
+                type = sl.type;
+                hexpos = sl.hexpos;
+            } else {
+                br.format_memory(line, type, addr, addrs_known,
+                                 bytes_per_line, 8, hexpos, memroot,
+                                 diff_memroot, diff_minline);
+            }
 
             if (addr <= cursor_addr && cursor_addr < addr + bytes_per_line) {
                 cp->visible = true;
@@ -1978,7 +2194,7 @@ class MemoryDisplay : public Window {
                 c = '1';
             Addr prov_size = c - '0';
             Addr prov_start = cursor_addr & ~(prov_size - 1);
-            unsigned line =
+            LineNo line =
                 br.getmem(memroot, 'm', prov_start, prov_size, NULL, NULL);
             if (line)
                 tbuf->goto_physline(line);
@@ -2196,7 +2412,7 @@ void TraceBuffer::update_other_windows()
                            vu.curr_logical_node.trace_file_firstline);
 }
 
-void TraceBuffer::update_other_windows_diff(unsigned line)
+void TraceBuffer::update_other_windows_diff(LineNo line)
 {
     if (crdisp)
         crdisp->diff_against_if_not_locked(line);
@@ -2274,6 +2490,7 @@ int main(int argc, char **argv)
     // per https://no-color.org/ . This is done before option
     // processing, so that the command line can override that in turn.
     bool use_terminal_colours = true;
+    bool prefault = false;
     {
         string no_color;
         if (get_environment_variable("NO_COLOR", no_color) &&
@@ -2289,10 +2506,14 @@ int main(int argc, char **argv)
     ap.optnoval({"--no-colour", "--no-color"},
                 _("don't use colour in the terminal"),
                 [&]() { use_terminal_colours = false; });
+    ap.optnoval({"--prefault"},
+                _("read the whole index into memory before browsing"),
+                [&]() { prefault = true; });
     ap.parse();
     tu.setup();
 
     Browser br(tu.trace, tu.image_filename, tu.load_offset);
+    br.prepare_index(prefault);
     run_browser(br, use_terminal_colours);
 
     return 0;
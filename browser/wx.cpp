@@ -24,6 +24,7 @@
 #include "libtarmac/argparse.hh"
 #include "libtarmac/intl.hh"
 #include "libtarmac/reporter.hh"
+#include "libtarmac/search.hh"
 #include "libtarmac/tarmacutil.hh"
 
 // wxWidgets will define the gettext _ wrapper macro itself, in a way that
@@ -47,18 +48,22 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
 #include <exception>
 #include <fstream>
 #include <functional>
+#include <future>
 #include <iostream>
 #include <limits>
 #include <map>
 #include <math.h>
 #include <memory>
 #include <ostream>
+#include <regex>
 #include <set>
 #include <sstream>
 #include <string.h>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -81,6 +86,7 @@ using std::out_of_range;
 using std::pair;
 using std::remove;
 using std::set;
+using std::shared_ptr;
 using std::streampos;
 using std::string;
 using std::swap;
@@ -493,9 +499,24 @@ struct LogicalPos {
 class GuiTarmacBrowserApp : public wxApp {
     unique_ptr<Browser> br;
 
+    // The trace is indexed on a separate thread, so that the GUI
+    // stays responsive while it works through a large trace, and the
+    // user can stop it early to look at the part indexed so far.
+    TarmacUtility tu;
+    std::thread indexing_thread;
+    std::atomic<bool> stop_indexing{false};
+    bool prefault = false;
+
+    void indexing_finished();
+
   public:
     bool OnInit() override;
+    int OnExit() override;
     void make_trace_window();
+
+    // Ask the indexing thread to stop at the next line of the trace,
+    // and finish off an index of everything before that.
+    void request_stop_indexing() { stop_indexing = true; }
 };
 
 wxSize edit_size(const string &s)
@@ -580,7 +601,7 @@ class TextViewWindow : public wxFrame {
     wxToolBar *toolbar;
     wxTextCtrl *lineedit;
 
-    void set_lineedit(unsigned line);
+    void set_lineedit(LineNo line);
 
     wxMenu *contextmenu;
 
@@ -607,7 +628,7 @@ class TextViewWindow : public wxFrame {
     void lineedit_activated(wxCommandEvent &event);
     void lineedit_unfocused(wxFocusEvent &event);
     virtual void reset_lineedit() = 0;
-    virtual void activate_lineedit(unsigned line) = 0;
+    virtual void activate_lineedit(LineNo line) = 0;
 
     virtual void redraw_canvas(unsigned line_start, unsigned line_limit) = 0;
 
@@ -1301,10 +1322,10 @@ auto TextViewWindow::logpos_dist_colmajor(const LogicalPos &lhs,
 void TextViewWindow::lineedit_activated(wxCommandEvent &event)
 {
     string value = lineedit->GetValue().ToStdString();
-    unsigned line;
+    LineNo line;
 
     try {
-        line = stoul(value);
+        line = stoull(value);
     } catch (invalid_argument) {
         return;
     } catch (out_of_range) {
@@ -1320,7 +1341,7 @@ void TextViewWindow::lineedit_unfocused(wxFocusEvent &event)
     reset_lineedit();
 }
 
-void TextViewWindow::set_lineedit(unsigned line)
+void TextViewWindow::set_lineedit(LineNo line)
 {
     ostringstream oss;
     oss << line;
@@ -1343,7 +1364,7 @@ class SubsidiaryView : public TextViewWindow, public SubsidiaryViewListNode {
     static void close_all();
 
     OFF_T memroot = 0, diff_memroot = 0;
-    unsigned line, diff_minline;
+    LineNo line, diff_minline;
 
     TraceWindow *tw;
     wxChoice *linkcombo;
@@ -1353,7 +1374,7 @@ class SubsidiaryView : public TextViewWindow, public SubsidiaryViewListNode {
     virtual ~SubsidiaryView();
 
     virtual void reset_lineedit() override { set_lineedit(line); }
-    virtual void activate_lineedit(unsigned line_) override
+    virtual void activate_lineedit(LineNo line_) override
     {
         SeqOrderPayload node;
         if (br.node_at_line(line_, &node)) {
@@ -1366,7 +1387,7 @@ class SubsidiaryView : public TextViewWindow, public SubsidiaryViewListNode {
 
     virtual void memroot_changed() { }
 
-    void update_line(OFF_T memroot_, unsigned line_)
+    void update_line(OFF_T memroot_, LineNo line_)
     {
         memroot = memroot_;
         line = line_;
@@ -1379,7 +1400,7 @@ class SubsidiaryView : public TextViewWindow, public SubsidiaryViewListNode {
         diff_minline = 0;
     }
 
-    void diff_against(OFF_T diff_memroot_, unsigned diff_minline_)
+    void diff_against(OFF_T diff_memroot_, LineNo diff_minline_)
     {
         diff_memroot = diff_memroot_;
         diff_minline = diff_minline_;
@@ -1559,7 +1580,8 @@ class TraceWindow : public TextViewWindow {
 
         FunctionRange(Browser::TraceView &vu) : vu(vu), br(vu.br) {}
 
-        unsigned firstline, lastline, depth;
+        LineNo firstline, lastline;
+        unsigned depth;
         SeqOrderPayload callnode, firstnode, lastnode;
         bool initialised = false;
 
@@ -1594,7 +1616,7 @@ class TraceWindow : public TextViewWindow {
 
     struct FoldChangeWrapper {
         TraceWindow &tw;
-        unsigned physline_wintop;
+        LineNo physline_wintop;
         double fraction_wintop;
         bool done = false;
         FoldChangeWrapper(TraceWindow *twp) : tw(*twp)
@@ -1660,6 +1682,7 @@ class TraceWindow : public TextViewWindow {
     void calldepth_menuaction(wxCommandEvent &event);
     void highlight_menuaction(wxCommandEvent &event);
     void branchtarget_menuaction(wxCommandEvent &event);
+    void querystats_menuaction(wxCommandEvent &event);
 
     MemPromptDialog *mem_prompt_dialog = nullptr;
     void mem_prompt_dialog_ended(bool ok);
@@ -1667,7 +1690,7 @@ class TraceWindow : public TextViewWindow {
     void mem_prompt_dialog_closed(wxCloseEvent &event);
 
     virtual void reset_lineedit() override;
-    virtual void activate_lineedit(unsigned line) override;
+    virtual void activate_lineedit(LineNo line) override;
 
     wxWindowID mi_fold_all;
     wxWindowID mi_unfold_all;
@@ -1725,17 +1748,34 @@ class TraceWindow : public TextViewWindow {
     template <int direction> void pc_nextprev(wxCommandEvent &event);
     template <int direction> void exc_nextprev(wxCommandEvent &event);
 
+    // The search in progress, restarted whenever the text in
+    // searchedit changes.
+    wxTextCtrl *searchedit;
+    std::unique_ptr<TraceSearch> search;
+    void search_in_direction(int direction);
+    void searchedit_activated(wxCommandEvent &event);
+    template <int direction> void search_nextprev(wxCommandEvent &event);
+
+    // Likewise for a condition to jump to the points where it
+    // becomes true, reparsed whenever the text in condedit changes.
+    wxTextCtrl *condedit;
+    string condition_text;
+    ExprPtr condition;
+    void condition_in_direction(int direction);
+    void condedit_activated(wxCommandEvent &event);
+    template <int direction> void condition_nextprev(wxCommandEvent &event);
+
     virtual bool keypress(wxKeyEvent &event) override;
 
     SubsidiaryViewListNode subview_list;
     void update_subviews();
-    void tell_subviews_to_diff_against(OFF_T memroot, unsigned line);
+    void tell_subviews_to_diff_against(OFF_T memroot, LineNo line);
 
   public:
     TraceWindow(GuiTarmacBrowserApp *app, Browser &br);
     ~TraceWindow();
 
-    void goto_physline(unsigned line);
+    void goto_physline(LineNo line);
     void add_subview(SubsidiaryView *sv);
 };
 
@@ -1850,6 +1890,7 @@ TraceWindow::TraceWindow(GuiTarmacBrowserApp *app, Browser &br)
     wxWindowID mi_newneonreg = NewControlId();
     wxWindowID mi_newmvereg = NewControlId();
     wxWindowID mi_recentre = NewControlId();
+    wxWindowID mi_querystats = NewControlId();
     wxWindowID mi_nextexc = NewControlId();
     wxWindowID mi_prevexc = NewControlId();
     mi_calldepth = NewControlId();
@@ -1895,6 +1936,8 @@ TraceWindow::TraceWindow(GuiTarmacBrowserApp *app, Browser &br)
         mi_branchtarget = NewControlId();
         viewmenu->AppendCheckItem(mi_branchtarget, _("Symbolic branch targets"));
     }
+    viewmenu->AppendSeparator();
+    viewmenu->Append(mi_querystats, _("Index query statistics"));
 
     Bind(wxEVT_MENU, &TraceWindow::newtrace_menuaction, this, mi_newtrace);
     Bind(wxEVT_MENU, &TraceWindow::newmem_menuaction, this, mi_newmem);
@@ -1910,6 +1953,7 @@ TraceWindow::TraceWindow(GuiTarmacBrowserApp *app, Browser &br)
     if (mi_branchtarget != wxID_NONE)
         Bind(wxEVT_MENU, &TraceWindow::branchtarget_menuaction, this,
              mi_branchtarget);
+    Bind(wxEVT_MENU, &TraceWindow::querystats_menuaction, this, mi_querystats);
     Bind(wxEVT_MENU, &TraceWindow::exc_nextprev<+1>, this, mi_nextexc);
     Bind(wxEVT_MENU, &TraceWindow::exc_nextprev<-1>, this, mi_prevexc);
 
@@ -1932,6 +1976,25 @@ TraceWindow::TraceWindow(GuiTarmacBrowserApp *app, Browser &br)
     toolbar->AddControl(pcprev_button);
     auto pcnext_button = new wxButton(toolbar, wxID_ANY, _("Next"));
     toolbar->AddControl(pcnext_button);
+    toolbar->AddControl(new wxStaticText(toolbar, wxID_ANY, _(" Search: ")));
+    searchedit =
+        new wxTextCtrl(toolbar, wxID_ANY, wxEmptyString, wxDefaultPosition,
+                       edit_size("longish_regular_expression"),
+                       wxTE_PROCESS_ENTER);
+    toolbar->AddControl(searchedit);
+    auto searchprev_button = new wxButton(toolbar, wxID_ANY, _("Prev"));
+    toolbar->AddControl(searchprev_button);
+    auto searchnext_button = new wxButton(toolbar, wxID_ANY, _("Next"));
+    toolbar->AddControl(searchnext_button);
+    toolbar->AddControl(new wxStaticText(toolbar, wxID_ANY, _(" When: ")));
+    condedit =
+        new wxTextCtrl(toolbar, wxID_ANY, wxEmptyString, wxDefaultPosition,
+                       edit_size("mem32[sp+8] == 0x1234"), wxTE_PROCESS_ENTER);
+    toolbar->AddControl(condedit);
+    auto condprev_button = new wxButton(toolbar, wxID_ANY, _("Prev"));
+    toolbar->AddControl(condprev_button);
+    auto condnext_button = new wxButton(toolbar, wxID_ANY, _("Next"));
+    toolbar->AddControl(condnext_button);
     toolbar->Realize();
 
     timeedit->Bind(wxEVT_TEXT_ENTER, &TraceWindow::timeedit_activated, this);
@@ -1940,6 +2003,17 @@ TraceWindow::TraceWindow(GuiTarmacBrowserApp *app, Browser &br)
     pcedit->Bind(wxEVT_KILL_FOCUS, &TraceWindow::pcedit_unfocused, this);
     pcprev_button->Bind(wxEVT_BUTTON, &TraceWindow::pc_nextprev<-1>, this);
     pcnext_button->Bind(wxEVT_BUTTON, &TraceWindow::pc_nextprev<+1>, this);
+    searchedit->Bind(wxEVT_TEXT_ENTER, &TraceWindow::searchedit_activated,
+                     this);
+    searchprev_button->Bind(wxEVT_BUTTON, &TraceWindow::search_nextprev<-1>,
+                            this);
+    searchnext_button->Bind(wxEVT_BUTTON, &TraceWindow::search_nextprev<+1>,
+                            this);
+    condedit->Bind(wxEVT_TEXT_ENTER, &TraceWindow::condedit_activated, this);
+    condprev_button->Bind(wxEVT_BUTTON, &TraceWindow::condition_nextprev<-1>,
+                          this);
+    condnext_button->Bind(wxEVT_BUTTON, &TraceWindow::condition_nextprev<+1>,
+                          this);
 
     mi_fold_all = NewControlId();
     mi_unfold_all = NewControlId();
@@ -1983,6 +2057,8 @@ TraceWindow::TraceWindow(GuiTarmacBrowserApp *app, Browser &br)
     {
         ostringstream oss;
         oss << br.get_tarmac_filename() << " [#" << window_index << "]";
+        if (br.index.isPartial())
+            oss << " " << _("(partially indexed)");
         set_title(oss.str());
     }
 
@@ -2047,14 +2123,14 @@ void TraceWindow::update_subviews()
                          vu.curr_logical_node.trace_file_firstline);
 }
 
-void TraceWindow::tell_subviews_to_diff_against(OFF_T memroot, unsigned line)
+void TraceWindow::tell_subviews_to_diff_against(OFF_T memroot, LineNo line)
 {
     // We have to provide the memory root from the later of the two
     // times, and the line number from the earlier one (because diff
     // lookups are done by looking in the later tree for a list of
     // changes dated after a given line).
     OFF_T curr_root = vu.curr_logical_node.memory_root;
-    unsigned curr_line = vu.curr_logical_node.trace_file_firstline;
+    LineNo curr_line = vu.curr_logical_node.trace_file_firstline;
 
     if (curr_line < line)
         line = curr_line;
@@ -2070,26 +2146,25 @@ unsigned TraceWindow::n_display_lines() { return vu.total_visible_lines(); }
 void TraceWindow::redraw_canvas(unsigned line_start, unsigned line_limit)
 {
     SeqOrderPayload node;
-    vector<string> node_lines;
+    shared_ptr<const Browser::TraceView::HighlightedLines> node_lines;
     unsigned lineofnode = 0;
 
     controls.clear();
 
     for (unsigned line = line_start; line < line_limit; line++) {
-        if (lineofnode >= node_lines.size()) {
+        if (!node_lines || lineofnode >= node_lines->size()) {
             // If we've run off the end of the previous node, or if
             // this is the first time round the loop, fetch a new node
             // to display.
             if (!vu.get_node_by_visline(line, &node, &lineofnode))
                 break;
-            node_lines = br.index.get_trace_lines(node);
+            node_lines =
+                vu.get_highlighted_lines(node, 0, substitute_branch_targets);
         }
 
         unsigned lineofnode_old = lineofnode;
 
-        HighlightedLine hl(node_lines[lineofnode++], br.index.parseParams());
-        if (br.has_image() && substitute_branch_targets)
-            hl.replace_instruction(br);
+        const HighlightedLine &hl = (*node_lines)[lineofnode++];
 
         unsigned display_depth = 0;
         if (depth_indentation)
@@ -2131,11 +2206,13 @@ void TraceWindow::redraw_canvas(unsigned line_start, unsigned line_limit)
             }
         }
 
-        if (lineofnode == node_lines.size() &&
+        if (lineofnode == node_lines->size() &&
             !node.cmp(vu.curr_visible_node)) {
             drawing_area->add_separator_line(y + line_height - 1);
         }
     }
+
+    vu.prefetch_around(line_start, line_limit - line_start);
 }
 
 bool TraceWindow::prepare_context_menu(const LogicalPos &logpos)
@@ -2225,7 +2302,7 @@ void TraceWindow::provenance_menuaction(wxCommandEvent &event)
     if (!context_menu_memtype)
         return; // just in case
 
-    unsigned line =
+    LineNo line =
         br.getmem(context_menu_memroot, context_menu_memtype,
                   context_menu_start, context_menu_size, nullptr, nullptr);
     if (line)
@@ -2313,7 +2390,7 @@ void TraceWindow::unfold_ui_action(const FunctionRange &fnrange, bool full)
 
     unsigned depth = full ? UINT_MAX : fnrange.depth;
 
-    unsigned prev_position = vu.curr_visible_node.trace_file_firstline;
+    LineNo prev_position = vu.curr_visible_node.trace_file_firstline;
 
     for (FoldChangeWrapper fcw(this); fcw.progress();)
         vu.set_fold_state(fnrange.firstline, fnrange.lastline, 0, depth);
@@ -2350,8 +2427,8 @@ void TraceWindow::update_location(UpdateLocationType type)
 void TraceWindow::keep_visnode_in_view(bool strict_centre)
 {
     auto &vis = vu.curr_visible_node;
-    unsigned phystop = vis.trace_file_firstline;
-    unsigned physbot = phystop + vis.trace_file_lines;
+    LineNo phystop = vis.trace_file_firstline;
+    LineNo physbot = phystop + vis.trace_file_lines;
 
     int screen_lines = drawing_area->height() / line_height;
 
@@ -2507,6 +2584,23 @@ void TraceWindow::recentre_menuaction(wxCommandEvent &event)
     drawing_area->Refresh();
 }
 
+// The first use starts collecting statistics about index queries
+// (unless --stats already did), and later ones show what's been
+// collected so far.
+void TraceWindow::querystats_menuaction(wxCommandEvent &event)
+{
+    if (!QueryStats::enabled()) {
+        QueryStats::enable();
+        wxMessageBox(_("Recording index query statistics"),
+                     _("Index query statistics"), wxOK);
+        return;
+    }
+
+    ostringstream oss;
+    QueryStats::report(oss);
+    wxMessageBox(oss.str(), _("Index query statistics"), wxOK);
+}
+
 void TraceWindow::calldepth_menuaction(wxCommandEvent &event)
 {
     depth_indentation = menubar->IsChecked(mi_calldepth);
@@ -2536,9 +2630,9 @@ void TraceWindow::reset_lineedit()
                  vu.curr_logical_node.trace_file_lines - 1);
 }
 
-void TraceWindow::activate_lineedit(unsigned line) { goto_physline(line); }
+void TraceWindow::activate_lineedit(LineNo line) { goto_physline(line); }
 
-void TraceWindow::goto_physline(unsigned line)
+void TraceWindow::goto_physline(LineNo line)
 {
     if (vu.goto_physline(line)) {
         update_location(UpdateLocationType::NewVis);
@@ -2634,13 +2728,81 @@ template <int direction> void TraceWindow::exc_nextprev(wxCommandEvent &event)
     drawing_area->Refresh();
 }
 
+void TraceWindow::search_in_direction(int direction)
+{
+    string pattern = searchedit->GetValue().ToStdString();
+    if (pattern.empty())
+        return;
+
+    if (!search || search->get_params().pattern != pattern) {
+        SearchParams params;
+        params.pattern = pattern;
+        params.regex = true;
+        try {
+            search.reset(new TraceSearch(br.index.trace_source(), params));
+        } catch (std::regex_error &) {
+            search = nullptr;
+            return;
+        }
+    }
+
+    if (vu.goto_search_match(*search, direction)) {
+        update_location(UpdateLocationType::NewVis);
+        keep_visnode_in_view();
+    }
+    drawing_area->Refresh();
+}
+
+void TraceWindow::searchedit_activated(wxCommandEvent &event)
+{
+    search_in_direction(+1);
+}
+
+template <int direction>
+void TraceWindow::search_nextprev(wxCommandEvent &event)
+{
+    search_in_direction(direction);
+}
+
+void TraceWindow::condition_in_direction(int direction)
+{
+    string text = condedit->GetValue().ToStdString();
+    if (is_empty_expression(text))
+        return;
+
+    if (!condition || condition_text != text) {
+        ostringstream error;
+        condition = br.parse_expression(text, error);
+        condition_text = text;
+        if (!condition)
+            return;
+    }
+
+    if (vu.goto_condition(*condition, direction)) {
+        update_location(UpdateLocationType::NewVis);
+        keep_visnode_in_view();
+    }
+    drawing_area->Refresh();
+}
+
+void TraceWindow::condedit_activated(wxCommandEvent &event)
+{
+    condition_in_direction(+1);
+}
+
+template <int direction>
+void TraceWindow::condition_nextprev(wxCommandEvent &event)
+{
+    condition_in_direction(direction);
+}
+
 bool TraceWindow::keypress(wxKeyEvent &event)
 {
     switch (event.GetKeyCode()) {
     case WXK_UP:
     case WXK_NUMPAD_UP: {
         OFF_T prev_memroot = vu.curr_logical_node.memory_root;
-        unsigned prev_line = vu.curr_logical_node.trace_file_firstline;
+        LineNo prev_line = vu.curr_logical_node.trace_file_firstline;
         if (vu.prev_visible_node(&vu.curr_visible_node)) {
             update_location(UpdateLocationType::NewVis);
             tell_subviews_to_diff_against(prev_memroot, prev_line);
@@ -2651,7 +2813,7 @@ bool TraceWindow::keypress(wxKeyEvent &event)
     case WXK_DOWN:
     case WXK_NUMPAD_DOWN: {
         OFF_T prev_memroot = vu.curr_logical_node.memory_root;
-        unsigned prev_line = vu.curr_logical_node.trace_file_firstline;
+        LineNo prev_line = vu.curr_logical_node.trace_file_firstline;
         if (vu.next_visible_node(&vu.curr_visible_node)) {
             update_location(UpdateLocationType::NewVis);
             tell_subviews_to_diff_against(prev_memroot, prev_line);
@@ -2805,21 +2967,23 @@ void RegisterWindow::provenance_query(RegisterId r)
     unsigned iflags = br.get_iflags(memroot);
     Addr roffset = reg_offset(r, iflags);
     size_t rsize = reg_size(r);
-    unsigned line = br.getmem(memroot, 'r', roffset, rsize, nullptr, nullptr);
+    LineNo line = br.getmem(memroot, 'r', roffset, rsize, nullptr, nullptr);
     if (line)
         tw->goto_physline(line);
 }
 
 void RegisterWindow::redraw_canvas(unsigned line_start, unsigned line_limit)
 {
+    vector<RegisterValue> values =
+        br.get_regs(memroot, regs, diff_memroot, diff_minline);
+
     for (unsigned line = line_start; line < line_limit && line < rows; line++) {
         for (unsigned col = 0; line + col * rows < regs.size(); col++) {
             unsigned regindex = line + col * rows;
             const RegisterId &r = regs[regindex];
 
             string dispstr, disptype;
-            br.format_reg(dispstr, disptype, r, memroot, diff_memroot,
-                          diff_minline);
+            br.format_reg(dispstr, disptype, r, values[regindex]);
             size_t valstart = dispstr.size() - format_reg_length(r);
             size_t xoffset = max_name_len + 1 - valstart;
 
@@ -2834,11 +2998,13 @@ void RegisterWindow::redraw_canvas(unsigned line_start, unsigned line_limit)
 void RegisterWindow::clipboard_get_paste_data(ostream &os, LogicalPos start,
                                               LogicalPos end)
 {
+    vector<RegisterValue> values = br.get_regs(memroot, regs);
+
     for (unsigned i = start.y1; i <= end.y1; i++) {
         const RegisterId &r = regs[i];
 
         string s, type;
-        br.format_reg(s, type, r, memroot);
+        br.format_reg(s, type, r, values[i]);
 
         if (i == end.y1) {
             s = s.substr(0, min((size_t)end.char_index + 1, s.size()));
@@ -3166,7 +3332,7 @@ void MemoryWindow::provenance_query(Addr start, Addr size)
 {
     if (!tw)
         return;
-    unsigned line = br.getmem(memroot, 'm', start, size, nullptr, nullptr);
+    LineNo line = br.getmem(memroot, 'm', start, size, nullptr, nullptr);
     if (line)
         tw->goto_physline(line);
 }
@@ -3382,13 +3548,15 @@ class WXGUIReporter : public Reporter {
     void indexing_status(const TracePair &trace,
                          IndexUpdateCheck status) override;
     void indexing_warning(const string &trace_filename,
-                          unsigned lineno, const string &msg) override;
+                          LineNo lineno, const string &msg) override;
     void indexing_error(const string &trace_filename,
-                        unsigned lineno, const string &msg) override;
+                        LineNo lineno, const string &msg) override;
     void indexing_start(streampos total) override;
     void indexing_progress(streampos pos) override;
     void indexing_done() override;
 
+    void make_progress_dialog(streampos total);
+
     string progress_title;
     int progress_max;
     int prev_progress;
@@ -3417,6 +3585,39 @@ string vcxxsprintf(const char *fmt, va_list ap)
     return buf.get();
 }
 
+/*
+ * Windows may only be touched from the GUI thread, but the Reporter
+ * methods are also called from the thread running the indexer. So
+ * they do their GUI work via this function, which runs 'fn' on the
+ * GUI thread, and if 'wait' is true, doesn't return until it has
+ * finished.
+ */
+static void run_in_gui_thread(function<void()> fn, bool wait)
+{
+    if (wxIsMainThread()) {
+        fn();
+    } else if (!wait) {
+        wxTheApp->CallAfter(fn);
+    } else {
+        std::promise<void> done;
+        wxTheApp->CallAfter([&fn, &done]() {
+            fn();
+            done.set_value();
+        });
+        done.get_future().wait();
+    }
+}
+
+static void show_message_box(const string &msg, const char *title, long style)
+{
+    run_in_gui_thread(
+        [&]() {
+            wxMessageDialog dlg(nullptr, msg, title, wxOK | wxCENTRE | style);
+            dlg.ShowModal();
+        },
+        true);
+}
+
 [[noreturn]] void WXGUIReporter::err(int exitstatus, const char *fmt, ...)
 {
     va_list ap;
@@ -3424,9 +3625,7 @@ string vcxxsprintf(const char *fmt, va_list ap)
     string msg = vcxxsprintf(fmt, ap);
     va_end(ap);
     msg = msg + ": " + get_error_message();
-    wxMessageDialog dlg(nullptr, msg, _("tarmac-gui-browser fatal error"),
-                        wxOK | wxCENTRE | wxICON_ERROR);
-    dlg.ShowModal();
+    show_message_box(msg, _("tarmac-gui-browser fatal error"), wxICON_ERROR);
     exit(exitstatus);
 }
 
@@ -3436,9 +3635,7 @@ string vcxxsprintf(const char *fmt, va_list ap)
     va_start(ap, fmt);
     string msg = vcxxsprintf(fmt, ap);
     va_end(ap);
-    wxMessageDialog dlg(nullptr, msg, _("tarmac-gui-browser fatal error"),
-                        wxOK | wxCENTRE | wxICON_ERROR);
-    dlg.ShowModal();
+    show_message_box(msg, _("tarmac-gui-browser fatal error"), wxICON_ERROR);
     exit(exitstatus);
 }
 
@@ -3449,9 +3646,7 @@ void WXGUIReporter::warn(const char *fmt, ...)
     string msg = vcxxsprintf(fmt, ap);
     va_end(ap);
     msg = msg + ": " + get_error_message();
-    wxMessageDialog dlg(nullptr, msg, _("tarmac-gui-browser warning"),
-                        wxOK | wxCENTRE | wxICON_EXCLAMATION);
-    dlg.ShowModal();
+    show_message_box(msg, _("tarmac-gui-browser warning"), wxICON_EXCLAMATION);
 }
 
 void WXGUIReporter::warnx(const char *fmt, ...)
@@ -3460,9 +3655,7 @@ void WXGUIReporter::warnx(const char *fmt, ...)
     va_start(ap, fmt);
     string msg = vcxxsprintf(fmt, ap);
     va_end(ap);
-    wxMessageDialog dlg(nullptr, msg, _("tarmac-gui-browser warning"),
-                        wxOK | wxCENTRE | wxICON_EXCLAMATION);
-    dlg.ShowModal();
+    show_message_box(msg, _("tarmac-gui-browser warning"), wxICON_EXCLAMATION);
 }
 
 void WXGUIReporter::indexing_status(const TracePair &trace,
@@ -3492,6 +3685,12 @@ void WXGUIReporter::indexing_status(const TracePair &trace,
       case IndexUpdateCheck::Incomplete:
         oss << endl << _("(previous index file generation was not completed)");
         break;
+      case IndexUpdateCheck::MissingParts:
+        oss << endl << _("(index file did not contain everything needed)");
+        break;
+      case IndexUpdateCheck::Extending:
+        oss << endl << _("(extending index file to cover new trace data)");
+        break;
       case IndexUpdateCheck::OK:
         oss << endl << _("(not actually indexing)");
         break;
@@ -3505,7 +3704,7 @@ void WXGUIReporter::indexing_status(const TracePair &trace,
 }
 
 void WXGUIReporter::indexing_warning(const string &trace_filename,
-                                     unsigned lineno, const string &msg)
+                                     LineNo lineno, const string &msg)
 {
     // Not really sure what we can usefully do with warnings during
     // indexing. I suppose we could try to put them on standard error
@@ -3514,7 +3713,7 @@ void WXGUIReporter::indexing_warning(const string &trace_filename,
 }
 
 void WXGUIReporter::indexing_error(const string &trace_filename,
-                                   unsigned lineno, const string &msg)
+                                   LineNo lineno, const string &msg)
 {
     ostringstream oss;
     oss << trace_filename << ":" << lineno << ": " << msg;
@@ -3522,20 +3721,28 @@ void WXGUIReporter::indexing_error(const string &trace_filename,
 }
 
 void WXGUIReporter::indexing_start(streampos total)
+{
+    // This is called on the indexing thread, so we wait for the GUI
+    // thread to make the dialog box before we let indexing begin.
+    run_in_gui_thread([this, total]() { make_progress_dialog(total); }, true);
+}
+
+void WXGUIReporter::make_progress_dialog(streampos total)
 {
     /*
      * We set an arbitrary dummy value of 10 for the progress bar's
      * range, which we'll change in a moment once we find out the
      * dialog box width.
      *
-     * It would be nice to add the wxPD_CAN_ABORT flag here, and use
-     * it to allow the user to cancel the operation. But I think we'd
-     * want to communicate that back to the indexer, so that it could
-     * delete the partial index file on the way out.
+     * If the user presses Cancel, we ask the indexer to stop, and it
+     * finishes an index of the part of the trace it's read so far,
+     * marked as partial so that it will be redone next time.
      */
+    string message = progress_title + "\n" +
+                     _("(Cancel to stop, and browse the part indexed so far)");
     progress_dlg = make_unique<wxProgressDialog>(
-        _("tarmac-gui-browser indexing"), progress_title, 10, nullptr,
-        wxPD_APP_MODAL | wxPD_AUTO_HIDE);
+        _("tarmac-gui-browser indexing"), message, 10, nullptr,
+        wxPD_APP_MODAL | wxPD_AUTO_HIDE | wxPD_CAN_ABORT);
 
     // The obvious thing to do here would be to set progress_max to
     // the input 'total' value, and call progress_dlg->Update every
@@ -3562,13 +3769,18 @@ void WXGUIReporter::indexing_progress(streampos pos)
     int value = progress_scale * pos;
     if (prev_progress != value) {
         prev_progress = value;
-        progress_dlg->Update(value);
+        run_in_gui_thread(
+            [this, value]() {
+                if (progress_dlg && !progress_dlg->Update(value))
+                    wxGetApp().request_stop_indexing();
+            },
+            false);
     }
 }
 
 void WXGUIReporter::indexing_done()
 {
-    progress_dlg = nullptr;
+    run_in_gui_thread([this]() { progress_dlg = nullptr; }, false);
 }
 
 std::unique_ptr<Reporter> reporter = make_wxgui_reporter();
@@ -3683,8 +3895,10 @@ bool GuiTarmacBrowserApp::OnInit()
     gettext_setup(false);
 
     Argparse ap("tarmac-gui-browser", argc, argv);
-    TarmacUtility tu;
     tu.add_options(ap);
+    ap.optnoval({"--prefault"},
+                _("read the whole index into memory before browsing"),
+                [this]() { prefault = true; });
 
     if (argc > 1) {
         /*
@@ -3737,12 +3951,8 @@ bool GuiTarmacBrowserApp::OnInit()
         ap.parse();
     }
 
-    tu.setup();
-
     config.read();
 
-    br = make_unique<Browser>(tu.trace, tu.image_filename, tu.load_offset);
-
     if (config.font.empty()) {
         TextViewWindow::font = wxFont(12, wxFONTFAMILY_TELETYPE,
                                       wxFONTSTYLE_NORMAL, wxFONTWEIGHT_NORMAL);
@@ -3766,12 +3976,55 @@ bool GuiTarmacBrowserApp::OnInit()
         TextViewWindow::baseline = h - descent;
     }
 
-    make_trace_window();
+    /*
+     * Now do the standard setup, which might have to index the trace
+     * file, on a thread of its own. The progress dialog is driven
+     * from the GUI thread's event loop (see WXGUIReporter), and when
+     * the setup has finished, we're called back to open the first
+     * trace window.
+     *
+     * Until then, the progress dialog may be the only top-level
+     * window, and it's destroyed (by WXGUIReporter::indexing_done)
+     * after the main loop has started. wx's usual rule of exiting
+     * when the last top-level window goes would then quit before the
+     * trace window could be opened, so that rule is suspended until
+     * make_trace_window has made one.
+     */
+    SetExitOnFrameDelete(false);
+    tu.set_indexer_stop_request(&stop_indexing);
+    indexing_thread = std::thread([this]() {
+        tu.setup_noexit();
+        CallAfter(&GuiTarmacBrowserApp::indexing_finished);
+    });
 
     return true;
 }
 
+void GuiTarmacBrowserApp::indexing_finished()
+{
+    indexing_thread.join();
+
+    if (tu.only_index()) {
+        ExitMainLoop();
+        return;
+    }
+
+    br = make_unique<Browser>(tu.trace, tu.image_filename, tu.load_offset);
+    br->prepare_index(prefault);
+    make_trace_window();
+}
+
+int GuiTarmacBrowserApp::OnExit()
+{
+    if (indexing_thread.joinable()) {
+        request_stop_indexing();
+        indexing_thread.join();
+    }
+    return wxApp::OnExit();
+}
+
 void GuiTarmacBrowserApp::make_trace_window()
 {
     (new TraceWindow(this, *br))->Show(true);
+    SetExitOnFrameDelete(true);
 }
@@ -21,24 +21,27 @@
 
 #include "libtarmac/index.hh"
 
+#include <algorithm>
+#include <cassert>
+#include <climits>
 #include <ostream>
-#include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 struct TarmacSite {
     Addr addr;            // PC address
     Time time;            // Time
-    unsigned tarmac_line; // Line number in the trace
+    LineNo tarmac_line;   // Line number in the trace
     OFF_T tarmac_pos;     // Offset (in bytes) in the trace
 
-    constexpr TarmacSite(Addr addr, Time time, unsigned tarmac_line,
+    constexpr TarmacSite(Addr addr, Time time, LineNo tarmac_line,
                          OFF_T tarmac_pos)
         : addr(addr), time(time), tarmac_line(tarmac_line),
           tarmac_pos(tarmac_pos)
     {
     }
-    constexpr TarmacSite(Addr addr, unsigned line)
+    constexpr TarmacSite(Addr addr, LineNo line)
         : addr(addr), time(0), tarmac_line(line), tarmac_pos(0)
     {
     }
@@ -72,13 +75,83 @@ struct TarmacSite {
     }
 };
 
+// Configuration options common to tools using a CallTree object.
+class Argparse;
+struct CallTreeOptions {
+    // When a record enters a function not at its start address, do we
+    // show it as 'function + 0xNNN', or just as 'function'?
+    bool show_offsets = true;
+
+    void add_options(Argparse &);
+};
+
+// Options for tools built on CallTreeWalker to look at only part of a
+// trace: the lines or times between two points, and/or only the calls
+// to one function. See CallTreeWalker::setWindow.
+struct CallTreeWindowOptions {
+    bool got_from_line = false, got_to_line = false;
+    bool got_from_time = false, got_to_time = false;
+    LineNo from_line = 0, to_line = 0; // line numbers in the trace file
+    Time from_time = 0, to_time = 0;
+    std::string root_function;
+
+    bool active() const
+    {
+        return got_from_line || got_to_line || got_from_time ||
+               got_to_time || !root_function.empty();
+    }
+
+    void add_options(Argparse &);
+};
+
+// The parts of a call tree that don't depend on how it is traversed:
+// the index it comes from, and how to describe the sites in it.
+class CallTreeBase {
+  protected:
+    const IndexNavigator &IN;
+    CallTreeOptions options;
+
+  public:
+    CallTreeBase(const IndexNavigator &IN) : IN(IN) {}
+
+    void setOptions(const CallTreeOptions &options_) { options = options_; }
+
+    std::string getFunctionName(Addr addr) const;
+    std::string getFunctionName(const TarmacSite &site) const;
+    void csdump(std::ostream &os, const TarmacSite &site) const;
+};
+
+// A cache of CallTreeBase::getFunctionName, for visitors that need the
+// names of a lot of function calls, most of which will be to the same
+// few functions. Each distinct entry address is symbolised once, and
+// given a small integer ID that can be used to refer to its name
+// (e.g. as a map key) more cheaply than the string itself.
+class FunctionNameTable {
+    const CallTreeBase &CT;
+    std::unordered_map<Addr, unsigned> ids;
+    std::vector<Addr> addrs;
+    std::vector<std::string> names;
+
+  public:
+    FunctionNameTable(const CallTreeBase &CT) : CT(CT) {}
+
+    unsigned getId(Addr addr);
+    Addr getAddr(unsigned id) const { return addrs[id]; }
+    const std::string &getName(unsigned id) const { return names[id]; }
+
+    const std::string &getFunctionName(const TarmacSite &site)
+    {
+        return getName(getId(site.addr));
+    }
+};
+
 class CallTree;
 class CallTreeVisitor {
   protected:
-    const CallTree &CT;
+    const CallTreeBase &CT;
 
   public:
-    CallTreeVisitor(const CallTree &CT) : CT(CT) {}
+    CallTreeVisitor(const CallTreeBase &CT) : CT(CT) {}
     void onFunctionEntry(const TarmacSite &function_entry,
                          const TarmacSite &function_exit)
     {
@@ -87,12 +160,19 @@ class CallTreeVisitor {
                         const TarmacSite &function_exit)
     {
     }
+    // CallTree::visit passes the subtree for the call; CallTreeWalker
+    // doesn't have one to pass.
     void onCallSite(const TarmacSite &function_entry,
                     const TarmacSite &function_exit,
                     const TarmacSite &call_site, const TarmacSite &resume_site,
                     const CallTree &TC)
     {
     }
+    void onCallSite(const TarmacSite &function_entry,
+                    const TarmacSite &function_exit,
+                    const TarmacSite &call_site, const TarmacSite &resume_site)
+    {
+    }
     void onResumeSite(const TarmacSite &function_entry,
                       const TarmacSite &function_exit,
                       const TarmacSite &resume_site)
@@ -100,19 +180,302 @@ class CallTreeVisitor {
     }
 };
 
-// Configuration options common to tools using a CallTree object.
-class Argparse;
-struct CallTreeOptions {
-    // When a record enters a function not at its start address, do we
-    // show it as 'function + 0xNNN', or just as 'function'?
-    bool show_offsets = true;
+// Traverse the calls in a trace, as recorded by the call depths in its
+// index, reporting them to a visitor in chronological order as they
+// are found, in the same sequence as CallTree::visit would. Only the
+// chain of calls leading to the current position is held in memory,
+// so memory use depends on the maximum call depth of the trace rather
+// than on the number of calls in it.
+//
+// A call that never returns (because the trace ends first) gets an
+// onCallSite with a default-constructed resume site, and no
+// onResumeSite.
+//
+// setWindow restricts the walk to part of the trace. Calls already in
+// progress at the start of the window, or still in progress at its
+// end, are clipped to it: such a call's entry site has the time and
+// position of the first node in the window (though still the address
+// of the function's real entry point, to say which function it is),
+// and its exit site is the last node in the window. A call cut off by
+// the end of the window is treated like one cut off by the end of the
+// trace.
+class CallTreeWalker : public CallTreeBase {
+    struct Return {
+        bool found;
+        LineNo line;          // first line after the return, if found
+        SeqOrderPayload node; // the node containing that line
+        TarmacSite exit;      // the last node before it
+    };
 
-    void add_options(Argparse &);
-};
+    // A call at the root of the walk: the outermost function of the
+    // trace, or one of the calls to the function chosen by setWindow.
+    struct Root {
+        LineNo line;          // the first line of the call
+        SeqOrderPayload node; // the node containing that line
+        Return ret;
+    };
 
-class CallTree {
-    const IndexNavigator &IN;
+    // The window set by setWindow, as the lines [window_first,
+    // window_end) of the trace, counting from zero as lrt_translate
+    // does, and the first and last nodes in it.
+    bool windowed = false;
+    LineNo window_first = 0, window_end = ULLONG_MAX;
+    SeqOrderPayload window_start, window_last;
+
+    // If 'rooted' is set, the roots of the walk are the calls to the
+    // function at 'root_addr', instead of the outermost function.
+    bool rooted = false;
+    Addr root_addr = 0;
+
+    bool next_line_at_other_depth(LineNo line, unsigned depth, bool higher,
+                                  LineNo &out) const;
+    LineNo find_call_entry(LineNo line, unsigned depth) const;
+    Return find_return(LineNo line, unsigned depth) const;
+    bool find_outermost_function(LineNo &line, SeqOrderPayload &node,
+                                 Return &ret, LineNo &end) const;
+    bool find_roots(std::vector<Root> &roots, LineNo &end) const;
+
+    // Find the next call made from call depth 'depth' at or after
+    // 'pos', and return the line where it was entered. That is before
+    // 'pos' if the call was already in progress at the start of the
+    // window.
+    bool next_call(LineNo pos, unsigned depth, LineNo &callline) const
+    {
+        if (!next_line_at_other_depth(pos, depth, true, callline) ||
+            callline >= window_end)
+            return false;
+        if (windowed && callline == window_first)
+            callline = find_call_entry(callline, depth);
+        return true;
+    }
+
+    // The entry site to report for a call entered at 'line'.
+    TarmacSite entry_site(LineNo line, const SeqOrderPayload &entry) const
+    {
+        if (line >= window_first)
+            return entry;
+        return TarmacSite(entry.pc, window_start.mod_time,
+                          window_start.trace_file_firstline,
+                          window_start.trace_file_pos);
+    }
 
+    template <typename Visitor>
+    void walk_function(Visitor &V, LineNo line, const SeqOrderPayload &entry,
+                       const Return &ret) const
+    {
+        unsigned depth = entry.call_depth;
+        TarmacSite function_entry = entry_site(line, entry),
+                   function_exit(ret.exit);
+        V.onFunctionEntry(function_entry, function_exit);
+
+        LineNo pos = std::max(line, window_first), callline;
+        while (next_call(pos, depth, callline) &&
+               !(ret.found && callline > ret.line)) {
+            SeqOrderPayload target, call_site;
+            IN.node_at_line(callline + 1, &target);
+            bool success = IN.get_previous_node(target, &call_site);
+            (void)success; // squash compiler warning if asserts compiled out
+            assert(success);
+
+            Return subret = find_return(callline, depth + 1);
+            TarmacSite resume_site;
+            if (subret.found)
+                resume_site = subret.node;
+
+            V.onCallSite(function_entry, function_exit, call_site,
+                         resume_site);
+            walk_function(V, callline, target, subret);
+            if (!subret.found)
+                break;
+            V.onResumeSite(function_entry, function_exit, resume_site);
+            pos = subret.line;
+        }
+
+        V.onFunctionExit(function_entry, function_exit);
+    }
+
+  public:
+    // A part of the call tree that can be walked independently of the
+    // rest of it: every call made from call depth 'depth' at a line in
+    // the range [firstline, lastline), together with everything each
+    // of those calls does in turn. 'context' holds the entry sites of
+    // the calls enclosing the shard, outermost first, the last being
+    // the function that makes the shard's calls.
+    struct Shard {
+        unsigned depth;
+        LineNo firstline, lastline;
+        std::vector<TarmacSite> context;
+    };
+
+  private:
+    // Split the body of one function, entered at 'line', into shards
+    // of about 'lines' lines each. Calls that are too big for one
+    // shard are split up in turn.
+    template <typename Visitor>
+    void split_function(Visitor &V, std::vector<Shard> &shards,
+                        std::vector<TarmacSite> &context, LineNo lines,
+                        LineNo line, const SeqOrderPayload &entry,
+                        const Return &ret, LineNo end) const
+    {
+        unsigned depth = entry.call_depth;
+        TarmacSite function_entry = entry_site(line, entry),
+                   function_exit(ret.exit);
+        V.onFunctionEntry(function_entry, function_exit);
+        context.push_back(function_entry);
+
+        LineNo limit = ret.found ? ret.line : end;
+        LineNo pos = std::max(line, window_first);
+        bool trace_ended = false; // inside a call that never returned
+        while (pos + lines < limit) {
+            LineNo cut = pos + lines;
+            SeqOrderPayload node;
+            IN.node_at_line(cut + 1, &node);
+            if (node.call_depth <= depth) {
+                // The cut is in this function itself, so we can just
+                // make it there.
+                shards.push_back({depth, pos, cut, context});
+                pos = cut;
+                continue;
+            }
+
+            // Otherwise the cut is inside one of our calls, which may
+            // have started before 'pos' if it was in progress at the
+            // start of the window.
+            LineNo callline = find_call_entry(cut, depth);
+            if (pos < callline)
+                shards.push_back({depth, pos, callline, context});
+
+            SeqOrderPayload target;
+            IN.node_at_line(callline + 1, &target);
+            Return subret = find_return(callline, depth + 1);
+            split_function(V, shards, context, lines, callline, target,
+                           subret, end);
+            if (!subret.found) {
+                trace_ended = true;
+                break;
+            }
+            pos = subret.line;
+        }
+        if (!trace_ended)
+            shards.push_back(
+                {depth, pos, ret.found ? ret.line : ULLONG_MAX, context});
+
+        context.pop_back();
+        V.onFunctionExit(function_entry, function_exit);
+    }
+
+  public:
+    CallTreeWalker(const IndexNavigator &IN) : CallTreeBase(IN) {}
+
+    // Restrict the walk to the part of the trace selected by 'wopts':
+    // only the lines in the window between the given start and end
+    // points, and/or only the calls to one function (with everything
+    // they call in turn), each of which is then a separate root of
+    // the walk. Exits with an error if the function can't be found,
+    // or the window contains no part of the trace.
+    //
+    // The start of the window is found directly in the index, and so
+    // is each call to the root function (by looking up visits to its
+    // address), so the time taken to walk a window depends on how
+    // much is in it, not on how far into the trace it is.
+    void setWindow(const CallTreeWindowOptions &wopts);
+
+    // If setWindow has restricted the walk to a window, set 'first'
+    // and 'last' to the first and last nodes in it, and return true.
+    bool getWindow(SeqOrderPayload &first, SeqOrderPayload &last) const
+    {
+        if (windowed) {
+            first = window_start;
+            last = window_last;
+        }
+        return windowed;
+    }
+
+    template <typename Visitor = CallTreeVisitor> void walk(Visitor &V) const
+    {
+        std::vector<Root> roots;
+        LineNo end;
+
+        if (!find_roots(roots, end)) {
+            V.onFunctionEntry(TarmacSite(), TarmacSite());
+            V.onFunctionExit(TarmacSite(), TarmacSite());
+            return;
+        }
+
+        for (const Root &root : roots)
+            walk_function(V, root.line, root.node, root.ret);
+    }
+
+    // Divide the call tree into about 'nshards' shards of similar
+    // size, which can then be walked in any order, or in parallel, by
+    // walk_shard. Between them, the shards visit every function call
+    // in the trace except the ones that had to be split across more
+    // than one shard (including the outermost function, always).
+    // Those are reported to V here instead, nested as walk() would
+    // nest them, but with no call sites, and none of the calls inside
+    // them that are left to the shards.
+    //
+    // So the shards are only useful to a visitor that looks at each
+    // function call in isolation, such as one that counts them, or
+    // one that can make use of each shard's context to put its calls
+    // in their place in the whole tree.
+    template <typename Visitor = CallTreeVisitor>
+    std::vector<Shard> split(Visitor &V, unsigned nshards) const
+    {
+        std::vector<Shard> shards;
+        std::vector<Root> roots;
+        LineNo end;
+
+        if (!find_roots(roots, end)) {
+            V.onFunctionEntry(TarmacSite(), TarmacSite());
+            V.onFunctionExit(TarmacSite(), TarmacSite());
+            return shards;
+        }
+
+        LineNo total = 0;
+        for (const Root &root : roots)
+            total += (root.ret.found ? root.ret.line : end) -
+                     std::max(root.line, window_first);
+        LineNo lines = std::max(1ULL, total / std::max(1U, nshards));
+        std::vector<TarmacSite> context;
+        for (const Root &root : roots)
+            split_function(V, shards, context, lines, root.line, root.node,
+                           root.ret, end);
+        return shards;
+    }
+
+    // Walk all the calls in one shard returned from split, in the
+    // same way as walk() would, except that there's no enclosing
+    // function, so the calls made directly from the shard's depth are
+    // not reported as call sites.
+    template <typename Visitor = CallTreeVisitor>
+    void walk_shard(Visitor &V, const Shard &shard) const
+    {
+        LineNo pos = shard.firstline, callline;
+        while (next_call(pos, shard.depth, callline) &&
+               callline < shard.lastline) {
+            SeqOrderPayload target;
+            IN.node_at_line(callline + 1, &target);
+            Return subret = find_return(callline, shard.depth + 1);
+            walk_function(V, callline, target, subret);
+            if (!subret.found)
+                break;
+            pos = subret.line;
+        }
+    }
+
+    // Write out the call tree in the same format as CallTree::dump.
+    void dump() const;
+
+    // Same as CallTree::generate_flame_graph. With more than one
+    // thread, the trace is split into shards which are walked in
+    // parallel, each thread accumulating its own partial totals for
+    // each call stack, and the totals are added up at the end, giving
+    // exactly the same output.
+    void generate_flame_graph(std::ostream &os, unsigned threads = 1) const;
+};
+
+class CallTree : public CallTreeBase {
     // The first instruction in this function instance.
     TarmacSite function_entry;
     // The last instruction in this function call instance, usually a return.
@@ -125,13 +488,14 @@ class CallTree {
     // The calltrees of all functions called by this function call instance.
     std::vector<CallTree> call_trees;
 
-    CallTreeOptions options;
-
   public:
+    // Build the complete call tree of a trace in memory. On a large
+    // trace, this can use a lot of memory; if you only need to go
+    // through the calls once in order, CallTreeWalker avoids that.
     CallTree(const IndexNavigator &IN);
     CallTree(const IndexNavigator &IN, const TarmacSite &site)
-        : IN(IN), function_entry(site), function_exit(), call_sites(),
-          resume_sites(), call_trees()
+        : CallTreeBase(IN), function_entry(site), function_exit(),
+          call_sites(), resume_sites(), call_trees()
     {
     }
 
@@ -154,11 +518,6 @@ class CallTree {
         resume_sites.push_back(resume_site);
     }
 
-    void setOptions(const CallTreeOptions &options_) { options = options_; }
-
-    std::string getFunctionName(Addr addr) const;
-    std::string getFunctionName(const TarmacSite &site) const;
-    void csdump(std::ostream &os, const TarmacSite &site) const;
     void dump(unsigned level = 0) const;
 
     /*
@@ -213,12 +572,6 @@ class CallTree {
 
         V.onFunctionEntry(function_entry, function_exit);
     }
-
-  private:
-    // Recursive helper function used by generate_flame_graph().
-    void generate_flame_graph_recurse(std::ostringstream &stackstream,
-                                      std::map<std::string, Time> &output,
-                                      Time *parent_time) const;
 };
 
 #endif // TARMAC_CALLTREE_HH
@@ -24,37 +24,195 @@
 // if they have been found by CMake.
 #include "libtarmac/platform.hh"
 
+#include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <functional>
+#include <iterator>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
+
+// Hints about how the contents of an Arena are going to be accessed,
+// which the platform can use to tune readahead and paging.
+enum class AccessPattern {
+    Normal,     // no particular pattern
+    Sequential, // mostly in increasing address order
+    Random,     // jumping about, so that readahead is wasted
+    HugePages,  // large and densely used, so use huge pages if possible
+};
+
+// Pass an AccessPattern hint on to the operating system for a range
+// of memory. The range needn't be page-aligned; only the whole pages
+// inside it are affected. Hints that the platform doesn't support are
+// ignored. (Implemented in the platform-specific module.)
+void advise_memory(void *addr, size_t len, AccessPattern pattern);
+
+// Reserve address space for 'len' bytes of memory that is filled in
+// and given back a range at a time, returning nullptr if there isn't
+// enough. commit_memory makes a range usable, zero-filled if it hasn't
+// been used before; discard_memory gives back the whole pages inside a
+// range, leaving the address space reserved, so that it reads as
+// zeroes (or can't be read at all) until committed again; and
+// release_memory gives back the whole reservation. (Implemented in the
+// platform-specific module.)
+void *reserve_memory(size_t len);
+void commit_memory(void *addr, size_t len);
+void discard_memory(void *addr, size_t len);
+void release_memory(void *addr, size_t len);
+
+// Kinds of data in an index that are looked at together, and so are
+// worth keeping apart from the others in the arena. Allocations from
+// any pool other than General are made from extents of the arena
+// reserved for that pool, each holding many allocations, so that (for
+// example) searching the seqtree doesn't also bring into memory the
+// memtree nodes that were created in between its nodes.
+enum class ArenaPool {
+    General,        // anything not listed below, e.g. the file header
+    MemTree,        // memtree nodes, and contents copied in checkpoints
+    MemSubTree,     // memsubtree nodes and their root pointers
+    MemContents,    // raw memory contents written during indexing
+    SeqTree,        // seqtree nodes, and call depth arrays copied with them
+    CallDepthArray, // call depth arrays made by build_call_tree
+    ByPCTree,
+    WriteTree,
+    Count
+};
+
+// Counts of the structures read out of arenas by the current thread,
+// kept only while 'enabled' is set, for QueryStats. A read at a
+// different page of the arena from the one before is counted as a
+// page switch, which is a rough upper bound on the number of pages a
+// query has to bring into memory. 'enabled' is atomic because other
+// threads (such as a prefetch worker) read arenas while it's set, but
+// only its own value matters, so it's read with relaxed ordering.
+struct ArenaAccessCounts {
+    static std::atomic<bool> enabled;
+
+    static bool is_enabled()
+    {
+        return enabled.load(std::memory_order_relaxed);
+    }
+    static thread_local ArenaAccessCounts current;
+
+    unsigned long long reads = 0, page_switches = 0;
+    OFF_T last_page = -1;
+
+    void note(OFF_T offset)
+    {
+        reads++;
+        OFF_T page = offset >> 12;
+        if (page != last_page) {
+            page_switches++;
+            last_page = page;
+        }
+    }
+};
 
 // Base class for a memory arena that will contain the index data structures.
 class Arena {
   protected:
     OFF_T curr_size = 0, next_offset = 0;
     void *mapping = nullptr;
+    AccessPattern access_pattern = AccessPattern::Normal;
+
+    // Set by an arena whose contents aren't all in memory to begin
+    // with, but are filled in by fill() as they're first read.
+    bool lazy = false;
 
   private:
     virtual void resize(size_t newsize) = 0; // must update curr_size
+    virtual void fill(OFF_T, size_t) const {}
+
+    void check_access(OFF_T offset, size_t size) const
+    {
+        assert(0 <= offset && (OFF_T)size <= next_offset &&
+               offset <= next_offset - (OFF_T)size);
+        if (ArenaAccessCounts::is_enabled())
+            ArenaAccessCounts::current.note(offset);
+        if (lazy)
+            fill(offset, size);
+    }
+
+    // The current extent of each pool: the next allocation from it
+    // goes at 'next', if there's room before 'end'. The extent began
+    // at 'start'. 'total' is the size of all the pool's extents so
+    // far, which the size of the next one is based on.
+    struct Extent {
+        OFF_T start = 0, next = 0, end = 0, total = 0;
+    };
+    Extent extents[(size_t)ArenaPool::Count];
+
+    // Extents that have been used up, and replaced by a new extent of
+    // the same pool, since take_finished_extents was last called.
+    std::vector<std::pair<OFF_T, OFF_T>> finished_extents;
 
   public:
     virtual ~Arena() = default;
 
     OFF_T alloc(size_t size);
+    OFF_T alloc(size_t size, ArenaPool pool);
     OFF_T curr_offset() const { return next_offset; }
 
+    // Return an offset that every allocation made from 'pool' so far
+    // is below, and that every later one will be at or above. Within a
+    // pool, allocations are always in increasing order of offset,
+    // because each new extent is allocated after everything else.
+    OFF_T pool_offset(ArenaPool pool) const
+    {
+        const Extent &e = extents[(size_t)pool];
+        return pool != ArenaPool::General && e.end ? e.next : next_offset;
+    }
+
+    // Append to 'out' the start and end offsets of every extent that
+    // a pool has moved on from since the last call, in the order they
+    // were finished with. Nothing more is allocated in them, and the
+    // trees' nodes in them are normally below their high-water marks,
+    // so they won't be written to again either (though a few in-place
+    // updates, like that of a sub-memtree's root pointer, can still
+    // happen).
+    void take_finished_extents(std::vector<std::pair<OFF_T, OFF_T>> &out);
+
+    // Say how the arena is going to be accessed. The hint is kept, and
+    // reapplied if the arena is moved or grown.
+    void advise(AccessPattern pattern);
+
+    // Write the part of a file-backed arena between 'start' and 'end'
+    // back to the file. If 'release' is false, this only starts the
+    // writes; if it's true, it waits for them to finish, and then
+    // drops that part of the file from memory, so that it has to be
+    // read back from disk if it's touched again. Either way, the
+    // contents of the arena are unaffected. Does nothing for an arena
+    // not backed by a file.
+    virtual void write_back(OFF_T start, OFF_T end, bool release);
+
+    // Read every page of the arena, using up to 'nthreads' threads,
+    // so that later accesses to a file-backed arena don't have to
+    // wait for the disk.
+    virtual void prefault(unsigned nthreads) const;
+
     template <class T> inline T *getptr(OFF_T offset)
     {
-        assert(0 <= offset && (OFF_T)sizeof(T) <= next_offset &&
-               offset <= next_offset - (OFF_T)sizeof(T));
+        check_access(offset, sizeof(T));
         return (T *)((char *)mapping + offset);
     }
 
     template <class T> inline const T *getptr(OFF_T offset) const
     {
-        assert(0 <= offset && (OFF_T)sizeof(T) <= next_offset &&
-               offset <= next_offset - (OFF_T)sizeof(T));
+        check_access(offset, sizeof(T));
+        return (const T *)((char *)mapping + offset);
+    }
+
+    // Return a pointer to 'count' consecutive objects of type T, all
+    // of which can be read through it. For reading a variable-sized
+    // array, which in a lazily filled arena might straddle parts that
+    // haven't been filled in yet.
+    template <class T> inline const T *getptr(OFF_T offset,
+                                              size_t count) const
+    {
+        check_access(offset, count * sizeof(T));
         return (const T *)((char *)mapping + offset);
     }
 
@@ -64,12 +222,31 @@ class Arena {
     }
 };
 
-// Arena stored in a disk file, accessed via memory-mapping
+// Parameters controlling how a writable MMapFile grows.
+struct MMapGrowthParams {
+    // If nonzero, the file is always extended to a multiple of this
+    // many bytes, so that a file growing steadily is extended (and
+    // its mapping updated) less often.
+    size_t granularity = 0;
+
+    // If true, disk space for each extension of the file is allocated
+    // straight away, where the platform supports it, instead of the
+    // file being left sparse until the pages are written.
+    bool preallocate = false;
+};
+
+// Arena stored in a disk file, accessed via memory-mapping.
+//
+// Where the platform allows it, a writable MMapFile reserves a large
+// range of address space when it's opened, and maps each extension
+// of the file into the next part of that range, so that the arena
+// doesn't move as it grows.
 class MMapFile: public Arena {
     struct PlatformData;
 
     const std::string filename;
     bool writable;
+    MMapGrowthParams growth;
     PlatformData *pdata;
 
     void map();
@@ -78,8 +255,11 @@ class MMapFile: public Arena {
     void resize(size_t newsize) override;
 
   public:
-    MMapFile(const std::string &filename, bool writable);
+    MMapFile(const std::string &filename, bool writable,
+             const MMapGrowthParams &growth = MMapGrowthParams());
     ~MMapFile();
+
+    void write_back(OFF_T start, OFF_T end, bool release) override;
 };
 
 // Arena stored as an allocated block of ordinary memory
@@ -91,8 +271,123 @@ class MemArena: public Arena {
     ~MemArena();
 };
 
+// Read-only Arena holding the contents of a compressed file, which
+// stores the original as a sequence of fixed-size blocks, each
+// compressed independently, preceded by a table of where each
+// block's compressed data ends.
+//
+// Each block is decompressed the first time anything in it is read,
+// into its place in a buffer the size of the whole original, so only
+// the parts of the index a tool actually looks at cost any time, or
+// (where the system allocates memory as it's touched) any memory.
+// Blocks are never evicted once decompressed, because the trees keep
+// pointers into the arena and read whole structures without regard
+// to block boundaries, so every byte must stay in place for as long
+// as the arena exists. So a tool that reads the whole index still
+// needs as much memory as the uncompressed index would take.
+class CompressedFile: public Arena {
+    struct Blocks;
+
+    const std::string filename;
+    Blocks *blocks;
+
+    void resize(size_t newsize) override;
+    void fill(OFF_T offset, size_t size) const override;
+    void fill_block(size_t block) const;
+
+  public:
+    CompressedFile(const std::string &filename);
+    ~CompressedFile();
+
+    // Decompress every block not yet decompressed, in parallel.
+    void prefault(unsigned nthreads) const override;
+
+    // Return true if a file is in the format this class reads.
+    static bool is_compressed(const std::string &filename);
+
+    // Replace an uncompressed file with a compressed version of
+    // itself.
+    static void compress_in_place(const std::string &filename);
+};
+
+// Integers in the index file are stored big-endian, so that an index
+// file is portable between hosts. Decoding them is done on every step
+// of every tree search, so it's worth making sure it compiles down to
+// a single (unaligned) load and byte-swap, on hosts where we know the
+// byte order and have a byte-swap builtin.
+#if defined __BYTE_ORDER__ && defined __ORDER_BIG_ENDIAN__ &&                \
+    __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define DISKINT_HOST_ORDER_MATCHES 1
+#elif defined __BYTE_ORDER__ && defined __ORDER_LITTLE_ENDIAN__ &&           \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && defined __GNUC__
+#define DISKINT_HOST_ORDER_SWAPPED 1
+#define DISKINT_BSWAP16 __builtin_bswap16
+#define DISKINT_BSWAP32 __builtin_bswap32
+#define DISKINT_BSWAP64 __builtin_bswap64
+#elif defined _MSC_VER
+// All the platforms supported by Visual Studio are little-endian.
+#include <stdlib.h>
+#define DISKINT_HOST_ORDER_SWAPPED 1
+#define DISKINT_BSWAP16 _byteswap_ushort
+#define DISKINT_BSWAP32 _byteswap_ulong
+#define DISKINT_BSWAP64 _byteswap_uint64
+#endif
+
+// Conversion between big-endian and host byte order, for unsigned
+// integers of each size that diskint is used with.
+template <size_t Size> struct DiskByteOrder;
+template <> struct DiskByteOrder<1> {
+    using UInt = uint8_t;
+    static inline UInt convert(UInt val) { return val; }
+};
+#if DISKINT_HOST_ORDER_SWAPPED
+template <> struct DiskByteOrder<2> {
+    using UInt = uint16_t;
+    static inline UInt convert(UInt val) { return DISKINT_BSWAP16(val); }
+};
+template <> struct DiskByteOrder<4> {
+    using UInt = uint32_t;
+    static inline UInt convert(UInt val) { return DISKINT_BSWAP32(val); }
+};
+template <> struct DiskByteOrder<8> {
+    using UInt = uint64_t;
+    static inline UInt convert(UInt val) { return DISKINT_BSWAP64(val); }
+};
+#elif DISKINT_HOST_ORDER_MATCHES
+template <> struct DiskByteOrder<2> {
+    using UInt = uint16_t;
+    static inline UInt convert(UInt val) { return val; }
+};
+template <> struct DiskByteOrder<4> {
+    using UInt = uint32_t;
+    static inline UInt convert(UInt val) { return val; }
+};
+template <> struct DiskByteOrder<8> {
+    using UInt = uint64_t;
+    static inline UInt convert(UInt val) { return val; }
+};
+#endif
+
 template <class Int> class diskint {
     unsigned char bytes[sizeof(Int)];
+
+#if DISKINT_HOST_ORDER_SWAPPED || DISKINT_HOST_ORDER_MATCHES
+    using Order = DiskByteOrder<sizeof(Int)>;
+    using UInt = typename Order::UInt;
+
+    inline void set(Int val)
+    {
+        UInt raw = Order::convert(static_cast<UInt>(val));
+        memcpy(bytes, &raw, sizeof(bytes));
+    }
+    inline Int get() const
+    {
+        UInt raw;
+        memcpy(&raw, bytes, sizeof(bytes));
+        return static_cast<Int>(Order::convert(raw));
+    }
+#else
+    // Portable fallback, for hosts whose byte order we don't know.
     inline void set(Int val)
     {
         for (size_t i = 0; i < sizeof(bytes); i++) {
@@ -100,6 +395,15 @@ template <class Int> class diskint {
             val >>= 8;
         }
     }
+    inline Int get() const
+    {
+        Int ret = 0;
+        for (size_t i = 0; i < sizeof(bytes); i++) {
+            ret = (ret << 8) + bytes[i];
+        }
+        return ret;
+    }
+#endif
 
   public:
     diskint() { set(0); }
@@ -109,15 +413,8 @@ template <class Int> class diskint {
     // but useful for gdb to set breakpoints on, because its syntax
     // has trouble specifying 'operator unsigned long long' and the
     // like, for some reason.
-    Int value() const
-    {
-        Int ret = 0;
-        for (size_t i = 0; i < sizeof(bytes); i++) {
-            ret = (ret << 8) + bytes[i];
-        }
-        return ret;
-    }
-    inline operator Int() const { return value(); }
+    Int value() const { return get(); }
+    inline operator Int() const { return get(); }
 };
 
 enum class WalkOrder { Preorder, Inorder, Postorder };
@@ -134,6 +431,7 @@ class AVLDisk {
     friend class AVLTest; // so the unit test can look inside
 
     Arena &arena;
+    ArenaPool pool;
 
     // This tree structure can operate in two mutually exclusive
     // modes, indicated by this flag.
@@ -160,10 +458,17 @@ class AVLDisk {
     bool refcounting;
 
     // High-water mark, used in non-refcounting mode. Nodes at
-    // addresses below here are already used by some prior tree root
-    // and hence are immutable.
+    // addresses below here (which are all in our own pool of the
+    // arena) are already used by some prior tree root and hence are
+    // immutable.
     OFF_T hwm;
 
+    // Number of times rewrite() has had to copy a node because it
+    // couldn't be modified (or was below one that couldn't), and
+    // number of times it has been able to modify one in place. Only
+    // used for reporting statistics.
+    unsigned long long clone_count = 0, inplace_count = 0;
+
     struct node {
         // offset can be 0, meaning this is the null node
         OFF_T offset, lc, rc;
@@ -195,7 +500,7 @@ class AVLDisk {
             newnode = freehead;
             freehead = fn.next;
         } else {
-            newnode = arena.alloc(sizeof(disknode));
+            newnode = arena.alloc(sizeof(disknode), pool);
         }
 
         disknode &dn = *arena.getptr<disknode>(newnode);
@@ -284,6 +589,9 @@ class AVLDisk {
                 adjust_refcount(n.lc, +1);
             if (n.rc)
                 adjust_refcount(n.rc, +1);
+            clone_count++;
+        } else {
+            inplace_count++;
         }
 
         adjust_refcount(n.lc, -1);
@@ -558,20 +866,69 @@ class AVLDisk {
         }
     }
 
+    // Used by copy_in_veb_order: a link from a node already copied to
+    // a child that hasn't been yet.
+    struct PendingLink {
+        OFF_T child;     // original child node
+        OFF_T newparent; // copy of its parent
+        bool right;      // true if the child is the right-hand one
+    };
+
+    // Copy the top 'levels' levels of the subtree rooted at 'oldoff',
+    // in van Emde Boas order: first (recursively) the top half of
+    // those levels, then each subtree hanging off the bottom of that
+    // half. Links from the last level copied to the children below it
+    // are left null, and appended to 'below' for the caller to fill in.
+    template <class CopyVisitor>
+    OFF_T veb_copy(OFF_T oldoff, int levels, std::vector<PendingLink> &below,
+                   CopyVisitor &visitor)
+    {
+        if (levels == 1) {
+            node n = get(oldoff);
+            OFF_T lc = n.lc, rc = n.rc;
+            n.offset = alloc_node();
+            visitor(n.payload, n.annotation);
+            n.lc = n.rc = 0;
+            put(n);
+            if (lc)
+                below.push_back(PendingLink{lc, n.offset, false});
+            if (rc)
+                below.push_back(PendingLink{rc, n.offset, true});
+            return n.offset;
+        }
+
+        int top = levels / 2;
+        std::vector<PendingLink> middle;
+        OFF_T newroot = veb_copy(oldoff, top, middle, visitor);
+        for (const PendingLink &link : middle) {
+            OFF_T newchild = veb_copy(link.child, levels - top, below, visitor);
+            disknode &dn = *arena.getptr<disknode>(link.newparent);
+            if (link.right)
+                dn.rc = newchild;
+            else
+                dn.lc = newchild;
+        }
+        return newroot;
+    }
+
   public:
-    AVLDisk(Arena &arena, bool refcounting = false)
-        : arena(arena), refcounting(refcounting)
+    AVLDisk(Arena &arena, bool refcounting = false,
+            ArenaPool pool = ArenaPool::General)
+        : arena(arena), pool(pool), refcounting(refcounting)
     {
-        hwm = arena.curr_offset();
+        hwm = arena.pool_offset(pool);
         freehead = 0;
     }
 
     void commit()
     {
         assert(!refcounting && "commit() is illegal in refcounting mode");
-        hwm = arena.curr_offset();
+        hwm = arena.pool_offset(pool);
     }
 
+    unsigned long long nodes_cloned() const { return clone_count; }
+    unsigned long long nodes_modified_in_place() const { return inplace_count; }
+
     OFF_T clone_tree(OFF_T root)
     {
         adjust_refcount(root, +1);
@@ -583,6 +940,28 @@ class AVLDisk {
         free_node(root);
     }
 
+    // Make a copy of a finished tree, with its nodes laid out in the
+    // arena in van Emde Boas order, so that any search from the root
+    // to a leaf of a tree of height h visits only about log_B(h)
+    // distinct blocks of any size B, instead of nearly h of them.
+    // Returns the root of the copy. The original tree is unchanged.
+    //
+    // 'visitor' is called for each node as soon as its copy has been
+    // allocated, with the copy's payload and annotation, which it may
+    // modify. Anything the visitor allocates in the arena is therefore
+    // placed next to the node it belongs to.
+    template <class CopyVisitor>
+    OFF_T copy_in_veb_order(OFF_T root, CopyVisitor visitor)
+    {
+        assert(!refcounting && "copy_in_veb_order is for finished trees");
+        if (!root)
+            return 0;
+        std::vector<PendingLink> below;
+        OFF_T newroot = veb_copy(root, get(root).height, below, visitor);
+        assert(below.empty());
+        return newroot;
+    }
+
     template <class PayloadComparable>
     OFF_T remove(OFF_T oldroot, const PayloadComparable &keyfinder, bool *found,
                  Payload *removed_payload)
@@ -736,11 +1115,19 @@ class AVLDisk {
         return false;
     }
 
+    // The visitors passed to walk(), visit() and visit_from() can be
+    // any callable object. They're instantiated as template
+    // parameters and passed down the recursion by reference, so a
+    // lambda is called directly at every node, and can be inlined,
+    // instead of going through a std::function (let alone a fresh copy
+    // of one per node). The std::function types below describe the
+    // visitors' signatures, and are convenient for storing one.
     using WalkVisitor =
         std::function<void(Payload &, Annotation &, OFF_T, Annotation *, OFF_T,
                            Annotation *, OFF_T)>;
 
-    void walk(OFF_T nodeoff, WalkOrder order, WalkVisitor visitor)
+    template <class Visitor>
+    void walk(OFF_T nodeoff, WalkOrder order, Visitor &&visitor)
     {
         node n, lc, rc;
         Annotation *lca, *rca;
@@ -771,12 +1158,46 @@ class AVLDisk {
         put(n);
     }
 
+    // Walk the tree once, calling 'inorder' on each node's payload
+    // between visiting its two subtrees, and 'postorder' after both,
+    // so that a pass which needs a value computed in order before it
+    // can finish each node doesn't have to traverse the tree twice.
+    using InorderVisitor = std::function<void(Payload &)>;
+
+    template <class Inorder, class Postorder>
+    void walk(OFF_T nodeoff, Inorder &&inorder, Postorder &&postorder)
+    {
+        node n, lc, rc;
+        Annotation *lca, *rca;
+
+        if (!nodeoff)
+            return;
+
+        n = get(nodeoff);
+
+        if (n.lc)
+            walk(n.lc, inorder, postorder);
+        inorder(n.payload);
+        if (n.rc)
+            walk(n.rc, inorder, postorder);
+
+        lca = n.lc ? (lc = get(n.lc), &lc.annotation) : nullptr;
+        rca = n.rc ? (rc = get(n.rc), &rc.annotation) : nullptr;
+        postorder(n.payload, n.annotation, n.lc, lca, n.rc, rca, nodeoff);
+        if (n.lc)
+            put(lc);
+        if (n.rc)
+            put(rc);
+
+        put(n);
+    }
+
     using ConstWalkVisitor = std::function<void(
         const Payload &, const Annotation &, OFF_T, const Annotation *, OFF_T,
         const Annotation *, OFF_T)>;
 
-    void walk(OFF_T nodeoff, WalkOrder order,
-              const ConstWalkVisitor &visitor) const
+    template <class Visitor>
+    void walk(OFF_T nodeoff, WalkOrder order, Visitor &&visitor) const
     {
         node n, lc, rc;
         Annotation *lca, *rca;
@@ -803,7 +1224,7 @@ class AVLDisk {
 
     using SimpleVisitor = std::function<void(const Payload &, OFF_T)>;
 
-    void visit(OFF_T nodeoff, SimpleVisitor visitor) const
+    template <class Visitor> void visit(OFF_T nodeoff, Visitor &&visitor) const
     {
         if (!nodeoff)
             return;
@@ -813,6 +1234,299 @@ class AVLDisk {
         visitor(n.payload, nodeoff);
         visit(n.rc, visitor);
     }
+
+    using RangeVisitor = std::function<bool(const Payload &, OFF_T)>;
+
+    // Visit the payloads that compare greater than or equal to
+    // 'keyfinder', in order, until the visitor returns false. This
+    // descends from the root only once, so visiting k payloads costs
+    // O(log n + k), where calling succ() k times would cost O(k log n).
+    // Returns false if the visitor stopped it.
+    template <class PayloadComparable, class Visitor>
+    bool visit_from(OFF_T nodeoff, const PayloadComparable &keyfinder,
+                    Visitor &&visitor) const
+    {
+        if (!nodeoff)
+            return true;
+
+        const node n = get(nodeoff);
+        if (keyfinder.cmp(n.payload) <= 0) {
+            if (!visit_from(n.lc, keyfinder, visitor))
+                return false;
+            if (!visitor(n.payload, nodeoff))
+                return false;
+        }
+        return visit_from(n.rc, keyfinder, visitor);
+    }
+
+    // The same, but also skipping any subtree for which 'skip'
+    // returns true when given its annotation, so that an annotation
+    // can rule out parts of the tree that the sort order can't.
+    template <class PayloadComparable, class SkipSubtree, class Visitor>
+    bool visit_from(OFF_T nodeoff, const PayloadComparable &keyfinder,
+                    const SkipSubtree &skip, Visitor &&visitor) const
+    {
+        if (!nodeoff)
+            return true;
+
+        const node n = get(nodeoff);
+        if (skip(n.annotation))
+            return true;
+        if (keyfinder.cmp(n.payload) <= 0) {
+            if (!visit_from(n.lc, keyfinder, skip, visitor))
+                return false;
+            if (!visitor(n.payload, nodeoff))
+                return false;
+        }
+        return visit_from(n.rc, keyfinder, skip, visitor);
+    }
+
+    // An iterator over the payloads of one tree root, in order. It
+    // keeps the path from the root down to the current node, so
+    // stepping to the next or previous payload takes amortised
+    // constant time, where succ() and pred() search all the way down
+    // from the root each time, and a loop using it needs neither
+    // recursion nor a visitor.
+    //
+    // Stepping off either end of the tree gives end(). Stepping
+    // forwards from end() goes back to the first payload, and
+    // backwards from it to the last, so a caller can always undo a
+    // step that went too far.
+    class const_iterator {
+        friend class AVLDisk;
+
+        const AVLDisk *tree = nullptr;
+        OFF_T root = 0;
+        std::vector<OFF_T> path; // empty at end()
+        Payload payload;
+
+        const_iterator(const AVLDisk *tree, OFF_T root)
+            : tree(tree), root(root)
+        {
+        }
+
+        const disknode &dn(OFF_T offset) const
+        {
+            return *tree->arena.template getptr<disknode>(offset);
+        }
+
+        // Go down from 'offset' to the first payload of its subtree,
+        // or the last.
+        void descend(OFF_T offset, bool first)
+        {
+            while (offset) {
+                path.push_back(offset);
+                offset = first ? dn(offset).lc : dn(offset).rc;
+            }
+        }
+
+        void load()
+        {
+            if (!path.empty())
+                payload = dn(path.back()).payload;
+        }
+
+        void step(bool forward)
+        {
+            if (path.empty()) {
+                descend(root, forward);
+            } else if (OFF_T child = forward ? dn(path.back()).rc
+                                             : dn(path.back()).lc) {
+                descend(child, forward);
+            } else {
+                // Go back up until we come up out of a subtree on the
+                // side we're moving away from.
+                OFF_T from;
+                do {
+                    from = path.back();
+                    path.pop_back();
+                } while (!path.empty() && from == (forward
+                                                       ? dn(path.back()).rc
+                                                       : dn(path.back()).lc));
+            }
+            load();
+        }
+
+      public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = Payload;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Payload *;
+        using reference = const Payload &;
+
+        const_iterator() = default;
+
+        const Payload &operator*() const { return payload; }
+        const Payload *operator->() const { return &payload; }
+
+        // Offset of the current node in the arena.
+        OFF_T offset() const { return path.back(); }
+
+        const_iterator &operator++()
+        {
+            step(true);
+            return *this;
+        }
+        const_iterator &operator--()
+        {
+            step(false);
+            return *this;
+        }
+        const_iterator operator++(int)
+        {
+            const_iterator ret = *this;
+            step(true);
+            return ret;
+        }
+        const_iterator operator--(int)
+        {
+            const_iterator ret = *this;
+            step(false);
+            return ret;
+        }
+
+        bool operator==(const const_iterator &rhs) const
+        {
+            if (path.empty() || rhs.path.empty())
+                return path.empty() && rhs.path.empty() && root == rhs.root;
+            return path.back() == rhs.path.back();
+        }
+        bool operator!=(const const_iterator &rhs) const
+        {
+            return !(*this == rhs);
+        }
+    };
+
+    const_iterator begin(OFF_T root) const
+    {
+        const_iterator it(this, root);
+        it.step(true);
+        return it;
+    }
+
+    const_iterator end(OFF_T root) const { return const_iterator(this, root); }
+
+    // An iterator at the first payload comparing greater than or equal
+    // to 'keyfinder', or end() if there isn't one.
+    template <class PayloadComparable>
+    const_iterator lower_bound(OFF_T root,
+                               const PayloadComparable &keyfinder) const
+    {
+        const_iterator it(this, root);
+        size_t found = 0;
+        for (OFF_T offset = root; offset;) {
+            it.path.push_back(offset);
+            const disknode &dn = *arena.getptr<disknode>(offset);
+            if (keyfinder.cmp(dn.payload) <= 0) {
+                found = it.path.size();
+                offset = dn.lc;
+            } else {
+                offset = dn.rc;
+            }
+        }
+        it.path.resize(found);
+        it.load();
+        return it;
+    }
+
+    // Visit the payloads of two trees that are not in any subtree the
+    // two have in common, in order of their position in each tree.
+    // The visitor is told which tree each payload came from: 0 for
+    // root_a, 1 for root_b. Trees built from each other by insert()
+    // and remove() share every node that neither changed, so this
+    // costs time proportional to the number of nodes that differ
+    // (times the tree height), not to the size of the trees.
+    //
+    // A payload can be reported from both trees, if a node holding it
+    // was copied because something below it changed.
+    using DiffVisitor = std::function<void(const Payload &, int)>;
+
+    void visit_differences(OFF_T root_a, OFF_T root_b,
+                           const DiffVisitor &visitor) const
+    {
+        // Each tree is walked in order by a stack of the things still
+        // to visit: either a whole subtree, or a single node whose
+        // left subtree has been dealt with. Two whole subtrees at the
+        // same offset are the same, and can be skipped together. For
+        // that to happen, the walks must be kept in step, by always
+        // advancing the one whose next payload comes first.
+        struct Pending {
+            OFF_T offset;
+            bool whole;
+            bool first_known;
+            Payload first;
+        };
+        std::vector<Pending> stacks[2];
+
+        auto push = [&](int side, OFF_T offset, bool whole) {
+            if (offset)
+                stacks[side].push_back({offset, whole, false, Payload()});
+        };
+        auto first = [&](Pending &p) -> const Payload & {
+            if (!p.first_known) {
+                OFF_T off = p.offset;
+                node n = get(off);
+                while (p.whole && n.lc)
+                    n = get(n.lc);
+                p.first = n.payload;
+                p.first_known = true;
+            }
+            return p.first;
+        };
+        auto height = [&](const Pending &p) {
+            return p.whole ? get(p.offset).height : 0;
+        };
+        auto expand = [&](int side) {
+            Pending p = stacks[side].back();
+            stacks[side].pop_back();
+            node n = get(p.offset);
+            push(side, n.rc, true);
+            push(side, p.offset, false);
+            push(side, n.lc, true);
+        };
+        // Report everything in the pending item on top of one stack.
+        auto emit = [&](int side) {
+            Pending p = stacks[side].back();
+            stacks[side].pop_back();
+            if (p.whole)
+                visit(p.offset, [&](const Payload &payload, OFF_T) {
+                    visitor(payload, side);
+                });
+            else
+                visitor(get(p.offset).payload, side);
+        };
+
+        push(0, root_a, true);
+        push(1, root_b, true);
+        while (!stacks[0].empty() || !stacks[1].empty()) {
+            if (stacks[0].empty() || stacks[1].empty()) {
+                emit(stacks[0].empty() ? 1 : 0);
+                continue;
+            }
+
+            Pending &a = stacks[0].back(), &b = stacks[1].back();
+            if (a.offset == b.offset && a.whole == b.whole) {
+                stacks[0].pop_back();
+                stacks[1].pop_back();
+                continue;
+            }
+
+            int c = first(a).cmp(first(b));
+            int side;
+            if (c != 0) {
+                side = c < 0 ? 0 : 1;
+            } else {
+                // Both start with the same payload, so either might
+                // contain the other's subtree, and only the larger
+                // one can usefully be expanded.
+                side = height(a) >= height(b) ? 0 : 1;
+            }
+            if (stacks[side].back().whole)
+                expand(side);
+            else
+                emit(side);
+        }
+    }
 };
 
 // A class encapsulating information about the filename of a Tarmac
@@ -0,0 +1,240 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#ifndef LIBTARMAC_EVENTCACHE_HH
+#define LIBTARMAC_EVENTCACHE_HH
+
+#include "libtarmac/platform.hh"
+
+#include "libtarmac/misc.hh"
+#include "libtarmac/parser.hh"
+#include "libtarmac/tracesource.hh"
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * An event cache is a side-car file holding every event that the
+ * parser found in a trace file, in a compact binary form that can be
+ * replayed into a ParseReceiver far faster than the text can be
+ * parsed again. The indexer can write one as it goes (see
+ * IndexerParams::event_cache), and use it in place of the trace text
+ * the next time the same trace is indexed, e.g. with different
+ * IndexerParams or after the index format changes.
+ *
+ * The cache records the length of every line as well as its events,
+ * so a reader always knows the exact position in the trace file that
+ * each event came from. It doesn't record highlighting, which is only
+ * needed for displaying a line, and is found by parsing that line
+ * again.
+ *
+ * A cache usually covers the trace from its first line, but it can
+ * start at any line. One that doesn't start at the beginning is a
+ * shard of the cache for the whole file: see write_event_cache_shard()
+ * below.
+ *
+ * The file starts with a header:
+ *
+ *   16-byte magic number "TarmacEventsV002"
+ *   u64  size of the trace file
+ *   u8   ParseParams: bigend, iset_specified, iset
+ *   u64  position in the trace file of the first line covered
+ *   u64  position in the trace file just after the last line covered
+ *   u64  offset in this file of the end record
+ *
+ * followed by a start record, giving the parser's inter-line state
+ * before the first line covered (see TarmacLineParser::SavedState):
+ *
+ *   'S'  u64 timestamp, str continued_event_type,
+ *        u64 post_event_type_start
+ *
+ * and then a sequence of records, each starting with a one-byte
+ * tag. Every line of the trace starts with an 'L' record, and the
+ * records after it, up to the next one, are that line's events, in the
+ * order the parser delivered them:
+ *
+ *   'L'  u32 length of the line, not counting its \n
+ *   'I'  instruction: u64 time, u8 effect, u64 pc, u8 iset, u8 width,
+ *        u32 instruction, str disassembly
+ *   'R'  register: u64 time, u8 prefix, u32 index, u64 offset, str bytes
+ *   'M'  memory: u64 time, u8 flags (1 = read, 2 = known), u64 size,
+ *        u64 addr, u64 contents
+ *   'T'  text only: u64 time, str type, str msg
+ *   'X'  exception: u64 time
+ *   'W'  parse warning: str message
+ *
+ * The last record is an end record, giving the parser's state after
+ * the last line covered, in the same form as the start record:
+ *
+ *   'E'  u64 timestamp, str continued_event_type,
+ *        u64 post_event_type_start
+ *
+ * Integers are big-endian, and 'str' is a u32 length followed by that
+ * many bytes. Only complete lines of the trace are covered, so the
+ * end of the part covered is always the position just after a \n.
+ */
+
+class EventCacheReader;
+
+class EventCacheWriter {
+    std::string filename, tmp_filename;
+    std::ofstream ofs;
+    std::string line;
+    OFF_T trace_size, covered, limit;
+    unsigned long long records_size;
+    bool finished;
+
+    void put(unsigned long long val, unsigned bytes, std::string &out);
+    void put_str(StringSpan s, std::string &out);
+    void put_state(char tag, const TarmacLineParser::SavedState &state,
+                   std::string &out);
+
+  public:
+    // Start writing an event cache, which will cover the first 'limit'
+    // bytes of a trace file of size 'trace_size', or the part of it
+    // from 'start' to 'limit', if the parser was in 'start_state' at
+    // 'start'. The file is written under a temporary name, and only
+    // renamed to 'filename' by finish(), so a partly written cache is
+    // never mistaken for a complete one.
+    EventCacheWriter(const std::string &filename, OFF_T trace_size,
+                     OFF_T limit, const ParseParams &pparams, OFF_T start = 0,
+                     const TarmacLineParser::SavedState &start_state =
+                         TarmacLineParser::SavedState());
+    ~EventCacheWriter();
+
+    // False if the file couldn't be created.
+    bool ok() const { return !ofs.fail(); }
+
+    // Record the events of one line, then end_line() to say how long
+    // the line was. Lines past the limit are ignored.
+    void record(const InstructionEventView &ev);
+    void record(const RegisterEventView &ev);
+    void record(const MemoryEvent &ev);
+    void record(const TextOnlyEventView &ev);
+    void record(const ExceptionEvent &ev);
+    void record_warning(const std::string &msg);
+    void end_line(size_t len);
+
+    // Copy all the lines of another cache, which must start where the
+    // lines recorded so far end.
+    void append(const EventCacheReader &cache);
+
+    // True once the lines recorded have reached the limit.
+    bool complete() const { return covered == limit; }
+
+    // Write the end record and put the file in place. Returns false if
+    // anything went wrong writing it, in which case the file is
+    // removed.
+    bool finish(const TarmacLineParser::SavedState &state);
+};
+
+class EventCacheReader {
+    std::string filename;
+    std::unique_ptr<TraceSource> file;
+    const unsigned char *data, *records, *pos, *end;
+    OFF_T first, covered;
+    TarmacLineParser::SavedState initial_state, final_state;
+
+    bool check_header(OFF_T trace_size, const ParseParams &pparams);
+    void corrupt() const;
+    unsigned long long get(unsigned bytes);
+    StringSpan get_str();
+    TarmacLineParser::SavedState get_state(char tag);
+
+  public:
+    // Open an event cache for the trace file 'tarmac_filename',
+    // returning false if it doesn't exist, is older than the trace
+    // file, or was written for a different trace or different parse
+    // parameters.
+    bool open(const std::string &filename, const std::string &tarmac_filename,
+              OFF_T trace_size, const ParseParams &pparams);
+
+    // The same, but without comparing the files' timestamps, which
+    // mean nothing for a shard copied from another machine.
+    bool open_shard(const std::string &filename, OFF_T trace_size,
+                    const ParseParams &pparams);
+
+    // Positions in the trace file of the start of the first line the
+    // cache covers and of the end of the last one, and the parser
+    // state at each.
+    OFF_T start_position() const { return first; }
+    OFF_T covered_size() const { return covered; }
+    const TarmacLineParser::SavedState &start_state() const
+    {
+        return initial_state;
+    }
+    const TarmacLineParser::SavedState &end_state() const
+    {
+        return final_state;
+    }
+
+    // The records of all the lines in the cache, as they appear in
+    // the file.
+    StringSpan line_records() const
+    {
+        return StringSpan((const char *)records, end - records);
+    }
+
+    // Read the start of the next line, returning false if there are no
+    // more. Then replay_line() sends that line's events to 'recv', in
+    // the order the parser originally delivered them.
+    // The strings and bytes of the events point straight into the
+    // cache file, so nothing is copied unless 'recv' asks for it.
+    bool next_line(size_t &len);
+    void replay_line(ParseReceiver &recv);
+
+    // Replay all the events in the cache, in order.
+    void replay(ParseReceiver &recv);
+};
+
+std::string default_event_cache_filename(const std::string &tarmac_filename);
+
+/*
+ * Parsing a very large trace can be shared out between machines, by
+ * having each one parse a different part of it into a shard of the
+ * event cache, and then stitching the shards together into the cache
+ * for the whole trace. Indexing the trace with the event cache turned
+ * on (IndexerParams::event_cache) then only has to build the index
+ * from the cached events.
+ *
+ * write_event_cache_shard parses the lines of the trace that start at
+ * byte positions in [start,end). The shards for a sequence of ranges
+ * that run on from each other cover every line exactly once. Like
+ * the parallel parser, it first parses a few lines before 'start' to
+ * find out what state the parser is likely to be in by then.
+ *
+ * stitch_event_cache_shards writes a cache for the whole trace (or the
+ * part of it from the start that the shards cover) from the given
+ * shards, in whatever order they're listed. If some shard's guess at
+ * its starting parser state was wrong, its lines are parsed again.
+ *
+ * Both report a fatal error if the trace can't be parsed, or if the
+ * shards don't fit together, and return false if the output file
+ * couldn't be written.
+ */
+bool write_event_cache_shard(const std::string &filename,
+                             const TraceSource &source, OFF_T start,
+                             OFF_T end, const ParseParams &pparams);
+bool stitch_event_cache_shards(const std::string &filename,
+                               const std::vector<std::string> &shards,
+                               const TraceSource &source,
+                               const ParseParams &pparams);
+
+#endif // LIBTARMAC_EVENTCACHE_HH
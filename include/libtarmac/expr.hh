@@ -23,6 +23,7 @@
 #include <memory>
 #include <ostream>
 #include <string>
+#include <vector>
 
 struct RegisterId;
 
@@ -47,10 +48,18 @@ struct ParseContext {
 // the value of a register given a RegisterId, or return false if the
 // register's value is unavailable in this particular execution
 // context (e.g. a time in the trace before it was first written).
+// Similarly for memory, read as an integer of 'size' bytes (1, 2, 4
+// or 8) in the target's byte order, which by default is never
+// available.
 struct ExecutionContext {
     virtual ~ExecutionContext() {}
     virtual bool lookup_register(const RegisterId &reg,
                                  uint64_t &out) const = 0;
+    virtual bool lookup_memory(uint64_t /*addr*/, size_t /*size*/,
+                               uint64_t & /*out*/) const
+    {
+        return false;
+    }
 };
 
 struct TrivialParseContext : ParseContext {
@@ -77,6 +86,13 @@ struct Expression {
     virtual uint64_t evaluate(const ExecutionContext &) = 0;
     virtual void dump(std::ostream &) = 0;
     virtual bool is_constant() { return false; }
+
+    // Append to 'out' every register the expression refers to, so
+    // that a caller evaluating it repeatedly can fetch them all in
+    // one go. (A register used more than once appears more than once.)
+    virtual void collect_registers(std::vector<RegisterId> & /*out*/) const
+    {
+    }
 };
 
 using ExprPtr = std::shared_ptr<Expression>;
@@ -85,6 +101,14 @@ ExprPtr parse_expression(const std::string &input, const ParseContext &,
                          std::ostream &error);
 ExprPtr constant_expression(uint64_t value);
 
+// Return an equivalent expression in which every subexpression that
+// doesn't depend on a register has been replaced by its value. Symbols
+// are already turned into constants by parse_expression, so this
+// leaves only the arithmetic that really has to be redone for each
+// new set of register values. The input expression may be modified,
+// so it should be replaced with the return value.
+ExprPtr simplify_expression(ExprPtr expr);
+
 // Returns true if the input string would be regarded by parse_expression's
 // lexer as containing no tokens at all. (Slightly more forgiving than 'is it
 // literally an empty string?', in that it ignores whitespace.)
@@ -24,6 +24,7 @@
 
 #include <forward_list>
 #include <map>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -73,17 +74,37 @@ struct Segment {
     }
 };
 
+// The symbol table is only read from the ELF file the first time
+// something asks for a symbol, so a tool that only wants an image's
+// segments, or never gets round to symbolising anything, doesn't pay
+// for reading the whole of a large one. This is safe with several
+// threads looking up symbols at once.
 class Image {
     std::unique_ptr<ElfFile> elf_file;
     const std::string image_filename;
     bool is_big_end;
+
+    // Everything below here is filled in by load_symbols.
+    mutable std::once_flag symbols_loaded;
     std::forward_list<Symbol> symbols;
-    std::map<Addr, std::vector<const Symbol *>> addrtab;
     std::map<std::string, std::vector<const Symbol *>> symtab;
 
+    // The address space divided into ranges within which
+    // find_symbol(Addr) always gives the same answer, sorted by
+    // start address, each with that answer precomputed. Each range
+    // runs up to the start of the next one (and the last one to the
+    // top of the address space), so a lookup is one binary search.
+    struct AddrRange {
+        Addr start;
+        const Symbol *sym;
+    };
+    std::vector<AddrRange> addr_ranges;
+
     void add_symbol(const Symbol &sym);
     void load_headers();
     void load_symboltable();
+    void build_addr_ranges();
+    void load_symbols() const;
 
   public:
     const std::string &get_filename() const { return image_filename; }
@@ -99,18 +120,14 @@ class Image {
     const std::vector<const Symbol *> *
     find_all_symbols(const std::string &name) const
     {
+        load_symbols();
         auto res = this->symtab.find(name);
         return (res == this->symtab.end() ? nullptr : &res->second);
     }
+    // Return all symbols whose names start with the given prefix,
+    // in order of name
     std::vector<const Symbol *>
-    find_all_symbols_starting_with(const std::string &name) const
-    {
-        std::vector<const Symbol *> res;
-        for (const auto &it : this->symtab)
-            if (it.first.rfind(name, 0) == 0)
-                res.insert(res.end(), it.second.begin(), it.second.end());
-        return res;
-    }
+    find_all_symbols_starting_with(const std::string &name) const;
 
     std::vector<Segment> get_segments(bool use_paddr = false) const;
     std::vector<uint8_t> get_segment_content(const Segment &segment) const;
@@ -25,15 +25,20 @@
 #include "libtarmac/platform.hh"
 
 #include "libtarmac/disktree.hh"
+#include "libtarmac/expr.hh"
 #include "libtarmac/image.hh"
 #include "libtarmac/index_ds.hh"
 #include "libtarmac/misc.hh"
 #include "libtarmac/parser.hh"
 #include "libtarmac/registers.hh"
+#include "libtarmac/tracesource.hh"
 
 #include <assert.h>
+#include <atomic>
 #include <fstream>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <ostream>
 #include <string>
 #include <vector>
@@ -44,16 +49,107 @@ struct IndexerParams {
     bool record_memory = true;
     bool record_calls = true;
 
-    bool can_store_on_disk() const {
-        /*
-         * At present, we only permit disk-based indexes if they
-         * contain all the optional parts. This prevents one tool
-         * finding a deficient index written by another. With a system
-         * of header flags indicating the missing pieces that could be
-         * changed, but this is the simplest thing for the moment.
-         */
-        return record_memory && record_calls;
+    // If this is true, the index also lists every write to registers
+    // and memory by address (see 'The write tree' in index_ds.hh), so
+    // that all the writes to a region can be found at once.
+    bool record_writes = false;
+
+    // True if an index built with these parameters contains
+    // everything that one built with 'needed' would.
+    bool covers(const IndexerParams &needed) const {
+        return (record_memory || !needed.record_memory) &&
+               (record_calls || !needed.record_calls) &&
+               (record_writes || !needed.record_writes);
     }
+
+    // Number of threads to use for parsing the trace file. If this
+    // is more than 1, the file is split into chunks at line
+    // boundaries which are parsed concurrently, and the resulting
+    // events are fed into the index in their original order, so the
+    // index file comes out exactly the same as it would have anyway.
+    unsigned parse_threads = 1;
+
+    // If this is true, and parse_threads is 1, the trace file is read
+    // ahead and parsed on two more threads, each a block ahead of the
+    // next stage, while the main thread builds the index from the
+    // parsed events. Again, the index file comes out the same.
+    bool pipeline = false;
+
+    // If this is true, the indexer keeps an event cache for the trace
+    // file (see eventcache.hh), in the file named by
+    // default_event_cache_filename. If a valid one is already there,
+    // its events are used instead of parsing the text of the trace;
+    // otherwise one is written while the trace is parsed, for next
+    // time.
+    bool event_cache = false;
+
+    // If this is true, the indexer saves its own state in the index
+    // file, so that if more data is later appended to the trace file,
+    // extend_index can carry on from where it left off.
+    bool resumable = false;
+
+    // If this is true, then after the index is built, the sequential
+    // order and by-PC trees are copied into a layout that keeps the
+    // nodes visited by a search close together in the file, so that
+    // searching an index that isn't already cached in memory touches
+    // fewer disk pages. The index file is larger, by the size of the
+    // copies.
+    bool relayout_trees = false;
+
+    // If this is nonzero, then every time this many more nodes have
+    // been added to the sequential order tree, the indexer writes out
+    // a fresh copy of the current memory tree as a checkpoint, laid
+    // out contiguously in the file, together with the data it points
+    // to. Later memory trees are built by modifying the checkpoint,
+    // so most of what a query for memory contents looks at is dense
+    // in the file, instead of spread over the whole trace's worth of
+    // updates. Checkpoints stop being written once they have used
+    // memory_checkpoint_budget bytes of the index (0 means no limit).
+    unsigned memory_checkpoint_interval = 0;
+    unsigned long long memory_checkpoint_budget = 0;
+
+    // If this is true, the finished index file is compressed (see
+    // CompressedFile), making it smaller to store and faster to read
+    // from a slow file system, at the cost of decompressing whatever
+    // part of it is read into memory every time it's opened. A
+    // compressed index can't be extended by extend_index.
+    bool compress = false;
+
+    // Control how an index file on disk grows while it's being
+    // written (see MMapGrowthParams). By default it's extended in
+    // steps of at least 16Mb, and left sparse.
+    size_t growth_granularity = 16 << 20;
+    bool preallocate = false;
+
+    // If this is nonzero, the indexer tries to keep no more than about
+    // this many bytes of an index file on disk in memory while writing
+    // it, instead of leaving it to the operating system to decide when
+    // to write the dirty pages back. Parts of the file that the trees
+    // have finished with are written back in order of their position
+    // in the file as soon as they're finished, and dropped from memory
+    // whenever the rest would go over the budget. This makes building
+    // an index much larger than physical memory proceed at a steady
+    // pace. The budget should be at least a few tens of megabytes,
+    // because the parts of the file still being written to aren't
+    // dropped.
+    unsigned long long memory_budget = 0;
+
+    // If this is non-null, the indexer checks it before reading each
+    // line of the trace file, and if it has become true, it stops
+    // there and finishes the index as if it had reached the end of
+    // the file. This lets an interactive tool give up waiting for a
+    // long trace and look at the part that has been indexed so far.
+    // An index finished early is marked as partial, so that
+    // check_index_header reports it as incomplete, and the next tool
+    // to use the trace will index it again in full.
+    const std::atomic<bool> *stop_request = nullptr;
+
+    // If this is nonzero, the indexer behaves as if stop_request had
+    // been set once it has read this many lines of the trace file
+    // (or, when parsing in parallel, at the end of the first chunk
+    // that goes past them). This is for testing the handling of
+    // partial indexes without needing another thread to time it.
+    LineNo stop_after_lines = 0;
 };
 
 // Parameters that tell run_indexer about desired diagnostics, and
@@ -65,37 +161,165 @@ struct IndexerDiagnostics {
         return *diagnostics_stream;
     }
     bool debug_call_heuristics = false;
+
+    // If this is true, the indexer writes a report to the diagnostics
+    // stream when it finishes, saying how long each phase of indexing
+    // took, how many of each kind of trace event it saw, and how much
+    // of the index file each of its data structures used.
+    bool show_stats = false;
 };
 
 void run_indexer(const TracePair &trace, const IndexerParams &iparams,
                  const IndexerDiagnostics &idiags, const ParseParams &pparams);
 
-enum class IndexHeaderState { OK, WrongMagic, Incomplete };
-IndexHeaderState check_index_header(const std::string &index_filename);
+// Check whether an existing index file can be brought up to date by
+// extend_index, instead of being rebuilt from scratch. This requires
+// that it was built with IndexerParams::resumable, that it contains
+// everything described by 'needed', that it was built with the same
+// parse parameters, that it isn't compressed, and that its trace file
+// looks as if it has only been appended to since then.
+bool can_extend_index(const TracePair &trace, const IndexerParams &needed,
+                      const ParseParams &pparams);
+
+// Extend an index for which can_extend_index returned true, by
+// indexing only the part of the trace file that it doesn't already
+// cover. The optional parts of the index are kept as they were; only
+// the parse_threads, pipeline, relayout_trees, memory_checkpoint_*,
+// memory_budget and compress fields of 'iparams' are used.
+void extend_index(const TracePair &trace, const IndexerParams &iparams,
+                  const IndexerDiagnostics &idiags, const ParseParams &pparams);
+
+enum class IndexHeaderState { OK, WrongMagic, Incomplete, MissingParts };
+
+// Check whether an existing index file is usable by a tool that
+// needs the parts of an index described by 'needed'. If 'present' is
+// not null, it is filled in with the optional parts that the index
+// does contain.
+IndexHeaderState check_index_header(const std::string &index_filename,
+                                    const IndexerParams &needed = {},
+                                    IndexerParams *present = nullptr);
 
+/*
+ * QueryStats records how often each kind of query is made of an
+ * existing index, and how long the queries take, so that a slow
+ * browser or tool can be narrowed down to the calls responsible.
+ *
+ * Nothing is recorded until enable() is called, and until then each
+ * query pays only for a test of one flag. Once enabled, each query
+ * also counts the structures it reads out of the index (roughly, the
+ * tree nodes it visits) and how many of those reads were at a
+ * different page of the index file from the one before. Statistics
+ * are collected from every thread and every index into one set of
+ * totals, which report() writes out.
+ */
+class QueryStats {
+  public:
+    enum Query {
+        NodeAtLine,
+        NodeAtTime,
+        NodeNearTime,
+        PreviousNode,
+        NextNode,
+        BufferLimit,
+        GetMem,
+        GetMemNext,
+        VisitMem,
+        GetRegs,
+        Diff,
+        FindNextMod,
+        FindCondition,
+        VisitWrites,
+        CountPCVisits,
+        RangeStats,
+        LRTTranslate,
+        TraceLines,
+        GotoPC,
+        FoldLookup,
+        FoldState,
+        NumQueries
+    };
+
+    static void enable();
+    static bool enabled() { return on.load(std::memory_order_relaxed); }
+
+    // Write a table of the statistics collected so far. Kinds of
+    // query that haven't been made are left out.
+    static void report(std::ostream &os);
+
+    // Scoped object that records one query, lasting its lifetime.
+    class Timer {
+        Query query;
+        bool active;
+        unsigned long long start_ns;
+        unsigned long long start_reads, start_page_switches;
+
+        void begin();
+        void end();
+
+      public:
+        Timer(Query query) : query(query), active(enabled())
+        {
+            if (active)
+                begin();
+        }
+        ~Timer()
+        {
+            if (active)
+                end();
+        }
+        Timer(const Timer &) = delete;
+    };
+
+  private:
+    static std::atomic<bool> on;
+};
+
+/*
+ * An IndexReader gives access to the trees in an existing index file,
+ * and to the text of the trace file it was made from.
+ *
+ * Nothing in an IndexReader changes as it's read: the trees are only
+ * ever searched, in place in the mapped index, and the trace file is
+ * mapped into memory the first time its text is needed, under a
+ * std::call_once, after which every read is just a pointer into the
+ * mapping. So any number of threads can share one IndexReader, and
+ * all its const methods can be called concurrently without locking.
+ * (The exception is advise(), which changes how the mapping is
+ * accessed, and should be called before the reader is shared.)
+ *
+ * The same goes for IndexNavigator, which adds nothing mutable of its
+ * own: its Image is read-only once loaded. Any state belonging to one
+ * particular walk through the trace is kept by the caller, e.g. in an
+ * IndexCursor, so that each thread can have its own.
+ */
 class IndexReader {
     const std::string index_filename;
     const std::string tarmac_filename;
     std::shared_ptr<Arena> arena;
-    mutable std::ifstream tarmac;
+    mutable std::unique_ptr<TraceSource> tarmac;
+    mutable std::once_flag tarmac_once;
     bool bigend, thumbonly, aarch64_used;
+    bool has_memory, has_calls, has_writes, resumable, partial;
     unsigned max_sve_bits;
 
-    std::string read_tarmac(OFF_T pos, OFF_T len) const;
+    StringSpan read_tarmac(OFF_T pos, OFF_T len) const;
 
   public:
     AVLDisk<MemoryPayload, MemoryAnnotation> memtree;
     AVLDisk<MemorySubPayload> memsubtree;
     AVLDisk<SeqOrderPayload, SeqOrderAnnotation> seqtree;
-    AVLDisk<ByPCPayload> bypctree;
-    OFF_T seqroot, bypcroot;
-    unsigned lineno_offset;
+    AVLDisk<ByPCPayload, ByPCAnnotation> bypctree;
+    AVLDisk<WritePayload, WriteAnnotation> writetree;
+    OFF_T seqroot, bypcroot, writeroot;
+    LineNo lineno_offset;
 
     IndexReader(const TracePair &trace);
 
-    const void *index_offset(OFF_T pos) const
+    // Return a pointer to 'size' bytes of the index, all of which can
+    // be read through it.
+    const void *index_offset(OFF_T pos, size_t size) const
     {
-        return arena->getptr<char>(pos);
+        return arena->getptr<char>(pos, size);
     }
 
     OFF_T index_subtree_root(OFF_T pos) const
@@ -103,17 +327,43 @@ class IndexReader {
         return *arena->getptr<diskint<OFF_T>>(pos);
     }
 
+    // Return the lines of the trace file covered by a node. The spans
+    // returned by get_trace_line_spans point directly into the mapped
+    // trace file, and remain valid for as long as the IndexReader.
+    std::vector<StringSpan>
+    get_trace_line_spans(const SeqOrderPayload &node) const;
     std::vector<std::string> get_trace_lines(const SeqOrderPayload &node) const;
     std::string get_trace_line(const SeqOrderPayload &node, unsigned lineno) const;
 
+    // The trace file itself, mapped into memory on first use.
+    const TraceSource &trace_source() const;
+
     const std::string &get_index_filename() const { return index_filename; }
     const std::string &get_tarmac_filename() const { return tarmac_filename; }
 
     bool isBigEndian() const { return bigend; }
     bool isAArch64() const { return aarch64_used; }
     bool isThumbOnly() const { return thumbonly; }
+    bool hasMemory() const { return has_memory; }
+    bool hasCalls() const { return has_calls; }
+    bool hasWrites() const { return has_writes; }
+    bool isResumable() const { return resumable; }
+    bool isPartial() const { return partial; }
     unsigned maxSVEBits() const { return max_sve_bits; }
     ParseParams parseParams() const;
+
+    // Tell the index how it's going to be accessed, or read it all
+    // into memory in advance (see Arena).
+    void advise(AccessPattern pattern) const { arena->advise(pattern); }
+    void prefault(unsigned nthreads) const { arena->prefault(nthreads); }
+};
+
+// The value of one register, as read by IndexNavigator::get_regs.
+struct RegisterValue {
+    std::vector<unsigned char> val; // raw bytes, in the order getmem gives
+    std::vector<unsigned char> def; // nonzero for each byte that is defined
+    LineNo line = 0;      // latest trace line that wrote any of it
+    bool changed = false; // true if it was written since diff_minline
 };
 
 class IndexNavigator {
@@ -154,6 +404,7 @@ class IndexNavigator {
 
     bool has_image() const { return bool(image); }
     std::shared_ptr<Image> get_image() const { return image; }
+    uint64_t get_load_offset() const { return load_offset; }
 
     bool lookup_symbol(const std::string &name, uint64_t &addr) const;
     bool lookup_symbol(const std::string &name, uint64_t &addr,
@@ -164,15 +415,35 @@ class IndexNavigator {
     // Read the system's raw memory representation at a given time.
     // Return value is the line number of the latest trace event that
     // wrote any part of that data.
-    unsigned getmem(OFF_T memroot, char type, Addr addr, size_t size,
-                    void *outdata, unsigned char *outdef) const;
+    LineNo getmem(OFF_T memroot, char type, Addr addr, size_t size,
+                  void *outdata, unsigned char *outdef) const;
 
     // Read the raw memory representation, and last-update indication,
     // of the first defined subregion of the specified region. Returns
     // false if no such subregion exists.
     bool getmem_next(OFF_T memroot, char type, Addr addr, size_t size,
                      const void **outdata, Addr *outaddr, size_t *outsize,
-                     unsigned *outline) const;
+                     LineNo *outline) const;
+
+    // Visit the defined parts of a region of memory (or register
+    // space), in address order, in a single in-order walk of the
+    // memory tree and the memory subtrees it points to. Each call to
+    // the visitor describes one contiguous extent of defined data,
+    // which was all written by the same trace line, in the same
+    // pieces that successive calls to getmem_next would return. Bytes
+    // not covered by any extent are undefined. As with getmem_next, a
+    // size of 0 means the whole address space from 'addr' upwards.
+    // Returns false if the visitor stopped the walk by returning
+    // false.
+    struct MemoryExtent {
+        Addr addr;
+        size_t size;
+        const void *data; // points into the index
+        LineNo line;      // trace line that last wrote this extent
+    };
+    using MemoryVisitor = std::function<bool(const MemoryExtent &)>;
+    bool visit_mem(OFF_T memroot, char type, Addr addr, size_t size,
+                   const MemoryVisitor &visitor) const;
 
     // Read the iflags at a given time.
     unsigned get_iflags(OFF_T memroot) const;
@@ -187,14 +458,116 @@ class IndexNavigator {
     std::pair<bool, uint64_t> get_reg_value(OFF_T memroot,
                                             const RegisterId &reg) const;
 
+    // Read 'size' bytes of memory (at most 8) as an integer in the
+    // trace's byte order. Fails if any of it is undefined.
+    std::pair<bool, uint64_t> get_mem_value(OFF_T memroot, Addr addr,
+                                            size_t size) const;
+
+    // Read a whole list of registers as of the same memory root. This
+    // gives the same results as calling getmem for each one, but it
+    // finds them all in a single in-order pass over the part of the
+    // memory tree covering their register space, instead of searching
+    // the tree from the top for every register, which adds up for a
+    // window full of large vector registers. The registers can be in
+    // any order, and the results are returned in the same order.
+    //
+    // If diff_memroot is nonzero, the same pass is made over it, to
+    // fill in RegisterValue::changed for registers with any part
+    // written at or after the line diff_minline, in the same way that
+    // find_next_mod would find it.
+    std::vector<RegisterValue> get_regs(OFF_T memroot,
+                                        const std::vector<RegisterId> &regs,
+                                        OFF_T diff_memroot = 0,
+                                        LineNo diff_minline = 0) const;
+
+    // Find every part of memory and register space whose contents
+    // differ between two memory roots, e.g. the states before and
+    // after a function call. A byte differs if it is defined in one
+    // state and not the other, or defined with a different value in
+    // each. The differences are reported in order of type and
+    // address, as maximal runs of consecutive differing bytes, until
+    // the visitor returns false.
+    //
+    // This only compares the parts of the memory trees that the two
+    // roots don't share, so its cost depends on how much was written
+    // between the two states, not on the total amount of memory.
+    // (Except across a memory checkpoint, which copies the whole
+    // tree, so that the two roots share nothing.) Returns false if
+    // the visitor stopped it.
+    struct StateChange {
+        char type; // 'r' or 'm'
+        Addr addr;
+        size_t size;
+        std::vector<unsigned char> before, before_def; // in memroot_a
+        std::vector<unsigned char> after, after_def;   // in memroot_b
+        LineNo line; // latest trace line that wrote any of it in memroot_b
+    };
+    using StateChangeVisitor = std::function<bool(const StateChange &)>;
+    bool diff(OFF_T memroot_a, OFF_T memroot_b,
+              const StateChangeVisitor &visitor) const;
+
     bool node_at_time(Time t, SeqOrderPayload *node) const;
-    bool node_at_line(unsigned line, SeqOrderPayload *node) const;
+    // Find the first node whose time is no earlier than 't' (if
+    // 'after' is true), or the last one no later than it (if false),
+    // for when 't' needn't be the exact time of any node.
+    bool node_near_time(Time t, bool after, SeqOrderPayload *node) const;
+    bool node_at_line(LineNo line, SeqOrderPayload *node) const;
     bool get_previous_node(SeqOrderPayload &in, SeqOrderPayload *out) const;
     bool get_next_node(SeqOrderPayload &in, SeqOrderPayload *out) const;
     bool find_buffer_limit(bool end, SeqOrderPayload *node) const;
-    bool find_next_mod(OFF_T memroot, char type, Addr addr, unsigned minline,
+    bool find_next_mod(OFF_T memroot, char type, Addr addr, LineNo minline,
                        int sign, Addr &lo, Addr &hi) const;
 
+    // Find the next node after 'start' (if dir > 0), or the last one
+    // before it (if dir < 0), at which the condition 'cond' becomes
+    // true: that is, it evaluates to nonzero in the state after that
+    // node, but not in the state before it. An evaluation that fails
+    // because a register or memory location it reads is undefined
+    // counts as false.
+    //
+    // Rather than evaluating the condition at every node, this only
+    // visits the nodes at which one of the registers or memory
+    // locations it read last time is modified, found by a binary
+    // search of the sequence tree using the last-modified lines in
+    // the memory tree. So the cost depends on how often the state
+    // the condition refers to changes, not on the length of the
+    // trace. (Except that a condition using the PC has to visit
+    // every node.)
+    bool find_condition(const SeqOrderPayload &start, Expression &cond,
+                        int dir, SeqOrderPayload *found) const;
+
+    // Visit every write to any part of the region [addr,addr+size)
+    // of register ('r') or memory ('m') space, in order of the lowest
+    // address written and then of line number, until the visitor
+    // returns false. This needs an index built with
+    // IndexerParams::record_writes, and costs a single search of the
+    // write tree, however many writes it finds. Returns false if the
+    // visitor stopped it.
+    using WriteVisitor = std::function<bool(const WritePayload &)>;
+    bool visit_writes(char type, Addr addr, size_t size,
+                      const WriteVisitor &visitor) const;
+
+    // Return the same writes as visit_writes, in trace order.
+    std::vector<WritePayload> find_writes(char type, Addr addr,
+                                          size_t size) const;
+
+    // Return the number of times any PC in the range [lo,hi) was
+    // visited. (A Thumb PC is recorded with its low bit clear.)
+    LineNo count_pc_visits(Addr lo, Addr hi) const;
+
+    // Summarise the part of the trace made up of the nodes containing
+    // lines 'first' to 'last' inclusive, from the totals in the
+    // sequence tree's annotations, at the cost of two searches of
+    // the tree however long the range is. Returns false if either
+    // line is outside the trace.
+    struct RangeStats {
+        LineNo firstline, lines; // extent of the range in trace lines
+        Time start_time, end_time; // times of its first and last nodes
+        LineNo instructions;
+        LineNo memory_reads, memory_writes, cpu_exceptions;
+    };
+    bool range_stats(LineNo first, LineNo last, RangeStats *stats) const;
+
     // Do a raw lookup in the layered range tree that indexes
     // trace lines by function call depth.
     //
@@ -203,19 +576,18 @@ class IndexNavigator {
     // [mindepth_i,maxdepth_i), and return the number of lines
     // preceding that one whose call depth are in the range
     // [mindepth_o,maxdepth_o).
-    unsigned lrt_translate(unsigned line, unsigned mindepth_i,
-                           unsigned maxdepth_i, unsigned mindepth_o,
-                           unsigned maxdepth_o) const;
+    LineNo lrt_translate(LineNo line, unsigned mindepth_i, unsigned maxdepth_i,
+                         unsigned mindepth_o, unsigned maxdepth_o) const;
 
     // The above call assumes the search will succeed. If there's a
     // chance of it being out of range, use this call instead, which
     // returns <true, answer> on success, or <false, 0> if the search
     // fails.
-    std::pair<bool, unsigned> lrt_translate_may_fail(unsigned line,
-                                                     unsigned mindepth_i,
-                                                     unsigned maxdepth_i,
-                                                     unsigned mindepth_o,
-                                                     unsigned maxdepth_o) const;
+    std::pair<bool, LineNo> lrt_translate_may_fail(LineNo line,
+                                                   unsigned mindepth_i,
+                                                   unsigned maxdepth_i,
+                                                   unsigned mindepth_o,
+                                                   unsigned maxdepth_o) const;
 
     // Convenience wrapper to take the difference of two lrt_translate
     // calls.
@@ -224,9 +596,64 @@ class IndexNavigator {
     // range, and E be the (lineend)th one. Then the return value is
     // the number of lines in the range [S,E) whose call depth
     // is in the output range.
-    unsigned lrt_translate_range(unsigned linestart, unsigned lineend,
-                                 unsigned mindepth_i, unsigned maxdepth_i,
-                                 unsigned mindepth_o, unsigned maxdepth_o) const;
+    LineNo lrt_translate_range(LineNo linestart, LineNo lineend,
+                               unsigned mindepth_i, unsigned maxdepth_i,
+                               unsigned mindepth_o, unsigned maxdepth_o) const;
+};
+
+/*
+ * A position in a trace, for stepping through it a node at a time.
+ *
+ * An IndexNavigator can be shared between threads (see IndexReader),
+ * but a cursor holds the state of one walk through the trace, so each
+ * thread should have its own. They're small, and cheap to make and to
+ * copy, so a thread pool working on the same trace can make one per
+ * task.
+ */
+class IndexCursor {
+    const IndexNavigator *nav;
+
+    // The cursor keeps its place in the sequential tree, so that
+    // next() and prev() don't have to search down from the root.
+    AVLDisk<SeqOrderPayload, SeqOrderAnnotation>::const_iterator pos;
+    bool at_node = false;
+
+    bool moved(bool found, const SeqOrderPayload &node);
+
+  public:
+    explicit IndexCursor(const IndexNavigator &nav) : nav(&nav) {}
+
+    // Move to the node containing a given line of the index, the node
+    // at a given time (as found by IndexNavigator::node_at_time), or
+    // the first or last node of the trace. Each of these returns false
+    // if there is no such node, leaving the cursor where it was.
+    bool goto_line(LineNo line);
+    bool goto_time(Time t);
+    bool goto_start();
+    bool goto_end();
+
+    // Step to the next or previous node. Returns false, leaving the
+    // cursor where it was, at the end of the trace.
+    bool next();
+    bool prev();
+
+    // True once the cursor has been moved to a node.
+    bool valid() const { return at_node; }
+
+    const SeqOrderPayload &node() const
+    {
+        assert(at_node);
+        return *pos;
+    }
+    const IndexNavigator &navigator() const { return *nav; }
+
+    // The lines of the trace file making up the current node, pointing
+    // into the mapped trace file, as IndexReader::get_trace_line_spans.
+    std::vector<StringSpan> lines() const
+    {
+        assert(at_node);
+        return nav->index.get_trace_line_spans(*pos);
+    }
 };
 
 #endif // LIBTARMAC_INDEX_HH
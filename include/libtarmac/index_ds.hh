@@ -28,6 +28,7 @@
 #include "libtarmac/misc.hh"
 
 #include <algorithm>
+#include <climits>
 
 /*
 
@@ -359,9 +360,17 @@ The payload of a ``bypctree`` entry is:
 
  * A PC value.
 
- * The timestamp of a Tarmac trace event at which that PC was visited.
+ * The line number of a Tarmac trace event at which that PC was
+   visited.
 
-The sorting order is primarily by PC, and secondarily by timestamp. So
+ * The timestamp and file position of that same event, duplicated
+   from its ``seqtree`` node.
+
+Each node is annotated with the number of nodes in its subtree. So the
+number of visits to a PC, or to a range of PCs, can be found by a
+single search from the root, without having to enumerate them.
+
+The sorting order is primarily by PC, and secondarily by line. So
 you can list all the visits to a function entry point in order, or
 find the next or previous one.
 
@@ -372,6 +381,36 @@ values are all congruent to 0 mod 4 (A32 and A64) or 1 or 3 mod 4
 (Thumb, since we use the 'low bit set' representation understood by
 BX).
 
+The write tree
+~~~~~~~~~~~~~~
+
+Optionally (see ``IndexerParams::record_writes``), the index can also
+contain a tree listing every write to registers or memory, known as
+``writetree`` in the code. The ``memtree`` can tell you when a region
+was last written as of a given moment, but finding *every* write to
+it that way means a fresh search from a different ``memtree`` root
+for each one; this tree lists them all side by side instead.
+
+The payload of a ``writetree`` entry is:
+
+ * The identifier of the address space ('r' or 'm') written to, as in
+   ``memtree``.
+
+ * The interval of addresses written.
+
+ * The line number of the ``seqtree`` node containing the write, and
+   that node's timestamp and file position, as in ``bypctree``.
+
+The sorting order is by address space, then by the low end of the
+address interval, then by line. Each node is annotated with the
+highest address written by anything in its subtree, so that a search
+for all the writes overlapping a range of addresses can skip any
+subtree whose writes all end below it.
+
+Memory writes whose contents aren't shown in the trace (such as
+semihosting calls that fill a buffer) are included, with the whole
+region that might have been written.
+
  */
 
 /* ----------------------------------------------------------------------
@@ -402,7 +441,14 @@ struct FileHeader {
     // If the actual Tarmac data starts somewhere other than line 1 of
     // the file (e.g. because of an initial header line), this stores
     // the offset, for adjusting line numbers shown during browsing.
-    diskint<unsigned> lineno_offset;
+    diskint<LineNo> lineno_offset;
+
+    // Location of a ResumeState (see below), or 0 if the index was
+    // not built to be extended.
+    diskint<OFF_T> resume_state;
+
+    // Root of the write tree, valid if FLAG_WRITES is set.
+    diskint<OFF_T> writeroot;
 };
 
 // Flag definitions for FileHeader::flags
@@ -410,6 +456,10 @@ struct FileHeader {
 #define FLAG_AARCH64_USED 0x00000002U // trace includes AArch64 execution state
 #define FLAG_COMPLETE 0x00000004U // index generation completed successfully
 #define FLAG_THUMB_ONLY 0x00000008U // trace assumes everything is Thumb
+#define FLAG_NO_MEMORY 0x00000100U // memory contents were not recorded
+#define FLAG_NO_CALLS 0x00000200U  // call depths were not computed
+#define FLAG_PARTIAL 0x00000400U   // indexing stopped before end of trace
+#define FLAG_WRITES 0x00000800U    // write tree was built
 
 // Four flag bits to indicate the maximum size of an SVE vector register. The
 // format is the same as the LEN field of SMCR_ELx: the length is measured in
@@ -418,6 +468,83 @@ struct FileHeader {
 #define FLAG_SVELEN_MASK 0x000000F0U
 #define FLAG_SVELEN_UNIT 0x00000010U
 
+/* ----------------------------------------------------------------------
+ * Saved state of the indexer, so that if more data is appended to the
+ * trace file after it has been indexed, the index can be extended to
+ * cover it, by picking up from where the indexer left off, instead of
+ * starting again from the beginning.
+ *
+ * The state is saved as of the start of the last line of the trace
+ * file, if that line didn't end with a newline (so it might yet be
+ * completed by the process writing the file), or otherwise as of the
+ * end of file. It includes the roots of the trees at that point,
+ * before the indexer made its final seqtree node, which the extension
+ * will replace.
+ */
+struct ResumeState {
+    // Position in the trace file to resume from, and a checksum of
+    // some of the data before it, to detect a trace file that has
+    // been rewritten rather than appended to.
+    diskint<OFF_T> trace_file_pos;
+    diskint<unsigned long long> trace_file_checksum;
+
+    // Tree roots.
+    diskint<OFF_T> memroot, last_memroot, seqroot, bypcroot, writeroot;
+
+    // Line numbers and file positions.
+    diskint<LineNo> lineno, true_lineno, prev_lineno, lineno_offset;
+    diskint<OFF_T> oldpos;
+
+    // State of the current seqtree node, and of the call-detection
+    // heuristics.
+    diskint<Time> current_time;
+    diskint<unsigned long long> last_sp, curr_sp, curr_pc;
+    diskint<unsigned long long> insns_since_lr_update;
+    diskint<unsigned long long> expected_next_pc, expected_next_lr;
+    diskint<unsigned> curr_iflags, last_iset, max_sve_bits;
+    diskint<unsigned> flags; // see RESUME_FLAG_* below
+
+    // Progress towards the next memory checkpoint, and space used by
+    // the previous ones.
+    diskint<unsigned> nodes_since_checkpoint;
+    diskint<unsigned long long> checkpoint_bytes, last_checkpoint_size;
+
+    // Arrays of ResumePendingCall and ResumeCallReturn, with the
+    // number of entries in use, and the space allocated for them.
+    diskint<OFF_T> pending_calls, callrets;
+    diskint<unsigned> n_pending_calls, n_callrets;
+    diskint<unsigned> pending_calls_space, callrets_space;
+
+    // Event counts so far in the current seqtree node.
+    diskint<unsigned> node_memory_reads, node_memory_writes;
+    diskint<unsigned> node_cpu_exceptions;
+
+    // The trace parser's inter-line state (see
+    // TarmacLineParser::SavedState). The continued event type is a
+    // short keyword, NUL-terminated unless it fills the array.
+    diskint<Time> parser_timestamp;
+    diskint<unsigned> parser_post_event_type_start;
+    char parser_continued_event_type[8];
+};
+
+// Flag definitions for ResumeState::flags
+#define RESUME_FLAG_SEEN_ANY_EVENT 0x00000001U
+#define RESUME_FLAG_SEEN_INSTRUCTION 0x00000002U // at current_time
+#define RESUME_FLAG_SEEN_CPU_EXCEPTION 0x00000004U // at current line
+#define RESUME_FLAG_AARCH64_USED 0x00000008U
+
+// A function call not yet matched up with its return
+struct ResumePendingCall {
+    diskint<unsigned long long> sp, pc;
+    diskint<LineNo> call_line;
+};
+
+// A line identified as a call (direction +1) or return (-1)
+struct ResumeCallReturn {
+    diskint<LineNo> line;
+    diskint<int> direction;
+};
+
 /* ----------------------------------------------------------------------
  * Payload and annotation formats for the top-level sequential order tree
  */
@@ -426,9 +553,13 @@ struct SeqOrderPayload {
     diskint<Time> mod_time; // timestamp as given in the trace file
     diskint<Addr> pc;       // PC of this node
 
-    // Locations in the trace file, in both bytes and lines
-    diskint<OFF_T> trace_file_pos, trace_file_len;
-    diskint<unsigned> trace_file_firstline, trace_file_lines;
+    // Locations in the trace file, in both bytes and lines. A node's
+    // length is stored in 32 bits, and the indexer refuses a trace in
+    // which one timestamp's worth of events is longer than that.
+    diskint<OFF_T> trace_file_pos;
+    diskint<unsigned> trace_file_len;
+    diskint<LineNo> trace_file_firstline;
+    diskint<unsigned> trace_file_lines;
 
     // Root of the memory tree representing the state just after this node
     diskint<OFF_T> memory_root;
@@ -436,6 +567,10 @@ struct SeqOrderPayload {
     // Current depth in the function call hierarchy
     diskint<unsigned> call_depth;
 
+    // Numbers of memory read and write events, and of CPU exception
+    // events, in this node
+    diskint<unsigned> memory_reads, memory_writes, cpu_exceptions;
+
     int cmp(const struct SeqOrderPayload &rhs) const
     {
         if (trace_file_firstline != rhs.trace_file_firstline)
@@ -451,30 +586,132 @@ struct SeqOrderAnnotation {
      * (call depth, cumulative amount of stuff up to that depth)
      * pairs. However, layered range trees are expensive to maintain
      * dynamically, so we don't try: the constructors for this
-     * annotation just let all the fields be default-initialised, and
-     * we write in the actual arrays in a tree walking pass _after_
-     * the whole tree is in its final state.
+     * annotation just let the call depth array fields be
+     * default-initialised, and we write in the actual arrays in a
+     * tree walking pass _after_ the whole tree is in its final state.
      */
 
-    // Points to an array of CallDepthArrayEntry structures, as
-    // defined below
+    // Points to an array of call depth array entries, as defined
+    // below, in the wide format if call_depth_array_wide is nonzero
+    // and otherwise in the narrow one.
     diskint<OFF_T> call_depth_array;
     diskint<unsigned> call_depth_arraylen;
+    diskint<unsigned char> call_depth_array_wide;
+
+    /*
+     * Unlike the call depth arrays, these totals over the subtree are
+     * cheap to keep up to date as the tree changes, so the
+     * constructors do maintain them. Along with the payloads of the
+     * two nodes at the ends of a range (whose timestamps are the
+     * range's earliest and latest, since timestamps never decrease
+     * through the trace), they let IndexNavigator::range_stats
+     * summarise any range of the trace in log time.
+     */
+    diskint<LineNo> instructions;
+    diskint<LineNo> memory_reads, memory_writes, cpu_exceptions;
 
     SeqOrderAnnotation() {}
-    SeqOrderAnnotation(const SeqOrderPayload &) {}
-    SeqOrderAnnotation(const SeqOrderAnnotation &, const SeqOrderAnnotation &)
+    SeqOrderAnnotation(const SeqOrderPayload &p)
+        : instructions(p.pc != KNOWN_INVALID_PC ? 1 : 0),
+          memory_reads(p.memory_reads), memory_writes(p.memory_writes),
+          cpu_exceptions(p.cpu_exceptions)
+    {
+    }
+    SeqOrderAnnotation(const SeqOrderAnnotation &lhs,
+                       const SeqOrderAnnotation &rhs)
+        : instructions(lhs.instructions + rhs.instructions),
+          memory_reads(lhs.memory_reads + rhs.memory_reads),
+          memory_writes(lhs.memory_writes + rhs.memory_writes),
+          cpu_exceptions(lhs.cpu_exceptions + rhs.cpu_exceptions)
     {
     }
 };
 
 #define SENTINEL_DEPTH (UINT_MAX - 1)
 struct CallDepthArrayEntry {
+    unsigned call_depth;
+    LineNo cumulative_lines, cumulative_insns;
+
+    // Indices into the arrays of the left and right subtrees.
+    unsigned leftlink, rightlink;
+};
+
+/*
+ * In the index file, a call depth array is stored in one of two
+ * formats. The cumulative counts in an array are counts of lines and
+ * instructions within one subtree, so for all but the few largest
+ * subtrees they fit in 32 bits, and those use the narrow format,
+ * which is little more than half the size of the wide one. The
+ * crosslinks are indices into a child's array, so they always fit in
+ * 32 bits, like the length of the array.
+ */
+struct NarrowCallDepthArrayEntry {
     diskint<unsigned> call_depth;
     diskint<unsigned> cumulative_lines, cumulative_insns;
-    diskint<OFF_T> leftlink, rightlink;
+    diskint<unsigned> leftlink, rightlink;
+};
+
+struct WideCallDepthArrayEntry {
+    diskint<unsigned> call_depth;
+    diskint<LineNo> cumulative_lines, cumulative_insns;
+    diskint<unsigned> leftlink, rightlink;
 };
 
+// True if an array whose last (sentinel) entry is 'last' needs the
+// wide format.
+inline bool call_depth_array_needs_wide(const CallDepthArrayEntry &last)
+{
+    return last.cumulative_lines > UINT_MAX ||
+           last.cumulative_insns > UINT_MAX;
+}
+
+inline size_t call_depth_array_entry_size(bool wide)
+{
+    return wide ? sizeof(WideCallDepthArrayEntry)
+                : sizeof(NarrowCallDepthArrayEntry);
+}
+
+template <class DiskEntry>
+inline CallDepthArrayEntry decode_call_depth_entry(const DiskEntry &d)
+{
+    CallDepthArrayEntry ent;
+    ent.call_depth = d.call_depth;
+    ent.cumulative_lines = d.cumulative_lines;
+    ent.cumulative_insns = d.cumulative_insns;
+    ent.leftlink = d.leftlink;
+    ent.rightlink = d.rightlink;
+    return ent;
+}
+
+template <class DiskEntry>
+inline void encode_call_depth_entry(DiskEntry &d, const CallDepthArrayEntry &ent)
+{
+    d.call_depth = ent.call_depth;
+    d.cumulative_lines = ent.cumulative_lines;
+    d.cumulative_insns = ent.cumulative_insns;
+    d.leftlink = ent.leftlink;
+    d.rightlink = ent.rightlink;
+}
+
+// Read or write entry 'i' of a call depth array in the index file.
+inline CallDepthArrayEntry get_call_depth_entry(const void *array, bool wide,
+                                                unsigned i)
+{
+    return wide ? decode_call_depth_entry(
+                      ((const WideCallDepthArrayEntry *)array)[i])
+                : decode_call_depth_entry(
+                      ((const NarrowCallDepthArrayEntry *)array)[i]);
+}
+
+inline void set_call_depth_entry(void *array, bool wide, unsigned i,
+                                 const CallDepthArrayEntry &ent)
+{
+    if (wide)
+        encode_call_depth_entry(((WideCallDepthArrayEntry *)array)[i], ent);
+    else
+        encode_call_depth_entry(((NarrowCallDepthArrayEntry *)array)[i], ent);
+}
+
 /* ----------------------------------------------------------------------
  * Payload and annotation formats for the memory tree
  */
@@ -495,7 +732,7 @@ struct MemoryPayload {
     // Identifies (by its trace_file_firstline field, i.e. primary
     // key) the seqtree node in which this piece of memory was last
     // touched
-    diskint<unsigned> trace_file_firstline;
+    diskint<LineNo> trace_file_firstline;
 
     int cmp(const struct MemoryPayload &rhs) const
     {
@@ -513,7 +750,7 @@ struct MemoryAnnotation {
     // Identifies (by its trace_file_firstline field, i.e. primary
     // key) the seqtree node in which any piece of memory within this
     // node's subtree was last touched
-    diskint<unsigned> latest;
+    diskint<LineNo> latest;
 
     MemoryAnnotation() : latest(0) {}
     MemoryAnnotation(const MemoryPayload &p) : latest(p.trace_file_firstline) {}
@@ -549,7 +786,13 @@ struct MemorySubPayload {
 
 struct ByPCPayload {
     diskint<Addr> pc;
-    diskint<unsigned> trace_file_firstline;
+    diskint<LineNo> trace_file_firstline;
+
+    // Copies of the same fields of the sequential-order tree node for
+    // this visit, so that a search of this tree needn't be followed
+    // by a search of that one to find out when the visit happened.
+    diskint<Time> mod_time;
+    diskint<OFF_T> trace_file_pos;
 
     int cmp(const struct ByPCPayload &rhs) const
     {
@@ -561,4 +804,57 @@ struct ByPCPayload {
     }
 };
 
+struct ByPCAnnotation {
+    // Number of nodes in the subtree, so that the tree can be searched
+    // for the number of visits in a range of PC values.
+    diskint<LineNo> count;
+
+    ByPCAnnotation() {}
+    ByPCAnnotation(const ByPCPayload &) : count(1) {}
+    ByPCAnnotation(const ByPCAnnotation &lhs, const ByPCAnnotation &rhs)
+        : count(lhs.count + rhs.count)
+    {
+    }
+};
+
+/* ----------------------------------------------------------------------
+ * Payload and annotation formats for the write tree
+ */
+
+struct WritePayload {
+    char type; // 'r'=register, 'm'=memory
+
+    diskint<Addr> lo, hi; // low and high bytes written, i.e. inclusive
+    diskint<LineNo> trace_file_firstline;
+
+    // Copies of the same fields of the sequential-order tree node
+    // containing the write.
+    diskint<Time> mod_time;
+    diskint<OFF_T> trace_file_pos;
+
+    int cmp(const struct WritePayload &rhs) const
+    {
+        if (type != rhs.type)
+            return type < rhs.type ? -1 : +1;
+        if (lo != rhs.lo)
+            return lo < rhs.lo ? -1 : +1;
+        if (trace_file_firstline != rhs.trace_file_firstline)
+            return trace_file_firstline < rhs.trace_file_firstline ? -1 : +1;
+        return 0;
+    }
+};
+
+struct WriteAnnotation {
+    // Highest address written by any node in the subtree, in either
+    // address space.
+    diskint<Addr> maxhi;
+
+    WriteAnnotation() {}
+    WriteAnnotation(const WritePayload &p) : maxhi(p.hi) {}
+    WriteAnnotation(const WriteAnnotation &lhs, const WriteAnnotation &rhs)
+        : maxhi(std::max(lhs.maxhi.value(), rhs.maxhi.value()))
+    {
+    }
+};
+
 #endif // LIBTARMAC_INDEX_DS_HH
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#ifndef LIBTARMAC_LINEINDEX_HH
+#define LIBTARMAC_LINEINDEX_HH
+
+#include "libtarmac/platform.hh"
+
+#include "libtarmac/misc.hh"
+#include "libtarmac/parser.hh"
+#include "libtarmac/tracesource.hh"
+
+#include <string>
+#include <vector>
+
+/*
+ * A LineIndex is a much smaller alternative to a full index, for
+ * tools that only need to find a line by its number or timestamp
+ * and then read the trace from there, and don't need to know the
+ * state of memory or registers. It's a sorted list of anchors, one
+ * every so many lines, giving the line number, byte position and
+ * timestamp at that point, so that finding any line costs a binary
+ * search and then a scan of at most a few anchor intervals.
+ *
+ * Building one only splits the trace into lines and finds each
+ * line's timestamp (see TarmacLineParser::parse_timestamp), which is
+ * much faster than indexing it fully. It can be saved to a side-car
+ * file, in a simple text format that scripts can read for
+ * themselves:
+ *
+ *   tarmac-line-index 1
+ *   <trace size in bytes> <anchor interval in lines>
+ *   <line> <byte position> <timestamp>
+ *   ...
+ *
+ * Line numbers count from 1. An anchor's timestamp is the one that
+ * the parser would give a line with no timestamp of its own at that
+ * point, i.e. that of the most recent timestamped line before it.
+ * The last anchor is just past the last complete line of the trace,
+ * so its line number is one more than the number of lines. Anchors
+ * are never placed on a line that might be a continuation of the one
+ * before, so parsing can always restart cleanly at one.
+ */
+struct LineAnchor {
+    LineNo line;
+    OFF_T pos;
+    Time time;
+};
+
+class LineIndex {
+  public:
+    static constexpr unsigned default_interval = 1024;
+
+    // Scan a trace file and build an index of it in memory.
+    void build(const TraceSource &src, const ParseParams &pparams,
+               unsigned interval = default_interval);
+
+    // Write the index to a file, or read it back. Both return false
+    // on failure. load() also fails if the file is present but isn't
+    // a line index, or describes a trace of a size other than
+    // 'trace_size'.
+    bool save(const std::string &filename) const;
+    bool load(const std::string &filename, OFF_T trace_size);
+
+    // Number of complete lines in the trace.
+    LineNo lines() const { return anchors.back().line - 1; }
+    unsigned get_interval() const { return interval; }
+    const std::vector<LineAnchor> &get_anchors() const { return anchors; }
+
+    // Find the start of line number 'line', or the end of the trace
+    // if there aren't that many lines. The returned anchor describes
+    // that line, rather than one of the saved ones.
+    LineAnchor find_line(const TraceSource &src, LineNo line) const;
+
+    // Find the first line whose timestamp is at least 't', or the end
+    // of the trace if there isn't one. This assumes, like
+    // IndexNavigator::node_at_time, that timestamps never go
+    // backwards.
+    LineAnchor find_time(const TraceSource &src, const ParseParams &pparams,
+                         Time t) const;
+
+  private:
+    std::vector<LineAnchor> anchors;
+    unsigned interval = default_interval;
+    OFF_T trace_size = 0;
+};
+
+std::string default_line_index_filename(const std::string &tarmac_filename);
+
+// Load the line index for a trace from 'index_filename' if it's there,
+// up to date and has the right interval, or otherwise build it, and
+// try to save it there for next time (only warning if that fails).
+void load_or_build_line_index(LineIndex &lindex, const TraceSource &src,
+                              const std::string &tarmac_filename,
+                              const std::string &index_filename,
+                              const ParseParams &pparams,
+                              unsigned interval = LineIndex::default_interval);
+
+#endif // LIBTARMAC_LINEINDEX_HH
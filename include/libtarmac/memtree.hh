@@ -193,6 +193,12 @@ template <class Payload, class Annotation> class AVLMem {
     AVLMem() : root(NULL) {}
     ~AVLMem() { free_node(root); }
 
+    void clear()
+    {
+        free_node(root);
+        root = NULL;
+    }
+
     template <class PayloadComparable>
     bool remove(const PayloadComparable &keyfinder, Payload *removed_payload)
     {
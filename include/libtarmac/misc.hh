@@ -33,12 +33,36 @@ template <typename T, size_t n> static inline void enforce_array(T (&)[n]) {}
 
 typedef unsigned long long Time;
 typedef unsigned long long Addr;
+typedef unsigned long long LineNo; // line number in a trace file
 
 template <typename value> inline value absdiff(value a, value b)
 {
     return a < b ? b - a : a - b;
 }
 
+// A reference to a run of characters owned by something else, such as
+// a memory-mapped file. (In C++17 this would be std::string_view.)
+struct StringSpan {
+    const char *data = nullptr;
+    size_t size = 0;
+
+    StringSpan() = default;
+    StringSpan(const char *data, size_t size) : data(data), size(size) {}
+
+    std::string str() const { return std::string(data, size); }
+
+    // The sub-span starting 'pos' characters in and running for at
+    // most 'len' more.
+    StringSpan sub(size_t pos, size_t len = SIZE_MAX) const
+    {
+        if (pos > size)
+            pos = size;
+        if (len > size - pos)
+            len = size - pos;
+        return StringSpan(data + pos, len);
+    }
+};
+
 // Force a string to exactly the given length, padding it with
 // 'padvalue' if it's too short.
 std::string rpad(const std::string &s, size_t len, char padvalue = ' ');
@@ -94,6 +118,17 @@ bool get_conf_path(const std::string &filename, std::string &out);
 
 bool get_environment_variable(const std::string &varname, std::string &out);
 
+// Cut an existing file down to 'size' bytes. Returns false on
+// failure, with the reason available from get_error_message().
+bool truncate_file(const std::string &filename, uint64_t size);
+
+// Write the first 'len' bytes of the file 'from' to the file 'to',
+// replacing any previous contents, in a way that doesn't copy the
+// data through this process, if the platform and file systems
+// support that. Returns false, having written nothing, if they don't.
+bool copy_file_prefix(const std::string &from, const std::string &to,
+                      uint64_t len);
+
 #ifdef _WIN32
 #define strcasecmp _stricmp
 #define strncasecmp _strnicmp
@@ -24,6 +24,7 @@
 
 #include <cstdint>
 #include <exception>
+#include <string>
 #include <vector>
 
 struct TarmacEvent {
@@ -132,6 +133,83 @@ struct TextOnlyEvent : TarmacEvent {
     }
 };
 
+/*
+ * Versions of the events above that don't own their variable-length
+ * data, which are what the parser delivers in the first place. The
+ * strings are spans of the line being parsed, and the register bytes
+ * are held in a buffer belonging to whatever generated the event, so
+ * none of them is valid after the receiver's got_event_view function
+ * returns. A receiver that wants to keep them must copy them, e.g. by
+ * calling to_event(), which is what ParseReceiver does by default.
+ */
+struct InstructionEventView : TarmacEvent {
+    InstructionEffect effect;
+    Addr pc;
+    ISet iset;
+    int width; // 16 or 32
+    unsigned instruction;
+    StringSpan disassembly;
+    InstructionEventView(Time time, InstructionEffect effect, Addr pc,
+                         ISet iset, int width, unsigned instruction,
+                         StringSpan disassembly)
+        : TarmacEvent(time), effect(effect), pc(pc), iset(iset), width(width),
+          instruction(instruction), disassembly(disassembly)
+    {
+    }
+    InstructionEventView(const InstructionEvent &ev)
+        : InstructionEventView(ev.time, ev.effect, ev.pc, ev.iset, ev.width,
+                               ev.instruction,
+                               StringSpan(ev.disassembly.data(),
+                                          ev.disassembly.size()))
+    {
+    }
+    InstructionEvent to_event() const
+    {
+        return InstructionEvent(time, effect, pc, iset, width, instruction,
+                                disassembly.str());
+    }
+};
+
+struct RegisterEventView : TarmacEvent {
+    RegisterId reg;
+    size_t offset;
+    const uint8_t *bytes;
+    size_t nbytes;
+    RegisterEventView(Time time, RegisterId reg, size_t offset,
+                      const uint8_t *bytes, size_t nbytes)
+        : TarmacEvent(time), reg(reg), offset(offset), bytes(bytes),
+          nbytes(nbytes)
+    {
+    }
+    RegisterEventView(const RegisterEvent &ev)
+        : RegisterEventView(ev.time, ev.reg, ev.offset, ev.bytes.data(),
+                            ev.bytes.size())
+    {
+    }
+    RegisterEvent to_event() const
+    {
+        return RegisterEvent(time, reg, offset,
+                             std::vector<uint8_t>(bytes, bytes + nbytes));
+    }
+};
+
+struct TextOnlyEventView : TarmacEvent {
+    StringSpan type, msg;
+    TextOnlyEventView(Time time, StringSpan type, StringSpan msg)
+        : TarmacEvent(time), type(type), msg(msg)
+    {
+    }
+    TextOnlyEventView(const TextOnlyEvent &ev)
+        : TextOnlyEventView(ev.time, StringSpan(ev.type.data(), ev.type.size()),
+                            StringSpan(ev.msg.data(), ev.msg.size()))
+    {
+    }
+    TextOnlyEvent to_event() const
+    {
+        return TextOnlyEvent(time, type.str(), msg.str());
+    }
+};
+
 struct TarmacParseError : std::exception {
     std::string msg;
     TarmacParseError(const std::string &msg) : msg(msg) {}
@@ -145,6 +223,27 @@ class ParseReceiver {
     virtual void got_event(TextOnlyEvent &) {}
     virtual void got_event(ExceptionEvent &) {}
 
+    // The parser delivers instruction, register and text-only events
+    // through these functions, which by default copy the event and
+    // pass it to got_event. A receiver that has no need to keep the
+    // event's strings or bytes can override these instead, and avoid
+    // allocating memory for every line.
+    virtual void got_event_view(const InstructionEventView &ev)
+    {
+        InstructionEvent copy = ev.to_event();
+        got_event(copy);
+    }
+    virtual void got_event_view(const RegisterEventView &ev)
+    {
+        RegisterEvent copy = ev.to_event();
+        got_event(copy);
+    }
+    virtual void got_event_view(const TextOnlyEventView &ev)
+    {
+        TextOnlyEvent copy = ev.to_event();
+        got_event(copy);
+    }
+
     // start and end describe a half-open interval of locations in the
     // input string, i.e. including line[start] and not including
     // line[end]
@@ -153,6 +252,11 @@ class ParseReceiver {
     {
     }
 
+    // A receiver that overrides highlight() must also override this to
+    // return true. Otherwise the parser is free to recognise common
+    // kinds of line by a faster route that doesn't call highlight().
+    virtual bool wants_highlights() const { return false; }
+
     // parse_warning can return true to automatically upgrade the
     // warning to an error
     virtual bool parse_warning(const std::string & /*msg*/) { return false; }
@@ -165,6 +269,55 @@ class TarmacLineParser {
     TarmacLineParser(const ParseParams &params, ParseReceiver &);
     ~TarmacLineParser();
     void parse(const std::string &s) const;
+    // Parse a line that isn't stored in a std::string, e.g. one that
+    // is still in a memory-mapped trace file.
+    void parse(const char *data, size_t len) const;
+
+    // Lines in the commonest shapes written by Fast Models and gem5
+    // (instruction, register and memory access lines) can be parsed by
+    // a specialised fast path, which delivers exactly the same events
+    // as the general parser, and hands anything it isn't sure of back
+    // to it. Normally the fast path is tried on the first lines of the
+    // input, and kept on only if most of them fit it, and never used
+    // for a receiver that wants highlights. For testing, it can be
+    // forced on or off instead.
+    enum class FastPath { Auto, Always, Never };
+    void set_fast_path(FastPath mode);
+
+    // The number of lines so far that the fast path has parsed.
+    unsigned long long fast_path_lines() const;
+
+    // Find just the timestamp of a line, without parsing the rest of
+    // it or generating any events. The parser's inter-line state is
+    // updated as parse() would, so the two can be mixed freely in a
+    // stream of lines. This can still throw TarmacParseError, if the
+    // start of the line can't even be lexed.
+    Time parse_timestamp(const char *data, size_t len) const;
+
+    // The parser remembers a small amount of state from one line to
+    // the next (the most recent timestamp, and whether an LD or ST
+    // record might be continued). These functions allow a trace file
+    // to be parsed in separate pieces by several parsers: one parser
+    // can take over where another left off, and two parsers can be
+    // checked to see whether they would treat the next line the same
+    // way.
+    void copy_state_from(const TarmacLineParser &other);
+    bool same_state_as(const TarmacLineParser &other) const;
+
+    // The same inter-line state, in a form that can be saved somewhere
+    // (e.g. in an index file) and restored into a different parser
+    // later, so that parsing can resume part way through a trace file.
+    struct SavedState {
+        Time timestamp = 0;
+
+        // Event type that the next line might continue (LD or ST), or
+        // empty if there isn't one, and the position of the token
+        // after it.
+        std::string continued_event_type;
+        size_t post_event_type_start = 0;
+    };
+    SavedState save_state() const;
+    void restore_state(const SavedState &state);
 };
 
 #endif // LIBTARMAC_PARSER_HH
@@ -19,6 +19,8 @@
 #ifndef LIBTARMAC_REPORTER_HH
 #define LIBTARMAC_REPORTER_HH
 
+#include "libtarmac/misc.hh"
+
 #include <memory>
 #include <ostream>
 #include <string>
@@ -30,6 +32,8 @@ enum class IndexUpdateCheck {
     TooOld,         // rebuild needed: index older than trace file
     WrongFormat,    // rebuild needed: index has wrong file format version
     Incomplete,     // rebuild needed: previous generation did not finish
+    MissingParts,   // rebuild needed: index lacks data this tool needs
+    Extending,      // trace file has grown, and the index can be extended
     Forced,         // rebuild explicitly requested by user
     InMemory,       // index is not stored on disk at all, so must be built
 };
@@ -46,6 +50,13 @@ struct TracePair;
  * indexing to standard error, because you don't _have_ a standard
  * error. So you have to do it with a GUI progress-bar dialog instead.
  * Similarly for fatal error messages.)
+ *
+ * A Reporter's methods can be called from several threads at once,
+ * when more than one trace file is being indexed concurrently (see
+ * TarmacUtilityMT::jobs). Each indexing run makes all of its
+ * indexing_start, indexing_progress and indexing_done calls from the
+ * thread it runs on, so an implementation can tell the runs apart by
+ * thread.
  */
 class Reporter {
   protected:
@@ -79,16 +90,25 @@ class Reporter {
     // Report a warning or fatal error during indexing, such as a
     // parsing problem. indexing_error does not return.
     virtual void indexing_warning(const std::string &trace_filename,
-                                  unsigned lineno, const std::string &msg) = 0;
+                                  LineNo lineno, const std::string &msg) = 0;
     virtual void indexing_error(const std::string &trace_filename,
-                                unsigned lineno, const std::string &msg) = 0;
+                                LineNo lineno, const std::string &msg) = 0;
 
     void set_indexing_progress(bool val) { progress = val; }
 
-    // Report progress during file indexing.
+    // Report progress during file indexing. If several runs are in
+    // progress at once, the command-line Reporter shows a single
+    // meter for all of them together.
     virtual void indexing_start(std::streampos total) = 0;
     virtual void indexing_progress(std::streampos pos) = 0;
     virtual void indexing_done() = 0;
+
+    // Bracket a set of indexing runs made on behalf of one request,
+    // such as TarmacUtilityMT indexing several trace files at once,
+    // so that a progress meter can show them as one, even if there's
+    // a moment between them when none is in progress.
+    virtual void indexing_batch_start() {}
+    virtual void indexing_batch_done() {}
 };
 
 std::unique_ptr<Reporter> make_cli_reporter();
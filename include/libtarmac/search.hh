@@ -0,0 +1,123 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#ifndef LIBTARMAC_SEARCH_HH
+#define LIBTARMAC_SEARCH_HH
+
+#include "libtarmac/platform.hh"
+
+#include "libtarmac/misc.hh"
+#include "libtarmac/tracesource.hh"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct SearchParams {
+    // The text to look for. If 'regex' is set, it's an ECMAScript
+    // regular expression as understood by std::regex, otherwise it's
+    // a literal string. Either way, it's matched against one line of
+    // the trace at a time, without its terminating \n. (A regex is
+    // only tried on lines containing any literal text that it can't
+    // match without, which is much faster than trying every line.)
+    std::string pattern;
+    bool regex = false;
+
+    // Number of threads to search with, or 0 for one per processor.
+    unsigned threads = 0;
+};
+
+/*
+ * A TraceSearch finds every line of a trace file that matches a
+ * pattern. It divides the file into chunks, which a pool of
+ * background threads search in parallel, and collects the numbers of
+ * the matching lines in order as each chunk at the front of the queue
+ * is finished. So the matches near the start of the file can be
+ * asked for long before the search has reached the end of it.
+ *
+ * Line numbers are the true line numbers in the trace file, counting
+ * from 1. (IndexReader::lineno_offset converts them to the ones used
+ * in an index.)
+ */
+class TraceSearch {
+    struct Match {
+        LineNo line;
+        OFF_T pos;
+        bool operator<(const Match &rhs) const { return line < rhs.line; }
+    };
+
+    struct Chunk {
+        OFF_T start, end;
+        std::vector<Match> matches; // line relative to the chunk's first
+        LineNo lines = 0;
+        bool done = false;
+    };
+
+    const TraceSource &src;
+    const SearchParams params;
+    bool use_regex;
+    std::string literal; // every matching line contains this
+    std::regex re;
+    std::vector<Chunk> chunks;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> next_chunk;
+    std::atomic<bool> stopping;
+
+    // Everything below is protected by 'mutex'. 'matches' holds the
+    // matches from the first 'published' chunks, which between them
+    // hold 'lines_published' lines.
+    mutable std::mutex mutex;
+    mutable std::condition_variable cond;
+    std::vector<Match> matches;
+    size_t published;
+    LineNo lines_published;
+
+    void worker();
+    void search_chunk(Chunk &chunk);
+
+  public:
+    // Start searching. Throws std::regex_error if params.regex is set
+    // and the pattern isn't a valid regular expression.
+    TraceSearch(const TraceSource &src, const SearchParams &params);
+    TraceSearch(const TraceSearch &) = delete;
+
+    // Destroying a search that hasn't finished abandons it.
+    ~TraceSearch();
+
+    const SearchParams &get_params() const { return params; }
+
+    // Find the first matching line after 'line' (if dir > 0) or the
+    // last one before it (if dir < 0), waiting for the search to get
+    // far enough through the file to be sure of the answer. Returns
+    // false if there is no such line. If 'pos' isn't null, it's set
+    // to the position in the file of the start of the matching line.
+    bool find(LineNo line, int dir, LineNo *match,
+              OFF_T *pos = nullptr) const;
+
+    // Report progress so far without waiting: how many matching
+    // lines have been found, and whether the search is complete.
+    size_t matches_so_far() const;
+    bool finished() const;
+};
+
+#endif // LIBTARMAC_SEARCH_HH
@@ -62,6 +62,17 @@ class TarmacUtilityBase {
         iparams = iparams_;
     }
 
+    // Give the indexer a flag to watch, which can be set from another
+    // thread to stop it early (see IndexerParams::stop_request). This
+    // can be called after add_options(), and leaves the rest of the
+    // indexer parameters as they were.
+    void set_indexer_stop_request(const std::atomic<bool> *stop) {
+        iparams.stop_request = stop;
+    }
+    void set_indexer_stop_after_lines(LineNo lines) {
+        iparams.stop_after_lines = lines;
+    }
+
     std::string image_filename;
     uint64_t load_offset = 0;
 
@@ -82,7 +93,12 @@ class TarmacUtilityBase {
     IndexerParams iparams;
     IndexerDiagnostics idiags;
 
-    void updateIndexIfNeeded(const TracePair &trace) const;
+    void updateIndexIfNeeded(const TracePair &trace) const
+    {
+        updateIndexIfNeeded(trace, idiags);
+    }
+    void updateIndexIfNeeded(const TracePair &trace,
+                             const IndexerDiagnostics &diags) const;
 
   private:
     // Subclass-dependent functionality.
@@ -124,13 +140,12 @@ struct TarmacUtility : public TarmacUtilityBase {
 struct TarmacUtilityMT : public TarmacUtilityBase {
     std::vector<TracePair> traces;
 
+    // Number of trace files to index at once, set by --jobs.
+    unsigned jobs = 1;
+
     virtual void add_options(Argparse &ap) override;
-    virtual void postProcessOptions() override {}
-    virtual void setupIndex() const override
-    {
-        for (const TracePair &trace : traces)
-            updateIndexIfNeeded(trace);
-    }
+    virtual void postProcessOptions() override;
+    virtual void setupIndex() const override;
 };
 
 /*
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#ifndef LIBTARMAC_TIMELINE_HH
+#define LIBTARMAC_TIMELINE_HH
+
+#include "libtarmac/index.hh"
+#include "libtarmac/misc.hh"
+
+#include <cstddef>
+#include <vector>
+
+/*
+ * A MergedTimeline combines the seq-order trees of several existing
+ * indexes into a single list of nodes in timestamp order, for
+ * looking at a set of traces that were captured side by side, such
+ * as one Tarmac trace per core of an SMP system.
+ *
+ * It's built by a k-way merge on SeqOrderPayload::mod_time, with an
+ * IndexCursor stepping through each source's seqtree, so nothing is
+ * re-parsed.
+ * Nodes with equal timestamps are ordered by source (in the order
+ * the sources were passed to the constructor), and then by their
+ * order within their own trace. Like IndexNavigator::node_at_time,
+ * this assumes the timestamps within each trace never go backwards.
+ *
+ * The merged list is held in memory: one Entry per node of every
+ * source, so it takes a little more than sizeof(SeqOrderPayload) per
+ * node, which for very long traces can be a lot more than the sources'
+ * own indexes take up when they're on disk and only paged in as
+ * needed.
+ *
+ * The IndexNavigators must outlive the MergedTimeline.
+ */
+class MergedTimeline {
+  public:
+    struct Entry {
+        unsigned source;      // index into the list of sources
+        SeqOrderPayload node; // the node, copied from that source's seqtree
+    };
+
+    MergedTimeline(const std::vector<const IndexNavigator *> &sources);
+
+    unsigned nsources() const { return sources.size(); }
+    const IndexNavigator &source(unsigned i) const { return *sources[i]; }
+
+    std::size_t size() const { return entries.size(); }
+    const Entry &operator[](std::size_t i) const { return entries[i]; }
+
+    // Return the position of the first entry whose timestamp is
+    // greater than t, or size() if there isn't one.
+    std::size_t position_after(Time t) const;
+
+    // Find what every source was doing at time t, i.e. the latest
+    // node of each source with timestamp at most t. The returned
+    // vector has one element per source, which is null if that
+    // source has no node that early. (Unlike node_at_time, t doesn't
+    // have to be the exact timestamp of any node, since in general
+    // it won't be one for every source at once.)
+    //
+    // This costs one binary search over the merged list plus a short
+    // scan, rather than one seqtree search per source.
+    std::vector<const Entry *> entries_at_time(Time t) const;
+
+  private:
+    std::vector<const IndexNavigator *> sources;
+    std::vector<Entry> entries;
+
+    // Every checkpoint_interval entries, we record the position of
+    // the latest entry so far from each source (or SIZE_MAX for
+    // none), so that entries_at_time never has to scan back further
+    // than that to find them all.
+    static constexpr std::size_t checkpoint_interval = 256;
+    std::vector<std::vector<std::size_t>> checkpoints;
+};
+
+#endif // LIBTARMAC_TIMELINE_HH
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#ifndef LIBTARMAC_TRACESOURCE_HH
+#define LIBTARMAC_TRACESOURCE_HH
+
+#include "libtarmac/platform.hh"
+
+#include "libtarmac/disktree.hh"
+#include "libtarmac/misc.hh"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Append to 'lines' each complete line in the region [p,end), not
+// including its terminating \n, and return the position just after
+// the last \n found (so anything from there to 'end' is a partial
+// line). This finds newlines a vector register at a time where the
+// host supports it, which is much faster than a separate search for
+// the end of each one when lines are as short as Tarmac's.
+const char *split_lines(const char *p, const char *end,
+                        std::vector<StringSpan> &lines);
+
+// Read-only access to a Tarmac trace file, by memory-mapping the
+// whole thing, so that lines of it can be handed out as StringSpans
+// without copying them or making a system call for each one.
+//
+// A trace compressed with gzip is read the same way, except that what
+// is handed out is its decompressed text, in address space reserved
+// for the whole of it. That's filled in a frame of a few megabytes at
+// a time, the first time anything asks for part of the frame, by
+// starting decompression from an access point saved at the frame's
+// start. Finding the access points takes one pass through the whole
+// file, so they're saved alongside the trace (in the file named by
+// default_gzip_access_filename) to be reused next time.
+//
+// The mapping is never modified once filled in, so a TraceSource can
+// be shared between threads.
+class TraceSource {
+    struct Gzip;
+
+    MMapFile file;
+    const char *base;
+    OFF_T filesize;
+    std::unique_ptr<Gzip> gz;
+
+    // Return the address of the text at 'pos', having made sure that
+    // it's been decompressed as far as pos+len, if the file is
+    // compressed.
+    const char *ensure(OFF_T pos, OFF_T len) const;
+
+    // Parts of get_line and next_line_start: find the first \n at or
+    // after 'pos', returning nullptr if there isn't one.
+    const char *find_newline(OFF_T pos) const;
+
+  public:
+    TraceSource(const std::string &filename);
+    TraceSource(const TraceSource &) = delete;
+    ~TraceSource();
+
+    // The size of the trace text: for a compressed file, the size it
+    // decompresses to.
+    OFF_T size() const { return filesize; }
+
+    bool is_compressed() const { return gz != nullptr; }
+
+    // Return the span of the file from pos to pos+len, truncated if it
+    // would run off the end of the file.
+    StringSpan span(OFF_T pos, OFF_T len) const;
+
+    // Find the line of the file starting at position 'pos'. Returns
+    // false if pos is at (or beyond) the end of the file. Otherwise,
+    // 'line' is set to the text of the line, not including its
+    // terminating \n, and 'terminated' says whether there was one (it
+    // can only be false for the last line in the file).
+    bool get_line(OFF_T pos, StringSpan &line, bool &terminated) const;
+
+    // Return the position of the start of the first line beginning at
+    // or after 'pos', or the size of the file if there isn't one.
+    OFF_T next_line_start(OFF_T pos) const;
+
+    // Return the position just after the last newline in the file, or
+    // 0 if there isn't one. Anything after this is a partial line,
+    // which the program writing the trace might not have finished.
+    OFF_T complete_lines_end() const;
+
+    // Give back the memory holding the decompressed text of a
+    // compressed file before 'pos', for a caller going through the
+    // file in order that has finished with it. Anything there that
+    // is asked for afterwards is decompressed again, but spans already
+    // handed out become invalid, so this must only be called by the
+    // sole user of the TraceSource. Does nothing for an uncompressed
+    // file, whose pages the operating system can drop by itself.
+    void discard_before(OFF_T pos) const;
+};
+
+// The file that the access points into a gzip-compressed trace are
+// saved in.
+std::string default_gzip_access_filename(const std::string &trace_filename);
+
+// Reads consecutive lines of a TraceSource, starting at a given
+// position, splitting a block of the file into lines at a time with
+// split_lines() and handing them out one by one.
+class TraceLineReader {
+    const TraceSource &src;
+    std::vector<StringSpan> lines;
+    size_t next;
+    OFF_T pos;
+
+    void refill();
+
+  public:
+    static constexpr OFF_T block_size = 65536;
+
+    TraceLineReader(const TraceSource &src, OFF_T pos)
+        : src(src), next(0), pos(pos)
+    {
+    }
+
+    // Position in the file of the next line to be returned.
+    OFF_T position() const { return pos; }
+
+    // Return the next line in the same form as TraceSource::get_line,
+    // and move past it. Returns false at the end of the file.
+    bool get_line(StringSpan &line, bool &terminated);
+};
+
+#endif // LIBTARMAC_TRACESOURCE_HH
@@ -59,40 +59,21 @@ void CallInfo::run(Addr symb_addr)
     unsigned long long pc = symb_addr;
     pc &= ~(unsigned long long)1;
 
-    // Search first in the bypctree to get the times at which symbol is called.
-    {
-        ByPCPayload ByPCFinder, ByPCFound;
-        ByPCFinder.pc = pc;
-        ByPCFinder.trace_file_firstline = 0;
-
-        while (true) {
-            bool ret = index.bypctree.succ(index.bypcroot, ByPCFinder,
-                                           &ByPCFound, nullptr);
-
-            if (ret && ByPCFound.pc == pc &&
-                ByPCFound.trace_file_firstline >
-                    ByPCFinder.trace_file_firstline) {
-                Sites.push_back(
-                    TarmacSite(ByPCFound.pc, ByPCFound.trace_file_firstline));
-                ByPCFinder.trace_file_firstline =
-                    ByPCFound.trace_file_firstline + 1;
-            } else
-                break;
-        }
-    }
-
-    // Search in seqtree, where we have much more details.
-    for (auto &s : Sites) {
-        SeqOrderPayload SeqOrderFinder, SeqOrderFound;
-        SeqOrderFinder.pc = s.addr;
-        SeqOrderFinder.trace_file_firstline = s.tarmac_line;
-
-        if (index.seqtree.find(index.seqroot, SeqOrderFinder, &SeqOrderFound,
-                               nullptr)) {
-            s.tarmac_pos = SeqOrderFound.trace_file_pos;
-            s.time = SeqOrderFound.mod_time;
-        }
-    }
+    // The bypctree records the time and position of every visit to
+    // the symbol, and lists them together in the order they happened.
+    Sites.reserve(count_pc_visits(pc, pc + 1));
+    ByPCPayload ByPCFinder;
+    ByPCFinder.pc = pc;
+    ByPCFinder.trace_file_firstline = 0;
+    index.bypctree.visit_from(
+        index.bypcroot, ByPCFinder, [&](const ByPCPayload &found, OFF_T) {
+            if (found.pc != pc)
+                return false;
+            Sites.push_back(TarmacSite(found.pc, found.mod_time,
+                                       found.trace_file_firstline,
+                                       found.trace_file_pos));
+            return true;
+        });
 
     for (const auto &s : Sites)
         cout << " - time: " << s.time
@@ -21,26 +21,33 @@
 #include "libtarmac/image.hh"
 #include "libtarmac/intl.hh"
 #include "libtarmac/misc.hh"
+#include "libtarmac/reporter.hh"
 
+#include <atomic>
 #include <climits>
+#include <cstdint>
+#include <future>
 #include <iostream>
 #include <sstream>
+#include <unordered_map>
 #include <vector>
 
 using std::cout;
 using std::dec;
-using std::endl;
+using std::future;
 using std::hex;
 using std::map;
+using std::max;
 using std::min;
 using std::ostream;
 using std::ostringstream;
 using std::pair;
 using std::showbase;
 using std::string;
+using std::unordered_map;
 using std::vector;
 
-string CallTree::getFunctionName(Addr addr) const
+string CallTreeBase::getFunctionName(Addr addr) const
 {
     if (IN.has_image())
         if (const Symbol *Symb = IN.get_image()->find_symbol(addr)) {
@@ -56,209 +63,530 @@ string CallTree::getFunctionName(Addr addr) const
     return string();
 }
 
-string CallTree::getFunctionName(const TarmacSite &site) const
+string CallTreeBase::getFunctionName(const TarmacSite &site) const
 {
     return getFunctionName(site.addr);
 }
 
-void CallTree::csdump(ostream &os, const TarmacSite &site) const
+unsigned FunctionNameTable::getId(Addr addr)
+{
+    auto it = ids.find(addr);
+    if (it != ids.end())
+        return it->second;
+
+    unsigned id = names.size();
+    ids.emplace(addr, id);
+    addrs.push_back(addr);
+    names.push_back(CT.getFunctionName(addr));
+    return id;
+}
+
+void CallTreeBase::csdump(ostream &os, const TarmacSite &site) const
 {
     os << "t:" << site.time;
     os << " l:" << (site.tarmac_line + IN.index.lineno_offset);
     os << " pc:0x" << hex << site.addr << dec;
 }
 
-void CallTree::dump(unsigned level) const
-{
-    cout << string(level * 2, ' ');
-    cout << "o ";
-    csdump(cout, function_entry);
-    cout << " - ";
-    csdump(cout, function_exit);
-    cout << " : " << getFunctionName(function_entry);
-    cout << '\n';
-    unsigned N = getNumCalls();
-    for (unsigned i = 0; i < N; i++) {
-        cout << string((level + 1) * 2, ' ');
+namespace {
+// Visitor that writes out a call tree as text, for CallTree::dump and
+// CallTreeWalker::dump.
+class DumpVisitor : public CallTreeVisitor {
+    unsigned level;
+    FunctionNameTable names;
+
+  public:
+    DumpVisitor(const CallTreeBase &CT, unsigned level)
+        : CallTreeVisitor(CT), level(level), names(CT)
+    {
+    }
+
+    void onFunctionEntry(const TarmacSite &function_entry,
+                         const TarmacSite &function_exit)
+    {
+        cout << string(level * 2, ' ');
+        cout << "o ";
+        CT.csdump(cout, function_entry);
+        cout << " - ";
+        CT.csdump(cout, function_exit);
+        cout << " : " << names.getFunctionName(function_entry);
+        cout << '\n';
+        level += 2;
+    }
+    void onFunctionExit(const TarmacSite &, const TarmacSite &) { level -= 2; }
+    void onCallSite(const TarmacSite &, const TarmacSite &,
+                    const TarmacSite &call_site, const TarmacSite &resume_site)
+    {
+        cout << string((level - 1) * 2, ' ');
         cout << "- ";
-        csdump(cout, call_sites[i]);
+        CT.csdump(cout, call_site);
         cout << " - ";
-        csdump(cout, resume_sites[i]);
+        CT.csdump(cout, resume_site);
         cout << '\n';
-        call_trees[i].dump(level + 2);
     }
-}
+    void onCallSite(const TarmacSite &function_entry,
+                    const TarmacSite &function_exit,
+                    const TarmacSite &call_site, const TarmacSite &resume_site,
+                    const CallTree &)
+    {
+        onCallSite(function_entry, function_exit, call_site, resume_site);
+    }
+};
 
-void CallTree::generate_flame_graph_recurse(ostringstream &stackstream,
-                                            map<string, Time> &output,
-                                            Time *parent_time) const
-{
-    // Remember the current size of the stack string stored in our
-    // ostringstream, so we can reset it at the end of this function.
-    size_t parent_size = stackstream.tellp();
-
-    // Semicolon separator between the previous text (if any) and our
-    // new function name.
-    if (parent_size > 0)
-        stackstream << ';';
-
-    // Add our function name to the end of the list, falling back to a
-    // hex function address if the actual name is unavailable.
-    string fn = getFunctionName(function_entry);
-    if (!fn.empty())
-        stackstream << fn;
-    else
-        stackstream << "0x" << hex << function_entry.addr;
-
-    // Count up the total time we spend in this function call. We
-    // actually want the time spent physically *in* this function, not
-    // counting subroutines, so the recursive calls in the loop below
-    // will subtract each subroutine's duration from total_time.
-    Time total_time = function_exit.time - function_entry.time;
-
-    // ... and therefore, we must adjust _our_ parent's total_time in
-    // the same way (if we have a parent at all).
-    if (parent_time)
-        *parent_time -= total_time;
-
-    // Iterate over all subroutines, appending their stacks to the
-    // output map, and adjusting our total_time to exclude their
-    // durations.
-    for (unsigned i = 0, N = getNumCalls(); i < N; i++)
-        call_trees[i].generate_flame_graph_recurse(stackstream, output,
-                                                   &total_time);
-
-    // Add our call stack to the map, with multiplicity equal to the
-    // final value of total_time after subroutines were subtracted.
-    //
-    // There doesn't seem to be an API call to truncate the contents
-    // of an ostringstream, so instead, I truncate it immediately
-    // after pulling it out into a std::string.
-    string stack_text = stackstream.str().substr(0, stackstream.tellp());
-    output[stack_text] += total_time;
-
-    // Restore the ostringstream's output position to where it was
-    // when we entered this function.
-    stackstream.seekp(parent_size);
-}
+// Visitor that accumulates the data for a flame graph, for
+// CallTree::generate_flame_graph and CallTreeWalker::generate_flame_graph.
+class FlameGraphVisitor : public CallTreeVisitor {
+    FunctionNameTable names;
+
+    // Every distinct call stack seen so far, as a tree in which each
+    // stack is represented by its parent (the same stack minus the
+    // innermost function) and the ID of that innermost function, with
+    // the total time spent in that exact stack. Stack 0 is the empty
+    // one at the root. The text form of each stack is only made once
+    // we've finished, in write().
+    struct Stack {
+        unsigned parent, function;
+        Time time;
+    };
+    vector<Stack> stacks;
+    unordered_map<uint64_t, unsigned> children;
+
+    // The index in 'stacks' of each function in the current call
+    // stack, and the time so far spent physically *in* that function,
+    // not counting subroutines.
+    vector<pair<unsigned, Time>> frames;
+
+    unsigned child(unsigned parent, unsigned function)
+    {
+        uint64_t key = (uint64_t(parent) << 32) | function;
+        auto it = children.find(key);
+        if (it != children.end())
+            return it->second;
+
+        unsigned index = stacks.size();
+        stacks.push_back({parent, function, 0});
+        children.emplace(key, index);
+        return index;
+    }
 
-void CallTree::generate_flame_graph(ostream &os) const
-{
-    ostringstream stackstream;
-    map<string, Time> output;
-    generate_flame_graph_recurse(stackstream, output, nullptr);
-    for (auto &kv : output)
-        os << kv.first << ' ' << kv.second << endl;
-}
+  public:
+    FlameGraphVisitor(const CallTreeBase &CT)
+        : CallTreeVisitor(CT), names(CT), stacks(1, Stack{0, 0, 0})
+    {
+    }
 
-namespace {
-class CallDepthTracker {
-    vector<CallTree *> CT;
-    CallTree &CTRoot;
-    int depth;
+    void onFunctionEntry(const TarmacSite &function_entry,
+                         const TarmacSite &function_exit)
+    {
+        unsigned parent = frames.empty() ? 0 : frames.back().first;
+        unsigned stack = child(parent, names.getId(function_entry.addr));
+
+        // Count up the total time we spend in this function call, and
+        // subtract it from our parent's, which will end up with only
+        // the time not accounted for by any of its subroutines.
+        Time total_time = function_exit.time - function_entry.time;
+        if (!frames.empty())
+            frames.back().second -= total_time;
+        frames.emplace_back(stack, total_time);
+    }
 
-  public:
-    CallDepthTracker(CallTree &CTRoot) : CTRoot(CTRoot), depth(-1)
+    void onFunctionExit(const TarmacSite &, const TarmacSite &)
     {
-        CT.push_back(&CTRoot);
+        // Add our call stack's time, with multiplicity equal to the
+        // time left after subroutines were subtracted.
+        stacks[frames.back().first].time += frames.back().second;
+        frames.pop_back();
     }
 
-    void start(const SeqOrderPayload &initialNode)
+    // Set up the call stack enclosing a shard (see
+    // CallTreeWalker::split), before walking it. The enclosing calls
+    // start with no time of their own, so that when leaveContext()
+    // adds in what's left, they each lose the time spent in the calls
+    // the shard makes from them. split() reports their total times.
+    void enterContext(const vector<TarmacSite> &context)
     {
-        // We are at the CallTree root. Perform some initialize as root
-        // needs some different handling.
-        CTRoot.setFunctionEntry(initialNode);
-        depth = initialNode.call_depth;
+        for (const TarmacSite &site : context) {
+            unsigned parent = frames.empty() ? 0 : frames.back().first;
+            frames.emplace_back(child(parent, names.getId(site.addr)), 0);
+        }
     }
 
-    void newDepth(const SeqOrderPayload &newNode,
-                  const SeqOrderPayload &prevNode)
+    void leaveContext()
     {
-        if (newNode.call_depth > depth) {
-            // A function call !
-            CallTree *SubCallTree = CT.back()->addCallSite(prevNode, newNode);
-            CT.push_back(SubCallTree);
-        } else if (newNode.call_depth < depth) {
-            // A function return !
-            CT.back()->setFunctionExit(prevNode);
-            CT.pop_back();
-            CT.back()->addResumeSite(newNode);
+        while (!frames.empty())
+            onFunctionExit(TarmacSite(), TarmacSite());
+    }
+
+    // Add the time spent in each call stack to 'output', keyed by the
+    // text of the stack.
+    void addTotals(map<string, Time> &output) const
+    {
+        // Make the text of each call stack, as the function names
+        // separated by semicolons, falling back to a hex function
+        // address if the actual name is unavailable. A stack's parent
+        // is always created before it, so its text is already there.
+        //
+        // Different stacks can still come out with the same text
+        // (e.g. with --no-offsets, for calls into the middle of the
+        // same function), so the output is collected in a map to
+        // merge those, and to sort it.
+        vector<string> text(stacks.size());
+        for (unsigned i = 1; i < stacks.size(); i++) {
+            const Stack &s = stacks[i];
+            string fn = names.getName(s.function);
+            if (fn.empty()) {
+                ostringstream oss;
+                oss << "0x" << hex << names.getAddr(s.function);
+                fn = oss.str();
+            }
+            text[i] = s.parent ? text[s.parent] + ";" + fn : fn;
+            output[text[i]] += s.time;
         }
-        depth = newNode.call_depth;
     }
 
-    void finish(const SeqOrderPayload &finalNode)
+    static void write(ostream &os, const map<string, Time> &output)
     {
-        if (depth == 0)
-            CT.back()->setFunctionExit(finalNode);
+        for (auto &kv : output)
+            os << kv.first << ' ' << kv.second << '\n';
+    }
+
+    void write(ostream &os) const
+    {
+        map<string, Time> output;
+        addTotals(output);
+        write(os, output);
+    }
+};
+
+// Visitor that builds a CallTree in memory from a CallTreeWalker.
+class CallTreeBuilder {
+    CallTree &root;
+    vector<CallTree *> stack;
+    TarmacSite pending_call_site;
+
+  public:
+    CallTreeBuilder(CallTree &root) : root(root) {}
+
+    void onFunctionEntry(const TarmacSite &function_entry,
+                         const TarmacSite &function_exit)
+    {
+        CallTree *CT;
+        if (stack.empty()) {
+            CT = &root;
+            CT->setFunctionEntry(function_entry);
+        } else {
+            CT = stack.back()->addCallSite(pending_call_site, function_entry);
+        }
+        CT->setFunctionExit(function_exit);
+        stack.push_back(CT);
+    }
+    void onFunctionExit(const TarmacSite &, const TarmacSite &)
+    {
+        stack.pop_back();
+    }
+    void onCallSite(const TarmacSite &, const TarmacSite &,
+                    const TarmacSite &call_site, const TarmacSite &)
+    {
+        pending_call_site = call_site;
+    }
+    void onResumeSite(const TarmacSite &, const TarmacSite &,
+                      const TarmacSite &resume_site)
+    {
+        stack.back()->addResumeSite(resume_site);
     }
 };
 } // namespace
 
+void CallTree::dump(unsigned level) const
+{
+    DumpVisitor V(*this, level);
+    visit(V);
+}
+
+void CallTree::generate_flame_graph(ostream &os) const
+{
+    FlameGraphVisitor V(*this);
+    visit(V);
+    V.write(os);
+}
+
 CallTree::CallTree(const IndexNavigator &IN)
-    : IN(IN), function_entry(), function_exit(), call_sites(), resume_sites(),
-      call_trees()
+    : CallTreeBase(IN), function_entry(), function_exit(), call_sites(),
+      resume_sites(), call_trees()
 {
-    CallDepthTracker tracker(*this);
+    CallTreeBuilder builder(*this);
+    CallTreeWalker(IN).walk(builder);
+}
 
-    unsigned line = 0;
-    SeqOrderPayload node;
+// Find the first line at or after 'line' whose call depth is greater
+// than 'depth' (if 'higher' is true), or less than it (if false).
+bool CallTreeWalker::next_line_at_other_depth(LineNo line, unsigned depth,
+                                              bool higher, LineNo &out) const
+{
+    unsigned mindepth = higher ? depth + 1 : 0;
+    unsigned maxdepth = higher ? UINT_MAX : depth;
+    if (mindepth >= maxdepth)
+        return false;
+
+    // How many lines before this one are in the depth range?
+    LineNo x = IN.lrt_translate(line, 0, UINT_MAX, mindepth, maxdepth);
+    // Find the next one after that.
+    pair<bool, LineNo> searchresult =
+        IN.lrt_translate_may_fail(x, mindepth, maxdepth, 0, UINT_MAX);
+    out = searchresult.second;
+    return searchresult.first;
+}
+
+// Find the line where a call made from the given depth was entered,
+// given any line inside it. The call starts just after the last line
+// before that one at this depth or lower, so there must be such a
+// line.
+LineNo CallTreeWalker::find_call_entry(LineNo line, unsigned depth) const
+{
+    LineNo x = IN.lrt_translate(line, 0, UINT_MAX, 0, depth + 1);
+    return IN.lrt_translate(x - 1, 0, depth + 1, 0, UINT_MAX) + 1;
+}
+
+// Find where a function call at the given depth, entered at 'line',
+// returns to its caller. A return after the end of the window doesn't
+// count, and the call is clipped to the window instead.
+CallTreeWalker::Return CallTreeWalker::find_return(LineNo line,
+                                                   unsigned depth) const
+{
+    Return ret;
+    ret.found = next_line_at_other_depth(line, depth, false, ret.line);
+    if (ret.found && ret.line < window_end) {
+        IN.node_at_line(ret.line + 1, &ret.node);
+        SeqOrderPayload prev;
+        bool success = IN.get_previous_node(ret.node, &prev);
+        (void)success; // squash compiler warning if asserts compiled out
+        assert(success);
+        ret.exit = prev;
+    } else if (windowed) {
+        ret.found = false;
+        ret.exit = window_last;
+    }
+    return ret;
+}
+
+// Find the outermost function of the trace, which is entered at its
+// first line with a valid PC, and runs to the end of the trace. Also
+// return the line number of the end of the trace in 'end'. Returns
+// false if there's no such line.
+bool CallTreeWalker::find_outermost_function(LineNo &line,
+                                             SeqOrderPayload &node,
+                                             Return &ret, LineNo &end) const
+{
+    line = 0;
 
     // Skip first lines which have an invalid PC.
     while (IN.node_at_line(line + 1, &node) && node.pc == KNOWN_INVALID_PC)
         line++;
 
-    bool initializeTracker = true;
-    while (IN.node_at_line(line + 1, &node)) {
-        if (initializeTracker) {
-            tracker.start(node);
-            initializeTracker = false;
-        } else {
-            SeqOrderPayload prevNode;
-            bool success = IN.get_previous_node(node, &prevNode);
-            (void)success; // squash compiler warning if asserts compiled out
-            assert(success);
-            tracker.newDepth(node, prevNode);
-        }
+    ret.found = false;
 
-        unsigned depth = node.call_depth;
-
-        bool found = false;
-        unsigned x, nextline = UINT_MAX;
-        pair<bool, unsigned> searchresult;
-
-        // How many lines in the trace file are at a higher depth than
-        // this one?
-        x = IN.lrt_translate(line, 0, UINT_MAX, depth + 1, UINT_MAX);
-        // Find the _next_ line at a higher depth.
-        searchresult =
-            IN.lrt_translate_may_fail(x, depth + 1, UINT_MAX, 0, UINT_MAX);
-        if (searchresult.first) {
-            found = true;
-            nextline = min(nextline, searchresult.second);
-        }
+    if (!IN.node_at_line(line + 1, &node))
+        return false;
 
-        if (depth > 0) {
-            // Same with a lower depth (if there is a lower depth).
-            x = IN.lrt_translate(line, 0, UINT_MAX, 0, depth);
-            searchresult = IN.lrt_translate_may_fail(x, 0, depth, 0, UINT_MAX);
-            if (searchresult.first) {
-                found = true;
-                nextline = min(nextline, searchresult.second);
-            }
+    // The outermost function's exit is the last node, but only if the
+    // trace ends back at the call depth where it started.
+    SeqOrderPayload final_node;
+    bool success = IN.find_buffer_limit(true, &final_node);
+    (void)success; // squash compiler warning if asserts compiled out
+    assert(success);
+    if (node.call_depth == 0 && final_node.call_depth == 0)
+        ret.exit = final_node;
+    end = final_node.trace_file_firstline + final_node.trace_file_lines;
+
+    return true;
+}
+
+// Find the calls at the root of the walk, in order, and return the
+// line number of the end of the walk in 'end'. Returns false if the
+// trace has no line with a valid PC at all.
+bool CallTreeWalker::find_roots(vector<Root> &roots, LineNo &end) const
+{
+    Root outer;
+    if (!find_outermost_function(outer.line, outer.node, outer.ret, end))
+        return false;
+    if (windowed) {
+        end = min(end, window_end);
+        if (outer.line >= end)
+            return true;
+        outer.ret.exit = window_last;
+    }
+
+    if (!rooted || outer.node.pc == root_addr) {
+        roots.push_back(outer);
+        return true;
+    }
+
+    // If a call to the root function is in progress at the start of
+    // the window, the outermost such call is the first root. Look for
+    // it among the calls enclosing the start of the window, working
+    // inwards.
+    LineNo skip_until = 0; // lines before this are in a root already
+    if (windowed && window_first > outer.line) {
+        for (unsigned depth = outer.node.call_depth;
+             depth < window_start.call_depth; depth++) {
+            Root root;
+            root.line = find_call_entry(window_first, depth);
+            IN.node_at_line(root.line + 1, &root.node);
+            if (root.node.pc != root_addr)
+                continue;
+            root.ret = find_return(root.line, depth + 1);
+            roots.push_back(root);
+            if (!root.ret.found)
+                return true;
+            skip_until = root.ret.line;
+            break;
         }
+    }
 
+    // Find the rest from the visits to the function's address in the
+    // index, ignoring any that are inside a call we've already found,
+    // or that didn't arrive by a call (such as a loop back to the
+    // start of the function).
+    ByPCPayload key;
+    key.pc = root_addr;
+    key.trace_file_firstline = max(window_first, skip_until) + 1;
+    IN.index.bypctree.visit_from(
+        IN.index.bypcroot, key, [&](const ByPCPayload &found, OFF_T) {
+            LineNo line = found.trace_file_firstline - 1;
+            if (found.pc != root_addr || line >= end)
+                return false;
+            if (line < skip_until)
+                return true;
+
+            Root root;
+            root.line = line;
+            IN.node_at_line(line + 1, &root.node);
+            SeqOrderPayload prev;
+            if (IN.get_previous_node(root.node, &prev) &&
+                prev.call_depth >= root.node.call_depth)
+                return true;
+
+            root.ret = find_return(line, root.node.call_depth);
+            roots.push_back(root);
+            if (!root.ret.found)
+                return false;
+            skip_until = root.ret.line;
+            return true;
+        });
+    return true;
+}
+
+void CallTreeWalker::setWindow(const CallTreeWindowOptions &wopts)
+{
+    if (!wopts.root_function.empty()) {
+        uint64_t addr;
+        if (!IN.has_image())
+            reporter->errx(1, _("--root-function requires an image to look "
+                                "up the function in"));
+        if (!IN.lookup_symbol(wopts.root_function, addr))
+            reporter->errx(1, _("symbol '%s' not found"),
+                           wopts.root_function.c_str());
+        rooted = true;
+        root_addr = addr & ~(Addr)1; // the PC tree has Thumb bits cleared
+    }
+
+    if (!(wopts.got_from_line || wopts.got_to_line || wopts.got_from_time ||
+          wopts.got_to_time))
+        return;
+
+    SeqOrderPayload first, last, node;
+    if (!IN.find_buffer_limit(false, &first) ||
+        !IN.find_buffer_limit(true, &last))
+        return; // nothing to walk anyway
+
+    // Narrow [first,last] down to the nodes between the given start
+    // and end points, converting line numbers in the trace file into
+    // the index's own.
+    LineNo offset = IN.index.lineno_offset;
+    LineNo lastline = last.trace_file_firstline + last.trace_file_lines - 1;
+    bool empty = false;
+    auto start_at = [&](bool found) {
         if (!found)
-            break;
+            empty = true;
+        else if (node.trace_file_firstline > first.trace_file_firstline)
+            first = node;
+    };
+    auto end_at = [&](bool found) {
+        if (!found)
+            empty = true;
+        else if (node.trace_file_firstline < last.trace_file_firstline)
+            last = node;
+    };
+    if (wopts.got_from_line && wopts.from_line > offset)
+        start_at(IN.node_at_line(wopts.from_line - offset, &node));
+    if (wopts.got_to_line)
+        end_at(wopts.to_line > offset &&
+               IN.node_at_line(min(wopts.to_line - offset, lastline), &node));
+    if (wopts.got_from_time)
+        start_at(IN.node_near_time(wopts.from_time, true, &node));
+    if (wopts.got_to_time)
+        end_at(IN.node_near_time(wopts.to_time, false, &node));
+
+    if (empty || first.trace_file_firstline > last.trace_file_firstline)
+        reporter->errx(1, _("no part of the trace is between the given "
+                            "start and end points"));
+
+    windowed = true;
+    window_first = first.trace_file_firstline - 1;
+    window_end = last.trace_file_firstline - 1 + last.trace_file_lines;
+    window_start = first;
+    window_last = last;
+}
 
-        line = nextline;
+void CallTreeWalker::dump() const
+{
+    DumpVisitor V(*this, 0);
+    walk(V);
+}
+
+// How many shards of the call tree to make for each thread, so that
+// the threads still have roughly equal amounts of work to do if the
+// shards turn out to vary in how long they take.
+static const unsigned FLAME_GRAPH_SHARDS_PER_THREAD = 16;
+
+void CallTreeWalker::generate_flame_graph(ostream &os, unsigned threads) const
+{
+    FlameGraphVisitor V(*this);
+    if (threads <= 1) {
+        walk(V);
+        V.write(os);
+        return;
     }
 
-    SeqOrderPayload finalNode;
-    bool success = IN.find_buffer_limit(true, &finalNode);
-    (void)success; // squash compiler warning if asserts compiled out
-    assert(success);
-    tracker.finish(finalNode);
+    // Each thread takes the next shard that nobody has started on,
+    // and walks it inside its context, accumulating its own call
+    // stacks. A shard's partial totals for the stacks enclosing it can
+    // be negative (mod 2^64), but they add up correctly with the
+    // totals of the calls that split() reports to V.
+    vector<Shard> shards = split(V, threads * FLAME_GRAPH_SHARDS_PER_THREAD);
+
+    std::atomic<size_t> next_shard(0);
+    vector<FlameGraphVisitor> partials(threads, FlameGraphVisitor(*this));
+    vector<future<void>> workers;
+    for (FlameGraphVisitor &partial : partials) {
+        FlameGraphVisitor *WV = &partial;
+        workers.push_back(std::async(std::launch::async, [&, WV]() {
+            size_t i;
+            while ((i = next_shard++) < shards.size()) {
+                WV->enterContext(shards[i].context);
+                walk_shard(*WV, shards[i]);
+                WV->leaveContext();
+            }
+        }));
+    }
+    for (auto &w : workers)
+        w.get();
+
+    map<string, Time> output;
+    V.addTotals(output);
+    for (const FlameGraphVisitor &partial : partials)
+        partial.addTotals(output);
+    FlameGraphVisitor::write(os, output);
 }
 
 void CallTreeOptions::add_options(Argparse &ap)
@@ -270,3 +598,35 @@ void CallTreeOptions::add_options(Argparse &ap)
             show_offsets = false;
         });
 }
+
+void CallTreeWindowOptions::add_options(Argparse &ap)
+{
+    ap.optval({"--from-line"}, _("LINE"),
+              _("start at this line of the trace file"),
+              [this](const string &s) {
+                  from_line = stoull(s, nullptr, 0);
+                  got_from_line = true;
+              });
+    ap.optval({"--to-line"}, _("LINE"),
+              _("stop at this line of the trace file"),
+              [this](const string &s) {
+                  to_line = stoull(s, nullptr, 0);
+                  got_to_line = true;
+              });
+    ap.optval({"--from-time"}, _("TIME"),
+              _("start at the first instruction at or after this time"),
+              [this](const string &s) {
+                  from_time = stoull(s, nullptr, 0);
+                  got_from_time = true;
+              });
+    ap.optval({"--to-time"}, _("TIME"),
+              _("stop at the last instruction at or before this time"),
+              [this](const string &s) {
+                  to_time = stoull(s, nullptr, 0);
+                  got_to_time = true;
+              });
+    ap.optval({"--root-function"}, _("FUNCTION"),
+              _("look only at the calls to FUNCTION, and the calls they "
+                "make in turn"),
+              [this](const string &s) { root_function = s; });
+}
@@ -0,0 +1,308 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#include "libtarmac/disktree.hh"
+#include "libtarmac/cmake.h"
+#include "libtarmac/intl.hh"
+#include "libtarmac/reporter.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+using std::future;
+using std::max;
+using std::min;
+using std::string;
+using std::vector;
+
+/*
+ * Layout of a compressed file: this header, then a table of nblocks
+ * end offsets, giving the position in the file just after each
+ * block's compressed data (the first block starts straight after the
+ * table). Every block except the last holds block_size bytes of the
+ * original file. A block whose compressed data is no smaller than the
+ * original is stored uncompressed, which is recognisable because its
+ * stored length is the same as its original length.
+ */
+static const char compressed_magic[16] = {
+    'T', 'a', 'r', 'm', 'a', 'c', 'Z', 'l', 'i', 'b', 'V', '0', '0', '0', '1',
+};
+
+struct CompressedFileHeader {
+    char magic[16];
+    diskint<uint64_t> size;
+    diskint<uint32_t> block_size;
+    diskint<uint32_t> nblocks;
+};
+
+// Small enough that a block's worth of work is cheap, but large
+// enough for zlib to find most of the repetition in the trees.
+static const size_t COMPRESSED_BLOCK_SIZE = 256 * 1024;
+
+// Run fn(first, last) on ranges of [0,n) in parallel, one per
+// thread, using up to 'nthreads' threads.
+template <class Fn>
+static void for_ranges_in_parallel(size_t n, size_t nthreads, Fn fn)
+{
+    nthreads = min(max(nthreads, (size_t)1), n);
+    vector<future<void>> workers;
+    for (size_t i = 0; i < nthreads; i++)
+        workers.push_back(std::async(std::launch::async, fn, n * i / nthreads,
+                                     n * (i + 1) / nthreads));
+    for (auto &w : workers)
+        w.get();
+}
+
+// The same, with one thread per available processor.
+template <class Fn> static void for_ranges_in_parallel(size_t n, Fn fn)
+{
+    for_ranges_in_parallel(n, std::thread::hardware_concurrency(), fn);
+}
+
+static bool has_compressed_magic(const Arena &file)
+{
+    if (file.curr_offset() < (OFF_T)sizeof(CompressedFileHeader))
+        return false;
+    const CompressedFileHeader &hdr = *file.getptr<CompressedFileHeader>(0);
+    return memcmp(hdr.magic, compressed_magic, sizeof(hdr.magic)) == 0;
+}
+
+bool CompressedFile::is_compressed(const string &filename)
+{
+    MMapFile file(filename, false);
+    return has_compressed_magic(file);
+}
+
+// The compressed file stays mapped for as long as the arena exists,
+// so that blocks can be decompressed from it as they're needed. Each
+// block is decompressed under its own once_flag, so that threads
+// sharing the arena can fill in different blocks at the same time,
+// and 'done' lets a read of a block that's already been filled in
+// skip even that.
+struct CompressedFile::Blocks {
+    MMapFile file;
+    size_t block_size = 0, nblocks = 0;
+    OFF_T table = 0, data_start = 0;
+    std::unique_ptr<std::once_flag[]> once;
+    std::unique_ptr<std::atomic<bool>[]> done;
+
+    Blocks(const string &filename) : file(filename, false) {}
+};
+
+CompressedFile::~CompressedFile()
+{
+    free(mapping);
+    delete blocks;
+}
+
+void CompressedFile::fill(OFF_T offset, size_t size) const
+{
+    if (!size)
+        return;
+    size_t first = offset / blocks->block_size;
+    size_t last = (offset + size - 1) / blocks->block_size;
+    for (size_t i = first; i <= last; i++)
+        if (!blocks->done[i].load(std::memory_order_acquire))
+            fill_block(i);
+}
+
+void CompressedFile::prefault(unsigned nthreads) const
+{
+    for_ranges_in_parallel(blocks->nblocks, nthreads,
+                           [this](size_t first, size_t last) {
+                               for (size_t i = first; i < last; i++)
+                                   fill_block(i);
+                           });
+}
+
+#if HAVE_ZLIB
+
+CompressedFile::CompressedFile(const string &filename)
+    : filename(filename), blocks(new Blocks(filename))
+{
+    const MMapFile &file = blocks->file;
+    if (!has_compressed_magic(file))
+        reporter->errx(1, _("%s: not a compressed file"), filename.c_str());
+
+    const CompressedFileHeader &hdr = *file.getptr<CompressedFileHeader>(0);
+    OFF_T size = hdr.size;
+    size_t block_size = hdr.block_size;
+    size_t nblocks = hdr.nblocks;
+    OFF_T table = sizeof(CompressedFileHeader);
+    if (block_size == 0 ||
+        (file.curr_offset() - table) / sizeof(diskint<uint64_t>) < nblocks ||
+        (OFF_T)nblocks != (size + (OFF_T)block_size - 1) / (OFF_T)block_size)
+        reporter->errx(1, _("%s: compressed file header is corrupt"),
+                       filename.c_str());
+    OFF_T data_start = table + nblocks * sizeof(diskint<uint64_t>);
+
+    // Checking the table now is cheap, and means a truncated file is
+    // reported when it's opened. Whether each block's data is intact
+    // can only be found out by decompressing it.
+    const diskint<uint64_t> *ends =
+        nblocks ? file.getptr<diskint<uint64_t>>(table, nblocks) : nullptr;
+    OFF_T prev = data_start;
+    for (size_t i = 0; i < nblocks; i++) {
+        OFF_T end = ends[i];
+        if (!(prev <= end && end <= file.curr_offset()))
+            reporter->errx(1, _("%s: compressed data is corrupt"),
+                           filename.c_str());
+        prev = end;
+    }
+
+    blocks->block_size = block_size;
+    blocks->nblocks = nblocks;
+    blocks->table = table;
+    blocks->data_start = data_start;
+    blocks->once.reset(new std::once_flag[nblocks]);
+    blocks->done.reset(new std::atomic<bool>[nblocks]);
+    for (size_t i = 0; i < nblocks; i++)
+        blocks->done[i].store(false, std::memory_order_relaxed);
+
+    // Nothing is decompressed yet, so on systems that allocate memory
+    // as it's touched, this costs only address space.
+    mapping = malloc(max(size, (OFF_T)1));
+    if (!mapping)
+        reporter->errx(1, _("Out of memory"));
+    curr_size = next_offset = size;
+    lazy = true;
+}
+
+void CompressedFile::fill_block(size_t i) const
+{
+    std::call_once(blocks->once[i], [this, i]() {
+        const MMapFile &file = blocks->file;
+        size_t nblocks = blocks->nblocks, block_size = blocks->block_size;
+        const diskint<uint64_t> *ends =
+            file.getptr<diskint<uint64_t>>(blocks->table, nblocks);
+        OFF_T start = i ? OFF_T(ends[i - 1]) : blocks->data_start;
+        OFF_T end = ends[i];
+        OFF_T out = i * block_size;
+        uLongf outlen = min((OFF_T)block_size, next_offset - out);
+        const Bytef *src = (const Bytef *)file.getptr<char>(start, end - start);
+        Bytef *dst = (Bytef *)mapping + out;
+        if ((uLongf)(end - start) == outlen) {
+            memcpy(dst, src, outlen);
+        } else {
+            uLongf expected = outlen;
+            if (uncompress(dst, &outlen, src, end - start) != Z_OK ||
+                outlen != expected)
+                reporter->errx(1, _("%s: compressed data is corrupt"),
+                               filename.c_str());
+        }
+    });
+    blocks->done[i].store(true, std::memory_order_release);
+}
+
+void CompressedFile::compress_in_place(const string &filename)
+{
+    vector<vector<Bytef>> blocks;
+    OFF_T size;
+
+    {
+        MMapFile file(filename, false);
+        size = file.curr_offset();
+        size_t nblocks =
+            (size + COMPRESSED_BLOCK_SIZE - 1) / COMPRESSED_BLOCK_SIZE;
+        blocks.resize(nblocks);
+        const Bytef *base =
+            size ? (const Bytef *)file.getptr<char>(0) : nullptr;
+
+        for_ranges_in_parallel(nblocks, [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; i++) {
+                const Bytef *src = base + i * COMPRESSED_BLOCK_SIZE;
+                uLong srclen = min((OFF_T)COMPRESSED_BLOCK_SIZE,
+                                   size - (OFF_T)(i * COMPRESSED_BLOCK_SIZE));
+                uLongf dstlen = compressBound(srclen);
+                blocks[i].resize(dstlen);
+                if (compress2(blocks[i].data(), &dstlen, src, srclen,
+                              Z_DEFAULT_COMPRESSION) != Z_OK ||
+                    dstlen >= srclen) {
+                    // Store the block as it is, if compressing it
+                    // didn't work or didn't help.
+                    blocks[i].assign(src, src + srclen);
+                } else {
+                    blocks[i].resize(dstlen);
+                }
+            }
+        });
+    }
+
+    remove(filename.c_str());
+    MMapFile file(filename, true);
+
+    OFF_T header_offset = file.alloc(sizeof(CompressedFileHeader));
+    OFF_T table = file.alloc(blocks.size() * sizeof(diskint<uint64_t>));
+    {
+        CompressedFileHeader &hdr =
+            *file.getptr<CompressedFileHeader>(header_offset);
+        memcpy(hdr.magic, compressed_magic, sizeof(hdr.magic));
+        hdr.size = size;
+        hdr.block_size = COMPRESSED_BLOCK_SIZE;
+        hdr.nblocks = blocks.size();
+    }
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        OFF_T pos = file.alloc(blocks[i].size());
+        memcpy(file.getptr<char>(pos), blocks[i].data(), blocks[i].size());
+        *file.getptr<diskint<uint64_t>>(table +
+                                        i * sizeof(diskint<uint64_t>)) =
+            file.curr_offset();
+        vector<Bytef>().swap(blocks[i]);
+    }
+}
+
+#else // HAVE_ZLIB
+
+CompressedFile::CompressedFile(const string &filename)
+    : filename(filename), blocks(nullptr)
+{
+    reporter->errx(1,
+                   _("%s: compressed index files are not supported in "
+                     "this build"),
+                   filename.c_str());
+}
+
+void CompressedFile::fill_block(size_t) const {}
+
+void CompressedFile::compress_in_place(const string &filename)
+{
+    reporter->errx(1,
+                   _("%s: compressed index files are not supported in "
+                     "this build"),
+                   filename.c_str());
+}
+
+#endif // HAVE_ZLIB
+
+void CompressedFile::resize(size_t)
+{
+    reporter->errx(1, _("Attempted to write to a compressed file"));
+}
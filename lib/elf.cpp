@@ -22,15 +22,13 @@
  */
 
 #include "libtarmac/elf.hh"
+#include "libtarmac/disktree.hh"
 #include "libtarmac/misc.hh"
 
 #include <assert.h>
 #include <stdint.h>
 #include <string.h>
 
-#include <sstream>
-
-using std::ostringstream;
 using std::string;
 using std::vector;
 
@@ -54,28 +52,35 @@ static constexpr unsigned ELFDATA2MSB = 2;
 
 uint64_t ElfSectionHeader::entries() const { return sh_size / sh_entsize; }
 
+// Access to the ELF file is by memory-mapping the whole thing, so that
+// reading a header or a symbol is just a bounds check and a pointer,
+// rather than a seek and a read for each one.
 class ElfCommonBase : public ElfFile {
-    FILE *fp;
+    MMapFile file;
+    const uint8_t *base;
+    uint64_t filesize;
 
   public:
-    ElfCommonBase(FILE *fp) : fp(fp) {}
-    ~ElfCommonBase() { fclose(fp); }
+    ElfCommonBase(const string &filename)
+        : file(filename, false), base(nullptr), filesize(file.curr_offset())
+    {
+        if (filesize > 0)
+            base = file.getptr<uint8_t>(0);
+    }
 
     virtual bool setup() = 0;
 
   protected:
-    bool read(size_t offset, size_t size, void *output) const;
+    // Return a pointer to 'size' bytes of the file at 'offset', or
+    // null if they aren't all there.
+    const uint8_t *data(uint64_t offset, uint64_t size) const;
 };
 
-bool ElfCommonBase::read(size_t offset, size_t size, void *output) const
+const uint8_t *ElfCommonBase::data(uint64_t offset, uint64_t size) const
 {
-    if (fseek(fp, offset, SEEK_SET) == -1)
-        return false;
-
-    if (fread(output, 1, size, fp) != size)
-        return false;
-
-    return true;
+    if (offset > filesize || size > filesize - offset)
+        return nullptr;
+    return base + offset;
 }
 
 static uint64_t read_integer_le(const void *vp, size_t size)
@@ -117,8 +122,9 @@ class ElfCommon : public ElfCommonBase {
 
     bool read_header()
     {
-        uint8_t data[40 + 3 * AddrSize];
-        if (!read(0, sizeof(data), data))
+        const size_t size = 40 + 3 * AddrSize;
+        const uint8_t *data = this->data(0, size);
+        if (!data)
             return false;
 
         memcpy(hdr.e_ident, data + 0, 16);
@@ -136,14 +142,15 @@ class ElfCommon : public ElfCommonBase {
         hdr.e_shentsize = ByteOrder::get(&p, 2);
         hdr.e_shnum = ByteOrder::get(&p, 2);
         hdr.e_shstrndx = ByteOrder::get(&p, 2);
-        assert(p == data + sizeof(data));
+        assert(p == data + size);
         return true;
     }
 
     bool read_section_header(uint64_t offset, ElfSectionHeader &shdr) const
     {
-        uint8_t data[16 + 6 * AddrSize];
-        if (!read(offset, sizeof(data), data))
+        const size_t size = 16 + 6 * AddrSize;
+        const uint8_t *data = this->data(offset, size);
+        if (!data)
             return false;
 
         const uint8_t *p = data;
@@ -157,14 +164,15 @@ class ElfCommon : public ElfCommonBase {
         shdr.sh_info = ByteOrder::get(&p, 4);
         shdr.sh_addralign = ByteOrder::get(&p, AddrSize);
         shdr.sh_entsize = ByteOrder::get(&p, AddrSize);
-        assert(p == data + sizeof(data));
+        assert(p == data + size);
         return true;
     }
 
     bool read_program_header(uint64_t offset, ElfProgramHeader &phdr) const
     {
-        uint8_t data[8 + 6 * AddrSize];
-        if (!read(offset, sizeof(data), data))
+        const size_t size = 8 + 6 * AddrSize;
+        const uint8_t *data = this->data(offset, size);
+        if (!data)
             return false;
 
         const uint8_t *p = data;
@@ -179,7 +187,7 @@ class ElfCommon : public ElfCommonBase {
         if (AddrSize == 4)
             phdr.p_flags = ByteOrder::get(&p, 4);
         phdr.p_align = ByteOrder::get(&p, AddrSize);
-        assert(p == data + sizeof(data));
+        assert(p == data + size);
         return true;
     }
 
@@ -234,12 +242,10 @@ class ElfCommon : public ElfCommonBase {
         if (phdr.p_filesz == 0)
             return true;
 
-        out.resize(phdr.p_filesz);
-        if (!read(phdr.p_offset, phdr.p_filesz, out.data())) {
-            out.clear();
+        const uint8_t *data = this->data(phdr.p_offset, phdr.p_filesz);
+        if (!data)
             return false;
-        }
-
+        out.assign(data, data + phdr.p_filesz);
         return true;
     }
 
@@ -254,16 +260,12 @@ class ElfCommon : public ElfCommonBase {
     string strtab_string(const ElfSectionHeader &shdr,
                          unsigned offset) const override
     {
-        ostringstream os;
-        while (offset < shdr.sh_size) {
-            char c;
-            if (!read(shdr.sh_offset + offset++, 1, &c))
-                break;
-            if (c == '\0')
-                break;
-            os << c;
-        }
-        return os.str();
+        const char *table = (const char *)data(shdr.sh_offset, shdr.sh_size);
+        if (!table || offset >= shdr.sh_size)
+            return "";
+        const char *start = table + offset, *end = table + shdr.sh_size;
+        const char *nul = (const char *)memchr(start, '\0', end - start);
+        return string(start, nul ? nul : end);
     }
 };
 
@@ -272,8 +274,8 @@ template <class ByteOrder> class Elf32 : public ElfCommon<ByteOrder, 4> {
 
     bool read_symbol(uint64_t offset, ElfSymbol &sym) const override
     {
-        uint8_t data[16];
-        if (!ElfCommonBase::read(offset, sizeof(data), data))
+        const uint8_t *data = this->data(offset, 16);
+        if (!data)
             return false;
 
         const uint8_t *p = data;
@@ -283,7 +285,7 @@ template <class ByteOrder> class Elf32 : public ElfCommon<ByteOrder, 4> {
         uint8_t st_info = ByteOrder::get(&p, 1);
         uint8_t st_other = ByteOrder::get(&p, 1);
         sym.st_shndx = ByteOrder::get(&p, 2);
-        assert(p == data + sizeof(data));
+        assert(p == data + 16);
 
         sym.st_bind = st_info >> 4;
         sym.st_type = st_info & 0xF;
@@ -298,8 +300,8 @@ template <class ByteOrder> class Elf64 : public ElfCommon<ByteOrder, 8> {
 
     bool read_symbol(uint64_t offset, ElfSymbol &sym) const override
     {
-        uint8_t data[24];
-        if (!ElfCommonBase::read(offset, sizeof(data), data))
+        const uint8_t *data = this->data(offset, 24);
+        if (!data)
             return false;
 
         const uint8_t *p = data;
@@ -309,7 +311,7 @@ template <class ByteOrder> class Elf64 : public ElfCommon<ByteOrder, 8> {
         sym.st_shndx = ByteOrder::get(&p, 2);
         sym.st_value = ByteOrder::get(&p, 8);
         sym.st_size = ByteOrder::get(&p, 8);
-        assert(p == data + sizeof(data));
+        assert(p == data + 24);
 
         sym.st_bind = st_info >> 4;
         sym.st_type = st_info & 0xF;
@@ -365,21 +367,23 @@ std::unique_ptr<ElfFile> elf_open(const string &filename)
         return nullptr;
     }
 
+    // Now we know it's an ELF file we understand, map the whole thing.
+    fclose(fp);
     std::unique_ptr<ElfCommonBase> elf_file;
     if (!elf64) {
         if (be)
-            elf_file = std::make_unique<Elf32BE>(fp);
+            elf_file = std::make_unique<Elf32BE>(filename);
         else
-            elf_file = std::make_unique<Elf32LE>(fp);
+            elf_file = std::make_unique<Elf32LE>(filename);
     } else {
         if (be)
-            elf_file = std::make_unique<Elf64BE>(fp);
+            elf_file = std::make_unique<Elf64BE>(filename);
         else
-            elf_file = std::make_unique<Elf64LE>(fp);
+            elf_file = std::make_unique<Elf64LE>(filename);
     }
 
     if (!elf_file->setup())
-        return nullptr; // now fp will be auto-closed by destructor
+        return nullptr;
 
     return elf_file;
 }
@@ -0,0 +1,542 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#include "libtarmac/eventcache.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/reporter.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::make_unique;
+using std::ofstream;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+static const char event_cache_magic[16] = {'T', 'a', 'r', 'm', 'a', 'c',
+                                           'E', 'v', 'e', 'n', 't', 's',
+                                           'V', '0', '0', '2'};
+
+// Size of the header, and the offset within it of the fields that
+// finish() fills in.
+static const size_t header_size = 16 + 8 + 3 + 8 + 8 + 8;
+static const size_t header_covered_offset = 16 + 8 + 3 + 8;
+
+// Before parsing its range of the trace, a shard's parser parses and
+// discards this much of what comes before it, as the parallel parser
+// in the indexer does before each chunk.
+static const OFF_T SHARD_WARMUP_SIZE = 4096;
+
+EventCacheWriter::EventCacheWriter(
+    const string &filename, OFF_T trace_size, OFF_T limit,
+    const ParseParams &pparams, OFF_T start,
+    const TarmacLineParser::SavedState &start_state)
+    : filename(filename), tmp_filename(filename + ".tmp"),
+      ofs(tmp_filename.c_str(), ofstream::binary), trace_size(trace_size),
+      covered(start), limit(limit), records_size(0), finished(false)
+{
+    string header(event_cache_magic, sizeof(event_cache_magic));
+    put(trace_size, 8, header);
+    put(pparams.bigend, 1, header);
+    put(pparams.iset_specified, 1, header);
+    put(pparams.iset_specified ? pparams.iset : 0, 1, header);
+    put(start, 8, header);
+    put(0, 8, header); // end of coverage, filled in by finish()
+    put(0, 8, header); // end record offset, likewise
+    ofs.write(header.data(), header.size());
+
+    string state;
+    put_state('S', start_state, state);
+    ofs.write(state.data(), state.size());
+    records_size += state.size();
+}
+
+EventCacheWriter::~EventCacheWriter()
+{
+    if (!finished) {
+        ofs.close();
+        remove(tmp_filename.c_str());
+    }
+}
+
+void EventCacheWriter::put(unsigned long long val, unsigned bytes,
+                           string &out)
+{
+    while (bytes-- > 0)
+        out.push_back((char)(val >> (8 * bytes)));
+}
+
+void EventCacheWriter::put_str(StringSpan s, string &out)
+{
+    put(s.size, 4, out);
+    out.append(s.data, s.size);
+}
+
+void EventCacheWriter::put_state(char tag,
+                                 const TarmacLineParser::SavedState &state,
+                                 string &out)
+{
+    out.push_back(tag);
+    put(state.timestamp, 8, out);
+    put_str(StringSpan(state.continued_event_type.data(),
+                       state.continued_event_type.size()),
+            out);
+    put(state.post_event_type_start, 8, out);
+}
+
+void EventCacheWriter::record(const InstructionEventView &ev)
+{
+    line.push_back('I');
+    put(ev.time, 8, line);
+    put(ev.effect, 1, line);
+    put(ev.pc, 8, line);
+    put(ev.iset, 1, line);
+    put(ev.width, 1, line);
+    put(ev.instruction, 4, line);
+    put_str(ev.disassembly, line);
+}
+
+void EventCacheWriter::record(const RegisterEventView &ev)
+{
+    line.push_back('R');
+    put(ev.time, 8, line);
+    put((unsigned)ev.reg.prefix, 1, line);
+    put(ev.reg.index, 4, line);
+    put(ev.offset, 8, line);
+    put(ev.nbytes, 4, line);
+    line.append((const char *)ev.bytes, ev.nbytes);
+}
+
+void EventCacheWriter::record(const MemoryEvent &ev)
+{
+    line.push_back('M');
+    put(ev.time, 8, line);
+    put((ev.read ? 1 : 0) | (ev.known ? 2 : 0), 1, line);
+    put(ev.size, 8, line);
+    put(ev.addr, 8, line);
+    put(ev.contents, 8, line);
+}
+
+void EventCacheWriter::record(const TextOnlyEventView &ev)
+{
+    line.push_back('T');
+    put(ev.time, 8, line);
+    put_str(ev.type, line);
+    put_str(ev.msg, line);
+}
+
+void EventCacheWriter::record(const ExceptionEvent &ev)
+{
+    line.push_back('X');
+    put(ev.time, 8, line);
+}
+
+void EventCacheWriter::record_warning(const string &msg)
+{
+    line.push_back('W');
+    put_str(StringSpan(msg.data(), msg.size()), line);
+}
+
+void EventCacheWriter::end_line(size_t len)
+{
+    if (covered + (OFF_T)len + 1 <= limit) {
+        string start;
+        start.push_back('L');
+        put(len, 4, start);
+        ofs.write(start.data(), start.size());
+        ofs.write(line.data(), line.size());
+        records_size += start.size() + line.size();
+        covered += len + 1;
+    }
+    line.clear();
+}
+
+void EventCacheWriter::append(const EventCacheReader &cache)
+{
+    assert(cache.start_position() == covered);
+    StringSpan records = cache.line_records();
+    ofs.write(records.data, records.size);
+    records_size += records.size;
+    covered = cache.covered_size();
+}
+
+bool EventCacheWriter::finish(const TarmacLineParser::SavedState &state)
+{
+    string end;
+    put_state('E', state, end);
+    ofs.write(end.data(), end.size());
+
+    string fields;
+    put(covered, 8, fields);
+    put(header_size + records_size, 8, fields);
+    ofs.seekp(header_covered_offset);
+    ofs.write(fields.data(), fields.size());
+    ofs.close();
+
+    if (ofs.fail() || rename(tmp_filename.c_str(), filename.c_str()) != 0)
+        return false;
+    finished = true;
+    return true;
+}
+
+void EventCacheReader::corrupt() const
+{
+    reporter->errx(1, _("event cache file '%s' is corrupt"),
+                   filename.c_str());
+}
+
+unsigned long long EventCacheReader::get(unsigned bytes)
+{
+    if ((size_t)(end - pos) < bytes)
+        corrupt();
+    unsigned long long val = 0;
+    while (bytes-- > 0)
+        val = (val << 8) | *pos++;
+    return val;
+}
+
+StringSpan EventCacheReader::get_str()
+{
+    size_t len = get(4);
+    if ((size_t)(end - pos) < len)
+        corrupt();
+    StringSpan s((const char *)pos, len);
+    pos += len;
+    return s;
+}
+
+TarmacLineParser::SavedState EventCacheReader::get_state(char tag)
+{
+    if (get(1) != (unsigned char)tag)
+        corrupt();
+    TarmacLineParser::SavedState state;
+    state.timestamp = get(8);
+    state.continued_event_type = get_str().str();
+    state.post_event_type_start = get(8);
+    return state;
+}
+
+bool EventCacheReader::check_header(OFF_T trace_size,
+                                    const ParseParams &pparams)
+{
+    if ((size_t)(end - pos) < header_size ||
+        memcmp(pos, event_cache_magic, sizeof(event_cache_magic)))
+        return false;
+    pos += sizeof(event_cache_magic);
+
+    if ((OFF_T)get(8) != trace_size || (bool)get(1) != pparams.bigend ||
+        (bool)get(1) != pparams.iset_specified)
+        return false;
+    unsigned iset = get(1);
+    if (pparams.iset_specified && iset != (unsigned)pparams.iset)
+        return false;
+
+    first = get(8);
+    covered = get(8);
+    unsigned long long end_offset = get(8);
+
+    // A cache that was never finished has no end record, and one
+    // claiming to cover more than the trace can't be for this trace.
+    if (end_offset < header_size || end_offset >= (size_t)(end - data) ||
+        first > covered || covered > trace_size)
+        return false;
+
+    const unsigned char *state = pos;
+    pos = data + end_offset;
+    final_state = get_state('E');
+
+    end = data + end_offset;
+    pos = state;
+    initial_state = get_state('S');
+    records = pos;
+    return true;
+}
+
+bool EventCacheReader::open(const string &filename_,
+                            const string &tarmac_filename, OFF_T trace_size,
+                            const ParseParams &pparams)
+{
+    uint64_t trace_timestamp, cache_timestamp;
+    if (!get_file_timestamp(tarmac_filename, &trace_timestamp) ||
+        !get_file_timestamp(filename_, &cache_timestamp) ||
+        cache_timestamp < trace_timestamp)
+        return false;
+
+    return open_shard(filename_, trace_size, pparams);
+}
+
+bool EventCacheReader::open_shard(const string &filename_, OFF_T trace_size,
+                                  const ParseParams &pparams)
+{
+    filename = filename_;
+    file.reset(new TraceSource(filename));
+    StringSpan all = file->span(0, file->size());
+    data = pos = (const unsigned char *)all.data;
+    end = data + all.size;
+    if (!check_header(trace_size, pparams)) {
+        file = nullptr;
+        return false;
+    }
+    return true;
+}
+
+bool EventCacheReader::next_line(size_t &len)
+{
+    if (pos == end)
+        return false;
+    if (get(1) != 'L')
+        corrupt();
+    len = get(4);
+    return true;
+}
+
+void EventCacheReader::replay_line(ParseReceiver &recv)
+{
+    while (pos < end && *pos != 'L') {
+        switch (get(1)) {
+        case 'I': {
+            Time time = get(8);
+            auto effect = (InstructionEffect)get(1);
+            Addr pc = get(8);
+            auto iset = (ISet)get(1);
+            int width = get(1);
+            unsigned instruction = get(4);
+            InstructionEventView ev(time, effect, pc, iset, width,
+                                    instruction, get_str());
+            recv.got_event_view(ev);
+            break;
+        }
+        case 'R': {
+            Time time = get(8);
+            RegisterId reg;
+            reg.prefix = (RegPrefix)get(1);
+            reg.index = get(4);
+            size_t offset = get(8);
+            StringSpan bytes = get_str();
+            RegisterEventView ev(time, reg, offset,
+                                 (const uint8_t *)bytes.data, bytes.size);
+            recv.got_event_view(ev);
+            break;
+        }
+        case 'M': {
+            Time time = get(8);
+            unsigned flags = get(1);
+            size_t size = get(8);
+            Addr addr = get(8);
+            unsigned long long contents = get(8);
+            MemoryEvent ev(time, flags & 1, size, addr, flags & 2, contents);
+            recv.got_event(ev);
+            break;
+        }
+        case 'T': {
+            Time time = get(8);
+            StringSpan type = get_str();
+            TextOnlyEventView ev(time, type, get_str());
+            recv.got_event_view(ev);
+            break;
+        }
+        case 'X': {
+            ExceptionEvent ev(get(8));
+            recv.got_event(ev);
+            break;
+        }
+        case 'W':
+            recv.parse_warning(get_str().str());
+            break;
+        default:
+            corrupt();
+        }
+    }
+}
+
+void EventCacheReader::replay(ParseReceiver &recv)
+{
+    size_t len;
+    while (next_line(len))
+        replay_line(recv);
+}
+
+string default_event_cache_filename(const string &tarmac_filename)
+{
+    return tarmac_filename + ".events";
+}
+
+namespace {
+// Receives the parser's output and records it in an event cache, or
+// throws it away if there isn't one yet.
+struct EventRecorder : ParseReceiver {
+    EventCacheWriter *writer = nullptr;
+
+    void got_event_view(const InstructionEventView &ev) override
+    {
+        if (writer)
+            writer->record(ev);
+    }
+    void got_event_view(const RegisterEventView &ev) override
+    {
+        if (writer)
+            writer->record(ev);
+    }
+    void got_event_view(const TextOnlyEventView &ev) override
+    {
+        if (writer)
+            writer->record(ev);
+    }
+    void got_event(MemoryEvent &ev) override
+    {
+        if (writer)
+            writer->record(ev);
+    }
+    void got_event(ExceptionEvent &ev) override
+    {
+        if (writer)
+            writer->record(ev);
+    }
+    bool parse_warning(const string &msg) override
+    {
+        if (writer)
+            writer->record_warning(msg);
+        return false;
+    }
+};
+} // namespace
+
+// Parse the lines of a trace that start in [start,end), and if
+// 'writer' isn't null, record them in it.
+static void parse_lines(TarmacLineParser &parser, EventCacheWriter *writer,
+                        const TraceSource &source, OFF_T start, OFF_T end)
+{
+    TraceLineReader reader(source, start);
+    StringSpan line;
+    bool terminated;
+    OFF_T pos;
+    while ((pos = reader.position()) < end &&
+           reader.get_line(line, terminated)) {
+        try {
+            parser.parse(line.data, line.size);
+        } catch (TarmacParseError e) {
+            if (writer)
+                reporter->errx(1,
+                               _("parse error in the line starting at byte "
+                                 "position %llu of the trace: %s"),
+                               (unsigned long long)pos, e.msg.c_str());
+        }
+        if (writer)
+            writer->end_line(line.size);
+    }
+}
+
+static bool same_state(const TarmacLineParser::SavedState &a,
+                       const TarmacLineParser::SavedState &b)
+{
+    return a.timestamp == b.timestamp &&
+           a.continued_event_type == b.continued_event_type &&
+           a.post_event_type_start == b.post_event_type_start;
+}
+
+bool write_event_cache_shard(const string &filename,
+                             const TraceSource &source, OFF_T start,
+                             OFF_T end, const ParseParams &pparams)
+{
+    // Round both ends of the range to the start of a line, and leave
+    // out any partial line at the end of the file, as the indexer does
+    // when it writes a cache.
+    OFF_T limit = source.complete_lines_end();
+    start = std::min(source.next_line_start(start), limit);
+    end = std::max(start, std::min(source.next_line_start(end), limit));
+
+    EventRecorder recorder;
+    TarmacLineParser parser(pparams, recorder);
+    parse_lines(parser, nullptr, source,
+                source.next_line_start(start > SHARD_WARMUP_SIZE
+                                           ? start - SHARD_WARMUP_SIZE
+                                           : 0),
+                start);
+
+    EventCacheWriter writer(filename, source.size(), end, pparams, start,
+                            parser.save_state());
+    if (!writer.ok())
+        return false;
+    recorder.writer = &writer;
+    parse_lines(parser, &writer, source, start, end);
+    return writer.finish(parser.save_state());
+}
+
+bool stitch_event_cache_shards(const string &filename,
+                               const vector<string> &shard_filenames,
+                               const TraceSource &source,
+                               const ParseParams &pparams)
+{
+    vector<unique_ptr<EventCacheReader>> shards;
+    for (const string &shard_filename : shard_filenames) {
+        auto shard = make_unique<EventCacheReader>();
+        if (!shard->open_shard(shard_filename, source.size(), pparams))
+            reporter->errx(1,
+                           _("'%s' is not an event cache shard for this "
+                             "trace file"),
+                           shard_filename.c_str());
+        shards.push_back(std::move(shard));
+    }
+    std::sort(shards.begin(), shards.end(),
+              [](const unique_ptr<EventCacheReader> &a,
+                 const unique_ptr<EventCacheReader> &b) {
+                  return a->start_position() < b->start_position();
+              });
+
+    OFF_T end = 0;
+    for (const auto &shard : shards) {
+        if (shard->start_position() != end)
+            reporter->errx(1,
+                           _("event cache shards do not fit together: "
+                             "one starts at byte position %llu of the trace "
+                             "instead of %llu"),
+                           (unsigned long long)shard->start_position(),
+                           (unsigned long long)end);
+        end = shard->covered_size();
+    }
+
+    EventCacheWriter writer(filename, source.size(), end, pparams);
+    if (!writer.ok())
+        return false;
+
+    // Each shard's parser started from a guess at the state the
+    // previous shard's ended in. A shard whose guess was wrong is
+    // parsed again, from the right state.
+    TarmacLineParser::SavedState state;
+    for (const auto &shard : shards) {
+        if (same_state(shard->start_state(), state)) {
+            writer.append(*shard);
+            state = shard->end_state();
+        } else {
+            EventRecorder recorder;
+            recorder.writer = &writer;
+            TarmacLineParser parser(pparams, recorder);
+            parser.restore_state(state);
+            parse_lines(parser, &writer, source, shard->start_position(),
+                        shard->covered_size());
+            state = parser.save_state();
+        }
+    }
+    return writer.finish(state);
+}
@@ -27,6 +27,7 @@
 #include <ostream>
 #include <sstream>
 #include <string>
+#include <vector>
 
 using std::exception;
 using std::istream;
@@ -34,6 +35,7 @@ using std::make_shared;
 using std::ostream;
 using std::ostringstream;
 using std::string;
+using std::vector;
 
 struct ParseError : exception {
     string msg;
@@ -81,6 +83,13 @@ struct OperatorExpression : Expression {
         return (lhexpr ? lhexpr->is_constant() : true) &&
                (rhexpr ? rhexpr->is_constant() : true);
     }
+    void collect_registers(vector<RegisterId> &out) const
+    {
+        if (lhexpr)
+            lhexpr->collect_registers(out);
+        if (rhexpr)
+            rhexpr->collect_registers(out);
+    }
 };
 
 struct AddExpression : OperatorExpression {
@@ -114,6 +123,74 @@ struct ShrExpression : OperatorExpression {
         return rhval >= 64 ? 0 : lhval >> rhval;
     }
 };
+struct AndExpression : OperatorExpression {
+    using OperatorExpression::OperatorExpression;
+    const char *opname() const { return "&"; }
+    uint64_t op(uint64_t lhval, uint64_t rhval) { return lhval & rhval; }
+};
+struct XorExpression : OperatorExpression {
+    using OperatorExpression::OperatorExpression;
+    const char *opname() const { return "^"; }
+    uint64_t op(uint64_t lhval, uint64_t rhval) { return lhval ^ rhval; }
+};
+struct OrExpression : OperatorExpression {
+    using OperatorExpression::OperatorExpression;
+    const char *opname() const { return "|"; }
+    uint64_t op(uint64_t lhval, uint64_t rhval) { return lhval | rhval; }
+};
+struct EqExpression : OperatorExpression {
+    using OperatorExpression::OperatorExpression;
+    const char *opname() const { return "=="; }
+    uint64_t op(uint64_t lhval, uint64_t rhval) { return lhval == rhval; }
+};
+struct NeExpression : OperatorExpression {
+    using OperatorExpression::OperatorExpression;
+    const char *opname() const { return "!="; }
+    uint64_t op(uint64_t lhval, uint64_t rhval) { return lhval != rhval; }
+};
+struct LtExpression : OperatorExpression {
+    using OperatorExpression::OperatorExpression;
+    const char *opname() const { return "<"; }
+    uint64_t op(uint64_t lhval, uint64_t rhval) { return lhval < rhval; }
+};
+struct LeExpression : OperatorExpression {
+    using OperatorExpression::OperatorExpression;
+    const char *opname() const { return "<="; }
+    uint64_t op(uint64_t lhval, uint64_t rhval) { return lhval <= rhval; }
+};
+struct GtExpression : OperatorExpression {
+    using OperatorExpression::OperatorExpression;
+    const char *opname() const { return ">"; }
+    uint64_t op(uint64_t lhval, uint64_t rhval) { return lhval > rhval; }
+};
+struct GeExpression : OperatorExpression {
+    using OperatorExpression::OperatorExpression;
+    const char *opname() const { return ">="; }
+    uint64_t op(uint64_t lhval, uint64_t rhval) { return lhval >= rhval; }
+};
+
+// The logical operators don't evaluate their right operand if the
+// left one decides the answer, as in C, so that e.g. 'x0 != 0 &&
+// mem32[x0] == 3' never reads memory at address 0.
+struct LogAndExpression : OperatorExpression {
+    using OperatorExpression::OperatorExpression;
+    const char *opname() const { return "&&"; }
+    uint64_t op(uint64_t lhval, uint64_t rhval) { return lhval && rhval; }
+    uint64_t evaluate(const ExecutionContext &ec)
+    {
+        return lhexpr->evaluate(ec) && rhexpr->evaluate(ec);
+    }
+};
+struct LogOrExpression : OperatorExpression {
+    using OperatorExpression::OperatorExpression;
+    const char *opname() const { return "||"; }
+    uint64_t op(uint64_t lhval, uint64_t rhval) { return lhval || rhval; }
+    uint64_t evaluate(const ExecutionContext &ec)
+    {
+        return lhexpr->evaluate(ec) || rhexpr->evaluate(ec);
+    }
+};
+
 struct NegExpression : OperatorExpression {
     NegExpression(ExprPtr lhexpr_) : OperatorExpression(lhexpr_, nullptr) {}
     const char *opname() const { return "-"; }
@@ -135,6 +212,38 @@ struct RegisterExpression : Expression {
         throw EvaluationError(format(_("register name '{}'"), name));
     }
     virtual void dump(ostream &os) { os << "(register " << name << ")"; }
+    void collect_registers(vector<RegisterId> &out) const
+    {
+        out.push_back(reg);
+    }
+};
+
+struct MemoryExpression : Expression {
+    ExprPtr addrexpr;
+    size_t size;
+    MemoryExpression(ExprPtr addrexpr, size_t size)
+        : addrexpr(addrexpr), size(size)
+    {
+    }
+    uint64_t evaluate(const ExecutionContext &ec)
+    {
+        uint64_t addr = addrexpr->evaluate(ec), toret;
+
+        if (ec.lookup_memory(addr, size, toret))
+            return toret;
+
+        throw EvaluationError(format(_("memory at address {:#x}"), addr));
+    }
+    virtual void dump(ostream &os)
+    {
+        os << "(mem" << size * 8 << " ";
+        addrexpr->dump(os);
+        os << ")";
+    }
+    void collect_registers(vector<RegisterId> &out) const
+    {
+        addrexpr->collect_registers(out);
+    }
 };
 
 enum {
@@ -143,6 +252,12 @@ enum {
     LEFTSHIFT,
     RIGHTSHIFT,
     SCOPE,
+    EQUAL,
+    NOTEQUAL,
+    LESSEQUAL,
+    GREATEREQUAL,
+    LOGAND,
+    LOGOR,
     BADTOKEN,
     TOK_EOF,
 };
@@ -226,8 +341,24 @@ void Lexer::advance()
         return;
     }
 
+    static const struct {
+        char first, second;
+        unsigned token;
+    } two_char_tokens[] = {
+        {'=', '=', EQUAL},      {'!', '=', NOTEQUAL}, {'<', '=', LESSEQUAL},
+        {'>', '=', GREATEREQUAL}, {'&', '&', LOGAND}, {'|', '|', LOGOR},
+    };
+    for (const auto &tc : two_char_tokens) {
+        if (*pos == tc.first && pos + 1 != end && *(pos + 1) == tc.second) {
+            token = tc.token;
+            pos += 2;
+            return;
+        }
+    }
+
     if (*pos == '+' || *pos == '-' || *pos == '*' || *pos == '(' ||
-        *pos == ')') {
+        *pos == ')' || *pos == '[' || *pos == ']' || *pos == '<' ||
+        *pos == '>' || *pos == '&' || *pos == '|' || *pos == '^') {
         token = *pos++;
         return;
     }
@@ -245,10 +376,18 @@ struct Parser {
     ExprPtr parse_unary();
     ExprPtr parse_mul();
     ExprPtr parse_add();
+    ExprPtr parse_shift();
+    ExprPtr parse_relational();
+    ExprPtr parse_equality();
+    ExprPtr parse_bitand();
+    ExprPtr parse_bitxor();
+    ExprPtr parse_bitor();
+    ExprPtr parse_logand();
     ExprPtr parse_expr();
 
     ExprPtr parse_register_name(const string &);
     ExprPtr parse_symbol_name(const string &);
+    ExprPtr parse_memory_access(const string &);
 };
 
 ExprPtr Parser::parse_unary()
@@ -287,6 +426,8 @@ ExprPtr Parser::parse_unary()
                                         id1));
 
             lexer.advance();
+        } else if (lexer.token == '[') {
+            toret = parse_memory_access(id1);
         } else {
             toret = parse_register_name(id1);
             if (!toret)
@@ -337,6 +478,30 @@ ExprPtr Parser::parse_symbol_name(const string &name)
     return nullptr;
 }
 
+// A memory access is written mem8[addr], mem16[addr], mem32[addr] or
+// mem64[addr], reading an integer of that many bits.
+ExprPtr Parser::parse_memory_access(const string &name)
+{
+    size_t size;
+    if (name == "mem8")
+        size = 1;
+    else if (name == "mem16")
+        size = 2;
+    else if (name == "mem32")
+        size = 4;
+    else if (name == "mem64")
+        size = 8;
+    else
+        throw ParseError(format(_("unrecognised memory access '{}'"), name));
+
+    lexer.advance();
+    ExprPtr addr = parse_expr();
+    if (lexer.token != ']')
+        throw ParseError(_("expected closing ']'"));
+    lexer.advance();
+    return ExprPtr(new MemoryExpression(addr, size));
+}
+
 ExprPtr Parser::parse_mul()
 {
     ExprPtr toret = parse_unary();
@@ -370,7 +535,7 @@ ExprPtr Parser::parse_add()
     return toret;
 }
 
-ExprPtr Parser::parse_expr()
+ExprPtr Parser::parse_shift()
 {
     ExprPtr toret = parse_add();
 
@@ -391,6 +556,115 @@ ExprPtr Parser::parse_expr()
     return toret;
 }
 
+ExprPtr Parser::parse_relational()
+{
+    ExprPtr toret = parse_shift();
+
+    while (lexer.token == '<' || lexer.token == '>' ||
+           lexer.token == LESSEQUAL || lexer.token == GREATEREQUAL) {
+        auto op = lexer.token;
+        lexer.advance();
+        ExprPtr rhs = parse_shift();
+        switch (op) {
+        case '<':
+            toret = ExprPtr(new LtExpression(toret, rhs));
+            break;
+        case '>':
+            toret = ExprPtr(new GtExpression(toret, rhs));
+            break;
+        case LESSEQUAL:
+            toret = ExprPtr(new LeExpression(toret, rhs));
+            break;
+        case GREATEREQUAL:
+            toret = ExprPtr(new GeExpression(toret, rhs));
+            break;
+        }
+    }
+
+    return toret;
+}
+
+ExprPtr Parser::parse_equality()
+{
+    ExprPtr toret = parse_relational();
+
+    while (lexer.token == EQUAL || lexer.token == NOTEQUAL) {
+        auto op = lexer.token;
+        lexer.advance();
+        ExprPtr rhs = parse_relational();
+        switch (op) {
+        case EQUAL:
+            toret = ExprPtr(new EqExpression(toret, rhs));
+            break;
+        case NOTEQUAL:
+            toret = ExprPtr(new NeExpression(toret, rhs));
+            break;
+        }
+    }
+
+    return toret;
+}
+
+ExprPtr Parser::parse_bitand()
+{
+    ExprPtr toret = parse_equality();
+
+    while (lexer.token == '&') {
+        lexer.advance();
+        toret = ExprPtr(new AndExpression(toret, parse_equality()));
+    }
+
+    return toret;
+}
+
+ExprPtr Parser::parse_bitxor()
+{
+    ExprPtr toret = parse_bitand();
+
+    while (lexer.token == '^') {
+        lexer.advance();
+        toret = ExprPtr(new XorExpression(toret, parse_bitand()));
+    }
+
+    return toret;
+}
+
+ExprPtr Parser::parse_bitor()
+{
+    ExprPtr toret = parse_bitxor();
+
+    while (lexer.token == '|') {
+        lexer.advance();
+        toret = ExprPtr(new OrExpression(toret, parse_bitxor()));
+    }
+
+    return toret;
+}
+
+ExprPtr Parser::parse_logand()
+{
+    ExprPtr toret = parse_bitor();
+
+    while (lexer.token == LOGAND) {
+        lexer.advance();
+        toret = ExprPtr(new LogAndExpression(toret, parse_bitor()));
+    }
+
+    return toret;
+}
+
+ExprPtr Parser::parse_expr()
+{
+    ExprPtr toret = parse_logand();
+
+    while (lexer.token == LOGOR) {
+        lexer.advance();
+        toret = ExprPtr(new LogOrExpression(toret, parse_logand()));
+    }
+
+    return toret;
+}
+
 ExprPtr parse_expression(const std::string &input, const ParseContext &pc,
                          std::ostream &error)
 {
@@ -408,6 +682,24 @@ ExprPtr parse_expression(const std::string &input, const ParseContext &pc,
     }
 }
 
+ExprPtr simplify_expression(ExprPtr expr)
+{
+    if (!expr)
+        return expr;
+    if (expr->is_constant()) {
+        TrivialExecutionContext ec;
+        return constant_expression(expr->evaluate(ec));
+    }
+    if (auto opexpr = std::dynamic_pointer_cast<OperatorExpression>(expr)) {
+        opexpr->lhexpr = simplify_expression(opexpr->lhexpr);
+        opexpr->rhexpr = simplify_expression(opexpr->rhexpr);
+    } else if (auto memexpr =
+                   std::dynamic_pointer_cast<MemoryExpression>(expr)) {
+        memexpr->addrexpr = simplify_expression(memexpr->addrexpr);
+    }
+    return expr;
+}
+
 bool is_empty_expression(const std::string &input)
 {
     Lexer lexer(input);
@@ -22,12 +22,20 @@
 #include "libtarmac/misc.hh"
 #include "libtarmac/reporter.hh"
 
+#include <algorithm>
+#include <cstdint>
 #include <cstdio>
+#include <set>
 #include <sstream>
 #include <string>
 
+using std::min;
 using std::ostringstream;
+using std::reverse;
+using std::set;
+using std::sort;
 using std::string;
+using std::upper_bound;
 using std::vector;
 
 string Symbol::getName() const
@@ -40,7 +48,7 @@ string Symbol::getName() const
     return name;
 }
 
-static inline bool want_to_index_symbol(string name)
+static inline bool want_to_index_symbol(const string &name)
 {
     // Don't index anonymous symbols.
     if (name.empty())
@@ -74,10 +82,6 @@ void Image::add_symbol(const Symbol &sym_)
     // Ensure we got the address to the symbol now stored
     Symbol &sym = symbols.front();
 
-    // address -> symbol map
-    auto &syms = addrtab[sym.addr];
-    syms.push_back(&sym);
-
     // name -> symbol map
     auto &dups = symtab[sym.name];
     if (dups.size() > 0) {
@@ -159,32 +163,106 @@ void Image::load_symboltable()
     }
 }
 
-const Symbol *Image::find_symbol(Addr address) const
+void Image::build_addr_ranges()
 {
     // Instead of seeing symbols as object with a size, we use them as
     // labels. We give priority to symbols with a size. This should
     // work reasonable well given the assumption that objects don't
     // have much overlap with each other.
+    //
+    // So the symbol for an address is the sized symbol containing it
+    // with the highest start address, or failing that, the symbol
+    // starting nearest below it. Where several symbols start at the
+    // same address, the one that appeared first in the ELF symbol
+    // table wins.
+    //
+    // That answer can only change at the start or end of a symbol,
+    // so we precompute it for each range between two consecutive
+    // such boundaries, by sweeping upwards through the boundaries
+    // keeping track of the set of sized symbols we're inside.
+
+    // 'symbols' is a forward_list built by push_front, so reverse it
+    // to recover the order of the symbol table.
+    vector<const Symbol *> syms;
+    for (const Symbol &sym : symbols)
+        syms.push_back(&sym);
+    reverse(syms.begin(), syms.end());
+
+    // A start or end event for every symbol, sorted by address. A
+    // symbol whose end would wrap past the top of the address space
+    // has no end event.
+    struct Event {
+        Addr addr;
+        size_t index; // into syms
+        bool end;
+    };
+    vector<Event> events;
+    for (size_t i = 0; i < syms.size(); i++) {
+        const Symbol *sym = syms[i];
+        events.push_back({sym->addr, i, false});
+        Addr end = sym->addr + sym->size;
+        if (sym->size != 0 && end > sym->addr)
+            events.push_back({end, i, true});
+    }
+    sort(events.begin(), events.end(),
+         [](const Event &a, const Event &b) { return a.addr < b.addr; });
+
+    // The sized symbols we're currently inside, ordered so that the
+    // winning one comes first: highest start address, then earliest
+    // in the symbol table.
+    auto better = [&](size_t a, size_t b) {
+        return syms[a]->addr != syms[b]->addr ? syms[a]->addr > syms[b]->addr
+                                              : a < b;
+    };
+    set<size_t, decltype(better)> active(better);
+    const Symbol *label = nullptr;
+
+    addr_ranges.clear();
+    for (size_t e = 0; e < events.size();) {
+        Addr addr = events[e].addr;
+        size_t first_here = SIZE_MAX;
+        for (; e < events.size() && events[e].addr == addr; e++) {
+            size_t i = events[e].index;
+            if (events[e].end) {
+                active.erase(i);
+            } else {
+                if (syms[i]->size != 0)
+                    active.insert(i);
+                first_here = min(first_here, i);
+            }
+        }
+        if (first_here != SIZE_MAX)
+            label = syms[first_here];
 
-    const Symbol *backup_sym = nullptr;
-    auto it = addrtab.upper_bound(address);
+        const Symbol *sym = active.empty() ? label : syms[*active.begin()];
+        if (addr_ranges.empty() || addr_ranges.back().sym != sym)
+            addr_ranges.push_back({addr, sym});
+    }
+}
+
+void Image::load_symbols() const
+{
+    // The symbol tables are logically part of the constant image, just
+    // not filled in until they're wanted.
+    std::call_once(symbols_loaded, [this]() {
+        Image *mutable_this = const_cast<Image *>(this);
+        mutable_this->load_symboltable();
+        mutable_this->build_addr_ranges();
+    });
+}
+
+const Symbol *Image::find_symbol(Addr address) const
+{
+    load_symbols();
+    auto it = upper_bound(
+        addr_ranges.begin(), addr_ranges.end(), address,
+        [](Addr addr, const AddrRange &range) { return addr < range.start; });
 
     // 'address' is before all symbols
-    if (it == addrtab.begin())
+    if (it == addr_ranges.begin())
         return nullptr;
 
-    // find the first symbol that contains or starts before 'address'
-    for (--it; it != addrtab.begin(); --it) {
-        const vector<const Symbol *> &syms = it->second;
-
-        for (const Symbol *sym : syms) {
-            if (sym->size != 0 && address - sym->addr < sym->size)
-                return sym;
-            if (!backup_sym)
-                backup_sym = sym;
-        }
-    }
-    return backup_sym;
+    return (it - 1)->sym;
 }
 
 const Symbol *Image::find_symbol(const string &name) const
@@ -204,6 +282,21 @@ const Symbol *Image::find_symbol(const string &name) const
     return find_symbol(name, index);
 }
 
+vector<const Symbol *>
+Image::find_all_symbols_starting_with(const string &name) const
+{
+    load_symbols();
+
+    // symtab is sorted by name, so all the names with this prefix
+    // are together, starting at the first one not less than it.
+    vector<const Symbol *> res;
+    for (auto it = symtab.lower_bound(name);
+         it != symtab.end() && it->first.compare(0, name.size(), name) == 0;
+         ++it)
+        res.insert(res.end(), it->second.begin(), it->second.end());
+    return res;
+}
+
 const Symbol *Image::find_symbol(const string &name, int index) const
 {
     const vector<const Symbol *> *res = find_all_symbols(name);
@@ -247,13 +340,13 @@ Image::Image(const string &image_filename) : image_filename(image_filename)
         reporter->errx(1, _("Cannot open ELF file \"%s\""),
                        image_filename.c_str());
     load_headers();
-    load_symboltable();
 }
 
 Image::~Image() {}
 
 void Image::dump()
 {
+    load_symbols();
     printf(_("Image '%s':\n"), image_filename.c_str());
     for (const auto &sym : symbols) {
         std::string name = sym.getName();
@@ -17,6 +17,7 @@
  */
 
 #include "libtarmac/index.hh"
+#include "libtarmac/eventcache.hh"
 #include "libtarmac/intl.hh"
 #include "libtarmac/misc.hh"
 #include "libtarmac/parser.hh"
@@ -24,25 +25,32 @@
 #include "libtarmac/reporter.hh"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <exception>
 #include <functional>
+#include <future>
 #include <iostream>
 #include <memory>
 #include <set>
 #include <sstream>
+#include <thread>
 #include <vector>
 
+using std::atomic;
 using std::cout;
 using std::dec;
+using std::deque;
 using std::endl;
 using std::exception;
+using std::future;
 using std::hex;
-using std::ifstream;
 using std::ios;
 using std::make_pair;
 using std::make_shared;
@@ -56,6 +64,7 @@ using std::ref;
 using std::set;
 using std::shared_ptr;
 using std::showbase;
+using std::sort;
 using std::streampos;
 using std::string;
 using std::unique_ptr;
@@ -65,33 +74,526 @@ using std::vector;
 // branching for the branch to _not_ be considered a potential function call.
 static constexpr unsigned long long BRANCH_LR_WRITE_THRESHOLD = 8;
 
+// Upper limit on the number of calls we'll keep waiting for a return
+// at once. Any more than this, and the ones deepest in the stack are
+// forgotten.
+static constexpr size_t MAX_PENDING_CALLS = 1 << 16;
+
 struct PendingCall {
     unsigned long long sp, pc;
-    unsigned call_line;
+    LineNo call_line;
+    PendingCall() = default;
     PendingCall(unsigned long long sp, unsigned long long pc,
-                unsigned call_line = 0)
+                LineNo call_line = 0)
         : sp(sp), pc(pc), call_line(call_line)
     {
     }
+};
+
+// The calls not yet matched up with a return, in an open-addressing
+// hash table keyed on (sp, return address).
+//
+// A call whose sp is below the current stack pointer can never be
+// matched, so evict_below() throws those away whenever the stack
+// pointer rises past the lowest one. min_sp is a lower bound on the
+// sp of every entry, so that the common case, in which nothing needs
+// evicting, doesn't have to look at the table at all.
+class PendingCallTable {
+    vector<PendingCall> slots;
+    vector<unsigned char> used;
+    vector<PendingCall> scratch;
+    size_t count = 0;
+    unsigned long long min_sp = ULLONG_MAX;
+
+    size_t home(unsigned long long sp, unsigned long long pc) const
+    {
+        unsigned long long h = sp * 0x9E3779B97F4A7C15ULL ^ pc;
+        h ^= h >> 29;
+        h *= 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 32;
+        return h & (slots.size() - 1);
+    }
+
+    size_t probe(unsigned long long sp, unsigned long long pc) const
+    {
+        size_t mask = slots.size() - 1;
+        size_t i = home(sp, pc);
+        while (used[i] && (slots[i].sp != sp || slots[i].pc != pc))
+            i = (i + 1) & mask;
+        return i;
+    }
+
+    // Empty the table, resize it to hold 'n' entries at no more than
+    // half load, and put back the entries in 'scratch'.
+    void rebuild(size_t n)
+    {
+        size_t size = 64;
+        while (size < 2 * n)
+            size *= 2;
+        slots.assign(size, PendingCall());
+        used.assign(size, 0);
+        count = 0;
+        min_sp = ULLONG_MAX;
+        for (const PendingCall &pc : scratch)
+            insert(pc);
+        scratch.clear();
+    }
+
+  public:
+    PendingCallTable() { rebuild(0); }
+
+    size_t size() const { return count; }
+
+    PendingCall *find(unsigned long long sp, unsigned long long pc)
+    {
+        size_t i = probe(sp, pc);
+        return used[i] ? &slots[i] : nullptr;
+    }
+
+    // Add a call, unless one with the same key is already waiting.
+    void insert(const PendingCall &call)
+    {
+        if (count >= MAX_PENDING_CALLS) {
+            // Forget the deepest quarter of the calls, which are the
+            // least likely ever to return.
+            for_each([&](const PendingCall &pc) { scratch.push_back(pc); });
+            size_t keep = count - count / 4;
+            std::nth_element(scratch.begin(), scratch.end() - keep,
+                             scratch.end(),
+                             [](const PendingCall &a, const PendingCall &b) {
+                                 return a.sp < b.sp;
+                             });
+            scratch.erase(scratch.begin(), scratch.end() - keep);
+            rebuild(keep);
+        } else if (2 * (count + 1) > slots.size()) {
+            for_each([&](const PendingCall &pc) { scratch.push_back(pc); });
+            rebuild(count + 1);
+        }
+
+        size_t i = probe(call.sp, call.pc);
+        if (used[i])
+            return;
+        slots[i] = call;
+        used[i] = 1;
+        count++;
+        min_sp = min(min_sp, call.sp);
+    }
+
+    // Remove an entry returned by find(), by moving later entries of
+    // its probe sequence back into the gap, so that the table never
+    // needs tombstones.
+    void erase(PendingCall *call)
+    {
+        size_t mask = slots.size() - 1;
+        size_t i = call - slots.data(), j = i;
+        while (true) {
+            j = (j + 1) & mask;
+            if (!used[j])
+                break;
+            size_t k = home(slots[j].sp, slots[j].pc);
+            if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                continue; // slots[j] can't move back as far as i
+            slots[i] = slots[j];
+            i = j;
+        }
+        used[i] = 0;
+        count--;
+    }
+
+    // Discard every entry whose sp is below 'sp'.
+    void evict_below(unsigned long long sp)
+    {
+        if (sp <= min_sp)
+            return;
+        for_each([&](const PendingCall &pc) {
+            if (pc.sp >= sp)
+                scratch.push_back(pc);
+        });
+        rebuild(scratch.size());
+    }
 
-    bool operator<(const PendingCall &rhs) const
+    template <typename F> void for_each(F f) const
     {
-        return (sp != rhs.sp ? sp < rhs.sp
-                             : pc != rhs.pc ? pc < rhs.pc : false);
+        for (size_t i = 0; i < slots.size(); i++)
+            if (used[i])
+                f(slots[i]);
     }
 };
 
+// A line identified as a call or a return. These are logged in the
+// order they're found, and only sorted by line once the whole trace
+// has been read, so each one is packed into a single word, with the
+// direction in the low bit.
 struct CallReturn {
-    unsigned line;
-    int direction; // +1 = call, -1 = return
-    CallReturn(unsigned line, int direction) : line(line), direction(direction)
+    LineNo packed;
+    CallReturn(LineNo line, int direction)
+        : packed(line << 1 | (direction > 0 ? 1 : 0))
+    {
+    }
+
+    LineNo line() const { return packed >> 1; }
+    int direction() const { return (packed & 1) ? +1 : -1; } // +1 = call
+
+    bool operator<(const CallReturn &rhs) const { return line() < rhs.line(); }
+};
+
+// Parameters of the parallel parsing mode, in which the trace file is
+// cut into chunks at line boundaries, and each chunk is parsed on a
+// worker thread while the main thread feeds the resulting events into
+// the index in their original order.
+//
+// We want many more chunks than threads, so that the workers can stay
+// ahead of the main thread, but not such large chunks that buffering
+// their parsed events costs a lot of memory.
+static constexpr OFF_T PARALLEL_CHUNK_MIN_SIZE = 16384;
+static constexpr OFF_T PARALLEL_CHUNK_MAX_SIZE = 16 << 20;
+static constexpr unsigned PARALLEL_CHUNKS_PER_THREAD = 8;
+
+// Before parsing its own chunk, each worker parses and discards the
+// last part of the previous chunk, so that its parser's inter-line
+// state (last timestamp, LD/ST continuation) is very likely to match
+// what a serial parser would have had at the chunk boundary. If it
+// doesn't match after all, the chunk is re-parsed serially.
+static constexpr OFF_T PARALLEL_CHUNK_WARMUP_SIZE = 4096;
+
+// Number of slots in the table of recently written memory contents
+// blocks that identical writes can share. A power of 2.
+static constexpr size_t RECENT_CONTENTS_TABLE_SIZE = 65536;
+
+// How far behind the line being indexed the text of a compressed trace
+// is kept in memory.
+static constexpr OFF_T TRACE_DISCARD_MARGIN = 1024 * 1024;
+
+// Least amount by which the index file must grow between one look at
+// what can be written back under IndexerParams::memory_budget and the
+// next. Otherwise it's a sixteenth of the budget.
+static constexpr OFF_T WRITE_BEHIND_MIN_STEP = 1024 * 1024;
+
+// Parameters of the pipelined mode, in which one thread reads ahead
+// through the trace file a block at a time, faulting its pages into
+// memory, and a second parses each block once it's been read, while
+// the main thread feeds the parsed events into the index. The rings
+// connecting the stages hold this many blocks, which bounds how far
+// each stage can get ahead of the next.
+static constexpr OFF_T PIPELINE_BLOCK_SIZE = 1 << 20;
+static constexpr size_t PIPELINE_RING_SIZE = 8;
+
+// Bounded single-producer, single-consumer queue connecting two
+// stages of the pipeline. Each side only writes its own end's index,
+// so no lock is needed. A side that finds the queue full (or empty)
+// yields until it isn't, or until 'abandon' is set, in which case it
+// returns false.
+template <typename T, size_t N> class SPSCRing {
+    T slots[N];
+    atomic<size_t> head{0}, tail{0}; // next slot to pop, and to push
+
+  public:
+    bool push(T item, const atomic<bool> &abandon)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        while (t - head.load(std::memory_order_acquire) == N) {
+            if (abandon)
+                return false;
+            std::this_thread::yield();
+        }
+        slots[t % N] = std::move(item);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item, const atomic<bool> &abandon)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        while (tail.load(std::memory_order_acquire) == h) {
+            if (abandon)
+                return false;
+            std::this_thread::yield();
+        }
+        item = std::move(slots[h % N]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+// The output of parsing one chunk of the trace file, recorded so that
+// it can be replayed later into the Index.
+struct ParsedChunk : ParseReceiver {
+    enum class Item : unsigned char {
+        Instruction,
+        Register,
+        Memory,
+        TextOnly,
+        Exception,
+        Warning,
+    };
+
+    struct Line {
+        size_t len;       // size of the line in the file, not counting \n
+        size_t items_end; // index in 'items' just after this line's last
+        bool error;       // true if parsing this line threw an error
+    };
+
+    OFF_T start, end;
+    bool last_line_unterminated = false;
+    vector<Line> lines;
+
+    // Events from all lines, in order, with one entry in 'items' for
+    // each, saying which of the vectors below to take it from.
+    // 'messages' contains the text of each Warning item, and also the
+    // error message for each line with 'error' set.
+    vector<Item> items;
+    vector<InstructionEvent> insn_events;
+    vector<RegisterEvent> reg_events;
+    vector<MemoryEvent> mem_events;
+    vector<TextOnlyEvent> text_events;
+    vector<ExceptionEvent> exc_events;
+    vector<string> messages;
+
+    // 'start_state' holds a copy of the parser's inter-line state as of
+    // the start of this chunk. 'parser' is the one that actually did
+    // the parsing, so after it finishes, it holds the state after the
+    // last line.
+    TarmacLineParser start_state, parser;
+    bool recording = false;
+
+    ParsedChunk(const ParseParams &pparams)
+        : start_state(pparams, *this), parser(pparams, *this)
+    {
+    }
+
+    void got_event(InstructionEvent &ev) override
+    {
+        if (recording) {
+            items.push_back(Item::Instruction);
+            insn_events.push_back(ev);
+        }
+    }
+    void got_event(RegisterEvent &ev) override
+    {
+        if (recording) {
+            items.push_back(Item::Register);
+            reg_events.push_back(ev);
+        }
+    }
+    void got_event(MemoryEvent &ev) override
+    {
+        if (recording) {
+            items.push_back(Item::Memory);
+            mem_events.push_back(ev);
+        }
+    }
+    void got_event(TextOnlyEvent &ev) override
+    {
+        if (recording) {
+            items.push_back(Item::TextOnly);
+            text_events.push_back(ev);
+        }
+    }
+    void got_event(ExceptionEvent &ev) override
+    {
+        if (recording) {
+            items.push_back(Item::Exception);
+            exc_events.push_back(ev);
+        }
+    }
+    bool parse_warning(const string &msg) override
     {
+        if (recording) {
+            items.push_back(Item::Warning);
+            messages.push_back(msg);
+        }
+        return false;
+    }
+};
+
+// Parse the lines of a chunk, recording their events, starting from
+// whatever state chunk.parser is already in.
+static void parse_chunk_lines(ParsedChunk &chunk, const TraceSource &source,
+                              const atomic<bool> &abandon)
+{
+    chunk.recording = true;
+
+    TraceLineReader reader(source, chunk.start);
+    StringSpan line;
+    bool terminated;
+    while (reader.position() < chunk.end && reader.get_line(line, terminated)) {
+        if (abandon)
+            break;
+
+        ParsedChunk::Line rec;
+        rec.len = line.size;
+        rec.error = false;
+        try {
+            chunk.parser.parse(line.data, line.size);
+        } catch (TarmacParseError e) {
+            chunk.messages.push_back(e.msg);
+            rec.error = true;
+        }
+        rec.items_end = chunk.items.size();
+        chunk.lines.push_back(rec);
+        chunk.last_line_unterminated = !terminated;
+    }
+}
+
+// Worker-thread function for parallel parsing: parse the part of the
+// trace file between 'start' and 'end', which must both be at the
+// start of a line (or end of file).
+static unique_ptr<ParsedChunk> parse_trace_chunk(const TraceSource &source,
+                                                 const ParseParams &pparams,
+                                                 OFF_T start, OFF_T end,
+                                                 const atomic<bool> &abandon)
+{
+    auto chunk = make_unique<ParsedChunk>(pparams);
+    chunk->start = start;
+    chunk->end = end;
+
+    // Run the parser over the complete lines in the warmup section,
+    // discarding everything it says.
+    OFF_T pos = source.next_line_start(start > PARALLEL_CHUNK_WARMUP_SIZE
+                                           ? start - PARALLEL_CHUNK_WARMUP_SIZE
+                                           : 0);
+    TraceLineReader reader(source, pos);
+    StringSpan line;
+    bool terminated;
+    while (reader.position() < start && reader.get_line(line, terminated)) {
+        try {
+            chunk->parser.parse(line.data, line.size);
+        } catch (TarmacParseError) {
+        }
+    }
+
+    chunk->start_state.copy_state_from(chunk->parser);
+    parse_chunk_lines(*chunk, source, abandon);
+    return chunk;
+}
+
+// First stage of the pipelined mode: read through the trace file from
+// 'start' to 'end' a block at a time, touching every page of it so
+// that the parser won't have to wait for the disk, and pass on the
+// position of the end of each block, which is always the start of a
+// line.
+static void pipeline_read(const TraceSource &source, OFF_T start, OFF_T end,
+                          SPSCRing<OFF_T, PIPELINE_RING_SIZE> &out,
+                          const atomic<bool> &abandon)
+{
+    for (OFF_T pos = start; pos < end;) {
+        OFF_T next = end;
+        if (pos + PIPELINE_BLOCK_SIZE < end)
+            next = source.next_line_start(pos + PIPELINE_BLOCK_SIZE);
+
+        StringSpan block = source.span(pos, next - pos);
+        volatile char sink;
+        for (size_t i = 0; i < block.size; i += 4096)
+            sink = block.data[i];
+        (void)sink;
+
+        if (!out.push(next, abandon))
+            return;
+        pos = next;
+    }
+}
+
+// Second stage of the pipelined mode: parse each block once the
+// reader has finished with it, and pass on the results. 'chunk' is
+// set up for the first block, with its parser in the state to start
+// from, and each later one starts from the state the one before it
+// finished in.
+static void pipeline_parse(const TraceSource &source,
+                           const ParseParams &pparams,
+                           unique_ptr<ParsedChunk> chunk, OFF_T end,
+                           SPSCRing<OFF_T, PIPELINE_RING_SIZE> &in,
+                           SPSCRing<unique_ptr<ParsedChunk>,
+                                    PIPELINE_RING_SIZE> &out,
+                           const atomic<bool> &abandon)
+{
+    for (OFF_T pos = chunk->start; pos < end;) {
+        OFF_T next;
+        if (!in.pop(next, abandon))
+            return;
+
+        chunk->start = pos;
+        chunk->end = next;
+        chunk->start_state.copy_state_from(chunk->parser);
+        parse_chunk_lines(*chunk, source, abandon);
+
+        auto following = make_unique<ParsedChunk>(pparams);
+        following->parser.copy_state_from(chunk->parser);
+        if (!out.push(std::move(chunk), abandon))
+            return;
+        chunk = std::move(following);
+        pos = next;
     }
+}
 
-    bool operator<(const CallReturn &rhs) const
+// Statistics about an indexing run, collected if
+// IndexerDiagnostics::show_stats is set.
+struct IndexStats {
+    // Parts of the indexing run that are timed separately, and whose
+    // use of space in the index is measured separately. All but the
+    // last few happen during reading of the trace file, and any time
+    // or space used while reading that isn't accounted for by one of
+    // them is reported as 'other'.
+    enum Phase {
+        MemoryUpdates,
+        MemoryReads,
+        SeqTreeUpdates,
+        ByPCTreeUpdates,
+        WriteTreeUpdates,
+        MemoryCheckpoints,
+        ResumeState,
+        WriteBehind,
+        CallDepths,
+        Relayout,
+        NumPhases,
+        FirstPhaseAfterReading = CallDepths
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    double seconds[NumPhases] = {};
+    unsigned long long bytes[NumPhases] = {};
+    double read_seconds = 0;
+    unsigned long long read_bytes = 0;
+    unsigned long long trace_lines = 0, trace_bytes = 0;
+    unsigned long long cached_lines = 0;
+
+    unsigned long long instruction_events = 0, register_events = 0;
+    unsigned long long memory_write_events = 0, memory_read_events = 0;
+    unsigned long long text_only_events = 0, exception_events = 0;
+    unsigned long long contents_blocks = 0, shared_contents_blocks = 0;
+
+    static double since(Clock::time_point start)
     {
-        return (line != rhs.line ? line < rhs.line : false);
+        return std::chrono::duration<double>(Clock::now() - start).count();
     }
+
+    // Scoped object that adds the time and index space used during
+    // its lifetime to one phase's totals. Does nothing if 'stats' is
+    // null, so it can be left in place when statistics aren't wanted.
+    class Timer {
+        IndexStats *stats;
+        Phase phase;
+        const Arena &arena;
+        Clock::time_point start;
+        OFF_T start_offset;
+
+      public:
+        Timer(IndexStats *stats, Phase phase, const Arena &arena)
+            : stats(stats), phase(phase), arena(arena)
+        {
+            if (stats) {
+                start = Clock::now();
+                start_offset = arena.curr_offset();
+            }
+        }
+        ~Timer()
+        {
+            if (stats) {
+                stats->seconds[phase] += since(start);
+                stats->bytes[phase] += arena.curr_offset() - start_offset;
+            }
+        }
+    };
 };
 
 class Index : ParseReceiver {
@@ -109,26 +611,97 @@ class Index : ParseReceiver {
     Time current_time;
     bool seen_instruction_at_current_time;
     bool seen_cpu_exception_at_current_line;
-    set<PendingCall> pending_calls;
-    set<CallReturn> found_callrets;
+    unsigned node_memory_reads, node_memory_writes, node_cpu_exceptions;
+    PendingCallTable pending_calls;
+    vector<CallReturn> found_callrets;
     bool aarch64_used;
     ISet last_iset;
     unsigned curr_iflags;
     size_t max_sve_bits;
+    set<string> reported_warnings;
 
     void delete_from_memtree(char type, Addr addr, size_t size);
 
     // Used during parsing (shared between parse_tarmac_line and
     // got_event):
     TarmacLineParser parser;
-    unique_ptr<ifstream> ifs;
-    size_t lineno, true_lineno, lineno_offset, prev_lineno;
+    unique_ptr<TraceSource> source;
+    unique_ptr<TraceLineReader> line_reader; // always reading 'source'
+    LineNo lineno, true_lineno, lineno_offset, prev_lineno;
     bool seen_any_event;
     streampos linepos, oldpos;
-    AVLDisk<ByPCPayload> *bypctree;
-    OFF_T header_offset, bypcroot;
+    AVLDisk<ByPCPayload, ByPCAnnotation> *bypctree;
+    AVLDisk<WritePayload, WriteAnnotation> *writetree;
+    OFF_T header_offset, bypcroot, writeroot;
+
+    // Used for saving and reloading a ResumeState. resume_pos is the
+    // position in the trace file at which the state will be saved.
+    OFF_T resume_pos, resume_state_offset;
+
+    // Set if IndexerParams::stop_request (or stop_after_lines) made us
+    // stop before the end of the trace file.
+    bool stopped_early;
+
+    bool stop_requested() const
+    {
+        return (iparams.stop_request && iparams.stop_request->load()) ||
+               (iparams.stop_after_lines &&
+                true_lineno > iparams.stop_after_lines);
+    }
 
-    unsigned char *make_memtree_update(char type, Addr addr, size_t size);
+    // Used for making memory checkpoints.
+    unsigned nodes_since_checkpoint;
+    unsigned long long checkpoint_bytes, last_checkpoint_size;
+
+    // Set while an event cache is being written alongside the index.
+    unique_ptr<EventCacheWriter> event_cache_writer;
+
+    // Used for keeping to IndexerParams::memory_budget. Everything
+    // below 'released' has been dropped from memory (though some of it
+    // may have been touched again since), and write_behind is next due
+    // when the file reaches next_write_behind.
+    OFF_T released, next_write_behind;
+    void write_behind();
+
+    // Used during parallel or pipelined parsing, to manage the worker
+    // threads.
+    deque<future<unique_ptr<ParsedChunk>>> parse_workers;
+    vector<future<void>> pipeline_stages;
+    atomic<bool> abandon_parse_workers;
+
+    // Null unless IndexerDiagnostics::show_stats is set.
+    unique_ptr<IndexStats> stats;
+    void report_stats();
+
+    void make_memtree_update(char type, Addr addr, const unsigned char *data,
+                             size_t size);
+
+    // Raw memory contents blocks allocated recently, so that a write
+    // of the same bytes as one of them (memset-style zeroing, say, or
+    // spilling a register that holds the same value as last time) can
+    // share its block instead of allocating another. Blocks are never
+    // modified once written, so sharing them is safe. The table is
+    // direct-mapped by a hash of the contents, so its size is fixed,
+    // and a new block just displaces whichever one hashed to the same
+    // slot.
+    struct ContentsBlock {
+        OFF_T offset;
+        size_t size;
+    };
+    vector<ContentsBlock> recent_contents;
+    OFF_T store_contents(const unsigned char *data, size_t size);
+
+    // A run of memory writes to consecutive addresses in the current
+    // seqtree node, in address order, not yet put in the memtree. A
+    // wide store (e.g. SVE, or DC ZVA) arrives as many MemoryEvents of
+    // at most 8 bytes each, and collecting them here lets it go into
+    // the memtree as one range, with one search of the tree to remove
+    // what it overwrites instead of one for every event.
+    Addr pending_write_addr;
+    vector<unsigned char> pending_write_bytes;
+    void add_pending_write(Addr addr, size_t size, unsigned long long contents);
+    void flush_pending_write();
+    void record_write(char type, Addr addr, size_t size);
 
     inline const RegisterId &REG_sp()
     {
@@ -146,8 +719,15 @@ class Index : ParseReceiver {
           expected_next_pc(KNOWN_INVALID_PC),
           expected_next_lr(KNOWN_INVALID_PC), arena(nullptr), memtree(nullptr),
           memsubtree(nullptr), seqtree(nullptr), aarch64_used(false),
-          last_iset(ARM), parser(pparams, *this)
+          last_iset(ARM), parser(pparams, *this), bypctree(nullptr),
+          writetree(nullptr), resume_state_offset(0),
+          stopped_early(false), nodes_since_checkpoint(0), checkpoint_bytes(0),
+          last_checkpoint_size(0), released(0), next_write_behind(0),
+          abandon_parse_workers(false),
+          recent_contents(RECENT_CONTENTS_TABLE_SIZE, ContentsBlock{0, 0})
     {
+        if (idiags.show_stats)
+            stats = make_unique<IndexStats>();
     }
 
     ~Index()
@@ -160,12 +740,15 @@ class Index : ParseReceiver {
             delete seqtree;
         if (bypctree)
             delete bypctree;
+        if (writetree)
+            delete writetree;
     }
 
-    void got_event_common(TarmacEvent *event, bool is_instruction);
+    void got_event_common(const TarmacEvent *event, bool is_instruction);
     bool parse_warning(const string &msg);
     TarmacEvent *parse_tarmac_line(string line);
     void parse_tarmac_file();
+    void extend_tarmac_file();
     OFF_T make_sub_memtree(char type, Addr addr, size_t size);
     void update_memtree(char type, Addr addr, size_t size,
                         unsigned long long contents);
@@ -180,18 +763,47 @@ class Index : ParseReceiver {
     void update_pc(unsigned long long pc, unsigned long long next_pc,
                    ISet iset);
     void update_iflags(unsigned iflags);
+    void make_memory_checkpoint();
     bool is_bigendian() const { return pparams.bigend; }
-    void got_event(RegisterEvent &ev);
+    void got_event_view(const RegisterEventView &ev);
     void got_event(MemoryEvent &ev);
-    void got_event(InstructionEvent &ev);
-    void got_event(TextOnlyEvent &ev);
+    void got_event_view(const InstructionEventView &ev);
+    void got_event_view(const TextOnlyEventView &ev);
     void got_event(ExceptionEvent &ev);
 
+    // Events replayed from a ParsedChunk are complete objects, but the
+    // index has no need to keep any of their contents.
+    void got_event(RegisterEvent &ev) { got_event_view(ev); }
+    void got_event(InstructionEvent &ev) { got_event_view(ev); }
+    void got_event(TextOnlyEvent &ev) { got_event_view(ev); }
+
+    MMapGrowthParams growth_params() const;
+    void make_trees();
     void open_index_file();
     void open_trace_file();
+    void reopen_index_file();
+    void reopen_trace_file();
+    void save_resume_state();
+    void load_resume_state();
+    void read_trace_file();
     bool read_one_trace_line();
+    bool next_trace_line(StringSpan &line, bool &terminated);
+    void end_trace_line(size_t len);
+    bool handle_parse_error(const string &msg, bool partial_last_line);
+    void indexing_failed(LineNo line, const string &msg);
     void finish_reading_trace_file();
+
+    void read_trace_file_in_parallel();
+    void read_trace_file_pipelined();
+    void open_event_cache();
+    void read_event_cache(EventCacheReader &cache);
+    void finish_event_cache();
+    bool replay_parsed_chunk(ParsedChunk &chunk);
+    bool reparse_chunk(ParsedChunk &chunk);
+    void stop_parse_workers();
+    void sort_callrets();
     void build_call_tree();
+    void relayout_trees();
     void finalise_index();
 };
 
@@ -199,16 +811,8 @@ void Index::update_sp(unsigned long long sp)
 {
     curr_sp = sp;
 
-    if (iparams.record_calls) {
-        for (auto it = pending_calls.begin(); it != pending_calls.end();) {
-            if (it->sp >= sp)
-                break;
-
-            auto to_erase = it;
-            ++it;
-            pending_calls.erase(to_erase);
-        }
-    }
+    if (iparams.record_calls)
+        pending_calls.evict_below(sp);
 }
 
 void Index::update_pc(unsigned long long pc, unsigned long long next_pc,
@@ -236,8 +840,8 @@ void Index::update_pc(unsigned long long pc, unsigned long long next_pc,
                 << "transfer of control @ " << prev_lineno << ", sp=" << hex
                 << sp << ", pc=" << pc << dec << endl;
 
-        auto it = pending_calls.find(PendingCall(sp, pc));
-        if (it != pending_calls.end()) {
+        PendingCall *it = pending_calls.find(sp, pc);
+        if (it) {
 
             if (idiags.debug_call_heuristics)
                 idiags.diag() << "  looks like return for call @ "
@@ -254,8 +858,8 @@ void Index::update_pc(unsigned long long pc, unsigned long long next_pc,
             // exactly the instructions that are not in the
             // (apparent) sequential execution path of the caller.
 
-            found_callrets.insert(CallReturn(it->call_line, +1));
-            found_callrets.insert(CallReturn(prev_lineno, -1));
+            found_callrets.push_back(CallReturn(it->call_line, +1));
+            found_callrets.push_back(CallReturn(prev_lineno, -1));
             pending_calls.erase(it);
         } else if (expected_next_lr != KNOWN_INVALID_PC &&
                    read_memtree_reg(REG_lr(), &lr) &&
@@ -295,9 +899,13 @@ static inline bool reg_update_overwrites_reg(Addr offset, size_t size,
     return !(offset + size <= regoffset) && !(regoffset + regsize <= offset);
 }
 
-void Index::got_event(RegisterEvent &ev)
+void Index::got_event_view(const RegisterEventView &ev)
 {
     got_event_common(&ev, false);
+    if (event_cache_writer)
+        event_cache_writer->record(ev);
+    if (stats)
+        stats->register_events++;
 
     RegisterId reg = ev.reg;
 
@@ -312,9 +920,13 @@ void Index::got_event(RegisterEvent &ev)
         reg.prefix = RegPrefix::d;
     }
     auto offset = reg_offset(reg, curr_iflags) + ev.offset;
-    auto size = ev.bytes.size();
-    unsigned char *p = make_memtree_update('r', offset, size);
-    memcpy(p, ev.bytes.data(), size);
+    auto size = ev.nbytes;
+    {
+        IndexStats::Timer timer(stats.get(), IndexStats::MemoryUpdates,
+                                *arena);
+        make_memtree_update('r', offset, ev.bytes, size);
+    }
+    record_write('r', offset, size);
 
     if (reg_update_overwrites_reg(offset, size, REG_sp(), curr_iflags)) {
         unsigned long long new_sp_value;
@@ -341,22 +953,35 @@ void Index::got_event(RegisterEvent &ev)
 void Index::got_event(MemoryEvent &ev)
 {
     got_event_common(&ev, false);
+    if (event_cache_writer)
+        event_cache_writer->record(ev);
+    if (stats)
+        (ev.read ? stats->memory_read_events : stats->memory_write_events)++;
+    (ev.read ? node_memory_reads : node_memory_writes)++;
 
     if (!ev.read) {
-        if (ev.known)
-            update_memtree('m', ev.addr, ev.size, ev.contents);
-        else
+        IndexStats::Timer timer(stats.get(), IndexStats::MemoryUpdates,
+                                *arena);
+        if (ev.known) {
+            add_pending_write(ev.addr, ev.size, ev.contents);
+        } else {
             make_sub_memtree('m', ev.addr, ev.size);
+        }
     } else {
+        IndexStats::Timer timer(stats.get(), IndexStats::MemoryReads, *arena);
         if (ev.known)
             update_memtree_from_read('m', ev.addr, ev.size, ev.contents);
         // if (read && !known), nothing we can do at all!
     }
 }
 
-void Index::got_event(InstructionEvent &ev)
+void Index::got_event_view(const InstructionEventView &ev)
 {
     got_event_common(&ev, true);
+    if (event_cache_writer)
+        event_cache_writer->record(ev);
+    if (stats)
+        stats->instruction_events++;
 
     if (insns_since_lr_update < BRANCH_LR_WRITE_THRESHOLD)
         insns_since_lr_update++;
@@ -454,16 +1079,32 @@ void Index::got_event(InstructionEvent &ev)
     update_pc(adjusted_pc, adjusted_pc + ev.width / 8, ev.iset);
 }
 
-void Index::got_event(TextOnlyEvent &ev) { got_event_common(&ev, false); }
+void Index::got_event_view(const TextOnlyEventView &ev)
+{
+    got_event_common(&ev, false);
+    if (event_cache_writer)
+        event_cache_writer->record(ev);
+    if (stats)
+        stats->text_only_events++;
+}
 
 void Index::got_event(ExceptionEvent &ev)
 {
     got_event_common(&ev, false);
+    if (event_cache_writer)
+        event_cache_writer->record(ev);
+    if (stats)
+        stats->exception_events++;
+    node_cpu_exceptions++;
 
     if (!seen_cpu_exception_at_current_line) {
+        IndexStats::Timer timer(stats.get(), IndexStats::ByPCTreeUpdates,
+                                *arena);
         ByPCPayload bypcp;
         bypcp.trace_file_firstline = prev_lineno;
         bypcp.pc = CPU_EXCEPTION_PC;
+        bypcp.mod_time = current_time;
+        bypcp.trace_file_pos = oldpos;
         bypcroot = bypctree->insert(bypcroot, bypcp);
         seen_cpu_exception_at_current_line = true;
     }
@@ -498,9 +1139,74 @@ void Index::delete_from_memtree(char type, Addr addr, size_t size)
     }
 }
 
-unsigned char *Index::make_memtree_update(char type, Addr addr, size_t size)
+void Index::add_pending_write(Addr addr, size_t size,
+                              unsigned long long contents)
+{
+    unsigned char data[8];
+    for (size_t i = 0; i < size; i++)
+        data[i] = contents >> (8 * (pparams.bigend ? size - 1 - i : i));
+
+    if (!pending_write_bytes.empty()) {
+        Addr end = pending_write_addr + pending_write_bytes.size();
+        if (addr == end) {
+            pending_write_bytes.insert(pending_write_bytes.end(), data,
+                                       data + size);
+            return;
+        }
+        if (addr + size == pending_write_addr) {
+            pending_write_bytes.insert(pending_write_bytes.begin(), data,
+                                       data + size);
+            pending_write_addr = addr;
+            return;
+        }
+        flush_pending_write();
+    }
+
+    pending_write_addr = addr;
+    pending_write_bytes.assign(data, data + size);
+}
+
+void Index::flush_pending_write()
+{
+    if (pending_write_bytes.empty())
+        return;
+
+    Addr addr = pending_write_addr;
+    size_t size = pending_write_bytes.size();
+    if (iparams.record_memory)
+        make_memtree_update('m', addr, pending_write_bytes.data(), size);
+    record_write('m', addr, size);
+    pending_write_bytes.clear();
+}
+
+OFF_T Index::store_contents(const unsigned char *data, size_t size)
+{
+    // FNV-1a, which is quick for the few bytes most writes have.
+    uint64_t hash = 0xcbf29ce484222325ULL ^ size;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+
+    ContentsBlock &slot =
+        recent_contents[hash & (RECENT_CONTENTS_TABLE_SIZE - 1)];
+    if (size && slot.size == size &&
+        !memcmp(arena->getptr<unsigned char>(slot.offset), data, size)) {
+        if (stats)
+            stats->shared_contents_blocks++;
+        return slot.offset;
+    }
+
+    OFF_T offset = arena->alloc(size, ArenaPool::MemContents);
+    memcpy(arena->getptr<unsigned char>(offset), data, size);
+    slot = {offset, size};
+    if (stats)
+        stats->contents_blocks++;
+    return offset;
+}
+
+void Index::make_memtree_update(char type, Addr addr, const unsigned char *data,
+                                size_t size)
 {
-    OFF_T contents_offset = arena->alloc(size);
+    OFF_T contents_offset = store_contents(data, size);
 
     delete_from_memtree(type, addr, size);
 
@@ -512,8 +1218,6 @@ unsigned char *Index::make_memtree_update(char type, Addr addr, size_t size)
     memp.contents = contents_offset;
     memp.trace_file_firstline = prev_lineno;
     memroot = memtree->insert(memroot, memp);
-
-    return arena->getptr<unsigned char>(contents_offset);
 }
 
 void Index::update_memtree(char type, Addr addr, size_t size,
@@ -522,14 +1226,16 @@ void Index::update_memtree(char type, Addr addr, size_t size,
     if (type == 'm' && !iparams.record_memory)
         return;
 
-    unsigned char *contents_ptr = make_memtree_update(type, addr, size);
+    unsigned char data[sizeof(contents)];
+    assert(size <= sizeof(data));
     if (type == 'm' && pparams.bigend) {
         for (size_t i = 0; i < size; i++)
-            contents_ptr[i] = contents >> (8 * (size - 1 - i));
+            data[i] = contents >> (8 * (size - 1 - i));
     } else {
         for (size_t i = 0; i < size; i++)
-            contents_ptr[i] = contents >> (8 * i);
+            data[i] = contents >> (8 * i);
     }
+    make_memtree_update(type, addr, data, size);
 }
 
 void Index::update_memtree_if_necessary(char type, Addr addr, size_t size,
@@ -553,7 +1259,10 @@ void Index::update_memtree_if_necessary(char type, Addr addr, size_t size,
 
 OFF_T Index::make_sub_memtree(char type, Addr addr, size_t size)
 {
-    OFF_T newroot_offset = arena->alloc(sizeof(diskint<OFF_T>));
+    flush_pending_write();
+
+    OFF_T newroot_offset =
+        arena->alloc(sizeof(diskint<OFF_T>), ArenaPool::MemSubTree);
     *arena->getptr<diskint<OFF_T>>(newroot_offset) = 0;
 
     delete_from_memtree(type, addr, size);
@@ -567,15 +1276,49 @@ OFF_T Index::make_sub_memtree(char type, Addr addr, size_t size)
     memp.trace_file_firstline = prev_lineno;
     memroot = memtree->insert(memroot, memp);
 
+    // The initial sub-memtree covering all of memory (see
+    // open_trace_file) isn't a write.
+    if (size)
+        record_write(type, addr, size);
+
     return newroot_offset;
 }
 
+void Index::record_write(char type, Addr addr, size_t size)
+{
+    if (!iparams.record_writes)
+        return;
+
+    IndexStats::Timer timer(stats.get(), IndexStats::WriteTreeUpdates, *arena);
+    WritePayload wp;
+    wp.type = type;
+    wp.lo = addr;
+    wp.hi = addr + (size - 1);
+    wp.trace_file_firstline = prev_lineno;
+    wp.mod_time = current_time;
+    wp.trace_file_pos = oldpos;
+
+    // The same seqtree node can write to the same address more than
+    // once (say, a register and then a smaller one aliasing it), but
+    // the tree can only hold one entry per address and line, so such
+    // writes are merged.
+    WritePayload old;
+    if (writetree->find(writeroot, wp, &old, nullptr)) {
+        if (old.hi >= wp.hi)
+            return;
+        writeroot = writetree->remove(writeroot, wp, nullptr, nullptr);
+    }
+    writeroot = writetree->insert(writeroot, wp);
+}
+
 void Index::update_memtree_from_read(char type, Addr addr, size_t size,
                                      unsigned long long contents)
 {
     if (type == 'm' && !iparams.record_memory)
         return;
 
+    flush_pending_write();
+
     auto data_ptr = make_unique<unsigned char[]>(size);
     unsigned char *data = data_ptr.get();
     if (pparams.bigend) {
@@ -632,15 +1375,12 @@ void Index::update_memtree_from_read(char type, Addr addr, size_t size,
                     MemorySubPayload msp_insert;
                     msp_insert.lo = msp.lo;
                     msp_insert.hi = msp_found.lo - 1;
-                    OFF_T contents_offset =
-                        arena->alloc(msp_insert.hi - msp_insert.lo + 1);
-                    // Take account of alloc() perhaps having
+                    msp_insert.contents =
+                        store_contents(data + (msp.lo - addr),
+                                       msp_insert.hi - msp_insert.lo + 1);
+                    // Take account of store_contents() perhaps having
                     // re-mmapped the file
                     subroot = arena->getptr<diskint<OFF_T>>(memp.contents);
-                    memcpy(arena->getptr<unsigned char>(contents_offset),
-                           data + (msp.lo - addr),
-                           msp_insert.hi - msp_insert.lo + 1);
-                    msp_insert.contents = contents_offset;
 
                     OFF_T new_subroot_value =
                         memsubtree->insert(*subroot, msp_insert);
@@ -736,23 +1476,58 @@ bool Index::read_memtree_reg(const RegisterId &reg, unsigned long long *output)
                               output);
 }
 
+void Index::make_memory_checkpoint()
+{
+    IndexStats::Timer timer(stats.get(), IndexStats::MemoryCheckpoints,
+                            *arena);
+    nodes_since_checkpoint = 0;
+
+    // Assume the next checkpoint will be about the same size as the
+    // last, so as not to go over the budget.
+    if (iparams.memory_checkpoint_budget &&
+        checkpoint_bytes + last_checkpoint_size >
+            iparams.memory_checkpoint_budget)
+        return;
+
+    OFF_T start = arena->pool_offset(ArenaPool::MemTree);
+
+    // Copy the raw memory contents along with each node. Sub-memtrees
+    // are not copied, because they're not immutable: each one is
+    // shared between every memory tree that has that same node, and
+    // is updated whenever a read shows what was in the memory it
+    // describes.
+    memroot = memtree->copy_in_veb_order(
+        memroot, [this](MemoryPayload &memp, MemoryAnnotation &) {
+            if (!memp.raw)
+                return;
+            size_t size = memp.hi - memp.lo + 1;
+            OFF_T contents = arena->alloc(size, ArenaPool::MemTree);
+            memcpy(arena->getptr<char>(contents),
+                   arena->getptr<char>(memp.contents), size);
+            memp.contents = contents;
+        });
+
+    last_checkpoint_size = arena->pool_offset(ArenaPool::MemTree) - start;
+    checkpoint_bytes += last_checkpoint_size;
+}
+
 class CallDepthCountingTreeWalker {
     int curr_depth;
-    const set<CallReturn> &callrets;
-    set<CallReturn>::const_iterator it;
+    const vector<CallReturn> &callrets;
+    vector<CallReturn>::const_iterator it;
 
   public:
-    CallDepthCountingTreeWalker(const set<CallReturn> &callrets)
+    // 'callrets' must be sorted, as by Index::sort_callrets().
+    CallDepthCountingTreeWalker(const vector<CallReturn> &callrets)
         : curr_depth(0), callrets(callrets), it(callrets.begin())
     {
     }
     CallDepthCountingTreeWalker(const CallDepthCountingTreeWalker &) = delete;
 
-    void operator()(SeqOrderPayload &main, SeqOrderAnnotation &, OFF_T,
-                    SeqOrderAnnotation *, OFF_T, SeqOrderAnnotation *, OFF_T)
+    void operator()(SeqOrderPayload &main)
     {
-        if (it != callrets.end() && it->line == main.trace_file_firstline) {
-            curr_depth += it->direction;
+        if (it != callrets.end() && it->line() == main.trace_file_firstline) {
+            curr_depth += it->direction();
             ++it;
         }
         main.call_depth = curr_depth;
@@ -762,6 +1537,24 @@ class CallDepthCountingTreeWalker {
 class CallDepthArrayTreeWalker {
     Arena *arena;
 
+    // The arrays of the node being visited and its two children,
+    // decoded from whichever format they are stored in. Kept here so
+    // that their storage is reused from one node to the next.
+    vector<CallDepthArrayEntry> arrays[3];
+    vector<CallDepthArrayEntry> new_array;
+
+    void decode(vector<CallDepthArrayEntry> &out,
+                const SeqOrderAnnotation *annot)
+    {
+        out.clear();
+        if (!annot)
+            return;
+        const void *array = arena->getptr<char>(annot->call_depth_array);
+        for (unsigned i = 0, e = annot->call_depth_arraylen; i < e; i++)
+            out.push_back(get_call_depth_entry(
+                array, annot->call_depth_array_wide, i));
+    }
+
   public:
     CallDepthArrayTreeWalker(Arena *arena) : arena(arena) {}
     CallDepthArrayTreeWalker(const CallDepthArrayTreeWalker &) = delete;
@@ -770,122 +1563,89 @@ class CallDepthArrayTreeWalker {
                     OFF_T, SeqOrderAnnotation *lc, OFF_T,
                     SeqOrderAnnotation *rc, OFF_T)
     {
-        CallDepthArrayEntry current_node_array[2];
-        CallDepthArrayEntry *arrays[3];
-        int len[3], index[3];
+        size_t index[3];
         enum { ROOT, LC, RC, NARRAYS };
 
         // Fake up a tiny CallDepthArray describing the node we're
         // currently visiting, and also including a sentinel node
         // giving the total subtree size.
-        current_node_array[0].call_depth = mainpayload.call_depth;
-        current_node_array[0].cumulative_lines = 0;
-        current_node_array[0].cumulative_insns = 0;
-        current_node_array[1].call_depth = SENTINEL_DEPTH;
-        current_node_array[1].cumulative_lines = mainpayload.trace_file_lines;
-        current_node_array[1].cumulative_insns = 1;
-        arrays[ROOT] = current_node_array;
-        len[ROOT] = 2;
-
-        // Set up to iterate over the CallDepthArrays for the left and
-        // right subtrees, if present.
-        if (lc) {
-            arrays[LC] =
-                arena->getptr<CallDepthArrayEntry>(lc->call_depth_array);
-            len[LC] = lc->call_depth_arraylen;
-        } else {
-            arrays[LC] = nullptr;
-            len[LC] = 0;
-        }
-        if (rc) {
-            arrays[RC] =
-                arena->getptr<CallDepthArrayEntry>(rc->call_depth_array);
-            len[RC] = rc->call_depth_arraylen;
-        } else {
-            arrays[RC] = nullptr;
-            len[RC] = 0;
-        }
-
-        // Do a preliminary merge pass over our collection of arrays
-        // to figure out how big the new node's array will have to be,
-        // by counting up the number of distinct call depths
-        // represented in it.
-        unsigned new_arraylen = 0;
-        for (int i = 0; i < NARRAYS; i++)
-            index[i] = 0;
-        while (true) {
-            unsigned next_depth = UINT_MAX;
-            for (int i = 0; i < NARRAYS; i++)
-                if (index[i] < len[i])
-                    next_depth = min(next_depth,
-                                     (unsigned)arrays[i][index[i]].call_depth);
-            if (next_depth == UINT_MAX)
-                break; // all arrays finished
-
-            new_arraylen++;
-
-            for (int i = 0; i < NARRAYS; i++)
-                if (index[i] < len[i] &&
-                    next_depth == arrays[i][index[i]].call_depth)
-                    index[i]++;
-        }
-
-        main.call_depth_array =
-            arena->alloc(new_arraylen * sizeof(CallDepthArrayEntry));
-        CallDepthArrayEntry *new_array =
-            arena->getptr<CallDepthArrayEntry>(main.call_depth_array);
-        main.call_depth_arraylen = new_arraylen;
-
-        // Reinitialise arrays[], since it contains pointers into the
-        // memory-mapped file which might have been invalidated by the
-        // above call to arena->alloc.
-        if (lc)
-            arrays[LC] =
-                arena->getptr<CallDepthArrayEntry>(lc->call_depth_array);
-        if (rc)
-            arrays[RC] =
-                arena->getptr<CallDepthArrayEntry>(rc->call_depth_array);
-
-        // Now do a second merge pass over the same arrays actually
-        // populating the new array.
-        unsigned new_arraypos = 0;
-        unsigned clines = 0, cinsns = 0;
+        arrays[ROOT].resize(2);
+        arrays[ROOT][0].call_depth = mainpayload.call_depth;
+        arrays[ROOT][0].cumulative_lines = 0;
+        arrays[ROOT][0].cumulative_insns = 0;
+        arrays[ROOT][1].call_depth = SENTINEL_DEPTH;
+        arrays[ROOT][1].cumulative_lines = mainpayload.trace_file_lines;
+        arrays[ROOT][1].cumulative_insns = 1;
+
+        // Decode the CallDepthArrays for the left and right subtrees,
+        // if present.
+        decode(arrays[LC], lc);
+        decode(arrays[RC], rc);
+
+        // Merge the arrays, making one entry in the new array for
+        // each distinct call depth represented in any of them.
+        new_array.clear();
+        LineNo clines = 0, cinsns = 0;
         for (int i = 0; i < NARRAYS; i++)
             index[i] = 0;
         while (true) {
             unsigned next_depth = UINT_MAX;
             for (int i = 0; i < NARRAYS; i++)
-                if (index[i] < len[i])
-                    next_depth = min(next_depth,
-                                     (unsigned)arrays[i][index[i]].call_depth);
+                if (index[i] < arrays[i].size())
+                    next_depth =
+                        min(next_depth, arrays[i][index[i]].call_depth);
             if (next_depth == UINT_MAX)
                 break; // all arrays finished
 
-            assert(new_arraypos < new_arraylen);
-            new_array[new_arraypos].call_depth = next_depth;
-            new_array[new_arraypos].cumulative_lines = clines;
-            new_array[new_arraypos].cumulative_insns = cinsns;
-            new_array[new_arraypos].leftlink = index[LC];
-            new_array[new_arraypos].rightlink = index[RC];
-            new_arraypos++;
-
-            for (int i = 0; i < NARRAYS; i++)
-                if (index[i] < len[i] &&
-                    next_depth == arrays[i][index[i]].call_depth) {
-                    if (index[i] + 1 < len[i]) {
-                        clines += (arrays[i][index[i] + 1].cumulative_lines -
-                                   arrays[i][index[i]].cumulative_lines);
-                        cinsns += (arrays[i][index[i] + 1].cumulative_insns -
-                                   arrays[i][index[i]].cumulative_insns);
+            CallDepthArrayEntry ent;
+            ent.call_depth = next_depth;
+            ent.cumulative_lines = clines;
+            ent.cumulative_insns = cinsns;
+            ent.leftlink = index[LC];
+            ent.rightlink = index[RC];
+            new_array.push_back(ent);
+
+            for (int i = 0; i < NARRAYS; i++) {
+                const vector<CallDepthArrayEntry> &a = arrays[i];
+                if (index[i] < a.size() &&
+                    next_depth == a[index[i]].call_depth) {
+                    if (index[i] + 1 < a.size()) {
+                        clines += (a[index[i] + 1].cumulative_lines -
+                                   a[index[i]].cumulative_lines);
+                        cinsns += (a[index[i] + 1].cumulative_insns -
+                                   a[index[i]].cumulative_insns);
                     }
                     index[i]++;
                 }
+            }
         }
-        assert(new_arraypos == new_arraylen);
+
+        // The sentinel entry at the end has the largest counts, so it
+        // decides which format the whole array needs.
+        bool wide = call_depth_array_needs_wide(new_array.back());
+        size_t size = new_array.size() * call_depth_array_entry_size(wide);
+
+        // If this node already has an array, it must be one written
+        // by a previous run of this walker over an index that has
+        // since been extended. Reuse its space if it's big enough, so
+        // that repeatedly extending an index doesn't keep growing the
+        // file.
+        size_t old_size =
+            main.call_depth_arraylen *
+            call_depth_array_entry_size(main.call_depth_array_wide);
+        if (!main.call_depth_array || old_size < size)
+            main.call_depth_array =
+                arena->alloc(size, ArenaPool::CallDepthArray);
+        main.call_depth_arraylen = new_array.size();
+        main.call_depth_array_wide = wide;
+
+        void *array = arena->getptr<char>(main.call_depth_array);
+        for (size_t i = 0; i < new_array.size(); i++)
+            set_call_depth_entry(array, wide, i, new_array[i]);
     }
 };
 
-void Index::got_event_common(TarmacEvent *event, bool is_instruction)
+void Index::got_event_common(const TarmacEvent *event, bool is_instruction)
 {
     /*
      * Tarmac files have been known to include chronological disorder,
@@ -905,7 +1665,24 @@ void Index::got_event_common(TarmacEvent *event, bool is_instruction)
 
     if (!event || ev_time != current_time ||
         (seen_instruction_at_current_time && is_instruction)) {
+        {
+            IndexStats::Timer timer(stats.get(), IndexStats::MemoryUpdates,
+                                    *arena);
+            flush_pending_write();
+        }
+
         if (seen_any_event && linepos != oldpos) {
+            // A node's length in bytes and lines are stored in 32
+            // bits. A single timestamp's worth of trace that doesn't
+            // fit can't be split into several nodes without breaking
+            // lookups by time, so give up rather than truncate it.
+            if (linepos - oldpos > UINT_MAX || lineno - prev_lineno > UINT_MAX)
+                indexing_failed(prev_lineno + lineno_offset,
+                                _("trace events with the same timestamp span "
+                                  "more than 2^32 bytes or lines of the trace "
+                                  "file, which is more than one index node "
+                                  "can hold"));
+
             SeqOrderPayload seqp;
             seqp.mod_time = current_time;
             seqp.pc = curr_pc;
@@ -915,14 +1692,29 @@ void Index::got_event_common(TarmacEvent *event, bool is_instruction)
             seqp.trace_file_lines = lineno - prev_lineno;
             seqp.memory_root = memroot;
             seqp.call_depth = 0; // fill this in later
-            seqroot = seqtree->insert(seqroot, seqp);
+            seqp.memory_reads = node_memory_reads;
+            seqp.memory_writes = node_memory_writes;
+            seqp.cpu_exceptions = node_cpu_exceptions;
+            {
+                IndexStats::Timer timer(stats.get(),
+                                        IndexStats::SeqTreeUpdates, *arena);
+                seqroot = seqtree->insert(seqroot, seqp);
+            }
 
             if (curr_pc != KNOWN_INVALID_PC) {
+                IndexStats::Timer timer(stats.get(),
+                                        IndexStats::ByPCTreeUpdates, *arena);
                 ByPCPayload bypcp;
                 bypcp.trace_file_firstline = prev_lineno;
                 bypcp.pc = curr_pc & ~(unsigned long long)1;
+                bypcp.mod_time = current_time;
+                bypcp.trace_file_pos = oldpos;
                 bypcroot = bypctree->insert(bypcroot, bypcp);
             }
+
+            if (iparams.memory_checkpoint_interval &&
+                ++nodes_since_checkpoint >= iparams.memory_checkpoint_interval)
+                make_memory_checkpoint();
         }
 
         last_memroot = memroot;
@@ -942,6 +1734,7 @@ void Index::got_event_common(TarmacEvent *event, bool is_instruction)
         prev_lineno = lineno;
         seen_any_event = true;
         seen_cpu_exception_at_current_line = false;
+        node_memory_reads = node_memory_writes = node_cpu_exceptions = 0;
     }
 
     if (is_instruction)
@@ -950,18 +1743,53 @@ void Index::got_event_common(TarmacEvent *event, bool is_instruction)
 
 bool Index::parse_warning(const string &msg)
 {
+    if (event_cache_writer)
+        event_cache_writer->record_warning(msg);
+
+    // In parallel parsing mode, each worker's parser keeps its own
+    // record of what it has already warned about, so the same warning
+    // can arrive here more than once.
+    if (!reported_warnings.insert(msg).second)
+        return false;
+
     reporter->indexing_warning(trace.tarmac_filename, lineno + lineno_offset,
                                msg);
     return false;
 }
 
+MMapGrowthParams Index::growth_params() const
+{
+    MMapGrowthParams growth;
+    growth.granularity = iparams.growth_granularity;
+    growth.preallocate = iparams.preallocate;
+    return growth;
+}
+
+void Index::make_trees()
+{
+    memtree = new AVLDisk<MemoryPayload, MemoryAnnotation>(
+        *arena, false, ArenaPool::MemTree);
+    memsubtree = new AVLDisk<MemorySubPayload>(*arena, false,
+                                               ArenaPool::MemSubTree);
+    seqtree = new AVLDisk<SeqOrderPayload, SeqOrderAnnotation>(
+        *arena, false, ArenaPool::SeqTree);
+    bypctree = new AVLDisk<ByPCPayload, ByPCAnnotation>(*arena, false,
+                                                        ArenaPool::ByPCTree);
+    writetree = new AVLDisk<WritePayload, WriteAnnotation>(
+        *arena, false, ArenaPool::WriteTree);
+}
+
 void Index::open_index_file()
 {
     if (trace.index_on_disk) {
         remove(trace.index_filename.c_str());
-        arena = make_shared<MMapFile>(trace.index_filename, true);
+        arena = make_shared<MMapFile>(trace.index_filename, true,
+                                      growth_params());
     } else {
         arena = trace.memory_index;
+        // The indexer writes all over an in-memory arena, and it can
+        // be large, so a smaller page table helps.
+        arena->advise(AccessPattern::HugePages);
     }
 
     MagicNumber &magic = *arena->newptr<MagicNumber>();
@@ -969,13 +1797,11 @@ void Index::open_index_file()
     header_offset = arena->alloc(sizeof(FileHeader));
     FileHeader &hdr = *arena->getptr<FileHeader>(header_offset);
     hdr.flags = 0;        // ensure FLAG_COMPLETE is not initially set
+    hdr.resume_state = 0;
 
     magic.setup();
 
-    memtree = new AVLDisk<MemoryPayload, MemoryAnnotation>(*arena);
-    memsubtree = new AVLDisk<MemorySubPayload>(*arena);
-    seqtree = new AVLDisk<SeqOrderPayload, SeqOrderAnnotation>(*arena);
-    bypctree = new AVLDisk<ByPCPayload>(*arena);
+    make_trees();
 }
 
 void Index::open_trace_file()
@@ -983,10 +1809,8 @@ void Index::open_trace_file()
     /*
      * Read in the input.
      */
-    ifs = make_unique<ifstream>(trace.tarmac_filename.c_str(),
-                                std::ios_base::in | std::ios_base::binary);
-    if (ifs->fail())
-        reporter->err(1, "%s: open", trace.tarmac_filename.c_str());
+    line_reader = nullptr;
+    source = make_unique<TraceSource>(trace.tarmac_filename);
 
     memroot = seqroot = 0;
     prev_lineno = 0; // used to fill in last-mod time in make_sub_memtree
@@ -1003,90 +1827,724 @@ void Index::open_trace_file()
     current_time = -(Time)1;
     seen_instruction_at_current_time = false;
     seen_cpu_exception_at_current_line = false;
-    bypcroot = 0;
+    node_memory_reads = node_memory_writes = node_cpu_exceptions = 0;
+    bypcroot = writeroot = 0;
     true_lineno = 0;
     lineno = 1;
-    oldpos = 0;
+    linepos = oldpos = 0;
     lineno_offset = 0;
     seen_any_event = false;
     prev_lineno = lineno;
     curr_pc = KNOWN_INVALID_PC;
     max_sve_bits = 128;
+    resume_pos = source->complete_lines_end();
 
-    ifs->seekg(0, ios::end);
-    reporter->indexing_start(ifs->tellg());
-    ifs->seekg(0);
+    reporter->indexing_start(source->size());
 }
 
-bool Index::read_one_trace_line()
+void Index::reopen_index_file()
 {
-    true_lineno++;
-    if (seen_any_event)
-        lineno++;
-
-    if (ifs->eof()) {
-        // If getline() above returned a truncated line, then it
-        // will have set the fail flag on the stream, which will
-        // have made ifs->tellg return -1. So clear the error flags,
-        // find out the final file position, and leave this loop
-        // before trying to read anything else.
-        ifs->clear();
-        linepos = ifs->tellg();
-        finish_reading_trace_file();
-        return false;
-    }
-
-    string line;
-    if (!getline(*ifs, line)) {
-        finish_reading_trace_file();
-        return false;
-    }
+    arena = make_shared<MMapFile>(trace.index_filename, true, growth_params());
 
-    try {
-        parser.parse(line);
-    } catch (TarmacParseError e) {
-        if (ifs->eof()) {
-            ostringstream oss;
-            oss << e.msg << endl
-                << _("ignoring parse error on partial last line "
-                     "(trace truncated?)");
-            reporter->indexing_warning(trace.tarmac_filename, lineno,
-                                       oss.str());
-            finish_reading_trace_file();
-            return false;
-        } else {
-            if (trace.index_on_disk)
-                remove(trace.index_filename.c_str());
-            reporter->indexing_error(trace.tarmac_filename, lineno, e.msg);
-        }
-    }
+    MagicNumber &magic = *arena->getptr<MagicNumber>(0);
+    header_offset = sizeof(MagicNumber);
+    FileHeader &hdr = *arena->getptr<FileHeader>(header_offset);
+    if (!magic.check() || !(hdr.flags & FLAG_COMPLETE) ||
+        (hdr.flags & FLAG_PARTIAL) || !hdr.resume_state)
+        reporter->errx(1, _("index file %s cannot be extended"),
+                       trace.index_filename.c_str());
+
+    // Keep the same optional parts of the index that it already had.
+    iparams.record_memory = !(hdr.flags & FLAG_NO_MEMORY);
+    iparams.record_calls = !(hdr.flags & FLAG_NO_CALLS);
+    iparams.record_writes = (hdr.flags & FLAG_WRITES);
+    iparams.resumable = true;
+    resume_state_offset = hdr.resume_state;
+
+    // The index isn't usable while we're partway through extending it.
+    hdr.flags = hdr.flags & ~FLAG_COMPLETE;
+
+    // Constructing the trees now sets their high-water marks to the
+    // current end of the file, so that they won't modify any node
+    // belonging to the existing index.
+    make_trees();
+}
 
-    // Maintain linepos ourselves, rather than calling ifs->tellg() numerous
-    // times. tellg() is a somehow slow function on some platforms, and this
-    // alone allows a 2x speedup in parsing time.
-    linepos += line.size() + 1;
-    reporter->indexing_progress(linepos);
+void Index::reopen_trace_file()
+{
+    line_reader = nullptr;
+    source = make_unique<TraceSource>(trace.tarmac_filename);
+    load_resume_state();
+    resume_pos = source->complete_lines_end();
 
-    return true;
+    reporter->indexing_start(source->size());
 }
 
-void Index::finish_reading_trace_file()
+// Checksum some of the trace file before 'pos', namely the first and
+// last few Kb, so that when extending an index we can check (cheaply,
+// if not infallibly) that the trace file has only been appended to.
+static unsigned long long trace_prefix_checksum(const TraceSource &source,
+                                                OFF_T pos)
 {
-    if (!ifs)
-        return;
-
-    reporter->indexing_done();
+    constexpr OFF_T window = 4096;
+
+    // 64-bit FNV-1a
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    auto add = [&hash](StringSpan span) {
+        for (size_t i = 0; i < span.size; i++) {
+            hash ^= (unsigned char)span.data[i];
+            hash *= 0x100000001b3ULL;
+        }
+    };
 
-    // Call got_event with no actual event, signalling end-of-file, so
-    // that the last record is output (the same flushing of
-    // accumulated data we'd do on seeing the next instruction, except
-    // that then we stop without processing an instruction).
-    got_event_common(nullptr, false);
+    OFF_T tail = max(min(pos, window), pos - window);
+    add(source.span(0, min(pos, window)));
+    add(source.span(tail, pos - tail));
+    return hash;
+}
 
-    ifs = nullptr;
+static bool resume_state_matches_trace(const ResumeState &rs,
+                                       const TraceSource &source)
+{
+    OFF_T pos = rs.trace_file_pos;
+    return pos <= source.size() &&
+           trace_prefix_checksum(source, pos) == rs.trace_file_checksum;
 }
 
-void Index::build_call_tree()
+void Index::save_resume_state()
+{
+    IndexStats::Timer timer(stats.get(), IndexStats::ResumeState, *arena);
+
+    flush_pending_write();
+
+    // Make sure nothing reachable from the tree roots we're about to
+    // save is modified in place by the rest of the indexing run.
+    memtree->commit();
+    memsubtree->commit();
+    seqtree->commit();
+    bypctree->commit();
+
+    // If we're extending an index, overwrite its existing ResumeState
+    // and reuse its arrays if they're big enough.
+    if (!resume_state_offset) {
+        resume_state_offset = arena->alloc(sizeof(ResumeState));
+        *arena->getptr<ResumeState>(resume_state_offset) = ResumeState();
+    }
+
+    OFF_T pending_array, callret_array;
+    unsigned pending_space, callret_space;
+    {
+        ResumeState &rs = *arena->getptr<ResumeState>(resume_state_offset);
+        pending_array = rs.pending_calls;
+        pending_space = rs.pending_calls_space;
+        callret_array = rs.callrets;
+        callret_space = rs.callrets_space;
+    }
+
+    sort_callrets();
+    unsigned n_pending = pending_calls.size();
+    unsigned n_callrets = found_callrets.size();
+    if (n_pending > pending_space) {
+        pending_space = n_pending + n_pending / 2;
+        pending_array =
+            arena->alloc(pending_space * sizeof(ResumePendingCall));
+    }
+    if (n_callrets > callret_space) {
+        callret_space = n_callrets + n_callrets / 2;
+        callret_array =
+            arena->alloc(callret_space * sizeof(ResumeCallReturn));
+    }
+
+    // Only look up pointers into the arena after all the allocation,
+    // since that might have moved it.
+    ResumeState &rs = *arena->getptr<ResumeState>(resume_state_offset);
+
+    if (n_pending) {
+        ResumePendingCall *out =
+            arena->getptr<ResumePendingCall>(pending_array);
+        pending_calls.for_each([&](const PendingCall &pc) {
+            out->sp = pc.sp;
+            out->pc = pc.pc;
+            out->call_line = pc.call_line;
+            out++;
+        });
+    }
+    if (n_callrets) {
+        ResumeCallReturn *out =
+            arena->getptr<ResumeCallReturn>(callret_array);
+        for (const CallReturn &cr : found_callrets) {
+            out->line = cr.line();
+            out->direction = cr.direction();
+            out++;
+        }
+    }
+    rs.pending_calls = pending_array;
+    rs.pending_calls_space = pending_space;
+    rs.n_pending_calls = n_pending;
+    rs.callrets = callret_array;
+    rs.callrets_space = callret_space;
+    rs.n_callrets = n_callrets;
+
+    rs.trace_file_pos = resume_pos;
+    rs.trace_file_checksum = trace_prefix_checksum(*source, resume_pos);
+
+    rs.memroot = memroot;
+    rs.last_memroot = last_memroot;
+    rs.seqroot = seqroot;
+    rs.bypcroot = bypcroot;
+    rs.writeroot = writeroot;
+
+    rs.lineno = lineno;
+    rs.true_lineno = true_lineno;
+    rs.prev_lineno = prev_lineno;
+    rs.lineno_offset = lineno_offset;
+    rs.oldpos = oldpos;
+
+    rs.current_time = current_time;
+    rs.last_sp = last_sp;
+    rs.curr_sp = curr_sp;
+    rs.curr_pc = curr_pc;
+    rs.insns_since_lr_update = insns_since_lr_update;
+    rs.expected_next_pc = expected_next_pc;
+    rs.expected_next_lr = expected_next_lr;
+    rs.curr_iflags = curr_iflags;
+    rs.last_iset = last_iset;
+    rs.max_sve_bits = max_sve_bits;
+
+    rs.nodes_since_checkpoint = nodes_since_checkpoint;
+    rs.checkpoint_bytes = checkpoint_bytes;
+    rs.last_checkpoint_size = last_checkpoint_size;
+
+    rs.node_memory_reads = node_memory_reads;
+    rs.node_memory_writes = node_memory_writes;
+    rs.node_cpu_exceptions = node_cpu_exceptions;
+
+    unsigned flags = 0;
+    if (seen_any_event)
+        flags |= RESUME_FLAG_SEEN_ANY_EVENT;
+    if (seen_instruction_at_current_time)
+        flags |= RESUME_FLAG_SEEN_INSTRUCTION;
+    if (seen_cpu_exception_at_current_line)
+        flags |= RESUME_FLAG_SEEN_CPU_EXCEPTION;
+    if (aarch64_used)
+        flags |= RESUME_FLAG_AARCH64_USED;
+    rs.flags = flags;
+
+    TarmacLineParser::SavedState pstate = parser.save_state();
+    rs.parser_timestamp = pstate.timestamp;
+    rs.parser_post_event_type_start = pstate.post_event_type_start;
+    memset(rs.parser_continued_event_type, 0,
+           sizeof(rs.parser_continued_event_type));
+    memcpy(rs.parser_continued_event_type, pstate.continued_event_type.data(),
+           min(pstate.continued_event_type.size(),
+               sizeof(rs.parser_continued_event_type)));
+}
+
+void Index::load_resume_state()
+{
+    const ResumeState &rs = *arena->getptr<ResumeState>(resume_state_offset);
+    if (!resume_state_matches_trace(rs, *source))
+        reporter->errx(1, _("trace file %s has changed other than by having "
+                            "data appended to it"),
+                       trace.tarmac_filename.c_str());
+
+    if (unsigned n = rs.n_pending_calls) {
+        const ResumePendingCall *in =
+            arena->getptr<ResumePendingCall>(rs.pending_calls);
+        for (; n > 0; n--, in++)
+            pending_calls.insert(PendingCall(in->sp, in->pc, in->call_line));
+    }
+    if (unsigned n = rs.n_callrets) {
+        const ResumeCallReturn *in =
+            arena->getptr<ResumeCallReturn>(rs.callrets);
+        for (; n > 0; n--, in++)
+            found_callrets.push_back(CallReturn(in->line, in->direction));
+    }
+
+    linepos = (OFF_T)rs.trace_file_pos;
+
+    memroot = rs.memroot;
+    last_memroot = rs.last_memroot;
+    seqroot = rs.seqroot;
+    bypcroot = rs.bypcroot;
+    writeroot = rs.writeroot;
+
+    lineno = rs.lineno;
+    true_lineno = rs.true_lineno;
+    prev_lineno = rs.prev_lineno;
+    lineno_offset = rs.lineno_offset;
+    oldpos = (OFF_T)rs.oldpos;
+
+    current_time = rs.current_time;
+    last_sp = rs.last_sp;
+    curr_sp = rs.curr_sp;
+    curr_pc = rs.curr_pc;
+    insns_since_lr_update = rs.insns_since_lr_update;
+    expected_next_pc = rs.expected_next_pc;
+    expected_next_lr = rs.expected_next_lr;
+    curr_iflags = rs.curr_iflags;
+    last_iset = (ISet)(unsigned)rs.last_iset;
+    max_sve_bits = rs.max_sve_bits;
+
+    nodes_since_checkpoint = rs.nodes_since_checkpoint;
+    checkpoint_bytes = rs.checkpoint_bytes;
+    last_checkpoint_size = rs.last_checkpoint_size;
+
+    node_memory_reads = rs.node_memory_reads;
+    node_memory_writes = rs.node_memory_writes;
+    node_cpu_exceptions = rs.node_cpu_exceptions;
+
+    unsigned flags = rs.flags;
+    seen_any_event = (flags & RESUME_FLAG_SEEN_ANY_EVENT);
+    seen_instruction_at_current_time = (flags & RESUME_FLAG_SEEN_INSTRUCTION);
+    seen_cpu_exception_at_current_line =
+        (flags & RESUME_FLAG_SEEN_CPU_EXCEPTION);
+    aarch64_used = (flags & RESUME_FLAG_AARCH64_USED);
+
+    TarmacLineParser::SavedState pstate;
+    pstate.timestamp = rs.parser_timestamp;
+    pstate.post_event_type_start = rs.parser_post_event_type_start;
+    const char *type = rs.parser_continued_event_type;
+    pstate.continued_event_type = string(
+        type, std::find(type, type + sizeof(rs.parser_continued_event_type),
+                        '\0'));
+    parser.restore_state(pstate);
+}
+
+void Index::read_trace_file()
+{
+    IndexStats::Clock::time_point start;
+    OFF_T start_offset = 0, start_pos = linepos;
+    LineNo start_lineno = true_lineno;
+    if (stats) {
+        start = IndexStats::Clock::now();
+        start_offset = arena->curr_offset();
+    }
+
+    if (iparams.event_cache && linepos == 0)
+        open_event_cache();
+
+    if (iparams.parse_threads > 1)
+        read_trace_file_in_parallel();
+    else if (iparams.pipeline)
+        read_trace_file_pipelined();
+    else
+        while (read_one_trace_line());
+
+    if (stats) {
+        stats->read_seconds += IndexStats::since(start);
+        stats->read_bytes += arena->curr_offset() - start_offset;
+        // true_lineno counts the attempt to read past the last line.
+        stats->trace_lines += true_lineno - start_lineno - 1;
+        stats->trace_bytes += (OFF_T)linepos - start_pos;
+    }
+}
+
+// Read the line of the trace file starting at linepos, through
+// line_reader, which is restarted if anything has moved linepos
+// somewhere other than where it left off.
+bool Index::next_trace_line(StringSpan &line, bool &terminated)
+{
+    if (!line_reader || line_reader->position() != (OFF_T)linepos)
+        line_reader = make_unique<TraceLineReader>(*source, linepos);
+    return line_reader->get_line(line, terminated);
+}
+
+// Account for a line of the trace file having been dealt with, after
+// its events have all been passed to got_event.
+void Index::end_trace_line(size_t len)
+{
+    if (event_cache_writer)
+        event_cache_writer->end_line(len);
+    linepos += len + 1;
+    reporter->indexing_progress(linepos);
+
+    // The decompressed text of a compressed trace needn't be kept once
+    // it's been indexed, apart from a margin for anything that looks
+    // back a little way, like a parallel worker's warmup.
+    if ((OFF_T)linepos > TRACE_DISCARD_MARGIN)
+        source->discard_before((OFF_T)linepos - TRACE_DISCARD_MARGIN);
+
+    if (iparams.memory_budget && trace.index_on_disk &&
+        arena->curr_offset() >= next_write_behind)
+        write_behind();
+}
+
+// Keep the part of the index file in memory within
+// IndexerParams::memory_budget, by writing back the parts of it that
+// the trees have finished with, and dropping them from memory.
+void Index::write_behind()
+{
+    IndexStats::Timer timer(stats.get(), IndexStats::WriteBehind, *arena);
+
+    OFF_T budget = iparams.memory_budget;
+    OFF_T curr = arena->curr_offset();
+    next_write_behind = curr + max(budget / 16, WRITE_BEHIND_MIN_STEP);
+
+    // Start the writes of every extent that has been finished with
+    // since last time, in file order. Doing it in small steps keeps
+    // the disk busy with long sequential writes, rather than leaving
+    // the dirty pages to pile up until the operating system has to
+    // write them back in a hurry, in whatever order it finds them.
+    // Extents still in use are left alone, since their pages would
+    // only be dirtied again.
+    vector<pair<OFF_T, OFF_T>> extents;
+    arena->take_finished_extents(extents);
+    std::sort(extents.begin(), extents.end());
+    for (size_t i = 0; i < extents.size();) {
+        OFF_T start = extents[i].first, end = extents[i].second;
+        for (i++; i < extents.size() && extents[i].first == end; i++)
+            end = extents[i].second;
+        arena->write_back(start, end, false);
+    }
+
+    // Once the file has grown by a quarter of the budget since last
+    // time, drop everything but the newest half of the budget from
+    // memory. This covers the whole file from the start, not just
+    // what has been written since last time, because pages of older
+    // parts touched since then (by cloning a path through an old part
+    // of a tree, say, or updating a sub-memtree's root pointer) are
+    // back in memory, and maybe dirty. Writing back a page that's
+    // still in use, or dropping it, does no harm beyond the cost of
+    // doing it again later.
+    if (curr - budget / 2 - released >= budget / 4) {
+        released = curr - budget / 2;
+        arena->write_back(0, released, true);
+    }
+}
+
+bool Index::read_one_trace_line()
+{
+    if ((OFF_T)linepos == resume_pos && iparams.resumable &&
+        trace.index_on_disk)
+        save_resume_state();
+
+    // Like a ResumeState, an event cache is finished here rather than
+    // as soon as its last line is read, because in parallel mode the
+    // parser's state is only brought up to date at the end of a chunk.
+    if (event_cache_writer && event_cache_writer->complete())
+        finish_event_cache();
+
+    true_lineno++;
+    if (seen_any_event)
+        lineno++;
+
+    if (stop_requested()) {
+        stopped_early = true;
+        finish_reading_trace_file();
+        return false;
+    }
+
+    StringSpan line;
+    bool terminated;
+    if (!next_trace_line(line, terminated)) {
+        // If the previous line was unterminated, linepos will have
+        // overshot the end of the file by 1, so set it to the real
+        // final file position.
+        linepos = source->size();
+        finish_reading_trace_file();
+        return false;
+    }
+
+    try {
+        parser.parse(line.data, line.size);
+    } catch (TarmacParseError e) {
+        if (!handle_parse_error(e.msg, !terminated))
+            return false;
+    }
+
+    end_trace_line(line.size);
+
+    return true;
+}
+
+bool Index::handle_parse_error(const string &msg, bool partial_last_line)
+{
+    if (partial_last_line) {
+        ostringstream oss;
+        oss << msg << endl
+            << _("ignoring parse error on partial last line "
+                 "(trace truncated?)");
+        reporter->indexing_warning(trace.tarmac_filename, lineno, oss.str());
+        finish_reading_trace_file();
+        return false;
+    }
+
+    indexing_failed(lineno, msg);
+    return true;
+}
+
+void Index::indexing_failed(LineNo line, const string &msg)
+{
+    stop_parse_workers();
+    if (trace.index_on_disk)
+        remove(trace.index_filename.c_str());
+    reporter->indexing_error(trace.tarmac_filename, line, msg);
+}
+
+void Index::read_trace_file_in_parallel()
+{
+    // Only the complete lines of the file are divided into chunks. A
+    // partial last line, and the end of the file, are handled by
+    // read_one_trace_line afterwards, which also saves a ResumeState
+    // at the right point if we need one.
+    OFF_T file_size = resume_pos;
+
+    OFF_T next_start = linepos;
+    OFF_T chunk_size = (file_size - next_start) /
+                       (iparams.parse_threads * PARALLEL_CHUNKS_PER_THREAD);
+    chunk_size = max(PARALLEL_CHUNK_MIN_SIZE,
+                     min(PARALLEL_CHUNK_MAX_SIZE, chunk_size));
+
+    auto start_worker = [&]() {
+        OFF_T start = next_start, end = file_size;
+        if (start + chunk_size < file_size)
+            end = source->next_line_start(start + chunk_size);
+        parse_workers.push_back(std::async(
+            std::launch::async, parse_trace_chunk, std::cref(*source),
+            std::cref(pparams), start, end, std::cref(abandon_parse_workers)));
+        next_start = end;
+    };
+
+    // Keep one chunk per thread in progress. Chunks are replayed into
+    // the index in order, and each time we take one off the front of
+    // the queue, we start work on another one at the back.
+    while (next_start < file_size &&
+           parse_workers.size() < iparams.parse_threads)
+        start_worker();
+
+    while (!parse_workers.empty()) {
+        // If we've been asked to stop, abandon the chunks in progress,
+        // and let read_one_trace_line below notice the request.
+        if (stop_requested()) {
+            stop_parse_workers();
+            break;
+        }
+
+        unique_ptr<ParsedChunk> chunk = parse_workers.front().get();
+        parse_workers.pop_front();
+        if (next_start < file_size)
+            start_worker();
+        if (!replay_parsed_chunk(*chunk)) {
+            stop_parse_workers();
+            return;
+        }
+    }
+
+    while (read_one_trace_line());
+}
+
+void Index::read_trace_file_pipelined()
+{
+    // As in the parallel mode, only the complete lines of the file go
+    // through the pipeline, and read_one_trace_line handles the rest.
+    OFF_T end = resume_pos;
+
+    if ((OFF_T)linepos < end) {
+        SPSCRing<OFF_T, PIPELINE_RING_SIZE> blocks;
+        SPSCRing<unique_ptr<ParsedChunk>, PIPELINE_RING_SIZE> chunks;
+
+        auto first = make_unique<ParsedChunk>(pparams);
+        first->start = linepos;
+        first->parser.copy_state_from(parser);
+
+        pipeline_stages.push_back(std::async(
+            std::launch::async, pipeline_read, std::cref(*source),
+            (OFF_T)linepos, end, std::ref(blocks),
+            std::cref(abandon_parse_workers)));
+        pipeline_stages.push_back(std::async(
+            std::launch::async, pipeline_parse, std::cref(*source),
+            std::cref(pparams), std::move(first), end, std::ref(blocks),
+            std::ref(chunks), std::cref(abandon_parse_workers)));
+
+        // The stages refer to the rings above, so they must always be
+        // stopped before leaving this scope.
+        while ((OFF_T)linepos < end) {
+            if (stop_requested())
+                break;
+
+            unique_ptr<ParsedChunk> chunk;
+            if (!chunks.pop(chunk, abandon_parse_workers))
+                break;
+            if (!replay_parsed_chunk(*chunk)) {
+                stop_parse_workers();
+                return;
+            }
+        }
+        stop_parse_workers();
+    }
+
+    while (read_one_trace_line());
+}
+
+// Use the event cache for this trace if there's a valid one, or else
+// start writing one.
+void Index::open_event_cache()
+{
+    string filename = default_event_cache_filename(trace.tarmac_filename);
+
+    EventCacheReader cache;
+    if (cache.open(filename, trace.tarmac_filename, source->size(),
+                   pparams) &&
+        cache.start_position() == 0) {
+        read_event_cache(cache);
+        return;
+    }
+
+    event_cache_writer = make_unique<EventCacheWriter>(
+        filename, source->size(), resume_pos, pparams);
+    if (!event_cache_writer->ok()) {
+        reporter->warn(_("unable to write event cache file '%s'"),
+                       filename.c_str());
+        event_cache_writer = nullptr;
+    }
+}
+
+// Feed the events from an event cache into the index, exactly as if
+// the lines they came from had been parsed. Whatever follows the part
+// of the trace the cache covers is left to be parsed as usual.
+void Index::read_event_cache(EventCacheReader &cache)
+{
+    size_t len;
+    while (!stop_requested() && cache.next_line(len)) {
+        true_lineno++;
+        if (seen_any_event)
+            lineno++;
+        cache.replay_line(*this);
+        end_trace_line(len);
+        if (stats)
+            stats->cached_lines++;
+    }
+
+    if ((OFF_T)linepos == cache.covered_size())
+        parser.restore_state(cache.end_state());
+}
+
+void Index::finish_event_cache()
+{
+    string filename = default_event_cache_filename(trace.tarmac_filename);
+    if (!event_cache_writer->finish(parser.save_state()))
+        reporter->warn(_("unable to write event cache file '%s'"),
+                       filename.c_str());
+    event_cache_writer = nullptr;
+}
+
+bool Index::replay_parsed_chunk(ParsedChunk &chunk)
+{
+    using Item = ParsedChunk::Item;
+
+    // If the worker's parser didn't start this chunk in the same state
+    // as our own parser, its output might be wrong, so fall back to
+    // parsing the chunk again ourselves.
+    if (!parser.same_state_as(chunk.start_state))
+        return reparse_chunk(chunk);
+
+    size_t item = 0, insn = 0, reg = 0, mem = 0, text = 0, exc = 0, msg = 0;
+    for (const ParsedChunk::Line &line : chunk.lines) {
+        true_lineno++;
+        if (seen_any_event)
+            lineno++;
+
+        for (; item < line.items_end; item++) {
+            switch (chunk.items[item]) {
+            case Item::Instruction:
+                got_event(chunk.insn_events[insn++]);
+                break;
+            case Item::Register:
+                got_event(chunk.reg_events[reg++]);
+                break;
+            case Item::Memory:
+                got_event(chunk.mem_events[mem++]);
+                break;
+            case Item::TextOnly:
+                got_event(chunk.text_events[text++]);
+                break;
+            case Item::Exception:
+                got_event(chunk.exc_events[exc++]);
+                break;
+            case Item::Warning:
+                parse_warning(chunk.messages[msg++]);
+                break;
+            }
+        }
+
+        if (line.error) {
+            bool partial =
+                chunk.last_line_unterminated && &line == &chunk.lines.back();
+            if (!handle_parse_error(chunk.messages[msg++], partial))
+                return false;
+        }
+
+        end_trace_line(line.len);
+    }
+
+    parser.copy_state_from(chunk.parser);
+    return true;
+}
+
+bool Index::reparse_chunk(ParsedChunk &chunk)
+{
+    StringSpan line;
+    bool terminated;
+    while (linepos < chunk.end && next_trace_line(line, terminated)) {
+        true_lineno++;
+        if (seen_any_event)
+            lineno++;
+
+        try {
+            parser.parse(line.data, line.size);
+        } catch (TarmacParseError e) {
+            if (!handle_parse_error(e.msg, !terminated))
+                return false;
+        }
+
+        end_trace_line(line.size);
+    }
+
+    return true;
+}
+
+void Index::stop_parse_workers()
+{
+    abandon_parse_workers = true;
+    for (auto &worker : parse_workers)
+        worker.wait();
+    parse_workers.clear();
+    for (auto &stage : pipeline_stages)
+        stage.wait();
+    pipeline_stages.clear();
+}
+
+void Index::finish_reading_trace_file()
+{
+    if (!source)
+        return;
+
+    reporter->indexing_done();
+
+    // Call got_event with no actual event, signalling end-of-file, so
+    // that the last record is output (the same flushing of
+    // accumulated data we'd do on seeing the next instruction, except
+    // that then we stop without processing an instruction).
+    got_event_common(nullptr, false);
+
+    line_reader = nullptr;
+    source = nullptr;
+}
+
+// Put found_callrets in line order. If a line was logged more than
+// once, only the first is kept.
+void Index::sort_callrets()
+{
+    std::stable_sort(found_callrets.begin(), found_callrets.end());
+    auto end = std::unique(found_callrets.begin(), found_callrets.end(),
+                           [](const CallReturn &a, const CallReturn &b) {
+                               return a.line() == b.line();
+                           });
+    found_callrets.erase(end, found_callrets.end());
+}
+
+void Index::build_call_tree()
 {
     /*
      * Now we've got to the end of the trace and matched up calls to
@@ -1094,17 +2552,45 @@ void Index::build_call_tree()
      * main seqtree to fill in the call depth fields.
      */
     if (iparams.record_calls) {
-        {
-            CallDepthCountingTreeWalker visitor(found_callrets);
-            seqtree->walk(seqroot, WalkOrder::Inorder, ref(visitor));
-        }
-        {
-            CallDepthArrayTreeWalker visitor(arena.get());
-            seqtree->walk(seqroot, WalkOrder::Postorder, ref(visitor));
-        }
+        IndexStats::Timer timer(stats.get(), IndexStats::CallDepths, *arena);
+        sort_callrets();
+
+        // Each node's call depth is needed in its own entry of the
+        // array built for it, and is known once every node before it
+        // has been counted, so both can be done in a single walk.
+        CallDepthCountingTreeWalker counter(found_callrets);
+        CallDepthArrayTreeWalker arrays(arena.get());
+        seqtree->walk(seqroot, ref(counter), ref(arrays));
     }
 }
 
+void Index::relayout_trees()
+{
+    if (!iparams.relayout_trees)
+        return;
+
+    IndexStats::Timer timer(stats.get(), IndexStats::Relayout, *arena);
+
+    // Copy each node's call depth array along with it, so that it
+    // ends up next to the node in the file.
+    seqroot = seqtree->copy_in_veb_order(
+        seqroot, [this](const SeqOrderPayload &, SeqOrderAnnotation &annot) {
+            if (!annot.call_depth_array)
+                return;
+            size_t size =
+                annot.call_depth_arraylen *
+                call_depth_array_entry_size(annot.call_depth_array_wide);
+            OFF_T array = arena->alloc(size, ArenaPool::SeqTree);
+            memcpy(arena->getptr<char>(array),
+                   arena->getptr<char>(annot.call_depth_array), size);
+            annot.call_depth_array = array;
+        });
+    bypcroot = bypctree->copy_in_veb_order(
+        bypcroot, [](const ByPCPayload &, ByPCAnnotation &) {});
+    writeroot = writetree->copy_in_veb_order(
+        writeroot, [](const WritePayload &, WriteAnnotation &) {});
+}
+
 void Index::finalise_index()
 {
     FileHeader &hdr = *arena->getptr<FileHeader>(header_offset);
@@ -1119,6 +2605,14 @@ void Index::finalise_index()
         flags |= FLAG_THUMB_ONLY;
     if (aarch64_used)
         flags |= FLAG_AARCH64_USED;
+    if (!iparams.record_memory)
+        flags |= FLAG_NO_MEMORY;
+    if (!iparams.record_calls)
+        flags |= FLAG_NO_CALLS;
+    if (iparams.record_writes)
+        flags |= FLAG_WRITES;
+    if (stopped_early)
+        flags |= FLAG_PARTIAL;
 
     unsigned svelen_flag = ((max_sve_bits + 127) / 128 - 1) * FLAG_SVELEN_UNIT;
     assert((svelen_flag & ~FLAG_SVELEN_MASK) == 0);
@@ -1129,44 +2623,211 @@ void Index::finalise_index()
 
     hdr.seqroot = seqroot;
     hdr.bypcroot = bypcroot;
+    hdr.writeroot = writeroot;
     hdr.lineno_offset = lineno_offset;
+    hdr.resume_state = resume_state_offset;
+}
+
+void Index::report_stats()
+{
+    ostream &os = idiags.diag();
+    auto old_flags = os.flags();
+    auto old_precision = os.precision(3);
+    os << std::fixed;
+
+    static const char *const phase_names[IndexStats::NumPhases] = {
+        "memory tree updates",       "sub-memtree fills from reads",
+        "sequential order tree",     "by-PC tree",
+        "write tree",                "memory checkpoints",
+        "resume state",              "write-behind",
+        "call depths",
+        "tree relayout",
+    };
+
+    double other_seconds = stats->read_seconds;
+    unsigned long long other_bytes = stats->read_bytes;
+    for (int i = 0; i < IndexStats::FirstPhaseAfterReading; i++) {
+        other_seconds -= stats->seconds[i];
+        other_bytes -= stats->bytes[i];
+    }
+
+    double rate_time = stats->read_seconds > 0 ? stats->read_seconds : 1e-9;
+    os << "Indexing statistics:" << endl;
+    os << "  trace lines read: " << stats->trace_lines << " ("
+       << stats->trace_lines / rate_time << " lines/s)" << endl;
+    os << "  trace bytes read: " << stats->trace_bytes << " ("
+       << stats->trace_bytes / rate_time / 1048576 << " MB/s)" << endl;
+    if (iparams.event_cache)
+        os << "  of which lines from event cache: " << stats->cached_lines
+           << endl;
+
+    os << "Time by phase (seconds):" << endl;
+    os << "  reading trace file: " << stats->read_seconds << endl;
+    for (int i = 0; i < IndexStats::FirstPhaseAfterReading; i++)
+        os << "    " << phase_names[i] << ": " << stats->seconds[i] << endl;
+    os << "    parsing and other event handling: " << other_seconds << endl;
+    for (int i = IndexStats::FirstPhaseAfterReading;
+         i < IndexStats::NumPhases; i++)
+        os << "  " << phase_names[i] << ": " << stats->seconds[i] << endl;
+
+    os << "Events:" << endl;
+    os << "  instructions: " << stats->instruction_events << endl;
+    os << "  register writes: " << stats->register_events << endl;
+    os << "  memory writes: " << stats->memory_write_events << endl;
+    os << "  memory reads: " << stats->memory_read_events << endl;
+    os << "  exceptions: " << stats->exception_events << endl;
+    os << "  other: " << stats->text_only_events << endl;
+
+    os << "Index space allocated (bytes):" << endl;
+    for (int i = 0; i < IndexStats::NumPhases; i++)
+        os << "  " << phase_names[i] << ": " << stats->bytes[i] << endl;
+    os << "  other: " << other_bytes << endl;
+    os << "  total index size: " << arena->curr_offset() << endl;
+
+    os << "Memory contents blocks:" << endl;
+    os << "  written: " << stats->contents_blocks << endl;
+    os << "  shared with an identical earlier block: "
+       << stats->shared_contents_blocks << endl;
+
+    os << "Tree nodes cloned / modified in place:" << endl;
+    os << "  memory tree: " << memtree->nodes_cloned() << " / "
+       << memtree->nodes_modified_in_place() << endl;
+    os << "  sub-memtrees: " << memsubtree->nodes_cloned() << " / "
+       << memsubtree->nodes_modified_in_place() << endl;
+    os << "  sequential order tree: " << seqtree->nodes_cloned() << " / "
+       << seqtree->nodes_modified_in_place() << endl;
+    os << "  by-PC tree: " << bypctree->nodes_cloned() << " / "
+       << bypctree->nodes_modified_in_place() << endl;
+    os << "  write tree: " << writetree->nodes_cloned() << " / "
+       << writetree->nodes_modified_in_place() << endl;
+
+    os.flags(old_flags);
+    os.precision(old_precision);
 }
 
 void Index::parse_tarmac_file()
 {
     open_index_file();
     open_trace_file();
-    while (read_one_trace_line());
+    read_trace_file();
+    build_call_tree();
+    relayout_trees();
+    finalise_index();
+    if (stats)
+        report_stats();
+}
+
+void Index::extend_tarmac_file()
+{
+    reopen_index_file();
+    reopen_trace_file();
+    read_trace_file();
+
+    // Adding to the end of the trace can change the call depth of
+    // lines all the way back to the start (e.g. if it contains the
+    // return from a call near the start), so the call depths have to
+    // be recomputed for the whole tree.
     build_call_tree();
+    relayout_trees();
     finalise_index();
+    if (stats)
+        report_stats();
 }
 
-IndexHeaderState check_index_header(const string &index_filename)
+// Open an existing index file for reading, decompressing it (as it's
+// read) if necessary.
+static shared_ptr<Arena> map_index_file(const string &index_filename,
+                                        bool compressed)
 {
-    MMapFile arena(index_filename, false);
+    if (compressed)
+        return make_shared<CompressedFile>(index_filename);
+    return make_shared<MMapFile>(index_filename, false);
+}
+
+IndexHeaderState check_index_header(const string &index_filename,
+                                    const IndexerParams &needed,
+                                    IndexerParams *present)
+{
+    bool compressed = CompressedFile::is_compressed(index_filename);
+    shared_ptr<Arena> arena = map_index_file(index_filename, compressed);
+    if (arena->curr_offset() <
+        (OFF_T)(sizeof(MagicNumber) + sizeof(FileHeader)))
+        return IndexHeaderState::WrongMagic;
 
-    MagicNumber &magic = *arena.getptr<MagicNumber>(0);
+    MagicNumber &magic = *arena->getptr<MagicNumber>(0);
     if (!magic.check())
         return IndexHeaderState::WrongMagic;
 
-    FileHeader &hdr = *arena.getptr<FileHeader>(sizeof(MagicNumber));
-    if (!(hdr.flags & FLAG_COMPLETE))
+    FileHeader &hdr = *arena->getptr<FileHeader>(sizeof(MagicNumber));
+    if (!(hdr.flags & FLAG_COMPLETE) || (hdr.flags & FLAG_PARTIAL))
         return IndexHeaderState::Incomplete;
 
+    IndexerParams contents;
+    contents.record_memory = !(hdr.flags & FLAG_NO_MEMORY);
+    contents.record_calls = !(hdr.flags & FLAG_NO_CALLS);
+    contents.record_writes = (hdr.flags & FLAG_WRITES);
+    contents.resumable = (hdr.resume_state != 0);
+    contents.compress = compressed;
+    if (present)
+        *present = contents;
+    if (!contents.covers(needed))
+        return IndexHeaderState::MissingParts;
+
     return IndexHeaderState::OK;
 }
 
 void run_indexer(const TracePair &trace, const IndexerParams &iparams,
                  const IndexerDiagnostics &idiags, const ParseParams &pparams)
 {
-    Index index(trace, iparams, idiags, pparams);
-    index.parse_tarmac_file();
+    {
+        Index index(trace, iparams, idiags, pparams);
+        index.parse_tarmac_file();
+    }
+    if (iparams.compress && trace.index_on_disk)
+        CompressedFile::compress_in_place(trace.index_filename);
+}
+
+bool can_extend_index(const TracePair &trace, const IndexerParams &needed,
+                      const ParseParams &pparams)
+{
+    if (!trace.index_on_disk)
+        return false;
+
+    IndexerParams present;
+    if (check_index_header(trace.index_filename, needed, &present) !=
+            IndexHeaderState::OK ||
+        !present.resumable || present.compress)
+        return false;
+
+    MMapFile arena(trace.index_filename, false);
+    FileHeader &hdr = *arena.getptr<FileHeader>(sizeof(MagicNumber));
+    if (bool(hdr.flags & FLAG_BIGEND) != pparams.bigend ||
+        bool(hdr.flags & FLAG_THUMB_ONLY) !=
+            (pparams.iset_specified && pparams.iset == THUMB))
+        return false;
+
+    TraceSource source(trace.tarmac_filename);
+    return resume_state_matches_trace(
+        *arena.getptr<ResumeState>(hdr.resume_state), source);
+}
+
+void extend_index(const TracePair &trace, const IndexerParams &iparams,
+                  const IndexerDiagnostics &idiags, const ParseParams &pparams)
+{
+    {
+        Index index(trace, iparams, idiags, pparams);
+        index.extend_tarmac_file();
+    }
+    if (iparams.compress)
+        CompressedFile::compress_in_place(trace.index_filename);
 }
 
 static shared_ptr<Arena> get_index_mapping(const TracePair &trace)
 {
     if (trace.index_on_disk)
-        return make_shared<MMapFile>(trace.index_filename, false);
+        return map_index_file(
+            trace.index_filename,
+            CompressedFile::is_compressed(trace.index_filename));
     else
         return trace.memory_index;
 }
@@ -1175,9 +2836,8 @@ IndexReader::IndexReader(const TracePair &trace)
     : index_filename(trace.index_filename),
       tarmac_filename(trace.tarmac_filename),
       arena(get_index_mapping(trace)),
-      tarmac(tarmac_filename, std::ios_base::in | std::ios_base::binary),
       bigend(), aarch64_used(), memtree(*arena), memsubtree(*arena),
-      seqtree(*arena), bypctree(*arena)
+      seqtree(*arena), bypctree(*arena), writetree(*arena)
 {
     MagicNumber &magic = *arena->getptr<MagicNumber>(0);
     if (!magic.check())
@@ -1186,14 +2846,127 @@ IndexReader::IndexReader(const TracePair &trace)
     FileHeader &hdr = *arena->getptr<FileHeader>(sizeof(MagicNumber));
     seqroot = hdr.seqroot;
     bypcroot = hdr.bypcroot;
+    writeroot = hdr.writeroot;
     bigend = (hdr.flags & FLAG_BIGEND);
     aarch64_used = (hdr.flags & FLAG_AARCH64_USED);
     thumbonly = (hdr.flags & FLAG_THUMB_ONLY);
+    has_memory = !(hdr.flags & FLAG_NO_MEMORY);
+    has_calls = !(hdr.flags & FLAG_NO_CALLS);
+    has_writes = (hdr.flags & FLAG_WRITES);
+    resumable = (hdr.resume_state != 0);
+    partial = (hdr.flags & FLAG_PARTIAL);
     max_sve_bits =
         128 * (((hdr.flags & FLAG_SVELEN_MASK) / FLAG_SVELEN_UNIT) + 1);
     lineno_offset = hdr.lineno_offset;
 }
 
+namespace {
+
+// Query latencies are counted in buckets a factor of 4 apart, the
+// first holding everything under 4us, and the last everything from
+// 4^11 us (about 4s) upwards.
+const unsigned QUERY_LATENCY_BUCKETS = 12;
+
+struct QueryTotals {
+    atomic<unsigned long long> calls{0}, nanoseconds{0};
+    atomic<unsigned long long> reads{0}, page_switches{0};
+    atomic<unsigned long long> latency[QUERY_LATENCY_BUCKETS] = {};
+};
+
+QueryTotals query_totals[QueryStats::NumQueries];
+
+unsigned long long query_clock_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+} // namespace
+
+std::atomic<bool> QueryStats::on{false};
+
+void QueryStats::enable()
+{
+    on.store(true, std::memory_order_relaxed);
+    ArenaAccessCounts::enabled.store(true, std::memory_order_relaxed);
+}
+
+void QueryStats::Timer::begin()
+{
+    const ArenaAccessCounts &counts = ArenaAccessCounts::current;
+    start_reads = counts.reads;
+    start_page_switches = counts.page_switches;
+    start_ns = query_clock_ns();
+}
+
+void QueryStats::Timer::end()
+{
+    unsigned long long ns = query_clock_ns() - start_ns;
+    const ArenaAccessCounts &counts = ArenaAccessCounts::current;
+    QueryTotals &totals = query_totals[query];
+    totals.calls++;
+    totals.nanoseconds += ns;
+    totals.reads += counts.reads - start_reads;
+    totals.page_switches += counts.page_switches - start_page_switches;
+
+    unsigned bucket = 0;
+    for (unsigned long long limit = 4000;
+         ns >= limit && bucket + 1 < QUERY_LATENCY_BUCKETS; limit *= 4)
+        bucket++;
+    totals.latency[bucket]++;
+}
+
+void QueryStats::report(ostream &os)
+{
+    static const char *const query_names[NumQueries] = {
+        "node_at_line",    "node_at_time",   "node_near_time",
+        "get_previous_node", "get_next_node", "find_buffer_limit",
+        "getmem",          "getmem_next",    "visit_mem",
+        "get_regs",        "diff",           "find_next_mod",
+        "find_condition",  "visit_writes",   "count_pc_visits",
+        "range_stats",     "lrt_translate",  "get_trace_lines",
+        "goto_pc",         "fold state lookup", "node_fold_state",
+    };
+
+    auto old_flags = os.flags();
+    auto old_precision = os.precision(3);
+    os << std::fixed;
+
+    os << "Index query statistics:" << endl;
+    for (int i = 0; i < NumQueries; i++) {
+        const QueryTotals &totals = query_totals[i];
+        unsigned long long calls = totals.calls;
+        if (!calls)
+            continue;
+
+        double seconds = totals.nanoseconds / 1e9;
+        os << "  " << query_names[i] << ": " << calls << " calls, "
+           << seconds << " s total, " << seconds * 1e6 / calls
+           << " us mean" << endl;
+        os << "    index reads: " << totals.reads << " ("
+           << (double)totals.reads / calls << " per call), page switches: "
+           << totals.page_switches << " ("
+           << (double)totals.page_switches / calls << " per call)" << endl;
+
+        os << "    latency:";
+        unsigned long long limit = 4;
+        for (unsigned b = 0; b < QUERY_LATENCY_BUCKETS; b++, limit *= 4) {
+            unsigned long long count = totals.latency[b];
+            if (!count)
+                continue;
+            if (b + 1 < QUERY_LATENCY_BUCKETS)
+                os << " <" << limit << "us: " << count;
+            else
+                os << " >=" << limit / 4 << "us: " << count;
+        }
+        os << endl;
+    }
+
+    os.flags(old_flags);
+    os.precision(old_precision);
+}
+
 ParseParams IndexReader::parseParams() const
 {
     ParseParams params;
@@ -1205,49 +2978,59 @@ ParseParams IndexReader::parseParams() const
     return params;
 }
 
-string IndexReader::read_tarmac(OFF_T pos, OFF_T len) const
+const TraceSource &IndexReader::trace_source() const
 {
-    vector<char> vbuf(len);
-    tarmac.seekg(pos);
-    tarmac.read(&vbuf[0], len);
-    return string(&vbuf[0], len);
+    // Map the trace file on first use, so that tools which never look
+    // at the trace text don't need it to be present. This can happen
+    // on more than one thread at once, e.g. in the browser's prefetcher.
+    std::call_once(tarmac_once, [this]() {
+        tarmac = make_unique<TraceSource>(tarmac_filename);
+    });
+    return *tarmac;
 }
 
-vector<string> IndexReader::get_trace_lines(const SeqOrderPayload &node) const
+StringSpan IndexReader::read_tarmac(OFF_T pos, OFF_T len) const
 {
-    string sbuf = read_tarmac(node.trace_file_pos, node.trace_file_len);
-    vector<string> lines;
+    return trace_source().span(pos, len);
+}
 
-    for (size_t pos = 0, size = sbuf.size(); pos < size;) {
-        size_t nl = sbuf.find('\n', pos);
-        if (nl == string::npos) {
-            /*
-             * If this is the end of a trace file with a truncated
-             * final line, pretend there's a \n at the end of sbuf.
-             * Then the next time we come round this loop we'll exit
-             * because pos will exceed sbuf's length.
-             */
-            nl = sbuf.size();
-        }
+vector<StringSpan>
+IndexReader::get_trace_line_spans(const SeqOrderPayload &node) const
+{
+    QueryStats::Timer timer(QueryStats::TraceLines);
+    StringSpan sbuf = read_tarmac(node.trace_file_pos, node.trace_file_len);
+    vector<StringSpan> lines;
 
-        string line = sbuf.substr(pos, nl - pos);
-        if (line.size() > 0 && line[line.size() - 1] == '\r')
-            line.resize(line.size() - 1);
-        lines.push_back(line);
+    const char *end = sbuf.data + sbuf.size;
+    const char *partial = split_lines(sbuf.data, end, lines);
 
-        pos = nl + 1;
-    }
+    // If this is the end of a trace file with a truncated final line,
+    // pretend there's a \n at the end of sbuf.
+    if (partial < end)
+        lines.emplace_back(partial, end - partial);
+
+    for (StringSpan &line : lines)
+        if (line.size > 0 && line.data[line.size - 1] == '\r')
+            line = StringSpan(line.data, line.size - 1);
+
+    return lines;
+}
 
+vector<string> IndexReader::get_trace_lines(const SeqOrderPayload &node) const
+{
+    vector<string> lines;
+    for (const StringSpan &span : get_trace_line_spans(node))
+        lines.push_back(span.str());
     return lines;
 }
 
 string IndexReader::get_trace_line(const SeqOrderPayload &node,
                                    unsigned lineno) const
 {
-    vector<string> lines = get_trace_lines(node);
+    vector<StringSpan> lines = get_trace_line_spans(node);
     if (lineno >= lines.size())
         return "";
-    return lines[lineno];
+    return lines[lineno].str();
 }
 
 bool IndexNavigator::lookup_symbol(const string &name, uint64_t &addr,
@@ -1298,7 +3081,7 @@ string IndexNavigator::get_symbolic_address(Addr addr, bool fallback) const
 
 struct IndexLRTSearcher {
     const IndexReader &index;
-    unsigned target;
+    LineNo target;
     unsigned mindepth_i, maxdepth_i;
     unsigned mindepth_o, maxdepth_o;
 
@@ -1308,12 +3091,12 @@ struct IndexLRTSearcher {
     // and maxindex apply to.
     OFF_T curr;
 
-    unsigned output_lines;
+    LineNo output_lines;
 
     class OutOfRangeException : exception {
     };
 
-    IndexLRTSearcher(const IndexReader &index, unsigned target, unsigned mindepth_i,
+    IndexLRTSearcher(const IndexReader &index, LineNo target, unsigned mindepth_i,
                      unsigned maxdepth_i, unsigned mindepth_o,
                      unsigned maxdepth_o)
         : index(index), target(target), mindepth_i(mindepth_i),
@@ -1324,12 +3107,15 @@ struct IndexLRTSearcher {
 
     IndexLRTSearcher(const IndexLRTSearcher &) = delete;
 
-    const CallDepthArrayEntry *lookup_array(const SeqOrderAnnotation *annot,
-                                            unsigned idx)
+    CallDepthArrayEntry lookup_array(const SeqOrderAnnotation *annot,
+                                     unsigned idx)
     {
-        auto *array = (const CallDepthArrayEntry *)index.index_offset(
-            annot->call_depth_array);
-        return array + idx;
+        bool wide = annot->call_depth_array_wide;
+        return get_call_depth_entry(
+            index.index_offset(annot->call_depth_array,
+                               annot->call_depth_arraylen *
+                                   call_depth_array_entry_size(wide)),
+            wide, idx);
     }
 
     unsigned find_depth(const SeqOrderAnnotation *annot, unsigned depth)
@@ -1338,8 +3124,7 @@ struct IndexLRTSearcher {
         while (hi > lo) {
             unsigned mid =
                 lo + (hi - lo) / 2; // might equal lo; never equals hi
-            auto *entry = lookup_array(annot, mid);
-            if (entry->call_depth >= depth)
+            if (lookup_array(annot, mid).call_depth >= depth)
                 hi = mid;
             else
                 lo = mid + 1;
@@ -1372,16 +3157,16 @@ struct IndexLRTSearcher {
 
         if (lhs) {
             unsigned minindex_i_lhs =
-                lookup_array(&here_a, minindex_i)->leftlink;
+                lookup_array(&here_a, minindex_i).leftlink;
             unsigned maxindex_i_lhs =
-                lookup_array(&here_a, maxindex_i)->leftlink;
+                lookup_array(&here_a, maxindex_i).leftlink;
             unsigned minindex_o_lhs =
-                lookup_array(&here_a, minindex_o)->leftlink;
+                lookup_array(&here_a, minindex_o).leftlink;
             unsigned maxindex_o_lhs =
-                lookup_array(&here_a, maxindex_o)->leftlink;
-            unsigned lines_i =
-                (lookup_array(lhs, maxindex_i_lhs)->cumulative_lines -
-                 lookup_array(lhs, minindex_i_lhs)->cumulative_lines);
+                lookup_array(&here_a, maxindex_o).leftlink;
+            LineNo lines_i =
+                (lookup_array(lhs, maxindex_i_lhs).cumulative_lines -
+                 lookup_array(lhs, minindex_i_lhs).cumulative_lines);
             if (target < lines_i) {
                 curr = lhs_off;
                 minindex_i = minindex_i_lhs;
@@ -1392,8 +3177,8 @@ struct IndexLRTSearcher {
             }
             target -= lines_i;
             output_lines +=
-                (lookup_array(lhs, maxindex_o_lhs)->cumulative_lines -
-                 lookup_array(lhs, minindex_o_lhs)->cumulative_lines);
+                (lookup_array(lhs, maxindex_o_lhs).cumulative_lines -
+                 lookup_array(lhs, minindex_o_lhs).cumulative_lines);
         }
 
         if (here_p.call_depth >= mindepth_i && here_p.call_depth < maxdepth_i) {
@@ -1413,16 +3198,16 @@ struct IndexLRTSearcher {
 
         if (rhs) {
             unsigned minindex_i_rhs =
-                lookup_array(&here_a, minindex_i)->rightlink;
+                lookup_array(&here_a, minindex_i).rightlink;
             unsigned maxindex_i_rhs =
-                lookup_array(&here_a, maxindex_i)->rightlink;
+                lookup_array(&here_a, maxindex_i).rightlink;
             unsigned minindex_o_rhs =
-                lookup_array(&here_a, minindex_o)->rightlink;
+                lookup_array(&here_a, minindex_o).rightlink;
             unsigned maxindex_o_rhs =
-                lookup_array(&here_a, maxindex_o)->rightlink;
-            unsigned lines =
-                (lookup_array(rhs, maxindex_i_rhs)->cumulative_lines -
-                 lookup_array(rhs, minindex_i_rhs)->cumulative_lines);
+                lookup_array(&here_a, maxindex_o).rightlink;
+            LineNo lines =
+                (lookup_array(rhs, maxindex_i_rhs).cumulative_lines -
+                 lookup_array(rhs, minindex_i_rhs).cumulative_lines);
             if (target <= lines) {
                 curr = rhs_off;
                 minindex_i = minindex_i_rhs;
@@ -1433,8 +3218,8 @@ struct IndexLRTSearcher {
             }
             target -= lines;
             output_lines +=
-                (lookup_array(rhs, maxindex_o_rhs)->cumulative_lines -
-                 lookup_array(rhs, minindex_o_rhs)->cumulative_lines);
+                (lookup_array(rhs, maxindex_o_rhs).cumulative_lines -
+                 lookup_array(rhs, minindex_o_rhs).cumulative_lines);
         }
 
         // If we get here, we were asked for an offset in the tree
@@ -1446,8 +3231,9 @@ struct IndexLRTSearcher {
 bool IndexNavigator::getmem_next(OFF_T memroot, char type, Addr addr,
                                  size_t size, const void **outdata,
                                  Addr *outaddr, size_t *outsize,
-                                 unsigned *outline) const
+                                 LineNo *outline) const
 {
+    QueryStats::Timer timer(QueryStats::GetMemNext);
     MemoryPayload memp_search;
     memp_search.type = type;
     memp_search.lo = addr;
@@ -1467,8 +3253,8 @@ bool IndexNavigator::getmem_next(OFF_T memroot, char type, Addr addr,
 
         if (memp_got.raw) {
             size_t size = addr_hi - addr_lo + 1;
-            const char *treedata =
-                (const char *)index.index_offset(memp_got.contents);
+            const char *treedata = (const char *)index.index_offset(
+                memp_got.contents, memp_got.hi - memp_got.lo + 1);
             if (outdata)
                 *outdata = treedata + (addr_lo - memp_got.lo);
             if (outaddr)
@@ -1496,8 +3282,8 @@ bool IndexNavigator::getmem_next(OFF_T memroot, char type, Addr addr,
 
             Addr subaddr_lo = max(msp.lo, msp_found.lo);
             Addr subaddr_hi = min(msp.hi, msp_found.hi);
-            const char *treedata =
-                (const char *)index.index_offset(msp_found.contents);
+            const char *treedata = (const char *)index.index_offset(
+                msp_found.contents, msp_found.hi - msp_found.lo + 1);
             size_t size = subaddr_hi - subaddr_lo + 1;
 
             if (outdata)
@@ -1515,11 +3301,77 @@ bool IndexNavigator::getmem_next(OFF_T memroot, char type, Addr addr,
     return false;
 }
 
-unsigned IndexNavigator::getmem(OFF_T memroot, char type, Addr addr,
-                                size_t size, void *outdata,
-                                unsigned char *outdef) const
+bool IndexNavigator::visit_mem(OFF_T memroot, char type, Addr addr,
+                               size_t size, const MemoryVisitor &visitor) const
+{
+    QueryStats::Timer timer(QueryStats::VisitMem);
+    Addr hi = addr + (size - 1);
+
+    // Both tree walks below are also ended by running off the top of
+    // the region, so keep track of whether it was the visitor that
+    // ended them.
+    bool stopped = false;
+    auto visit = [&](Addr ext_lo, Addr ext_hi, const char *data,
+                     LineNo line) {
+        MemoryExtent ext;
+        ext.addr = ext_lo;
+        ext.size = ext_hi - ext_lo + 1;
+        ext.data = data;
+        ext.line = line;
+        if (!visitor(ext))
+            stopped = true;
+        return !stopped;
+    };
+
+    MemoryPayload key;
+    key.type = type;
+    key.lo = addr;
+    key.hi = addr;
+
+    index.memtree.visit_from(
+        memroot, key, [&](const MemoryPayload &node, OFF_T) {
+            if (node.type != type || node.lo > hi)
+                return false;
+
+            Addr node_lo = max(addr, node.lo.value());
+            Addr node_hi = min(hi, node.hi.value());
+
+            if (node.raw)
+                return visit(node_lo, node_hi,
+                             (const char *)index.index_offset(
+                                 node.contents, node.hi - node.lo + 1) +
+                                 (node_lo - node.lo),
+                             node.trace_file_firstline);
+
+            MemorySubPayload subkey;
+            subkey.lo = node_lo;
+            subkey.hi = node_lo;
+            index.memsubtree.visit_from(
+                index.index_subtree_root(node.contents), subkey,
+                [&](const MemorySubPayload &sub, OFF_T) {
+                    if (sub.lo > node_hi)
+                        return false;
+                    Addr sub_lo = max(node_lo, sub.lo.value());
+                    Addr sub_hi = min(node_hi, sub.hi.value());
+                    return visit(
+                        sub_lo, sub_hi,
+                        (const char *)index.index_offset(
+                            sub.contents, sub.hi - sub.lo + 1) +
+                            (sub_lo - sub.lo),
+                        node.trace_file_firstline);
+                });
+            return !stopped;
+        });
+
+    return !stopped;
+}
+
+LineNo IndexNavigator::getmem(OFF_T memroot, char type, Addr addr,
+                              size_t size, void *outdata,
+                              unsigned char *outdef) const
 {
-    unsigned retline = 0;
+    QueryStats::Timer timer(QueryStats::GetMem);
+    LineNo retline = 0;
     MemoryPayload memp_search;
     memp_search.type = type;
     memp_search.lo = addr;
@@ -1538,8 +3390,8 @@ unsigned IndexNavigator::getmem(OFF_T memroot, char type, Addr addr,
         Addr addr_hi = min(memp_search.hi, memp_got.hi);
 
         if (memp_got.raw) {
-            const char *treedata =
-                (const char *)index.index_offset(memp_got.contents);
+            const char *treedata = (const char *)index.index_offset(
+                memp_got.contents, memp_got.hi - memp_got.lo + 1);
             if (outdata)
                 memcpy((char *)outdata + (addr_lo - addr),
                        treedata + (addr_lo - memp_got.lo),
@@ -1556,8 +3408,8 @@ unsigned IndexNavigator::getmem(OFF_T memroot, char type, Addr addr,
                                            subroot, msp, &msp_found, nullptr)) {
                 Addr subaddr_lo = max(msp.lo, msp_found.lo);
                 Addr subaddr_hi = min(msp.hi, msp_found.hi);
-                const char *treedata =
-                    (const char *)index.index_offset(msp_found.contents);
+                const char *treedata = (const char *)index.index_offset(
+                    msp_found.contents, msp_found.hi - msp_found.lo + 1);
                 if (outdata)
                     memcpy((char *)outdata + (subaddr_lo - addr),
                            treedata + (subaddr_lo - msp_found.lo),
@@ -1624,6 +3476,298 @@ pair<bool, uint64_t> IndexNavigator::get_reg_value(OFF_T memroot,
     return make_pair(is_defined, toret);
 }
 
+namespace {
+// A register being read by IndexNavigator::get_regs, and the range of
+// the register address space it occupies (inclusive, as in
+// MemoryPayload).
+struct RegisterSpan {
+    Addr lo, hi;
+    size_t index; // position in the caller's list of registers
+
+    bool operator<(const RegisterSpan &rhs) const { return lo < rhs.lo; }
+};
+
+// Visit every node of a memory tree that overlaps any of a sorted list
+// of RegisterSpans, in address order, calling 'fn' with each pair of
+// a node and a span that it overlaps.
+template <class Fn>
+void sweep_register_spans(const AVLDisk<MemoryPayload, MemoryAnnotation> &tree,
+                          OFF_T memroot, const vector<RegisterSpan> &spans,
+                          Fn fn)
+{
+    Addr span_hi = 0;
+    for (const RegisterSpan &span : spans)
+        span_hi = max(span_hi, span.hi);
+
+    MemoryPayload key;
+    key.type = 'r';
+    key.lo = spans.front().lo;
+    key.hi = spans.front().lo;
+
+    // Spans before 'first' all end before the node we're looking at,
+    // and since the nodes are visited in address order, they can't
+    // overlap any later node either.
+    size_t first = 0;
+    tree.visit_from(memroot, key, [&](const MemoryPayload &node, OFF_T) {
+        if (node.type != 'r' || node.lo > span_hi)
+            return false;
+        while (first < spans.size() && spans[first].hi < node.lo)
+            first++;
+        for (size_t i = first; i < spans.size() && spans[i].lo <= node.hi;
+             i++)
+            if (spans[i].hi >= node.lo)
+                fn(node, spans[i]);
+        return true;
+    });
+}
+} // namespace
+
+vector<RegisterValue>
+IndexNavigator::get_regs(OFF_T memroot, const vector<RegisterId> &regs,
+                         OFF_T diff_memroot, LineNo diff_minline) const
+{
+    QueryStats::Timer timer(QueryStats::GetRegs);
+    vector<RegisterValue> values(regs.size());
+    if (regs.empty())
+        return values;
+
+    // As in get_reg_bytes, only look up the iflags if some register
+    // needs them.
+    bool need_iflags = false;
+    for (const RegisterId &reg : regs)
+        need_iflags |= reg_needs_iflags(reg);
+    unsigned iflags = need_iflags ? get_iflags(memroot) : 0;
+
+    vector<RegisterSpan> spans;
+    for (size_t i = 0; i < regs.size(); i++) {
+        Addr offset = reg_needs_iflags(regs[i]) ? reg_offset(regs[i], iflags)
+                                                : reg_offset(regs[i]);
+        size_t size = reg_size(regs[i]);
+        spans.push_back({offset, offset + (size - 1), i});
+        values[i].val.resize(size);
+        values[i].def.resize(size);
+    }
+    std::stable_sort(spans.begin(), spans.end());
+
+    // Copy one contiguous piece of register data from the index into
+    // the output for a span, clipped to the part inside the span.
+    auto copy_bytes = [&](const RegisterSpan &span, Addr lo, Addr hi,
+                          const char *data) {
+        Addr clip_lo = max(lo, span.lo), clip_hi = min(hi, span.hi);
+        if (clip_lo > clip_hi)
+            return;
+        RegisterValue &value = values[span.index];
+        memcpy(&value.val[clip_lo - span.lo], data + (clip_lo - lo),
+               clip_hi - clip_lo + 1);
+        memset(&value.def[clip_lo - span.lo], 1, clip_hi - clip_lo + 1);
+    };
+
+    sweep_register_spans(
+        index.memtree, memroot, spans,
+        [&](const MemoryPayload &node, const RegisterSpan &span) {
+            RegisterValue &value = values[span.index];
+            if (value.line < node.trace_file_firstline)
+                value.line = node.trace_file_firstline;
+
+            if (node.raw) {
+                copy_bytes(span, node.lo, node.hi,
+                           (const char *)index.index_offset(
+                               node.contents, node.hi - node.lo + 1));
+                return;
+            }
+
+            MemorySubPayload key;
+            Addr lo = max(span.lo, node.lo.value());
+            Addr hi = min(span.hi, node.hi.value());
+            key.lo = lo;
+            key.hi = lo;
+            index.memsubtree.visit_from(
+                index.index_subtree_root(node.contents), key,
+                [&](const MemorySubPayload &sub, OFF_T) {
+                    if (sub.lo > hi)
+                        return false;
+                    copy_bytes(span, sub.lo, sub.hi,
+                               (const char *)index.index_offset(
+                                   sub.contents, sub.hi - sub.lo + 1));
+                    return true;
+                });
+        });
+
+    if (diff_memroot)
+        sweep_register_spans(
+            index.memtree, diff_memroot, spans,
+            [&](const MemoryPayload &node, const RegisterSpan &span) {
+                if (node.trace_file_firstline >= diff_minline)
+                    values[span.index].changed = true;
+            });
+
+    return values;
+}
+
+pair<bool, uint64_t> IndexNavigator::get_mem_value(OFF_T memroot, Addr addr,
+                                                   size_t size) const
+{
+    assert(size <= 8);
+    unsigned char val[8], def[8];
+    getmem(memroot, 'm', addr, size, val, def);
+    uint64_t toret = 0;
+    for (size_t j = 0; j < size; j++) {
+        if (!def[j])
+            return make_pair(false, 0);
+        size_t byte = index.isBigEndian() ? size - 1 - j : j;
+        toret |= (uint64_t)val[j] << 8 * byte;
+    }
+    return make_pair(true, toret);
+}
+
+namespace {
+struct Span {
+    Addr lo, hi; // inclusive
+    const void *p;
+};
+
+// Walk two lists of disjoint spans, each sorted by address, and call
+// f(lo, hi, a, b) for each maximal range [lo,hi] lying within the same
+// span of each list, where a or b is null if that list has no span
+// there. Ranges covered by neither list are skipped.
+template <class F>
+void sweep_spans(const vector<Span> &a, const vector<Span> &b, F f)
+{
+    const Addr top = ~(Addr)0;
+    size_t i = 0, j = 0;
+    Addr pos = 0;
+    while (true) {
+        while (i < a.size() && a[i].hi < pos)
+            i++;
+        while (j < b.size() && b[j].hi < pos)
+            j++;
+        if (i == a.size() && j == b.size())
+            return;
+
+        bool ina = i < a.size() && a[i].lo <= pos;
+        bool inb = j < b.size() && b[j].lo <= pos;
+        if (!ina && !inb) {
+            pos = min(i < a.size() ? a[i].lo : top,
+                      j < b.size() ? b[j].lo : top);
+            continue;
+        }
+
+        Addr end = top;
+        if (i < a.size())
+            end = min(end, ina ? a[i].hi : a[i].lo - 1);
+        if (j < b.size())
+            end = min(end, inb ? b[j].hi : b[j].lo - 1);
+        f(pos, end, ina ? &a[i] : nullptr, inb ? &b[j] : nullptr);
+        if (end == top)
+            return;
+        pos = end + 1;
+    }
+}
+
+// Add [lo,hi] to a sorted list of disjoint ranges, merging it with the
+// last one if they're adjacent.
+void add_range(vector<Span> &ranges, Addr lo, Addr hi)
+{
+    if (!ranges.empty() && ranges.back().hi + 1 == lo)
+        ranges.back().hi = hi;
+    else
+        ranges.push_back({lo, hi, nullptr});
+}
+} // namespace
+
+bool IndexNavigator::diff(OFF_T memroot_a, OFF_T memroot_b,
+                          const StateChangeVisitor &visitor) const
+{
+    QueryStats::Timer timer(QueryStats::Diff);
+    // Every byte covered by a node the two trees share is the same in
+    // both, so only the nodes they don't share need looking at. Even
+    // where two of those overlap, they may map the overlap to the
+    // same data, because splitting a node to make room for a write
+    // leaves the parts either side pointing at the same raw contents
+    // or the same sub-memtree. So collect the ranges where that's not
+    // so, and only compare those byte by byte.
+    vector<MemoryPayload> unshared[2];
+    index.memtree.visit_differences(
+        memroot_a, memroot_b,
+        [&](const MemoryPayload &memp, int side) {
+            unshared[side].push_back(memp);
+        });
+
+    StateChange change;
+    for (char type : {'m', 'r'}) {
+        vector<Span> nodes[2];
+        for (int side = 0; side < 2; side++)
+            for (const MemoryPayload &memp : unshared[side])
+                if (memp.type == type)
+                    nodes[side].push_back({memp.lo, memp.hi, &memp});
+
+        vector<Span> suspect;
+        sweep_spans(nodes[0], nodes[1],
+                    [&](Addr lo, Addr hi, const Span *a, const Span *b) {
+                        if (a && b) {
+                            auto &ma = *(const MemoryPayload *)a->p;
+                            auto &mb = *(const MemoryPayload *)b->p;
+                            if (ma.raw == mb.raw &&
+                                (ma.raw ? ma.contents + (lo - ma.lo) ==
+                                              mb.contents + (lo - mb.lo)
+                                        : ma.contents == mb.contents))
+                                return;
+                        }
+                        add_range(suspect, lo, hi);
+                    });
+
+        // Now compare the defined extents of each tree within those
+        // ranges, and find the runs of bytes that differ.
+        vector<Span> runs;
+        for (const Span &range : suspect) {
+            vector<Span> extents[2];
+            OFF_T roots[2] = {memroot_a, memroot_b};
+            for (int side = 0; side < 2; side++)
+                visit_mem(roots[side], type, range.lo, range.hi - range.lo + 1,
+                          [&](const MemoryExtent &ext) {
+                              extents[side].push_back(
+                                  {ext.addr, ext.addr + (ext.size - 1),
+                                   ext.data});
+                              return true;
+                          });
+
+            sweep_spans(
+                extents[0], extents[1],
+                [&](Addr lo, Addr hi, const Span *a, const Span *b) {
+                    if (!a || !b) {
+                        add_range(runs, lo, hi);
+                        return;
+                    }
+                    auto pa = (const unsigned char *)a->p + (lo - a->lo);
+                    auto pb = (const unsigned char *)b->p + (lo - b->lo);
+                    for (Addr i = 0; i <= hi - lo; i++)
+                        if (pa[i] != pb[i])
+                            add_range(runs, lo + i, lo + i);
+                });
+        }
+
+        for (const Span &run : runs) {
+            change.type = type;
+            change.addr = run.lo;
+            change.size = run.hi - run.lo + 1;
+            for (int side = 0; side < 2; side++) {
+                auto &val = side ? change.after : change.before;
+                auto &def = side ? change.after_def : change.before_def;
+                val.resize(change.size);
+                def.resize(change.size);
+                LineNo line = getmem(side ? memroot_b : memroot_a, type,
+                                     change.addr, change.size, val.data(),
+                                     def.data());
+                if (side)
+                    change.line = line;
+            }
+            if (!visitor(change))
+                return false;
+        }
+    }
+    return true;
+}
+
 unsigned IndexNavigator::get_iflags(OFF_T memroot) const
 {
     RegisterId reg = {RegPrefix::internal_flags, 0};
@@ -1648,16 +3792,33 @@ class SeqTimeFinder {
 
 bool IndexNavigator::node_at_time(Time t, SeqOrderPayload *node) const
 {
+    QueryStats::Timer timer(QueryStats::NodeAtTime);
     return index.seqtree.find_rightmost(index.seqroot, SeqTimeFinder(t), node,
                                         nullptr);
 }
 
+bool IndexNavigator::node_near_time(Time t, bool after,
+                                    SeqOrderPayload *node) const
+{
+    QueryStats::Timer timer(QueryStats::NodeNearTime);
+    // succ and pred find the nodes strictly after or before the key.
+    if (after)
+        return t == 0 ? find_buffer_limit(false, node)
+                      : index.seqtree.succ(index.seqroot, SeqTimeFinder(t - 1),
+                                           node, nullptr);
+    else
+        return t + 1 == 0 ? find_buffer_limit(true, node)
+                          : index.seqtree.pred(index.seqroot,
+                                               SeqTimeFinder(t + 1), node,
+                                               nullptr);
+}
+
 namespace {
 class SeqLineFinder {
-    unsigned line;
+    LineNo line;
 
   public:
-    SeqLineFinder(unsigned line) : line(line) {}
+    SeqLineFinder(LineNo line) : line(line) {}
     int cmp(const SeqOrderPayload &rhs) const
     {
         return (line < rhs.trace_file_firstline
@@ -1669,8 +3830,9 @@ class SeqLineFinder {
 };
 } // namespace
 
-bool IndexNavigator::node_at_line(unsigned line, SeqOrderPayload *node) const
+bool IndexNavigator::node_at_line(LineNo line, SeqOrderPayload *node) const
 {
+    QueryStats::Timer timer(QueryStats::NodeAtLine);
     return index.seqtree.find(index.seqroot, SeqLineFinder(line), node,
                               nullptr);
 }
@@ -1678,6 +3840,7 @@ bool IndexNavigator::node_at_line(unsigned line, SeqOrderPayload *node) const
 bool IndexNavigator::get_previous_node(SeqOrderPayload &in,
                                        SeqOrderPayload *out) const
 {
+    QueryStats::Timer timer(QueryStats::PreviousNode);
     return index.seqtree.find(index.seqroot,
                               SeqLineFinder(in.trace_file_firstline - 1), out,
                               nullptr);
@@ -1686,6 +3849,7 @@ bool IndexNavigator::get_previous_node(SeqOrderPayload &in,
 bool IndexNavigator::get_next_node(SeqOrderPayload &in,
                                    SeqOrderPayload *out) const
 {
+    QueryStats::Timer timer(QueryStats::NextNode);
     return index.seqtree.find(
         index.seqroot,
         SeqLineFinder(in.trace_file_firstline + in.trace_file_lines), out,
@@ -1694,6 +3858,7 @@ bool IndexNavigator::get_next_node(SeqOrderPayload &in,
 
 bool IndexNavigator::find_buffer_limit(bool end, SeqOrderPayload *node) const
 {
+    QueryStats::Timer timer(QueryStats::BufferLimit);
     if (end)
         return index.seqtree.pred(index.seqroot, Infinity<SeqOrderPayload>(+1),
                                   node, nullptr);
@@ -1702,10 +3867,64 @@ bool IndexNavigator::find_buffer_limit(bool end, SeqOrderPayload *node) const
                                   node, nullptr);
 }
 
+bool IndexCursor::moved(bool found, const SeqOrderPayload &node)
+{
+    if (found) {
+        pos = nav->index.seqtree.lower_bound(
+            nav->index.seqroot, SeqLineFinder(node.trace_file_firstline));
+        at_node = true;
+    }
+    return found;
+}
+
+bool IndexCursor::goto_line(LineNo line)
+{
+    SeqOrderPayload node;
+    return moved(nav->node_at_line(line, &node), node);
+}
+
+bool IndexCursor::goto_time(Time t)
+{
+    SeqOrderPayload node;
+    return moved(nav->node_at_time(t, &node), node);
+}
+
+bool IndexCursor::goto_start()
+{
+    SeqOrderPayload node;
+    return moved(nav->find_buffer_limit(false, &node), node);
+}
+
+bool IndexCursor::goto_end()
+{
+    SeqOrderPayload node;
+    return moved(nav->find_buffer_limit(true, &node), node);
+}
+
+bool IndexCursor::next()
+{
+    assert(at_node);
+    if (++pos == nav->index.seqtree.end(nav->index.seqroot)) {
+        --pos;
+        return false;
+    }
+    return true;
+}
+
+bool IndexCursor::prev()
+{
+    assert(at_node);
+    if (--pos == nav->index.seqtree.end(nav->index.seqroot)) {
+        ++pos;
+        return false;
+    }
+    return true;
+}
+
 namespace {
 struct RegMemChangesSearcher {
     // Input parameters for search
-    unsigned minline;
+    LineNo minline;
     char type;
     Addr addr;
     int sign;
@@ -1720,7 +3939,7 @@ struct RegMemChangesSearcher {
     Addr lo, hi;
     bool got_something, got_a_subtree;
 
-    RegMemChangesSearcher(unsigned minline, char type, Addr addr, int sign)
+    RegMemChangesSearcher(LineNo minline, char type, Addr addr, int sign)
         : minline(minline), type(type), addr(addr), sign(sign), pass(1),
           got_something(false)
     {
@@ -1847,9 +4066,10 @@ struct RegMemChangesSearcher {
 } // namespace
 
 bool IndexNavigator::find_next_mod(OFF_T memroot, char type, Addr addr,
-                                   unsigned minline, int sign, Addr &lo,
+                                   LineNo minline, int sign, Addr &lo,
                                    Addr &hi) const
 {
+    QueryStats::Timer timer(QueryStats::FindNextMod);
     RegMemChangesSearcher rmcs(minline, type, addr, sign);
     index.memtree.search(memroot, ref(rmcs), nullptr);
     if (rmcs.need_second_pass())
@@ -1857,9 +4077,326 @@ bool IndexNavigator::find_next_mod(OFF_T memroot, char type, Addr addr,
     return rmcs.get_result(lo, hi);
 }
 
-unsigned IndexNavigator::lrt_translate(unsigned line, unsigned mindepth_i,
-                                       unsigned maxdepth_i, unsigned mindepth_o,
-                                       unsigned maxdepth_o) const
+namespace {
+// Execution context that evaluates an expression in the state after
+// one node of the trace, and records every location in register or
+// memory space that the evaluation read. Until one of those is
+// modified, the expression can't change its value: even the
+// addresses it reads memory from depend only on registers and memory
+// it has already read.
+class NodeStateContext : public ExecutionContext {
+    struct Location {
+        char type;
+        Addr addr;
+        size_t size;
+    };
+
+    const IndexNavigator &IN;
+    SeqOrderPayload node;
+    mutable vector<Location> locations;
+    mutable bool used_pc;
+
+    void note_register(const RegisterId &reg) const
+    {
+        Addr offset = reg_needs_iflags(reg)
+                          ? reg_offset(reg, IN.get_iflags(node.memory_root))
+                          : reg_offset(reg);
+        locations.push_back({'r', offset, reg_size(reg)});
+    }
+
+  public:
+    NodeStateContext(const IndexNavigator &IN) : IN(IN) {}
+
+    bool lookup_register(const RegisterId &reg, uint64_t &out) const override
+    {
+        if (reg == REG_pc) {
+            // As in the browser, the PC is the address of the next
+            // instruction to execute, which can change at every node.
+            used_pc = true;
+            SeqOrderPayload next;
+            if (!IN.node_at_line(
+                    node.trace_file_firstline + node.trace_file_lines, &next))
+                return false;
+            out = next.pc;
+            return true;
+        }
+
+        if (reg_needs_iflags(reg))
+            note_register({RegPrefix::internal_flags, 0});
+        note_register(reg);
+        auto val = IN.get_reg_value(node.memory_root, reg);
+        out = val.second;
+        return val.first;
+    }
+
+    bool lookup_memory(uint64_t addr, size_t size,
+                       uint64_t &out) const override
+    {
+        locations.push_back({'m', addr, size});
+        auto val = IN.get_mem_value(node.memory_root, addr, size);
+        out = val.second;
+        return val.first;
+    }
+
+    // Evaluate the condition after a given node, as a truth value.
+    bool evaluate(Expression &cond, const SeqOrderPayload &node_)
+    {
+        node = node_;
+        locations.clear();
+        used_pc = false;
+        try {
+            return cond.evaluate(*this) != 0;
+        } catch (EvaluationError &) {
+            return false;
+        }
+    }
+
+    // True if the state read by the last evaluation might be
+    // different in the state after every node.
+    bool every_node() const { return used_pc; }
+
+    // Return the latest line, as of the state after 'n', to have
+    // modified any of the state read by the last evaluation, or 0 if
+    // none of it has been written at all.
+    LineNo last_change(const SeqOrderPayload &n) const
+    {
+        LineNo latest = 0;
+        for (const Location &loc : locations)
+            latest = max(latest, IN.getmem(n.memory_root, loc.type, loc.addr,
+                                           loc.size, nullptr, nullptr));
+        return latest;
+    }
+
+    // Find the first node after 'from', no later than 'last', at
+    // which any of the state read by the last evaluation is
+    // modified. A node includes the changes of all the nodes before
+    // it in its memory tree, so this can binary-search the lines in
+    // between.
+    bool next_change(const SeqOrderPayload &from, const SeqOrderPayload &last,
+                     SeqOrderPayload *out) const
+    {
+        LineNo since = from.trace_file_firstline;
+        if (last_change(last) <= since)
+            return false;
+
+        LineNo lo = from.trace_file_firstline + from.trace_file_lines;
+        LineNo hi = last.trace_file_firstline;
+        *out = last;
+        while (lo < hi) {
+            SeqOrderPayload mid;
+            if (!IN.node_at_line(lo + (hi - lo) / 2, &mid))
+                break;
+            if (last_change(mid) > since) {
+                hi = mid.trace_file_firstline;
+                *out = mid;
+            } else {
+                lo = mid.trace_file_firstline + mid.trace_file_lines;
+            }
+        }
+        return true;
+    }
+};
+} // namespace
+
+bool IndexNavigator::find_condition(const SeqOrderPayload &start,
+                                    Expression &cond, int dir,
+                                    SeqOrderPayload *found) const
+{
+    QueryStats::Timer timer(QueryStats::FindCondition);
+    NodeStateContext ctx(*this);
+
+    if (dir > 0) {
+        SeqOrderPayload node = start, last, next;
+        if (!find_buffer_limit(true, &last))
+            return false;
+
+        // If every node has to be looked at, step through them with
+        // an iterator rather than searching for each from the root.
+        auto it = index.seqtree.end(index.seqroot);
+        if (ctx.every_node())
+            it = index.seqtree.lower_bound(
+                index.seqroot, SeqLineFinder(start.trace_file_firstline));
+        auto step = [&]() {
+            if (!ctx.every_node())
+                return ctx.next_change(node, last, &next);
+            if (++it == index.seqtree.end(index.seqroot))
+                return false;
+            next = *it;
+            return true;
+        };
+
+        bool held = ctx.evaluate(cond, node);
+        while (step()) {
+            bool holds = ctx.evaluate(cond, next);
+            if (holds && !held) {
+                *found = next;
+                return true;
+            }
+            held = holds;
+            node = next;
+        }
+        return false;
+    }
+
+    // Going backwards, the value of the condition at 'node' was
+    // decided by the last change to the state it reads, so we only
+    // need to look at the node making that change and the one before.
+    SeqOrderPayload node = start, changed, before;
+    if (!get_previous_node(node, &node))
+        return false;
+    while (true) {
+        bool holds = ctx.evaluate(cond, node);
+        changed = node;
+        if (!ctx.every_node()) {
+            LineNo line = ctx.last_change(node);
+            if (!line || !node_at_line(line, &changed))
+                return false;
+        }
+        if (!get_previous_node(changed, &before))
+            return false;
+        if (holds && !ctx.evaluate(cond, before)) {
+            *found = changed;
+            return true;
+        }
+        node = before;
+    }
+}
+
+bool IndexNavigator::visit_writes(char type, Addr addr, size_t size,
+                                  const WriteVisitor &visitor) const
+{
+    QueryStats::Timer timer(QueryStats::VisitWrites);
+    if (!size)
+        return true;
+    Addr lo = addr, hi = addr + (size - 1);
+
+    // Start from the first write in this address space, skip every
+    // subtree whose writes all end below the region, and stop at the
+    // first write starting above it.
+    WritePayload key;
+    key.type = type;
+    key.lo = 0;
+    key.trace_file_firstline = 0;
+    return index.writetree.visit_from(
+        index.writeroot, key,
+        [lo](const WriteAnnotation &annot) { return annot.maxhi < lo; },
+        [&](const WritePayload &wp, OFF_T) {
+            if (wp.type != type || wp.lo > hi)
+                return false;
+            if (wp.hi < lo)
+                return true;
+            return visitor(wp);
+        });
+}
+
+vector<WritePayload> IndexNavigator::find_writes(char type, Addr addr,
+                                                 size_t size) const
+{
+    vector<WritePayload> writes;
+    visit_writes(type, addr, size, [&](const WritePayload &wp) {
+        writes.push_back(wp);
+        return true;
+    });
+    sort(writes.begin(), writes.end(),
+         [](const WritePayload &a, const WritePayload &b) {
+             if (a.trace_file_firstline != b.trace_file_firstline)
+                 return a.trace_file_firstline < b.trace_file_firstline;
+             return a.lo < b.lo;
+         });
+    return writes;
+}
+
+namespace {
+// Searcher that counts the nodes of the PC tree whose PC is less than
+// 'pc', by adding up the counts of the subtrees it passes on its left
+// on the way down.
+struct ByPCCountSearcher {
+    Addr pc;
+    LineNo count = 0;
+
+    ByPCCountSearcher(Addr pc) : pc(pc) {}
+
+    int operator()(OFF_T, const ByPCAnnotation *lca, OFF_T,
+                   const ByPCPayload &payload, const ByPCAnnotation &, OFF_T,
+                   const ByPCAnnotation *)
+    {
+        if (payload.pc < pc) {
+            count += (lca ? lca->count.value() : 0) + 1;
+            return +1;
+        }
+        return -1;
+    }
+};
+} // namespace
+
+LineNo IndexNavigator::count_pc_visits(Addr lo, Addr hi) const
+{
+    QueryStats::Timer timer(QueryStats::CountPCVisits);
+    if (lo >= hi)
+        return 0;
+    ByPCCountSearcher below_lo(lo), below_hi(hi);
+    index.bypctree.search(index.bypcroot, ref(below_lo), nullptr);
+    index.bypctree.search(index.bypcroot, ref(below_hi), nullptr);
+    return below_hi.count - below_lo.count;
+}
+
+namespace {
+// Searcher that totals the annotations of all the nodes of the
+// sequence tree before the one containing 'line', by adding up the
+// subtrees and nodes it passes on its left on the way down.
+struct SeqTotalSearcher {
+    LineNo line;
+    SeqOrderAnnotation total;
+
+    SeqTotalSearcher(LineNo line) : line(line) {}
+
+    int operator()(OFF_T, const SeqOrderAnnotation *lca, OFF_T,
+                   const SeqOrderPayload &payload, const SeqOrderAnnotation &,
+                   OFF_T, const SeqOrderAnnotation *)
+    {
+        if (payload.trace_file_firstline < line) {
+            if (lca)
+                total = SeqOrderAnnotation(total, *lca);
+            total = SeqOrderAnnotation(total, SeqOrderAnnotation(payload));
+            return +1;
+        }
+        return -1;
+    }
+};
+} // namespace
+
+bool IndexNavigator::range_stats(LineNo first, LineNo last,
+                                 RangeStats *stats) const
+{
+    QueryStats::Timer timer(QueryStats::RangeStats);
+    SeqOrderPayload start, end;
+    if (first > last || !node_at_line(first, &start) ||
+        !node_at_line(last, &end))
+        return false;
+
+    SeqTotalSearcher before(start.trace_file_firstline);
+    SeqTotalSearcher upto(end.trace_file_firstline + 1);
+    index.seqtree.search(index.seqroot, ref(before), nullptr);
+    index.seqtree.search(index.seqroot, ref(upto), nullptr);
+
+    stats->firstline = start.trace_file_firstline;
+    stats->lines = end.trace_file_firstline + end.trace_file_lines -
+                   start.trace_file_firstline;
+    stats->start_time = start.mod_time;
+    stats->end_time = end.mod_time;
+    stats->instructions =
+        upto.total.instructions - before.total.instructions;
+    stats->memory_reads = upto.total.memory_reads - before.total.memory_reads;
+    stats->memory_writes =
+        upto.total.memory_writes - before.total.memory_writes;
+    stats->cpu_exceptions =
+        upto.total.cpu_exceptions - before.total.cpu_exceptions;
+    return true;
+}
+
+LineNo IndexNavigator::lrt_translate(LineNo line, unsigned mindepth_i,
+                                     unsigned maxdepth_i, unsigned mindepth_o,
+                                     unsigned maxdepth_o) const
 {
     auto pair = lrt_translate_may_fail(line, mindepth_i, maxdepth_i, mindepth_o,
                                        maxdepth_o);
@@ -1867,11 +4404,12 @@ unsigned IndexNavigator::lrt_translate(unsigned line, unsigned mindepth_i,
     return pair.second;
 }
 
-std::pair<bool, unsigned>
-IndexNavigator::lrt_translate_may_fail(unsigned line, unsigned mindepth_i,
+std::pair<bool, LineNo>
+IndexNavigator::lrt_translate_may_fail(LineNo line, unsigned mindepth_i,
                                        unsigned maxdepth_i, unsigned mindepth_o,
                                        unsigned maxdepth_o) const
 {
+    QueryStats::Timer timer(QueryStats::LRTTranslate);
     IndexLRTSearcher searcher(index, line, mindepth_i, maxdepth_i, mindepth_o,
                               maxdepth_o);
     bool success;
@@ -1880,12 +4418,12 @@ IndexNavigator::lrt_translate_may_fail(unsigned line, unsigned mindepth_i,
     } catch (IndexLRTSearcher::OutOfRangeException) {
         success = false;
     }
-    unsigned output = success ? searcher.output_lines : 0;
+    LineNo output = success ? searcher.output_lines : 0;
     return std::make_pair(success, output);
 }
 
-unsigned IndexNavigator::lrt_translate_range(
-    unsigned linestart, unsigned lineend, unsigned mindepth_i,
+LineNo IndexNavigator::lrt_translate_range(
+    LineNo linestart, LineNo lineend, unsigned mindepth_i,
     unsigned maxdepth_i, unsigned mindepth_o, unsigned maxdepth_o) const
 {
     return (
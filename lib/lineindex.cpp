@@ -0,0 +1,226 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#include "libtarmac/lineindex.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/reporter.hh"
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using std::ifstream;
+using std::lower_bound;
+using std::ofstream;
+using std::string;
+using std::upper_bound;
+using std::vector;
+
+constexpr unsigned LineIndex::default_interval;
+
+static const char line_index_magic[] = "tarmac-line-index";
+static const unsigned line_index_version = 1;
+
+// Find the timestamp of one line. If the parser can't make sense of
+// it, treat it as having no timestamp of its own: the full indexer
+// would report the error, but all we need is to keep going.
+static Time line_timestamp(TarmacLineParser &parser, const StringSpan &text,
+                           Time prev)
+{
+    try {
+        return parser.parse_timestamp(text.data, text.size);
+    } catch (TarmacParseError &) {
+        TarmacLineParser::SavedState state;
+        state.timestamp = prev;
+        parser.restore_state(state);
+        return prev;
+    }
+}
+
+static OFF_T next_pos(OFF_T pos, const StringSpan &text, bool terminated)
+{
+    return pos + text.size + (terminated ? 1 : 0);
+}
+
+void LineIndex::build(const TraceSource &src, const ParseParams &pparams,
+                      unsigned interval_)
+{
+    interval = interval_ ? interval_ : 1;
+    trace_size = src.size();
+    anchors.clear();
+
+    ParseReceiver receiver;
+    TarmacLineParser parser(pparams, receiver);
+
+    // A partial line at the end of the file is left out, in case the
+    // program writing the trace hasn't finished it.
+    OFF_T end = src.complete_lines_end();
+    LineNo line = 1, next_anchor = 1;
+    Time time = 0;
+    TraceLineReader reader(src, 0);
+    StringSpan text;
+    bool terminated;
+    while (reader.position() < end) {
+        OFF_T pos = reader.position();
+        reader.get_line(text, terminated);
+        if (line >= next_anchor &&
+            parser.save_state().continued_event_type.empty()) {
+            anchors.push_back({line, pos, time});
+            next_anchor = line + interval;
+        }
+        time = line_timestamp(parser, text, time);
+        line++;
+    }
+    anchors.push_back({line, reader.position(), time});
+}
+
+bool LineIndex::save(const string &filename) const
+{
+    ofstream ofs(filename.c_str(), ofstream::binary);
+    if (ofs.fail())
+        return false;
+    ofs << line_index_magic << " " << line_index_version << "\n"
+        << trace_size << " " << interval << "\n";
+    for (const LineAnchor &a : anchors)
+        ofs << a.line << " " << a.pos << " " << a.time << "\n";
+    ofs.close();
+    return !ofs.fail();
+}
+
+bool LineIndex::load(const string &filename, OFF_T expected_size)
+{
+    ifstream ifs(filename.c_str(), ifstream::binary);
+    string magic;
+    unsigned version;
+    if (!(ifs >> magic >> version) || magic != line_index_magic ||
+        version != line_index_version)
+        return false;
+
+    OFF_T size;
+    unsigned interval_;
+    if (!(ifs >> size >> interval_) || size != expected_size || !interval_)
+        return false;
+
+    vector<LineAnchor> anchors_;
+    LineAnchor a;
+    while (ifs >> a.line >> a.pos >> a.time) {
+        // Check the anchors are in order, so that searching them
+        // can't go wrong, and that the first is at the very start.
+        if (anchors_.empty() ? (a.line != 1 || a.pos != 0)
+                             : (a.line <= anchors_.back().line ||
+                                a.pos <= anchors_.back().pos ||
+                                a.time < anchors_.back().time))
+            return false;
+        anchors_.push_back(a);
+    }
+    if (!ifs.eof() || anchors_.empty() || anchors_.back().pos > size)
+        return false;
+
+    anchors.swap(anchors_);
+    interval = interval_;
+    trace_size = size;
+    return true;
+}
+
+LineAnchor LineIndex::find_line(const TraceSource &src, LineNo line) const
+{
+    if (line >= anchors.back().line)
+        return anchors.back();
+
+    auto it = upper_bound(
+        anchors.begin(), anchors.end(), line,
+        [](LineNo line, const LineAnchor &a) { return line < a.line; });
+    LineAnchor a = *--it;
+    if (a.line == line)
+        return a;
+
+    // Only timestamps are needed here, and finding those doesn't
+    // depend on the parse parameters.
+    ParseReceiver receiver;
+    TarmacLineParser parser(ParseParams(), receiver);
+    TarmacLineParser::SavedState state;
+    state.timestamp = a.time;
+    parser.restore_state(state);
+
+    StringSpan text;
+    bool terminated;
+    while (a.line < line && src.get_line(a.pos, text, terminated)) {
+        a.time = line_timestamp(parser, text, a.time);
+        a.pos = next_pos(a.pos, text, terminated);
+        a.line++;
+    }
+    return a;
+}
+
+LineAnchor LineIndex::find_time(const TraceSource &src,
+                                const ParseParams &pparams, Time t) const
+{
+    // Every line before an anchor has a timestamp no later than the
+    // anchor's, so the line we want is after the last anchor whose
+    // timestamp is earlier than t, and before the next one.
+    auto it = lower_bound(
+        anchors.begin(), anchors.end(), t,
+        [](const LineAnchor &a, Time t) { return a.time < t; });
+    if (it != anchors.begin())
+        --it;
+    LineAnchor a = *it;
+
+    ParseReceiver receiver;
+    TarmacLineParser parser(pparams, receiver);
+    TarmacLineParser::SavedState state;
+    state.timestamp = a.time;
+    parser.restore_state(state);
+
+    const LineAnchor &end = anchors.back();
+    StringSpan text;
+    bool terminated;
+    while (a.pos < end.pos && src.get_line(a.pos, text, terminated)) {
+        Time time = line_timestamp(parser, text, a.time);
+        if (time >= t)
+            return a;
+        a.time = time;
+        a.pos = next_pos(a.pos, text, terminated);
+        a.line++;
+    }
+    return end;
+}
+
+string default_line_index_filename(const string &tarmac_filename)
+{
+    return tarmac_filename + ".lines";
+}
+
+void load_or_build_line_index(LineIndex &lindex, const TraceSource &src,
+                              const string &tarmac_filename,
+                              const string &index_filename,
+                              const ParseParams &pparams, unsigned interval)
+{
+    uint64_t trace_timestamp, index_timestamp;
+    if (get_file_timestamp(tarmac_filename, &trace_timestamp) &&
+        get_file_timestamp(index_filename, &index_timestamp) &&
+        index_timestamp >= trace_timestamp &&
+        lindex.load(index_filename, src.size()) &&
+        lindex.get_interval() == interval)
+        return;
+
+    lindex.build(src, pparams, interval);
+    if (!lindex.save(index_filename))
+        reporter->warn(_("unable to write line index file '%s'"),
+                       index_filename.c_str());
+}
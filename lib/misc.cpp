@@ -25,15 +25,29 @@
 #include <stdarg.h>
 #include <string.h>
 
+#include <algorithm>
+#include <future>
 #include <iostream>
+#include <mutex>
 #include <sstream>
+#include <utility>
+#include <vector>
 
+using std::async;
 using std::clog;
 using std::endl;
+using std::future;
+using std::launch;
+using std::lock_guard;
 using std::make_unique;
+using std::max;
+using std::min;
+using std::mutex;
+using std::pair;
 using std::streampos;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 
 string rpad(const string &s, size_t len, char padvalue)
 {
@@ -59,20 +73,63 @@ class CommandLineReporter : public Reporter {
     void indexing_status(const TracePair &pair,
                          IndexUpdateCheck status) override;
     void indexing_warning(const string &trace_filename,
-                          unsigned lineno, const string &msg) override;
+                          LineNo lineno, const string &msg) override;
     void indexing_error(const string &trace_filename,
-                        unsigned lineno, const string &msg) override;
+                        LineNo lineno, const string &msg) override;
     void indexing_start(streampos total) override;
     void indexing_progress(streampos pos) override;
     void indexing_done() override;
+    void indexing_batch_start() override;
+    void indexing_batch_done() override;
 
-    streampos indexing_total_size;
+    // Output from different threads is serialised by this mutex,
+    // which also protects the data below it.
+    mutex lock;
+
+    // The progress meter covers a batch of indexing runs, which starts
+    // when a run begins while none is in progress, and ends when none
+    // is in progress any more. For a single run at a time, that's the
+    // same as showing the progress of each run by itself. Between
+    // indexing_batch_start and indexing_batch_done (batch_held), the
+    // batch also carries on through any gap between runs.
+    unsigned runs_in_progress = 0, runs_in_batch = 0;
+    long long batch_total_size = 0, batch_pos = 0;
     int last_shown_progress_percentage;
+    bool meter_on_screen = false;
+    bool batch_held = false;
+
+    void start_batch();
+    void finish_batch();
+    void show_progress();
+
+    // Called with the lock held before printing any other message, so
+    // that it doesn't end up on the same line as the progress meter.
+    // The meter is shown again on the next progress update.
+    void interrupt_meter()
+    {
+        if (meter_on_screen) {
+            clog << endl;
+            meter_on_screen = false;
+            last_shown_progress_percentage = -1;
+        }
+    }
 
   public:
     CommandLineReporter() = default;
 };
 
+namespace {
+// State of the indexing run on the current thread, if any, as seen by
+// CommandLineReporter. 'reported' is the amount of its progress that
+// has been added to the batch total, which is only updated after the
+// run has got a little further, so that indexing_progress doesn't
+// have to take the lock on every line of the trace.
+struct IndexingRun {
+    long long total = 0, reported = 0, next_report = 0;
+};
+thread_local IndexingRun this_run;
+} // namespace
+
 unique_ptr<Reporter> make_cli_reporter()
 {
     return make_unique<CommandLineReporter>();
@@ -80,6 +137,8 @@ unique_ptr<Reporter> make_cli_reporter()
 
 [[noreturn]] void CommandLineReporter::err(int exitstatus, const char *fmt, ...)
 {
+    lock_guard<mutex> guard(lock);
+    interrupt_meter();
     va_list ap;
     va_start(ap, fmt);
     vfprintf(stderr, fmt, ap);
@@ -91,6 +150,8 @@ unique_ptr<Reporter> make_cli_reporter()
 
 [[noreturn]] void CommandLineReporter::errx(int exitstatus, const char *fmt, ...)
 {
+    lock_guard<mutex> guard(lock);
+    interrupt_meter();
     va_list ap;
     va_start(ap, fmt);
     vfprintf(stderr, fmt, ap);
@@ -101,6 +162,8 @@ unique_ptr<Reporter> make_cli_reporter()
 
 void CommandLineReporter::warn(const char *fmt, ...)
 {
+    lock_guard<mutex> guard(lock);
+    interrupt_meter();
     va_list ap;
     va_start(ap, fmt);
     vfprintf(stderr, fmt, ap);
@@ -111,6 +174,8 @@ void CommandLineReporter::warn(const char *fmt, ...)
 
 void CommandLineReporter::warnx(const char *fmt, ...)
 {
+    lock_guard<mutex> guard(lock);
+    interrupt_meter();
     va_list ap;
     va_start(ap, fmt);
     vfprintf(stderr, fmt, ap);
@@ -124,6 +189,8 @@ void CommandLineReporter::indexing_status(const TracePair &pair,
     if (!verbose)
         return;
 
+    lock_guard<mutex> guard(lock);
+    interrupt_meter();
     switch (status) {
       case IndexUpdateCheck::InMemory:
         // If index is in memory, no need to print anything
@@ -151,6 +218,18 @@ void CommandLineReporter::indexing_status(const TracePair &pair,
                          pair.index_filename)
                << endl;
           break;
+      case IndexUpdateCheck::MissingParts:
+          clog << format(_("index file {} does not contain everything this "
+                           "tool needs; rebuilding it"),
+                         pair.index_filename)
+               << endl;
+          break;
+      case IndexUpdateCheck::Extending:
+          clog << format(_("trace file {} has grown since index file {} was "
+                           "built; extending it"),
+                         pair.tarmac_filename, pair.index_filename)
+               << endl;
+          break;
       case IndexUpdateCheck::OK:
           clog << format(_("index file {} looks ok; not rebuilding it"),
                          pair.index_filename)
@@ -164,43 +243,115 @@ void CommandLineReporter::indexing_status(const TracePair &pair,
 }
 
 void CommandLineReporter::indexing_warning(const string &trace_filename,
-                                           unsigned lineno, const string &msg)
+                                           LineNo lineno, const string &msg)
 {
+    lock_guard<mutex> guard(lock);
+    interrupt_meter();
     clog << trace_filename << ":" << lineno << ": " << msg << endl;
 }
 
 void CommandLineReporter::indexing_error(const string &trace_filename,
-                                         unsigned lineno, const string &msg)
+                                         LineNo lineno, const string &msg)
 {
+    lock_guard<mutex> guard(lock);
+    interrupt_meter();
     clog << trace_filename << ":" << lineno << ": " << msg << endl;
     exit(1);
 }
 
 void CommandLineReporter::indexing_start(streampos total)
 {
-    last_shown_progress_percentage = -1;
-    indexing_total_size = total;
+    lock_guard<mutex> guard(lock);
+    if (runs_in_progress == 0 && !batch_held)
+        start_batch();
+    runs_in_progress++;
+    runs_in_batch++;
+    batch_total_size += std::streamoff(total);
+
+    this_run.total = std::streamoff(total);
+    this_run.reported = 0;
+    this_run.next_report = 0;
 }
 
 void CommandLineReporter::indexing_progress(streampos pos)
 {
-    if (!progress)
+    long long offset = std::streamoff(pos);
+    if (!progress || offset < this_run.next_report)
         return;
 
-    int percentage = 100 * pos / indexing_total_size;
+    lock_guard<mutex> guard(lock);
+    batch_pos += offset - this_run.reported;
+    this_run.reported = offset;
+    this_run.next_report = offset + max(1LL, this_run.total / 1000);
+    show_progress();
+}
+
+void CommandLineReporter::show_progress()
+{
+    int percentage = 100 * batch_pos / max(1LL, batch_total_size);
     if (percentage != last_shown_progress_percentage) {
         last_shown_progress_percentage = percentage;
-        clog << "\r" << format(_("Reading trace file ({}%)"), percentage);
+        if (runs_in_batch > 1)
+            clog << "\r"
+                 << format(_("Reading {} trace files ({}%)"), runs_in_batch,
+                           percentage);
+        else
+            clog << "\r" << format(_("Reading trace file ({}%)"), percentage);
         clog.flush();
+        meter_on_screen = true;
     }
 }
 
 void CommandLineReporter::indexing_done()
 {
+    lock_guard<mutex> guard(lock);
+    batch_pos += this_run.total - this_run.reported;
+    this_run.reported = this_run.total;
+    runs_in_progress--;
+
     if (!progress)
         return;
 
-    clog << "\r" << _("Reading trace file (finished)") << endl;
+    if (runs_in_progress > 0 || batch_held) {
+        show_progress();
+        return;
+    }
+
+    finish_batch();
+}
+
+void CommandLineReporter::indexing_batch_start()
+{
+    lock_guard<mutex> guard(lock);
+    if (runs_in_progress == 0 && !batch_held)
+        start_batch();
+    batch_held = true;
+}
+
+void CommandLineReporter::indexing_batch_done()
+{
+    lock_guard<mutex> guard(lock);
+    batch_held = false;
+    if (progress && runs_in_progress == 0 && runs_in_batch > 0)
+        finish_batch();
+}
+
+void CommandLineReporter::start_batch()
+{
+    runs_in_batch = 0;
+    batch_total_size = batch_pos = 0;
+    last_shown_progress_percentage = -1;
+}
+
+void CommandLineReporter::finish_batch()
+{
+    meter_on_screen = false;
+    if (runs_in_batch > 1)
+        clog << "\r"
+             << format(_("Reading {} trace files (finished)"), runs_in_batch)
+             << endl;
+    else
+        clog << "\r" << _("Reading trace file (finished)") << endl;
 }
 
 OFF_T Arena::alloc(size_t size)
@@ -215,6 +366,81 @@ OFF_T Arena::alloc(size_t size)
     return ret;
 }
 
+OFF_T Arena::alloc(size_t size, ArenaPool pool)
+{
+    if (pool == ArenaPool::General)
+        return alloc(size);
+
+    Extent &e = extents[(size_t)pool];
+    if ((size_t)(e.end - e.next) < size) {
+        // Make each extent an eighth of the pool so far, within
+        // limits, so that the unused end of the last one is never
+        // much of the file.
+        OFF_T extent_size = max<OFF_T>(
+            min<OFF_T>(e.total / 8, 4 << 20), 64 << 10);
+        extent_size = max<OFF_T>(extent_size, size);
+        if (e.end)
+            finished_extents.emplace_back(e.start, e.end);
+        e.start = e.next = alloc(extent_size);
+        e.end = e.next + extent_size;
+        e.total += extent_size;
+    }
+    OFF_T ret = e.next;
+    e.next += size;
+    return ret;
+}
+
+std::atomic<bool> ArenaAccessCounts::enabled{false};
+thread_local ArenaAccessCounts ArenaAccessCounts::current;
+
+void Arena::take_finished_extents(vector<pair<OFF_T, OFF_T>> &out)
+{
+    out.insert(out.end(), finished_extents.begin(), finished_extents.end());
+    finished_extents.clear();
+}
+
+void Arena::advise(AccessPattern pattern)
+{
+    access_pattern = pattern;
+    if (mapping)
+        advise_memory(mapping, curr_size, pattern);
+}
+
+void Arena::write_back(OFF_T, OFF_T, bool)
+{
+    // An arena in ordinary memory has no file to write back to.
+}
+
+void Arena::prefault(unsigned nthreads) const
+{
+    if (!mapping || !next_offset)
+        return;
+
+    // Touching one byte per page is enough to fault it in. A small
+    // page size is assumed, which at worst touches pages more than
+    // once.
+    const size_t page = 4096;
+    size_t npages = (next_offset + page - 1) / page;
+    nthreads = max(1U, min(nthreads, (unsigned)(npages / 256 + 1)));
+
+    auto touch = [this, page, npages, nthreads](unsigned thread) {
+        const volatile char *p = (const volatile char *)mapping;
+        size_t lo = npages * thread / nthreads;
+        size_t hi = npages * (thread + 1) / nthreads;
+        char sum = 0;
+        for (size_t i = lo; i < hi; i++)
+            sum += p[i * page];
+        return sum;
+    };
+
+    vector<future<char>> workers;
+    for (unsigned i = 1; i < nthreads; i++)
+        workers.push_back(async(launch::async, touch, i));
+    touch(0);
+    for (auto &w : workers)
+        w.get();
+}
+
 MemArena::~MemArena()
 {
     free(mapping);
@@ -226,6 +452,8 @@ void MemArena::resize(size_t newsize)
     if (!mapping)
         reporter->errx(1, _("Out of memory"));
     curr_size = newsize;
+    if (access_pattern != AccessPattern::Normal)
+        advise_memory(mapping, curr_size, access_pattern);
 }
 
 static std::wstring string_to_wstring(const std::string &str)
@@ -32,14 +32,13 @@
 #include <cmath>
 #include <set>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <utility>
 #include <vector>
 
 using std::back_inserter;
-using std::begin;
 using std::copy_if;
-using std::end;
 using std::endl;
 using std::max;
 using std::ostringstream;
@@ -48,39 +47,173 @@ using std::set;
 using std::string;
 using std::vector;
 
-// This can be replaced with std::string::starts_with once C++20 is old enough.
-static bool starts_with(const std::string &str, const char *prefix)
+// This can be replaced with std::string_view::starts_with once C++20 is old
+// enough.
+static bool starts_with(StringSpan str, const char *prefix)
 {
     size_t prefix_len = strlen(prefix);
-    return str.size() >= prefix_len && str.compare(0, prefix_len, prefix) == 0;
+    return str.size >= prefix_len && !memcmp(str.data, prefix, prefix_len);
 }
 
-// This can be replaced with std::string::ends_with once C++20 is old enough.
-static bool ends_with(const std::string &str, const char *suffix)
+// This can be replaced with std::string_view::ends_with once C++20 is old
+// enough.
+static bool ends_with(StringSpan str, const char *suffix)
 {
     size_t suffix_len = strlen(suffix);
-    return str.size() >= suffix_len &&
-           str.compare(str.size() - suffix_len, suffix_len, suffix) == 0;
+    return str.size >= suffix_len &&
+           !memcmp(str.data + str.size - suffix_len, suffix, suffix_len);
 }
 
-static bool contains_only(const std::string &str, const char *permitted_chars)
+// Return the index of the first character of 'str' not in
+// 'permitted_chars', or str.size if there isn't one.
+static size_t span_not_of(StringSpan str, const char *permitted_chars)
 {
-    return str.find_first_not_of(permitted_chars) == string::npos;
+    size_t i = 0;
+    while (i < str.size && str.data[i] && strchr(permitted_chars, str.data[i]))
+        i++;
+    return i;
 }
 
+static bool contains_only(StringSpan str, const char *permitted_chars)
+{
+    return span_not_of(str, permitted_chars) == str.size;
+}
+
+// Return the index of the first character of 'str' that is in
+// 'chars', or str.size if there isn't one.
+static size_t strcspn_span(StringSpan str, const char *chars)
+{
+    size_t i = 0;
+    while (i < str.size && !(str.data[i] && strchr(chars, str.data[i])))
+        i++;
+    return i;
+}
+
+// Convert a string of digits to an integer, in the manner of stoull,
+// including throwing std::out_of_range if the value doesn't fit.
+static uint64_t span_to_integer(StringSpan str, unsigned base)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < str.size; i++) {
+        char c = str.data[i];
+        unsigned digit = (c >= '0' && c <= '9'   ? c - '0'
+                          : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                                                 : c - 'A' + 10);
+        if (value > (UINT64_MAX - digit) / base)
+            throw std::out_of_range("span_to_integer");
+        value = value * base + digit;
+    }
+    return value;
+}
+
+// All the words that the parser looks for by name. Recognising these
+// in a token is done by a single lookup in a table, after which they
+// can be compared as enum values, instead of repeatedly comparing the
+// text of the token against string literals.
+#define TARMAC_KEYWORDS(K)                                                     \
+    /* Instruction-set states */                                               \
+    K(A) K(T) K(T16) K(T32) K(O)                                               \
+    /* Event types the parser understands */                                   \
+    K(IT) K(IS) K(IF) K(ES) K(R) K(LD) K(ST) K(E) K(EXC) K(Tarmac)             \
+    K(R01) K(R02) K(R04) K(R08) K(W01) K(W02) K(W04) K(W08)                    \
+    /* Event types treated as text-only without a warning */                   \
+    K(CADI) K(P) K(CACHE) K(TTW) K(BR) K(INFO_EXCEPTION_REASON) K(SIGNAL)      \
+    /* Other keywords found within events */                                   \
+    K(Reset) K(CCFAIL) K(X) K(ABORTED)                                         \
+    /* System operations that look like register updates */                    \
+    K(DC) K(IC) K(TLBI) K(AT)                                                  \
+    /* Timestamp units */                                                      \
+    K(clk) K(ns) K(cs) K(cyc) K(tic) K(ps) K(us)                               \
+    /* end of list */
+
+#define MAKE_KEYWORD_ENUM(kw) kw,
+enum class Keyword : uint8_t {
+    None,
+    TARMAC_KEYWORDS(MAKE_KEYWORD_ENUM)
+    NotLookedUp,
+};
+#undef MAKE_KEYWORD_ENUM
+
+struct KeywordInfo {
+    const char *text;
+    size_t len;
+    Keyword kw;
+};
+
+// The keyword table, sorted on (length, text) so that it can be
+// binary-searched.
+static const vector<KeywordInfo> keyword_table = []() {
+    vector<KeywordInfo> table = {
+#define MAKE_KEYWORD_TABLE_ENTRY(kw) {#kw, sizeof(#kw) - 1, Keyword::kw},
+        TARMAC_KEYWORDS(MAKE_KEYWORD_TABLE_ENTRY)
+#undef MAKE_KEYWORD_TABLE_ENTRY
+    };
+    std::sort(table.begin(), table.end(),
+              [](const KeywordInfo &a, const KeywordInfo &b) {
+                  return a.len != b.len ? a.len < b.len
+                                        : strcmp(a.text, b.text) < 0;
+              });
+    return table;
+}();
+
+static Keyword lookup_keyword(StringSpan word)
+{
+    auto it = std::lower_bound(
+        keyword_table.begin(), keyword_table.end(), word,
+        [](const KeywordInfo &info, StringSpan word) {
+            return info.len != word.size
+                       ? info.len < word.size
+                       : memcmp(info.text, word.data, word.size) < 0;
+        });
+    if (it != keyword_table.end() && it->len == word.size &&
+        !memcmp(it->text, word.data, word.size))
+        return it->kw;
+    return Keyword::None;
+}
+
+static const char *keyword_text(Keyword kw)
+{
+    for (const KeywordInfo &info : keyword_table)
+        if (info.kw == kw)
+            return info.text;
+    return nullptr;
+}
+
+static bool is_timestamp_unit(Keyword kw)
+{
+    switch (kw) {
+    case Keyword::clk:
+    case Keyword::ns:
+    case Keyword::cs:
+    case Keyword::cyc:
+    case Keyword::tic:
+    case Keyword::ps:
+    case Keyword::us:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// A token of a Tarmac line. The text of a word token is a span
+// pointing into the line being parsed, so tokens are cheap to make and
+// copy, and must not outlive that line (but see detached()).
 struct Token {
     static constexpr const char *decimal_digits = "0123456789";
     static constexpr const char *float_chars = "0123456789.";
     static constexpr const char *hex_digits = "0123456789ABCDEFabcdef";
     static constexpr const char *regvalue_chars = "0123456789ABCDEFabcdef_-xX";
 
-    size_t startpos, endpos;
-    char c;   // '\0' if this is a word/EOL, otherwise a single punct character
-    string s; // if c == '\0', the text of the word, or "" for EOL
+    size_t startpos = 0, endpos = 0;
+    char c;       // '\0' if this is a word/EOL, otherwise a single punct character
+    StringSpan s; // if c == '\0', the text of the word, or empty for EOL
+
+    // Looked up in the keyword table the first time it's needed
+    mutable Keyword kw = Keyword::NotLookedUp;
 
-    Token() : c('\0'), s("") {}
-    Token(char c) : c(c), s("") {}
-    Token(const string &s) : c('\0'), s(s) {}
+    Token() : c('\0') {}
+    Token(char c) : c(c) {}
+    Token(StringSpan s) : c('\0'), s(s) {}
 
     inline Token &setpos(size_t start, size_t end)
     {
@@ -89,8 +222,8 @@ struct Token {
         return *this;
     }
 
-    inline bool iseol() const { return c == '\0' && s.size() == 0; }
-    inline bool isword() const { return c == '\0' && s.size() > 0; }
+    inline bool iseol() const { return c == '\0' && s.size == 0; }
+    inline bool isword() const { return c == '\0' && s.size > 0; }
     inline bool isword(const char *permitted_chars) const
     {
         return isword() && contains_only(s, permitted_chars);
@@ -99,7 +232,7 @@ struct Token {
     inline uint64_t decimalvalue() const
     {
         assert(isdecimal());
-        return stoull(s, NULL, 10);
+        return span_to_integer(s, 10);
     }
     inline bool isfloat() const { return isword(float_chars); }
     inline uint64_t decimalvaluefromfloat() const
@@ -107,7 +240,7 @@ struct Token {
         assert(isfloat());
         // Timestamp encountered as xxx.yyyyyyyyus - just multiply by 1e6
         // to make them an integer.
-        return static_cast<uint64_t>(round(stold(s, NULL) * 1000000.f));
+        return static_cast<uint64_t>(round(stold(s.str(), NULL) * 1000000.f));
     }
     inline bool ishex() const { return isword(hex_digits); }
     inline bool isregvalue() const { return isword(regvalue_chars); }
@@ -119,7 +252,7 @@ struct Token {
             return false;
         for (const char *suffix : {"_S", "_NS", ""}) {
             if (ends_with(s, suffix))
-                return contains_only(s.substr(0, s.size() - strlen(suffix)),
+                return contains_only(s.sub(0, s.size - strlen(suffix)),
                                      hex_digits);
         }
         return false;
@@ -127,39 +260,66 @@ struct Token {
     inline uint64_t hexvalue() const
     {
         assert(ishex());
-        return stoull(s, NULL, 16);
+        return span_to_integer(s, 16);
     }
     inline bool ishyphens() const
     {
         return isword() && contains_only(s, "-");
     }
-    inline int length() const { return isword() ? s.size() : 1; }
+    inline int length() const { return isword() ? s.size : 1; }
 
-    inline bool starts_with(const char *prefix)
+    inline bool starts_with(const char *prefix) const
     {
         return ::starts_with(s, prefix);
     }
 
-    void remove_chars(const char *chars)
+    inline Keyword keyword() const
+    {
+        if (kw == Keyword::NotLookedUp)
+            kw = isword() ? lookup_keyword(s) : Keyword::None;
+        return kw;
+    }
+
+    // Return a copy of this token, which must be a keyword, whose text
+    // points into the keyword table instead of the line being parsed,
+    // so that it can be kept after the line has gone away.
+    Token detached() const
     {
-        size_t i = 0, j = 0;
-        while ((j = s.find_first_not_of(chars, j)) != string::npos)
-            s[i++] = s[j++];
-        s.resize(i);
+        Token ret = *this;
+        const char *text = keyword_text(keyword());
+        assert(text);
+        ret.s = StringSpan(text, s.size);
+        return ret;
+    }
+
+    // Return a token covering 'len' characters of this one starting
+    // at 'pos'.
+    Token sub(size_t pos, size_t len) const
+    {
+        assert(isword());
+        Token ret(s.sub(pos, len));
+        ret.setpos(startpos + pos, startpos + pos + ret.s.size);
+        return ret;
     }
 
     inline bool operator==(const Token &rhs) const
     {
-        return (c == rhs.c && (!isword() || s == rhs.s));
+        return (c == rhs.c &&
+                (!isword() || (s.size == rhs.s.size &&
+                               !memcmp(s.data, rhs.s.data, s.size))));
     }
     inline bool operator==(const char c_) const
     {
         assert(c_ != '\0');
         return c == c_;
     }
-    inline bool operator==(const string &s_) const
+    inline bool operator==(Keyword kw_) const
+    {
+        return keyword() == kw_;
+    }
+    inline bool operator==(const char *s_) const
     {
-        return isword() && s == s_;
+        return isword() && s.size == strlen(s_) && !memcmp(s.data, s_, s.size);
     }
     template <class T> inline bool operator!=(const T &rhs) const
     {
@@ -168,12 +328,7 @@ struct Token {
 
     pair<Token, Token> split(size_t pos) const {
         assert(isword());
-
-        pair<Token, Token> p{ Token(s.substr(0, pos)), Token(s.substr(pos)) };
-
-        p.first.setpos(startpos, startpos + pos);
-        p.second.setpos(startpos + pos, endpos);
-        return p;
+        return {sub(0, pos), sub(pos, s.size - pos)};
     }
 };
 
@@ -198,9 +353,10 @@ class TarmacLineParserImpl {
         bool event_type_is_continuable = false;
 
         // If event_type_is_continuable is true, this stores the
-        // event-type token from the previous line. The startpos and
-        // endpos values will therefore be indices into a string that
-        // has already been thrown away, so don't use them.
+        // event-type token from the previous line, detached from that
+        // line's text. The startpos and endpos values will be indices
+        // into a line that has already been thrown away, so don't use
+        // them.
         Token event_type_token;
 
         // We recognise continuations of LD and ST lines by leading
@@ -209,9 +365,22 @@ class TarmacLineParserImpl {
         // this variable stores the starting position of the token
         // after the LD or ST, i.e. the address.
         size_t post_event_type_start = 0;
+
+        bool operator==(const InterLineState &rhs) const
+        {
+            if (timestamp != rhs.timestamp ||
+                event_type_is_continuable != rhs.event_type_is_continuable)
+                return false;
+            if (!event_type_is_continuable)
+                return true; // the remaining fields are unused
+            return (event_type_token == rhs.event_type_token &&
+                    post_event_type_start == rhs.post_event_type_start);
+        }
     };
 
-    string line;
+    // The line being parsed, which belongs to our caller, and is only
+    // valid during a call to parse().
+    const char *line;
     size_t pos, size;
     const ParseParams &params;
     set<string> unrecognised_registers_already_reported;
@@ -220,14 +389,61 @@ class TarmacLineParserImpl {
     ParseReceiver *receiver;
     InterLineState next_line;
 
-    static set<string> known_timestamp_units;
+    // Scratch space reused from one line to the next, so that parsing
+    // a line doesn't have to allocate memory once these have grown
+    // large enough.
+    string scratch_token_text;
+    string reg_contents;
+    vector<uint16_t> reg_bytes;
+    vector<uint8_t> reg_realbytes;
+
+    // Dialect detection for the fast path (see parse()).
+    enum class Dialect { Unknown, FastModels, Other };
+    static constexpr unsigned DIALECT_DETECTION_LINES = 64;
+    TarmacLineParser::FastPath fast_path;
+    Dialect dialect;
+    unsigned detection_lines, detection_hits;
+    unsigned long long fast_lines;
 
     TarmacLineParserImpl(const ParseParams &params, ParseReceiver *receiver)
-        : params(params), receiver(receiver)
+        : line(nullptr), pos(0), size(0), params(params), receiver(receiver),
+          fast_path(TarmacLineParser::FastPath::Auto),
+          dialect(Dialect::Unknown), detection_lines(0), detection_hits(0),
+          fast_lines(0)
+    {
+    }
+
+    // The text of the line from 'start' to the end, as an owned string
+    // suitable for storing in an event.
+    string rest_of_line(size_t start) const
+    {
+        return string(line + start, size - start);
+    }
+    StringSpan rest_of_line_span(size_t start) const
+    {
+        return StringSpan(line + start, size - start);
+    }
+
+    // Return a version of tok with all of 'chars' removed from it. If
+    // there were any, the new token's text lives in
+    // scratch_token_text, so only one such token can exist at a time.
+    Token remove_chars(const Token &tok, const char *chars)
     {
+        if (!tok.isword() || tok.s.size == strcspn_span(tok.s, chars))
+            return tok;
+
+        scratch_token_text.clear();
+        for (size_t i = 0; i < tok.s.size; i++)
+            if (!strchr(chars, tok.s.data[i]))
+                scratch_token_text.push_back(tok.s.data[i]);
+
+        Token ret(StringSpan(scratch_token_text.data(),
+                             scratch_token_text.size()));
+        ret.setpos(tok.startpos, tok.endpos);
+        return ret;
     }
 
-    inline bool iswordchr(char c)
+    static bool iswordchr(char c)
     {
         return isalnum((unsigned char)c) || c == '_' || c == '-' || c == '.' ||
                c == '#';
@@ -243,10 +459,10 @@ class TarmacLineParserImpl {
     }
 
     [[noreturn]] void lex_error(size_t pos) {
-        highlight(pos, line.size(), HL_ERROR);
+        highlight(pos, size, HL_ERROR);
         ostringstream os;
         os << "Unrecognised token" << endl;
-        os << line << endl;
+        os << rest_of_line(0) << endl;
         os << string(pos, ' ') << "^" << endl;
         throw TarmacParseError(os.str());
     }
@@ -256,7 +472,7 @@ class TarmacLineParserImpl {
         highlight(tok, HL_ERROR);
         ostringstream os;
         os << msg << endl;
-        os << line << endl;
+        os << rest_of_line(0) << endl;
         os << string(tok.startpos, ' ')
            << string(max((size_t)1, tok.endpos - tok.startpos), '^') << endl;
         throw TarmacParseError(os.str());
@@ -300,7 +516,7 @@ class TarmacLineParserImpl {
         while (pos < size && iswordchr(line[pos]))
             pos++;
         if (pos > start) {
-            Token ret(line.substr(start, pos - start));
+            Token ret(StringSpan(line + start, pos - start));
             ret.setpos(start, pos);
             return ret;
         }
@@ -312,11 +528,12 @@ class TarmacLineParserImpl {
     static bool parse_iset_state(const Token &tok, ISet *output)
     {
         ISet iset;
-        if (tok == "A")
+        Keyword kw = tok.keyword();
+        if (kw == Keyword::A)
             iset = ARM;
-        else if (tok == "T" || tok == "T16" || tok == "T32")
+        else if (kw == Keyword::T || kw == Keyword::T16 || kw == Keyword::T32)
             iset = THUMB;
-        else if (tok == "O")
+        else if (kw == Keyword::O)
             iset = A64;
         else
             return false;
@@ -326,35 +543,26 @@ class TarmacLineParserImpl {
         return true;
     }
 
-    void parse(const string &line_)
+    // Set up the lexer to read a line, and lex it as far as the
+    // event type token, which is returned. The line's timestamp is
+    // written to 'time', and also recorded in next_line.
+    Token lex_line_start(const char *line_data, size_t line_len,
+                         const InterLineState &prev_line, Time &time)
     {
-        // Get the inter-line state referring to the previous line,
-        // and replace it with a default-constructed InterLineState
-        // which we can update if we need to remember anything from
-        // _this_ line until the next.
-        InterLineState prev_line;
-        std::swap(prev_line, next_line);
-
-        // Constants used in 'byte' arrays for register and memory updates, to
-        // represent special values that aren't ordinary bytes.
-        constexpr uint16_t UNUSED = 0x100, UNKNOWN = 0x101;
-
-        // Set up the lexer.
-        line = line_;
+        line = line_data;
         pos = 0;
-        size = line.find_last_not_of("\r\n");
-        if (size != string::npos)
-            size++;
-        else
-            size = line.size();
-        line.resize(size);
+        size = line_len;
+        while (size > 0 && (line[size - 1] == '\r' || line[size - 1] == '\n'))
+            size--;
+        if (size == 0)
+            size = line_len; // a line of nothing but \r and \n is left alone
 
         // Fetch the first token.
         Token tok = lex();
 
         // Tarmac lines often, but not always, start with a timestamp.
         // If they don't, we default to the previous timestamp.
-        Time time = prev_line.timestamp;
+        time = prev_line.timestamp;
 
         // Before even checking for a timestamp on this line, see if
         // this looks like a continuation of a previous LD or ST
@@ -372,27 +580,24 @@ class TarmacLineParserImpl {
                 highlight(tok, HL_TIMESTAMP);
                 tok = lex();
 
-                if (tok.isword() && (known_timestamp_units.find(tok.s) !=
-                                     known_timestamp_units.end()))
+                if (is_timestamp_unit(tok.keyword()))
                     tok = lex();
             } else if (tok.isfloat()) {
                 time = tok.decimalvaluefromfloat();
                 highlight(tok, HL_TIMESTAMP);
                 tok = lex();
 
-                if (tok.isword() && (known_timestamp_units.find(tok.s) !=
-                                     known_timestamp_units.end()))
+                if (is_timestamp_unit(tok.keyword()))
                     tok = lex();
             } else {
                 // Another possibility is that the timestamp and its unit
                 // are smushed together in a single token, with no
                 // intervening space.
                 if (tok.isword()) {
-                    size_t end_of_digits =
-                        tok.s.find_first_not_of(Token::float_chars);
-                    if (end_of_digits > 0 && end_of_digits != string::npos &&
-                        (known_timestamp_units.find(tok.s.substr(
-                             end_of_digits)) != known_timestamp_units.end())) {
+                    size_t end_of_digits = span_not_of(tok.s, Token::float_chars);
+                    if (end_of_digits > 0 && end_of_digits != tok.s.size &&
+                        is_timestamp_unit(
+                            lookup_keyword(tok.s.sub(end_of_digits)))) {
                         auto pair = tok.split(end_of_digits);
                         if (pair.first.isdecimal()) {
                             time = pair.first.decimalvalue();
@@ -416,10 +621,318 @@ class TarmacLineParserImpl {
             tok = lex();
         }
 
+        return tok;
+    }
+
+    // Find only the timestamp of a line, and remember as much about
+    // it as the next line will need, without parsing the rest.
+    Time parse_timestamp(const char *line_data, size_t line_len)
+    {
+        InterLineState prev_line;
+        std::swap(prev_line, next_line);
+
+        Time time;
+        Token tok = lex_line_start(line_data, line_len, prev_line, time);
+        if (tok == Keyword::LD || tok == Keyword::ST) {
+            next_line.event_type_is_continuable = true;
+            next_line.event_type_token = tok.detached();
+            next_line.post_event_type_start = lex().startpos;
+        }
+        return time;
+    }
+
+    // A cursor over a line for the fast path, which splits it into
+    // the same words and punctuation as lex() would, without making
+    // Tokens or calling highlight().
+    struct FastCursor {
+        const char *p, *end;
+
+        void skip_space()
+        {
+            while (p < end && isspace((unsigned char)*p))
+                p++;
+        }
+        // Return the next word, or an empty span if the next thing
+        // isn't one.
+        StringSpan word()
+        {
+            skip_space();
+            const char *start = p;
+            while (p < end && iswordchr(*p))
+                p++;
+            return StringSpan(start, p - start);
+        }
+        bool punct(char c)
+        {
+            skip_space();
+            if (p < end && *p == c) {
+                p++;
+                return true;
+            }
+            return false;
+        }
+        bool at_eol()
+        {
+            skip_space();
+            return p == end;
+        }
+    };
+
+    static bool is_hex_digit(char c)
+    {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+               (c >= 'A' && c <= 'F');
+    }
+
+    // A word of hex digits, short enough for span_to_integer to be sure
+    // not to throw. (Longer ones are left to the general parser, which
+    // reports them.)
+    static bool is_short_hex(StringSpan s)
+    {
+        if (s.size == 0 || s.size > 16)
+            return false;
+        for (size_t i = 0; i < s.size; i++)
+            if (!is_hex_digit(s.data[i]))
+                return false;
+        return true;
+    }
+
+    // The hex digits of a word made of hex digits and underscores,
+    // with the underscores removed, or false if it has anything else
+    // in it or no digits at all.
+    bool hex_without_underscores(StringSpan s, string &out)
+    {
+        out.clear();
+        for (size_t i = 0; i < s.size; i++) {
+            char c = s.data[i];
+            if (is_hex_digit(c))
+                out.push_back(c);
+            else if (c != '_')
+                return false;
+        }
+        return !out.empty();
+    }
+
+    // The fast path for the Fast Models dialect, which gem5 also writes
+    // with a cpu identifier after the timestamp. It handles lines of
+    // these shapes, which are nearly all of a trace in that dialect:
+    //
+    //   <time> clk IT (<count>) <address> <encoding> <iset> <mode> : <disassembly>
+    //   <time> clk R <register> <value>
+    //   <time> clk MW<size> <address>[:<physical address>] <value>
+    //
+    // Each check below matches what the general parser would do with
+    // the same line, and for anything else (a line in a different
+    // shape, or one the general parser would warn about, or deliver
+    // more than one event for) this returns false having done nothing,
+    // and the general parser deals with it.
+    bool parse_fast_models(const char *line_data, size_t line_len)
+    {
+        size_t len = line_len;
+        while (len > 0 &&
+               (line_data[len - 1] == '\r' || line_data[len - 1] == '\n'))
+            len--;
+        FastCursor cur{line_data, line_data + len};
+
+        StringSpan w = cur.word();
+        if (w.size == 0 || w.size > 19 || !contains_only(w, Token::decimal_digits))
+            return false;
+        Time time = span_to_integer(w, 10);
+
+        w = cur.word();
+        if (is_timestamp_unit(lookup_keyword(w)))
+            w = cur.word();
+        if (starts_with(w, "cpu"))
+            w = cur.word();
+
+        bool ok;
+        if (w.size == 2 && w.data[0] == 'I' &&
+            (w.data[1] == 'T' || w.data[1] == 'S'))
+            ok = fast_instruction(cur, time, w.data[1] == 'S');
+        else if (w.size == 1 && w.data[0] == 'R')
+            ok = fast_register(cur, time);
+        else if (w.size == 3 && w.data[0] == 'M')
+            ok = fast_memory(cur, time, w);
+        else
+            ok = false;
+
+        if (ok) {
+            next_line = InterLineState();
+            next_line.timestamp = time;
+        }
+        return ok;
+    }
+
+    bool fast_instruction(FastCursor &cur, Time time, bool ccfail)
+    {
+        // The bracketed instruction count is all that tells this
+        // layout apart from others that put something else in the
+        // brackets.
+        if (!cur.punct('('))
+            return false;
+        StringSpan count = cur.word();
+        if (count.size == 0 || !contains_only(count, Token::decimal_digits) ||
+            !cur.punct(')'))
+            return false;
+
+        StringSpan address = cur.word();
+        StringSpan encoding = cur.word();
+        if (!is_short_hex(address) || !is_short_hex(encoding) ||
+            parse_iset_state(Token(encoding), nullptr))
+            return false;
+
+        ISet iset;
+        if (!parse_iset_state(Token(cur.word()), &iset))
+            return false;
+        if (cur.word().size == 0 || !cur.punct(':'))
+            return false; // no CPU mode
+        cur.skip_space();
+        if (cur.p < cur.end && !iswordchr(*cur.p) &&
+            !strchr(":()[],<>", *cur.p))
+            return false; // lex() would fail on the disassembly
+
+        InstructionEventView ev(time, ccfail ? IE_CCFAIL : IE_EXECUTED,
+                                span_to_integer(address, 16), iset,
+                                encoding.size * 4,
+                                span_to_integer(encoding, 16),
+                                StringSpan(cur.p, cur.end - cur.p));
+        receiver->got_event_view(ev);
+        return true;
+    }
+
+    bool fast_register(FastCursor &cur, Time time)
+    {
+        StringSpan name = cur.word();
+        StringSpan value = cur.word();
+        if (name.size == 0 || value.size == 0 || !cur.at_eol())
+            return false;
+
+        Keyword kw = lookup_keyword(name);
+        if (kw == Keyword::DC || kw == Keyword::IC || kw == Keyword::TLBI ||
+            kw == Keyword::AT)
+            return false;
+        RegisterId reg;
+        string &regname = scratch_token_text;
+        regname.assign(name.data, name.size);
+        if (!lookup_reg_name(reg, regname) || reg.prefix == RegPrefix::fpcr ||
+            !strcasecmp(regname.c_str(), "sp") ||
+            !strncasecmp(regname.c_str(), "sp_", 3))
+            return false;
+
+        string &contents = reg_contents;
+        if (!hex_without_underscores(value, contents))
+            return false;
+        if (reg.prefix == RegPrefix::psr && regname == "cpsr") {
+            // Normalised to 32 bits, as in the general parser.
+            if (contents.size() < 8)
+                contents.insert(0, 8 - contents.size(), '0');
+            contents.erase(0, contents.size() - 8);
+        } else if (contents.size() != 2 * reg_size(reg)) {
+            return false;
+        }
+
+        // The value is written most significant byte first.
+        vector<uint8_t> &bytes = reg_realbytes;
+        size_t nbytes = contents.size() / 2;
+        bytes.resize(nbytes);
+        for (size_t i = 0; i < nbytes; i++)
+            bytes[nbytes - 1 - i] = span_to_integer(
+                StringSpan(contents.data() + 2 * i, 2), 16);
+
+        RegisterEventView ev(time, reg, 0, bytes.data(), nbytes);
+        receiver->got_event_view(ev);
+        return true;
+    }
+
+    bool fast_memory(FastCursor &cur, Time time, StringSpan type)
+    {
+        char rw = type.data[1], size = type.data[2];
+        if ((rw != 'R' && rw != 'W') ||
+            (size != '1' && size != '2' && size != '4' && size != '8'))
+            return false;
+
+        StringSpan address = cur.word();
+        if (!is_short_hex(address))
+            return false;
+        if (cur.punct(':')) {
+            // A physical address, which is ignored.
+            Token phys(cur.word());
+            if (!phys.ishexwithoptionalnamespace())
+                return false;
+        }
+
+        string &contents = reg_contents;
+        if (!hex_without_underscores(cur.word(), contents) ||
+            contents.size() > 16)
+            return false;
+
+        MemoryEvent ev(time, rw == 'R', size - '0',
+                       span_to_integer(address, 16), true,
+                       span_to_integer(
+                           StringSpan(contents.data(), contents.size()), 16));
+        receiver->got_event(ev);
+        return true;
+    }
+
+    void parse(const char *line_data, size_t line_len)
+    {
+        // Most traces are in a single dialect. If the fast path for one
+        // fits most of the first lines, it's tried on every line after
+        // that; if not, the general parser is left to deal with them
+        // all, without wasting time on the fast path first.
+        bool try_fast;
+        switch (fast_path) {
+        case TarmacLineParser::FastPath::Always:
+            try_fast = true;
+            break;
+        case TarmacLineParser::FastPath::Never:
+            try_fast = false;
+            break;
+        default:
+            try_fast = dialect != Dialect::Other &&
+                       !receiver->wants_highlights();
+            break;
+        }
+
+        if (try_fast && !next_line.event_type_is_continuable) {
+            bool fast = parse_fast_models(line_data, line_len);
+            if (dialect == Dialect::Unknown) {
+                detection_hits += fast;
+                if (++detection_lines == DIALECT_DETECTION_LINES)
+                    dialect = detection_hits * 2 >= detection_lines
+                                  ? Dialect::FastModels
+                                  : Dialect::Other;
+            }
+            if (fast) {
+                fast_lines++;
+                return;
+            }
+        }
+
+        parse_general(line_data, line_len);
+    }
+
+    void parse_general(const char *line_data, size_t line_len)
+    {
+        // Get the inter-line state referring to the previous line,
+        // and replace it with a default-constructed InterLineState
+        // which we can update if we need to remember anything from
+        // _this_ line until the next.
+        InterLineState prev_line;
+        std::swap(prev_line, next_line);
+
+        // Constants used in 'byte' arrays for register and memory updates, to
+        // represent special values that aren't ordinary bytes.
+        constexpr uint16_t UNUSED = 0x100, UNKNOWN = 0x101;
+
+        Time time;
+        Token tok = lex_line_start(line_data, line_len, prev_line, time);
+
         // Now we definitely expect an event type, and we diverge
         // based on what it is.
         highlight(tok, HL_EVENT);
-        if (tok == "IT" || tok == "IS" || tok == "IF" || tok == "ES") {
+        if (tok == Keyword::IT || tok == Keyword::IS || tok == Keyword::IF ||
+            tok == Keyword::ES) {
             // An instruction-execution (or non-execution) event.
 
             // The "IS" event is Fast-Models-speak for 'instruction
@@ -431,20 +944,18 @@ class TarmacLineParserImpl {
             // "IF" can appear in some RTL-generated Tarmac. We treat
             // it just like IT.
             InstructionEffect effect = IE_EXECUTED;
-            if (tok == "IS")
+            if (tok == Keyword::IS)
                 effect = IE_CCFAIL;
 
-            bool is_ES = (tok == "ES");
-
-            const Token firsttok = tok;
+            bool is_ES = (tok == Keyword::ES);
 
             tok = lex();
-            if (tok == "EXC" || tok == "Reset") {
+            if (tok == Keyword::EXC || tok == Keyword::Reset) {
                 // Sometimes used to report an exception event relating to the
                 // instruction, e.g. because it was illegal. We abandon parsing
                 // this as an instruction event, and treat it as an exception.
                 tok = lex(); // now tok.startpos begins unparsed text
-                highlight(tok.startpos, line.size(), HL_TEXT_EVENT);
+                highlight(tok.startpos, size, HL_TEXT_EVENT);
                 ExceptionEvent ev(time);
                 receiver->got_event(ev);
                 return;
@@ -624,7 +1135,7 @@ class TarmacLineParserImpl {
                 iset = params.iset;
             } else {
                 highlight(tok, HL_ISET);
-                if (tok == "T16" || tok == "T32")
+                if (tok == Keyword::T16 || tok == Keyword::T32)
                     t16_t32_state = true;
                 tok = lex();
 
@@ -657,7 +1168,7 @@ class TarmacLineParserImpl {
                     tok = lex();
                 }
 
-                if (is_ES && tok == "CCFAIL") {
+                if (is_ES && tok == Keyword::CCFAIL) {
                     effect = IE_CCFAIL;
                     highlight(tok, HL_CCFAIL);
                     tok = lex();
@@ -666,31 +1177,31 @@ class TarmacLineParserImpl {
 
             // Now we're done, and tok.startpos points at the
             // beginning of the instruction disassembly.
-            size_t disass_end = line.size();
+            size_t disass_end = size;
             while (disass_end > tok.startpos &&
                    isspace((unsigned char)line[disass_end - 1]))
                 disass_end--;
             highlight(tok.startpos, disass_end, HL_DISASSEMBLY);
-            if (disass_end < line.size())
-                highlight(disass_end, line.size(), HL_SPACE);
-            InstructionEvent ev(time, effect, address, iset, width,
-                                bitpattern, line.substr(tok.startpos));
-            receiver->got_event(ev);
-        } else if (tok == "R") {
+            if (disass_end < size)
+                highlight(disass_end, size, HL_SPACE);
+            InstructionEventView ev(time, effect, address, iset, width,
+                                    bitpattern, rest_of_line_span(tok.startpos));
+            receiver->got_event_view(ev);
+        } else if (tok == Keyword::R) {
             // Register update.
             tok = lex();
             if (!tok.isword())
                 parse_error(tok, _("expected register name"));
             Token regnametok = tok; // save for later error reporting
-            string regname = tok.s;
+            string regname = tok.s.str();
             tok = lex();
 
-            if (regname == "DC" || regname == "IC" || regname == "TLBI" ||
-                regname == "AT") {
+            if (regnametok == Keyword::DC || regnametok == Keyword::IC ||
+                regnametok == Keyword::TLBI || regnametok == Keyword::AT) {
                 if (!unrecognised_system_operations_reported.count(regname)) {
                     unrecognised_system_operations_reported.insert(regname);
                     warning(format(_("unsupported system operation '{}'"),
-                                   regnametok.s));
+                                   regname));
                 }
                 return;
             }
@@ -706,7 +1217,7 @@ class TarmacLineParserImpl {
                 if (!tok.isword())
                     parse_error(tok, _("expected extra register "
                                        "identification details"));
-                extrainfo = tok.s;
+                extrainfo = tok.s.str();
                 tok = lex();
 
                 if (tok != ')')
@@ -715,9 +1226,11 @@ class TarmacLineParserImpl {
                 tok = lex();
             }
 
-            string contents;
+            string &contents = reg_contents;
+            contents.clear();
             auto consume_register_contents = [&contents](Token &tok) {
-                copy_if(begin(tok.s), end(tok.s), back_inserter(contents),
+                copy_if(tok.s.data, tok.s.data + tok.s.size,
+                        back_inserter(contents),
                         [](char c) { return c != '_' && c != 'x' && c != 'X'; });
             };
 
@@ -920,7 +1433,8 @@ class TarmacLineParserImpl {
 
             unsigned bits = contents.size() * 4;
 
-            vector<uint16_t> bytes;
+            vector<uint16_t> &bytes = reg_bytes;
+            bytes.clear();
             if (bits % 8 != 0)
                 parse_error(tok, _("expected register contents to be an integer"
                                    " number of bytes"));
@@ -977,17 +1491,20 @@ class TarmacLineParserImpl {
                     offset++;
                 } else {
                     size_t start = offset;
-                    vector<uint8_t> realbytes;
+                    vector<uint8_t> &realbytes = reg_realbytes;
+                    realbytes.clear();
                     while (offset < bytes.size() && bytes[offset] != UNKNOWN)
                         realbytes.push_back(bytes[offset++]);
-                    RegisterEvent ev(time, reg, start, realbytes);
-                    receiver->got_event(ev);
+                    RegisterEventView ev(time, reg, start, realbytes.data(),
+                                         realbytes.size());
+                    receiver->got_event_view(ev);
                 }
             }
-        } else if ((tok.isword() && tok.s.substr(0, 1) == "M") ||
-                   tok == "R01" || tok == "R02" || tok == "R04" ||
-                   tok == "R08" || tok == "W01" || tok == "W02" ||
-                   tok == "W04" || tok == "W08") {
+        } else if ((tok.isword() && tok.s.data[0] == 'M') ||
+                   tok == Keyword::R01 || tok == Keyword::R02 ||
+                   tok == Keyword::R04 || tok == Keyword::R08 ||
+                   tok == Keyword::W01 || tok == Keyword::W02 ||
+                   tok == Keyword::W04 || tok == Keyword::W08) {
             // Contiguous memory access event.
 
             const Token firsttok = tok;
@@ -997,28 +1514,29 @@ class TarmacLineParserImpl {
             bool expect_memory_order = false;
             size_t size = 0;
 
-            for (size_t pos = 0, end = tok.s.size(); pos < end ;) {
+            for (size_t pos = 0, end = tok.s.size; pos < end ;) {
                 size_t prevpos = pos;
-                char c = tok.s[pos++];
+                char c = tok.s.data[pos++];
 
                 if (!seen_rw && (c == 'R' || c == 'W')) {
                     seen_rw = true;
                     read = (c == 'R');
                 } else if (!seen_size && isdigit((unsigned char)c)) {
-                    while (pos < end && isdigit((unsigned char)tok.s[pos]))
+                    while (pos < end && isdigit((unsigned char)tok.s.data[pos]))
                         pos++;
                     seen_size = true;
-                    size = stoull(tok.s.substr(prevpos, pos));
+                    size = span_to_integer(tok.s.sub(prevpos, pos - prevpos),
+                                           10);
                 } else if (pos == 8 && end == 8 && (c == 'I' || c == 'A')) {
                     // Memory access events in Cortex-M4 RTL end in a flag
                     // indicating whether the access is data (D), instruction
                     // (I) or a peripheral bus (A). We ignore all but D, by
                     // treating them as text-only events, because I observe
                     // that they have confusing endianness.
-                    highlight(firsttok.startpos, line.size(), HL_TEXT_EVENT);
-                    TextOnlyEvent ev(time, tok.s,
-                                     line.substr(firsttok.startpos));
-                    receiver->got_event(ev);
+                    highlight(firsttok.startpos, size, HL_TEXT_EVENT);
+                    TextOnlyEventView ev(time, tok.s,
+                                         rest_of_line_span(firsttok.startpos));
+                    receiver->got_event_view(ev);
                     return;
                 } else if (pos == 8 && end == 8 && (c == 'D')) {
                     // This is a data-bus access in the Cortex-M4 RTL style.
@@ -1031,7 +1549,7 @@ class TarmacLineParserImpl {
             }
             tok = lex();
 
-            if (tok == "X") {
+            if (tok == Keyword::X) {
                 /*
                  * Sometimes an exclusive memory operation is indicated by a
                  * separate "X" token. In other cases, it's folded in to the
@@ -1070,14 +1588,14 @@ class TarmacLineParserImpl {
                  * this as a memory access event at all.
                  */
                 tok = lex();
-                if (tok == "ABORTED") {
+                if (tok == Keyword::ABORTED) {
                     Token tok2 = lex();
                     if (tok2 != ')')
                         parse_error(tok2, _("expected closing parenthesis"));
-                    highlight(tok.startpos, line.size(), HL_TEXT_EVENT);
-                    TextOnlyEvent ev(time, tok.s,
-                                     line.substr(firsttok.startpos));
-                    receiver->got_event(ev);
+                    highlight(tok.startpos, size, HL_TEXT_EVENT);
+                    TextOnlyEventView ev(time, tok.s,
+                                         rest_of_line_span(firsttok.startpos));
+                    receiver->got_event_view(ev);
                     return;
                 } else {
                     parse_error(tok, _("unrecognised parenthesised keyword"));
@@ -1090,7 +1608,7 @@ class TarmacLineParserImpl {
             // those out.
             //
             // Also, it may be full of 'x', indicating unknown data.
-            tok.remove_chars("_");
+            tok = remove_chars(tok, "_");
             if (!tok.isword() && !tok.isword("xX"))
                 parse_error(tok, _("expected memory contents in hex"));
 
@@ -1143,13 +1661,13 @@ class TarmacLineParserImpl {
                                    size));
             }
 
-        } else if (tok == "LD" || tok == "ST") {
+        } else if (tok == Keyword::LD || tok == Keyword::ST) {
             // Diagrammatic memory access event.
 
             next_line.event_type_is_continuable = true;
-            next_line.event_type_token = tok;
+            next_line.event_type_token = tok.detached();
 
-            bool read = (tok == "LD");
+            bool read = (tok == Keyword::LD);
             tok = lex();
 
             next_line.post_event_type_start = tok.startpos;
@@ -1171,13 +1689,11 @@ class TarmacLineParserImpl {
                 if (!tok.isword("0123456789ABCDEFabcdef.#"))
                     parse_error(tok, _("expected a word of data bytes, "
                                        "'.' and '#'"));
-                if (tok.s.size() % 2)
+                if (tok.s.size % 2)
                     parse_error(tok, _("expected data word to cover a "
                                        "whole number of bytes"));
-                for (size_t i = 0; i < tok.s.size(); i += 2) {
-                    Token bytetok(tok.s.substr(i, 2));
-                    bytetok.startpos += i;
-                    bytetok.endpos = bytetok.startpos + 2;
+                for (size_t i = 0; i < tok.s.size; i += 2) {
+                    Token bytetok = tok.sub(i, 2);
 
                     if (bytepos >= 16)
                         parse_error(bytetok,
@@ -1241,13 +1757,13 @@ class TarmacLineParserImpl {
                     i = j;
                 }
             }
-        } else if (tok == "EXC") {
+        } else if (tok == Keyword::EXC) {
             // Trace event type that reports CPU exceptions in the
             // ES-style format. Sometimes there's an ES token before
             // it, which we handle above.
             ExceptionEvent ev(time);
             receiver->got_event(ev);
-        } else if (tok == "E") {
+        } else if (tok == Keyword::E) {
             // Trace event type that reports (among other things) CPU
             // exceptions in the IT-style format.
             //
@@ -1262,18 +1778,18 @@ class TarmacLineParserImpl {
             // DebugEvent_<something>, with no intervening pc value or
             // exception type, and we're not interested in those.
 
-            string type(tok.s);
             tok = lex();
 
             if (tok.starts_with("DebugEvent_")) {
                 // Not interesting enough to make an ExceptionEvent
-                TextOnlyEvent ev(time, type, line.substr(tok.startpos));
-                receiver->got_event(ev);
+                TextOnlyEventView ev(time, StringSpan("E", 1),
+                                     rest_of_line_span(tok.startpos));
+                receiver->got_event_view(ev);
             } else {
                 ExceptionEvent ev(time);
                 receiver->got_event(ev);
             }
-        } else if (tok == "Tarmac") {
+        } else if (tok == Keyword::Tarmac) {
             // Header line seen at the start of some trace files. Typically
             // says "Tarmac Text Rev 1" or "Tarmac Text Rev 3t", or similar.
             //
@@ -1296,24 +1812,33 @@ class TarmacLineParserImpl {
             // provokes a warning, just in case it _did_ have
             // important semantics that we shouldn't have ignored.
 
-            string type(tok.s);
-            if (type == "CADI" || type == "E" || type == "P" ||
-                type == "CACHE" || type == "TTW" || type == "BR" ||
-                type == "INFO_EXCEPTION_REASON" || type == "SIGNAL" ||
-                type == "EXC") {
+            StringSpan type = tok.s;
+            switch (tok.keyword()) {
+            case Keyword::CADI:
+            case Keyword::E:
+            case Keyword::P:
+            case Keyword::CACHE:
+            case Keyword::TTW:
+            case Keyword::BR:
+            case Keyword::INFO_EXCEPTION_REASON:
+            case Keyword::SIGNAL:
+            case Keyword::EXC:
                 // no warning
-            } else {
-                if (!unrecognised_tarmac_events_reported.count(type)) {
-                    unrecognised_tarmac_events_reported.insert(type);
-                    warning(format(_("unknown Tarmac event type '{}'"), type));
+                break;
+            default:
+                if (!unrecognised_tarmac_events_reported.count(type.str())) {
+                    unrecognised_tarmac_events_reported.insert(type.str());
+                    warning(format(_("unknown Tarmac event type '{}'"),
+                                   type.str()));
                 }
+                break;
             }
 
             tok = lex();
-            highlight(tok.startpos, line.size(), HL_TEXT_EVENT);
+            highlight(tok.startpos, size, HL_TEXT_EVENT);
 
-            TextOnlyEvent ev(time, type, line.substr(tok.startpos));
-            receiver->got_event(ev);
+            TextOnlyEventView ev(time, type, rest_of_line_span(tok.startpos));
+            receiver->got_event_view(ev);
         }
     }
 };
@@ -1326,8 +1851,68 @@ TarmacLineParser::TarmacLineParser(const ParseParams &params,
 
 TarmacLineParser::~TarmacLineParser() { delete pImpl; }
 
-void TarmacLineParser::parse(const string &s) const { pImpl->parse(s); }
+void TarmacLineParser::parse(const string &s) const
+{
+    pImpl->parse(s.data(), s.size());
+}
 
-set<string> TarmacLineParserImpl::known_timestamp_units = {
-    "clk", "ns", "cs", "cyc", "tic", "ps", "us",
-};
+void TarmacLineParser::parse(const char *data, size_t len) const
+{
+    pImpl->parse(data, len);
+}
+
+Time TarmacLineParser::parse_timestamp(const char *data, size_t len) const
+{
+    return pImpl->parse_timestamp(data, len);
+}
+
+void TarmacLineParser::set_fast_path(FastPath mode)
+{
+    pImpl->fast_path = mode;
+}
+
+unsigned long long TarmacLineParser::fast_path_lines() const
+{
+    return pImpl->fast_lines;
+}
+
+void TarmacLineParser::copy_state_from(const TarmacLineParser &other)
+{
+    pImpl->next_line = other.pImpl->next_line;
+}
+
+bool TarmacLineParser::same_state_as(const TarmacLineParser &other) const
+{
+    return pImpl->next_line == other.pImpl->next_line;
+}
+
+TarmacLineParser::SavedState TarmacLineParser::save_state() const
+{
+    SavedState state;
+    state.timestamp = pImpl->next_line.timestamp;
+    if (pImpl->next_line.event_type_is_continuable) {
+        state.continued_event_type = pImpl->next_line.event_type_token.s.str();
+        state.post_event_type_start = pImpl->next_line.post_event_type_start;
+    }
+    return state;
+}
+
+void TarmacLineParser::restore_state(const SavedState &state)
+{
+    TarmacLineParserImpl::InterLineState next_line;
+    next_line.timestamp = state.timestamp;
+
+    // Only a keyword can have been saved as a continued event type.
+    // If we're given anything else, just forget it.
+    Keyword kw = lookup_keyword(StringSpan(state.continued_event_type.data(),
+                                           state.continued_event_type.size()));
+    if (kw != Keyword::None) {
+        next_line.event_type_is_continuable = true;
+        const char *text = keyword_text(kw);
+        next_line.event_type_token = Token(StringSpan(text, strlen(text)));
+        next_line.event_type_token.kw = kw;
+        next_line.post_event_type_start = state.post_event_type_start;
+    }
+
+    pImpl->next_line = next_line;
+}
@@ -24,6 +24,7 @@
 #include <errno.h>
 #include <string.h>
 
+#include <algorithm>
 #include <sstream>
 
 #include <fcntl.h>
@@ -32,6 +33,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+using std::min;
 using std::ostringstream;
 using std::string;
 
@@ -50,10 +52,35 @@ string get_error_message() { return strerror(errno); }
 
 struct MMapFile::PlatformData {
     int fd;
+
+    // Address space reserved for a writable file to grow into, or
+    // null if it couldn't be reserved (or isn't needed). While this
+    // is set, 'mapping' points to the start of it, and the first
+    // 'mapped' bytes of it are mapped to the file.
+    void *reservation = nullptr;
+    size_t reserved = 0, mapped = 0;
 };
 
-MMapFile::MMapFile(const string &filename, bool writable)
-    : filename(filename), writable(writable)
+// How much address space to reserve for a writable MMapFile. On a
+// 32-bit system there isn't enough to spare, so we don't try.
+static const size_t mmap_reservation_size =
+    sizeof(size_t) >= 8 ? (size_t)((uint64_t)1 << 40) : 0;
+
+static void *reserve_address_space(size_t size)
+{
+    if (!size)
+        return nullptr;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    void *p = mmap(NULL, size, PROT_NONE, flags, -1, 0);
+    return p == MAP_FAILED ? nullptr : p;
+}
+
+MMapFile::MMapFile(const string &filename, bool writable,
+                   const MMapGrowthParams &growth)
+    : filename(filename), writable(writable), growth(growth)
 {
     pdata = new PlatformData;
 
@@ -66,6 +93,11 @@ MMapFile::MMapFile(const string &filename, bool writable)
         reporter->err(1, "%s: lseek", filename.c_str());
     curr_size = next_offset;
     mapping = nullptr;
+    if (writable) {
+        pdata->reservation = reserve_address_space(mmap_reservation_size);
+        if (pdata->reservation)
+            pdata->reserved = mmap_reservation_size;
+    }
     map();
 }
 
@@ -84,16 +116,39 @@ MMapFile::~MMapFile()
 void MMapFile::map()
 {
     assert(!mapping);
+    if (pdata->reservation && (size_t)curr_size > pdata->reserved) {
+        // The file is already too big for the reserved space, so we
+        // can't use it.
+        munmap(pdata->reservation, pdata->reserved);
+        pdata->reservation = nullptr;
+        pdata->reserved = 0;
+    }
     if (!curr_size)
         return;
-    mapping = mmap(NULL, curr_size, PROT_READ | (writable ? PROT_WRITE : 0),
-                   MAP_SHARED, pdata->fd, 0);
+    int flags = MAP_SHARED;
+    if (pdata->reservation)
+        flags |= MAP_FIXED;
+    mapping = mmap(pdata->reservation, curr_size,
+                   PROT_READ | (writable ? PROT_WRITE : 0), flags, pdata->fd, 0);
     if (mapping == MAP_FAILED)
         reporter->err(1, "%s: mmap", filename.c_str());
+    pdata->mapped = curr_size;
+    if (access_pattern != AccessPattern::Normal)
+        advise_memory(mapping, curr_size, access_pattern);
 }
 
 void MMapFile::unmap()
 {
+    if (pdata->reservation) {
+        // Unmapping the whole reservation covers the part mapped to
+        // the file as well.
+        if (munmap(pdata->reservation, pdata->reserved) < 0)
+            reporter->err(1, "%s: munmap", filename.c_str());
+        pdata->reservation = nullptr;
+        pdata->reserved = pdata->mapped = 0;
+        mapping = nullptr;
+        return;
+    }
     if (!curr_size) {
         assert(!mapping);
         return;
@@ -106,13 +161,168 @@ void MMapFile::unmap()
 
 void MMapFile::resize(size_t newsize)
 {
-    if (ftruncate(pdata->fd, newsize) < 0)
+    if (growth.granularity)
+        newsize = (newsize + growth.granularity - 1) / growth.granularity *
+                  growth.granularity;
+
+    bool extended = false;
+#ifdef __linux__
+    if (growth.preallocate && newsize > (size_t)curr_size) {
+        // posix_fallocate returns an error code rather than setting
+        // errno. If it fails, we fall back to ftruncate, which will
+        // report any error that isn't just a lack of support.
+        extended = posix_fallocate(pdata->fd, curr_size,
+                                   newsize - curr_size) == 0;
+    }
+#endif
+    if (!extended && ftruncate(pdata->fd, newsize) < 0)
         reporter->err(1, "%s: ftruncate (extending)", filename.c_str());
+
+    if (pdata->reservation && newsize <= pdata->reserved) {
+        // Map just the new part of the file into the reserved space,
+        // starting from the page containing the old end of the file.
+        // Everything before that stays where it is.
+        size_t pagesize = sysconf(_SC_PAGESIZE);
+        size_t start = pdata->mapped / pagesize * pagesize;
+        if (mmap((char *)pdata->reservation + start, newsize - start,
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, pdata->fd,
+                 start) == MAP_FAILED)
+            reporter->err(1, "%s: mmap", filename.c_str());
+        mapping = pdata->reservation;
+        pdata->mapped = curr_size = newsize;
+        if (access_pattern != AccessPattern::Normal)
+            advise_memory(mapping, curr_size, access_pattern);
+        return;
+    }
+
+#ifdef MREMAP_MAYMOVE
+    if (!pdata->reservation && mapping) {
+        // The kernel can move an existing mapping for us, which is
+        // cheaper than tearing it down and building a new one.
+        void *newmapping = mremap(mapping, curr_size, newsize, MREMAP_MAYMOVE);
+        if (newmapping == MAP_FAILED)
+            reporter->err(1, "%s: mremap", filename.c_str());
+        mapping = newmapping;
+        curr_size = newsize;
+        if (access_pattern != AccessPattern::Normal)
+            advise_memory(mapping, curr_size, access_pattern);
+        return;
+    }
+#endif
+
     unmap();
     curr_size = newsize;
     map();
 }
 
+void MMapFile::write_back(OFF_T start, OFF_T end, bool release)
+{
+    if (!writable || !mapping)
+        return;
+
+    // Widen the range to whole pages. Writing back or dropping a page
+    // only partly in the range does no harm, because the mapping is
+    // shared, so the file always has the latest contents of the page.
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    OFF_T lo = start / pagesize * pagesize;
+    OFF_T hi = min<OFF_T>((end + pagesize - 1) / pagesize * pagesize,
+                          curr_size);
+    if (lo >= hi)
+        return;
+    char *addr = (char *)mapping + lo;
+    size_t len = hi - lo;
+
+#ifdef __linux__
+    // sync_file_range starts the writes without waiting for them, and
+    // without also flushing the file's metadata, which msync(MS_ASYNC)
+    // on Linux doesn't bother to do at all.
+    unsigned flags = SYNC_FILE_RANGE_WRITE;
+    if (release)
+        flags |= SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WAIT_AFTER;
+    if (sync_file_range(pdata->fd, lo, len, flags) < 0)
+        reporter->err(1, "%s: sync_file_range", filename.c_str());
+#else
+    if (msync(addr, len, release ? MS_SYNC : MS_ASYNC) < 0)
+        reporter->err(1, "%s: msync", filename.c_str());
+#endif
+
+    if (release) {
+        // Once the pages are clean, dropping them from our mapping and
+        // then from the page cache loses nothing. These are only
+        // hints, so failure isn't worth reporting.
+        madvise(addr, len, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(pdata->fd, lo, len, POSIX_FADV_DONTNEED);
+#endif
+    }
+}
+
+void advise_memory(void *addr, size_t len, AccessPattern pattern)
+{
+    // madvise only works on whole pages, so shrink the range to the
+    // pages it completely covers.
+    uintptr_t pagesize = sysconf(_SC_PAGESIZE);
+    uintptr_t lo = ((uintptr_t)addr + pagesize - 1) & ~(pagesize - 1);
+    uintptr_t hi = ((uintptr_t)addr + len) & ~(pagesize - 1);
+    if (lo >= hi)
+        return;
+
+    // These are only hints, so failure isn't worth reporting.
+    switch (pattern) {
+    case AccessPattern::Normal:
+        posix_madvise((void *)lo, hi - lo, POSIX_MADV_NORMAL);
+        break;
+    case AccessPattern::Sequential:
+        posix_madvise((void *)lo, hi - lo, POSIX_MADV_SEQUENTIAL);
+        break;
+    case AccessPattern::Random:
+        posix_madvise((void *)lo, hi - lo, POSIX_MADV_RANDOM);
+        break;
+    case AccessPattern::HugePages:
+#ifdef MADV_HUGEPAGE
+        madvise((void *)lo, hi - lo, MADV_HUGEPAGE);
+#endif
+        break;
+    }
+}
+
+void *reserve_memory(size_t len)
+{
+    if (!len)
+        return nullptr;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return p == MAP_FAILED ? nullptr : p;
+}
+
+void commit_memory(void *, size_t)
+{
+    // Pages of an anonymous mapping are allocated as they're written.
+}
+
+void discard_memory(void *addr, size_t len)
+{
+    uintptr_t pagesize = sysconf(_SC_PAGESIZE);
+    uintptr_t lo = ((uintptr_t)addr + pagesize - 1) & ~(pagesize - 1);
+    uintptr_t hi = ((uintptr_t)addr + len) & ~(pagesize - 1);
+    if (lo >= hi)
+        return;
+
+    // MADV_DONTNEED on a private anonymous mapping frees the pages
+    // and makes them read as zeroes. If it fails, the memory is just
+    // kept.
+    madvise((void *)lo, hi - lo, MADV_DONTNEED);
+}
+
+void release_memory(void *addr, size_t len)
+{
+    if (addr && munmap(addr, len) < 0)
+        reporter->err(1, "munmap");
+}
+
 static bool try_make_conf_path(const char *env_var, const char *suffix,
                                const string &filename, string &out)
 {
@@ -181,6 +391,51 @@ bool get_environment_variable(const string &varname, string &out)
     return true;
 }
 
+bool truncate_file(const string &filename, uint64_t size)
+{
+    return truncate(filename.c_str(), size) == 0;
+}
+
+bool copy_file_prefix(const string &from, const string &to, uint64_t len)
+{
+#if defined __linux__ && defined __GLIBC__ &&                                  \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    int infd = open(from.c_str(), O_RDONLY);
+    if (infd < 0)
+        reporter->err(1, "%s: open", from.c_str());
+    int outfd = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (outfd < 0)
+        reporter->err(1, "%s: open", to.c_str());
+
+    bool first = true;
+    while (len > 0) {
+        ssize_t ret = copy_file_range(infd, nullptr, outfd, nullptr, len, 0);
+        if (ret < 0 && first &&
+            (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+             errno == EOPNOTSUPP)) {
+            // This kernel or file system can't do it, so leave the
+            // caller to copy the data the ordinary way.
+            close(infd);
+            close(outfd);
+            return false;
+        }
+        if (ret < 0)
+            reporter->err(1, "%s: copy_file_range", to.c_str());
+        if (ret == 0)
+            reporter->errx(1, _("%s: unexpected end of file"), from.c_str());
+        len -= ret;
+        first = false;
+    }
+
+    close(infd);
+    if (close(outfd) < 0)
+        reporter->err(1, "%s: close", to.c_str());
+    return true;
+#else
+    return false;
+#endif
+}
+
 void gettext_setup(bool console_application)
 {
     // On this platform, we don't need to know whether it's a console
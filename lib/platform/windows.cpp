@@ -81,8 +81,9 @@ struct MMapFile::PlatformData {
     HANDLE mh;
 };
 
-MMapFile::MMapFile(const string &filename, bool writable)
-    : filename(filename), writable(writable)
+MMapFile::MMapFile(const string &filename, bool writable,
+                   const MMapGrowthParams &growth)
+    : filename(filename), writable(writable), growth(growth)
 {
     pdata = new PlatformData;
 
@@ -166,6 +167,14 @@ void MMapFile::unmap()
 
 void MMapFile::resize(size_t newsize)
 {
+    // Windows can't grow a view of a file in place, so the best we
+    // can do is to remap less often. (SetEndOfFile allocates the
+    // space anyway, so there's nothing extra to do for
+    // growth.preallocate.)
+    if (growth.granularity)
+        newsize = (newsize + growth.granularity - 1) / growth.granularity *
+                  growth.granularity;
+
     unmap();
 
     LARGE_INTEGER pos;
@@ -181,6 +190,70 @@ void MMapFile::resize(size_t newsize)
     map();
 }
 
+void MMapFile::write_back(OFF_T start, OFF_T end, bool release)
+{
+    if (!writable || !mapping)
+        return;
+    if (end > curr_size)
+        end = curr_size;
+    if (start >= end)
+        return;
+    void *addr = (char *)mapping + start;
+    size_t len = end - start;
+
+    // FlushViewOfFile starts the writes of the view's dirty pages
+    // without waiting for them. There's no direct way to drop pages of
+    // a view from memory, but VirtualUnlock on pages that aren't locked
+    // takes them out of the process's working set, which is the
+    // nearest thing; it reports an error for that case, which we
+    // ignore.
+    if (!FlushViewOfFile(addr, len))
+        reporter->err(1, "%s: FlushViewOfFile", filename.c_str());
+    if (release)
+        VirtualUnlock(addr, len);
+}
+
+void advise_memory(void *, size_t, AccessPattern)
+{
+    // Windows has no equivalent of madvise for views of files, and
+    // large pages need a privilege that isn't normally granted, so
+    // all the hints are ignored.
+}
+
+void *reserve_memory(size_t len)
+{
+    if (!len)
+        return nullptr;
+    return VirtualAlloc(NULL, len, MEM_RESERVE, PAGE_READWRITE);
+}
+
+void commit_memory(void *addr, size_t len)
+{
+    // Committing pages that are already committed leaves their
+    // contents alone, so a range sharing a page with one already in
+    // use is safe to commit.
+    if (len && !VirtualAlloc(addr, len, MEM_COMMIT, PAGE_READWRITE))
+        reporter->errx(1, _("Out of memory"));
+}
+
+void discard_memory(void *addr, size_t len)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    uintptr_t pagesize = info.dwPageSize;
+    uintptr_t lo = ((uintptr_t)addr + pagesize - 1) & ~(pagesize - 1);
+    uintptr_t hi = ((uintptr_t)addr + len) & ~(pagesize - 1);
+    if (lo >= hi)
+        return;
+    VirtualFree((void *)lo, hi - lo, MEM_DECOMMIT);
+}
+
+void release_memory(void *addr, size_t)
+{
+    if (addr)
+        VirtualFree(addr, 0, MEM_RELEASE);
+}
+
 #if !HAVE_APPDATAPROGRAMDATA
 // Compensate for this not being defined by earlier toolchain versions
 static const GUID FOLDERID_AppDataProgramData = {
@@ -263,6 +336,27 @@ bool get_environment_variable(const string &varname, string &out)
     return true;
 }
 
+bool truncate_file(const string &filename, uint64_t size)
+{
+    HANDLE fh = CreateFile(filename.c_str(), GENERIC_WRITE, 0, NULL,
+                           OPEN_EXISTING, 0, NULL);
+    if (fh == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER pos;
+    pos.QuadPart = size;
+    bool ok = SetFilePointerEx(fh, pos, NULL, FILE_BEGIN) && SetEndOfFile(fh);
+    CloseHandle(fh);
+    return ok;
+}
+
+bool copy_file_prefix(const string &, const string &, uint64_t)
+{
+    // CopyFile can only copy a whole file, so the caller will have
+    // to do it.
+    return false;
+}
+
 #if HAVE_LIBINTL
 #error "We didn't expect libintl to be available on Windows, so no setup code"
 #else
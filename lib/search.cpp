@@ -0,0 +1,255 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#include "libtarmac/search.hh"
+
+#include <algorithm>
+#include <cstring>
+
+using std::max;
+using std::min;
+using std::string;
+using std::unique_lock;
+using std::vector;
+
+// Small enough that the first chunk's matches turn up almost at once,
+// but large enough that handing out chunks costs nothing much.
+static const OFF_T SEARCH_CHUNK_SIZE = 4 * 1024 * 1024;
+
+// Find the first occurrence of 'pat' in [p,end), or return nullptr.
+// memchr for the first character of the pattern skips most of the
+// text a vector register at a time.
+static const char *find_literal(const char *p, const char *end,
+                                const string &pat)
+{
+    if (pat.empty())
+        return p;
+    size_t n = pat.size();
+    while ((size_t)(end - p) >= n) {
+        p = (const char *)memchr(p, pat[0], end - p - n + 1);
+        if (!p)
+            return nullptr;
+        if (!memcmp(p + 1, pat.data() + 1, n - 1))
+            return p;
+        p++;
+    }
+    return nullptr;
+}
+
+// Find the longest run of literal text that every match of a regex
+// must contain, or return the empty string if there isn't any we can
+// be sure of. This only has to be safe, not clever: it gives up on
+// alternation altogether, and ignores anything inside a group or a
+// character class, and any character that a quantifier could make
+// optional.
+static string required_literal(const string &re)
+{
+    if (re.find('|') != string::npos)
+        return "";
+
+    string best, run;
+    int depth = 0;
+    auto end_run = [&]() {
+        if (run.size() > best.size())
+            best = run;
+        run.clear();
+    };
+    for (size_t i = 0; i < re.size(); i++) {
+        char c = re[i];
+        char next = i + 1 < re.size() ? re[i + 1] : '\0';
+        if (c == '\\') {
+            end_run();
+            i++;
+        } else if (c == '[') {
+            end_run();
+            // Skip to the end of the class. A ']' straight after the
+            // opening '[' or '[^' is part of the class.
+            i++;
+            if (i < re.size() && re[i] == '^')
+                i++;
+            if (i < re.size() && re[i] == ']')
+                i++;
+            while (i < re.size() && re[i] != ']')
+                i += re[i] == '\\' ? 2 : 1;
+        } else if (c == '(') {
+            end_run();
+            depth++;
+        } else if (c == ')') {
+            depth--;
+        } else if (depth > 0) {
+            continue;
+        } else if (strchr("^$.?*+{}", c)) {
+            end_run();
+        } else if (next == '?' || next == '*' || next == '{') {
+            end_run();
+        } else {
+            run.push_back(c);
+            if (next == '+')
+                end_run();
+        }
+    }
+    end_run();
+    return best;
+}
+
+TraceSearch::TraceSearch(const TraceSource &src, const SearchParams &params)
+    : src(src), params(params), next_chunk(0), stopping(false), published(0),
+      lines_published(0)
+{
+    use_regex = params.regex && params.pattern.find_first_of(
+                                    "\\^$.|?*+()[]{}") != string::npos;
+    if (use_regex) {
+        re = std::regex(params.pattern, std::regex::optimize);
+        literal = required_literal(params.pattern);
+    } else {
+        literal = params.pattern;
+    }
+
+    for (OFF_T pos = 0; pos < src.size();) {
+        OFF_T end = src.next_line_start(min(pos + SEARCH_CHUNK_SIZE,
+                                            src.size()));
+        chunks.push_back({pos, end});
+        pos = end;
+    }
+
+    unsigned nthreads = params.threads;
+    if (!nthreads)
+        nthreads = max(1U, std::thread::hardware_concurrency());
+    nthreads = min((size_t)nthreads, max(chunks.size(), (size_t)1));
+    for (unsigned i = 0; i < nthreads; i++)
+        workers.emplace_back(&TraceSearch::worker, this);
+}
+
+TraceSearch::~TraceSearch()
+{
+    stopping = true;
+    for (auto &w : workers)
+        w.join();
+}
+
+void TraceSearch::worker()
+{
+    // Chunks are handed out in order, so the ones at the front of the
+    // file are always the next to be finished.
+    size_t i;
+    while (!stopping && (i = next_chunk++) < chunks.size()) {
+        search_chunk(chunks[i]);
+
+        unique_lock<std::mutex> lock(mutex);
+        chunks[i].done = true;
+        while (published < chunks.size() && chunks[published].done) {
+            Chunk &c = chunks[published++];
+            for (const Match &m : c.matches)
+                matches.push_back({lines_published + m.line, m.pos});
+            lines_published += c.lines;
+            vector<Match>().swap(c.matches);
+        }
+        cond.notify_all();
+    }
+}
+
+void TraceSearch::search_chunk(Chunk &chunk)
+{
+    StringSpan text = src.span(chunk.start, chunk.end - chunk.start);
+    const char *end = text.data + text.size;
+
+    vector<StringSpan> lines;
+    const char *partial = split_lines(text.data, end, lines);
+    if (partial < end)
+        lines.emplace_back(partial, end - partial); // last line of the file
+    chunk.lines = lines.size();
+
+    auto matches_line = [&](size_t i) {
+        return !use_regex ||
+               std::regex_search(lines[i].data, lines[i].data + lines[i].size,
+                                 re);
+    };
+
+    if (literal.empty()) {
+        for (size_t i = 0; i < lines.size(); i++)
+            if (matches_line(i))
+                chunk.matches.push_back(
+                    {i + 1, chunk.start + (lines[i].data - text.data)});
+        return;
+    }
+
+    // Search the whole chunk at once for the literal, rather than line
+    // by line, and only then find which line each occurrence is in.
+    // Text containing no \n can't be found across the end of a line.
+    size_t i = 0;
+    const char *p = text.data;
+    while (i < lines.size()) {
+        const char *found = find_literal(p, end, literal);
+        if (!found)
+            break;
+        while (lines[i].data + lines[i].size < found)
+            i++;
+        if (matches_line(i))
+            chunk.matches.push_back(
+                {i + 1, chunk.start + (lines[i].data - text.data)});
+        if (++i < lines.size())
+            p = lines[i].data;
+    }
+}
+
+bool TraceSearch::find(LineNo line, int dir, LineNo *match, OFF_T *pos) const
+{
+    unique_lock<std::mutex> lock(mutex);
+    Match key{line, 0};
+    while (true) {
+        bool complete = published == chunks.size();
+        if (dir > 0) {
+            auto it = std::upper_bound(matches.begin(), matches.end(), key);
+            if (it != matches.end()) {
+                *match = it->line;
+                if (pos)
+                    *pos = it->pos;
+                return true;
+            }
+            if (complete)
+                return false;
+        } else {
+            // A match before 'line' is only certainly the last one
+            // once every line before 'line' has been searched.
+            if (complete || lines_published + 1 >= line) {
+                auto it =
+                    std::lower_bound(matches.begin(), matches.end(), key);
+                if (it == matches.begin())
+                    return false;
+                --it;
+                *match = it->line;
+                if (pos)
+                    *pos = it->pos;
+                return true;
+            }
+        }
+        cond.wait(lock);
+    }
+}
+
+size_t TraceSearch::matches_so_far() const
+{
+    unique_lock<std::mutex> lock(mutex);
+    return matches.size();
+}
+
+bool TraceSearch::finished() const
+{
+    unique_lock<std::mutex> lock(mutex);
+    return published == chunks.size();
+}
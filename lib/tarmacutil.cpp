@@ -23,15 +23,28 @@
 #include "libtarmac/misc.hh"
 #include "libtarmac/reporter.hh"
 
+#include <algorithm>
+#include <atomic>
+#include <future>
 #include <iostream>
 #include <memory>
+#include <sstream>
+#include <stdexcept>
 #include <stdlib.h>
+#include <thread>
+#include <vector>
 
+using std::atomic;
 using std::cout;
+using std::future;
 using std::make_shared;
 using std::make_unique;
+using std::max;
+using std::min;
+using std::ostringstream;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 
 TarmacUtilityBase::TarmacUtilityBase()
     : verbose(is_interactive()), show_progress_meter(verbose) {
@@ -40,9 +53,6 @@ TarmacUtilityBase::TarmacUtilityBase()
 
 void TarmacUtilityBase::add_options(Argparse &ap)
 {
-    if (!iparams.can_store_on_disk())
-        index_on_disk = false;
-
     if (can_use_image) {
         ap.optval({"--image"}, _("IMAGEFILE"), _("image file name"),
                   [this](const string &s) { image_filename = s; });
@@ -65,6 +75,22 @@ void TarmacUtilityBase::add_options(Argparse &ap)
         ap.optnoval({"--memory-index"},
                     _("keep index in memory instead of on disk"),
                     [this]() { index_on_disk = false; });
+        ap.optnoval({"--resumable-index"},
+                    _("save state in the index so that it can be extended "
+                      "if the trace file grows"),
+                    [this]() { iparams.resumable = true; });
+        ap.optnoval({"--write-history-index"},
+                    _("also index every write to registers and memory by "
+                      "address, for listing the writes to a region"),
+                    [this]() { iparams.record_writes = true; });
+        ap.optnoval({"--relayout-index"},
+                    _("lay out the index so that searching it touches fewer "
+                      "disk pages, at the cost of making it larger"),
+                    [this]() { iparams.relayout_trees = true; });
+        ap.optnoval({"--compress-index"},
+                    _("compress the index file, making it smaller but "
+                      "slower to open"),
+                    [this]() { iparams.compress = true; });
     }
     ap.optnoval({"--li"}, _("assume trace is from a little-endian platform"),
                 [this]() {
@@ -102,6 +128,77 @@ void TarmacUtilityBase::add_options(Argparse &ap)
                       }
                   });
     }
+    if (does_indexing()) {
+        ap.optval({"--index-threads"}, _("N"),
+                  _("use N threads to parse the trace file while indexing"),
+                  [this](const string &s) {
+                      unsigned long n;
+                      try {
+                          size_t pos;
+                          n = stoul(s, &pos, 0);
+                          if (pos < s.size())
+                              throw std::invalid_argument(s);
+                      } catch (std::invalid_argument) {
+                          throw ArgparseError(format(
+                              _("'{}': unable to parse numeric value"), s));
+                      } catch (std::out_of_range) {
+                          throw ArgparseError(format(
+                              _("'{}': numeric value out of range"), s));
+                      }
+                      if (n < 1)
+                          throw ArgparseError(
+                              _("--index-threads requires at least 1"));
+                      // More threads than the machine can run at once
+                      // only add overhead, and a huge value would try
+                      // to start that many threads.
+                      unsigned long max_threads =
+                          4UL * max(1U, std::thread::hardware_concurrency());
+                      iparams.parse_threads = min(n, max_threads);
+                  });
+        ap.optnoval({"--index-pipeline"},
+                    _("read and parse the trace file on separate threads "
+                      "from building the index"),
+                    [this]() { iparams.pipeline = true; });
+        ap.optnoval({"--event-cache"},
+                    _("keep a cache of the parsed events of the trace file, "
+                      "to make indexing it again faster"),
+                    [this]() { iparams.event_cache = true; });
+        ap.optval({"--memory-checkpoints"}, _("N"),
+                  _("write a checkpoint of the memory contents into the "
+                    "index after every N trace nodes (timestamps)"),
+                  [this](const string &s) {
+                      iparams.memory_checkpoint_interval =
+                          stoul(s, nullptr, 0);
+                  });
+        ap.optval({"--memory-checkpoint-budget"}, _("MBYTES"),
+                  _("stop writing memory checkpoints when they have used "
+                    "this much space in the index"),
+                  [this](const string &s) {
+                      iparams.memory_checkpoint_budget =
+                          stoull(s, nullptr, 0) << 20;
+                  });
+        ap.optval({"--index-growth"}, _("MBYTES"),
+                  _("extend the index file in steps of at least this "
+                    "much while writing it"),
+                  [this](const string &s) {
+                      iparams.growth_granularity = stoull(s, nullptr, 0)
+                                                   << 20;
+                  });
+        ap.optval({"--index-memory-budget"}, _("MBYTES"),
+                  _("keep at most about this much of the index file in "
+                    "memory while writing it"),
+                  [this](const string &s) {
+                      iparams.memory_budget = stoull(s, nullptr, 0) << 20;
+                  });
+        ap.optnoval({"--preallocate-index"},
+                    _("allocate disk space for the index file as it grows, "
+                      "instead of leaving it sparse"),
+                    [this]() { iparams.preallocate = true; });
+        ap.optnoval({"--stats"},
+                    _("report statistics about the indexing process, and "
+                      "about the queries made of the index afterwards"),
+                    [this]() { idiags.show_stats = true; });
+    }
     ap.optnoval({"-v", "--verbose"}, _("make tool more verbose"),
                 [this]() { verbose = true; });
     ap.optnoval({"-q", "--quiet"}, _("make tool quiet"),
@@ -153,21 +250,87 @@ void TarmacUtilityMT::add_options(Argparse &ap)
     auto add_pair = [this](const string &s) {
         TracePair pair;
         pair.tarmac_filename = s;
-        pair.index_on_disk = index_on_disk;
-        if (index_on_disk)
-            pair.index_filename = defaultIndexFilename(s);
         traces.push_back(pair);
     };
     ap.positional_multiple(_("TRACEFILE"), _("Tarmac trace files to read"),
                            add_pair);
+
+    ap.optval({"--jobs"}, _("N"), _("index up to N of the trace files at once"),
+              [this](const string &s) {
+                  unsigned long n = stoul(s, nullptr, 0);
+                  if (n < 1)
+                      throw ArgparseError(_("--jobs requires at least 1"));
+                  jobs = n;
+              });
+}
+
+void TarmacUtilityMT::postProcessOptions()
+{
+    // The index location is filled in here rather than as each trace
+    // file name is seen, so that it doesn't depend on whether
+    // --memory-index came before or after the file names.
+    for (TracePair &trace : traces) {
+        trace.index_on_disk = index_on_disk;
+        if (index_on_disk)
+            trace.index_filename = defaultIndexFilename(trace.tarmac_filename);
+        else
+            trace.memory_index = make_shared<MemArena>();
+    }
+    if (!index_on_disk) {
+        if (indexing == Troolean::No)
+            reporter->warnx(_("Ignoring --no-index since index is in memory"));
+        indexing = Troolean::Yes;
+    }
+}
+
+void TarmacUtilityMT::setupIndex() const
+{
+    size_t nthreads = min<size_t>(jobs, traces.size());
+    if (nthreads <= 1) {
+        for (const TracePair &trace : traces)
+            updateIndexIfNeeded(trace);
+        return;
+    }
+
+    // Each worker thread takes the next trace that nobody has started
+    // on. The traces are independent of each other, so the order
+    // doesn't matter, except to anything the indexer writes to the
+    // diagnostics stream, which we collect separately for each trace
+    // and write out in trace order at the end. The progress meter
+    // shows all the traces together, even if at some moment no worker
+    // is indexing one.
+    vector<ostringstream> diag_streams(traces.size());
+    atomic<size_t> next_trace(0);
+    reporter->indexing_batch_start();
+    vector<future<void>> workers;
+    for (size_t i = 0; i < nthreads; i++) {
+        workers.push_back(std::async(std::launch::async, [&]() {
+            size_t t;
+            while ((t = next_trace++) < traces.size()) {
+                IndexerDiagnostics diags = idiags;
+                diags.diagnostics_stream = &diag_streams[t];
+                updateIndexIfNeeded(traces[t], diags);
+            }
+        }));
+    }
+    for (auto &w : workers)
+        w.get();
+    reporter->indexing_batch_done();
+
+    for (const ostringstream &oss : diag_streams)
+        *idiags.diagnostics_stream << oss.str();
 }
 
-void TarmacUtilityBase::updateIndexIfNeeded(const TracePair &trace) const
+void TarmacUtilityBase::updateIndexIfNeeded(
+    const TracePair &trace, const IndexerDiagnostics &diags) const
 {
     Troolean doIndexing = indexing; // so we can translate Auto into Yes or No
 
-    reporter->set_indexing_verbosity(verbose);
-    reporter->set_indexing_progress(show_progress_meter);
+    // If we rebuild an existing index because it lacks something we
+    // need, keep everything it did have as well, so that the tools
+    // that were already using it don't then have to rebuild it back.
+    IndexerParams rebuild_params = iparams;
+    bool extend = false;
 
     if (!trace.index_on_disk) {
         // If we're indexing to memory, there can never be an existing index
@@ -183,15 +346,29 @@ void TarmacUtilityBase::updateIndexIfNeeded(const TracePair &trace) const
         if (!get_file_timestamp(trace.index_filename, &index_timestamp)) {
             status = IndexUpdateCheck::Missing;
         } else if (index_timestamp < trace_timestamp) {
-            status = IndexUpdateCheck::TooOld;
+            // If the trace file has only been appended to, we might
+            // be able to index just the new part.
+            extend = can_extend_index(trace, iparams, get_parse_params());
+            status = (extend ? IndexUpdateCheck::Extending
+                             : IndexUpdateCheck::TooOld);
         } else {
-            switch (check_index_header(trace.index_filename)) {
+            IndexerParams present;
+            switch (check_index_header(trace.index_filename, iparams,
+                                       &present)) {
             case IndexHeaderState::WrongMagic:
                 status = IndexUpdateCheck::WrongFormat;
                 break;
             case IndexHeaderState::Incomplete:
                 status = IndexUpdateCheck::Incomplete;
                 break;
+            case IndexHeaderState::MissingParts:
+                status = IndexUpdateCheck::MissingParts;
+                rebuild_params.record_memory |= present.record_memory;
+                rebuild_params.record_calls |= present.record_calls;
+                rebuild_params.record_writes |= present.record_writes;
+                rebuild_params.resumable |= present.resumable;
+                rebuild_params.compress |= present.compress;
+                break;
             default:
                 status = IndexUpdateCheck::OK;
                 break;
@@ -205,8 +382,12 @@ void TarmacUtilityBase::updateIndexIfNeeded(const TracePair &trace) const
         reporter->indexing_status(trace, IndexUpdateCheck::Forced);
     }
 
-    if (doIndexing == Troolean::Yes)
-        run_indexer(trace, iparams, idiags, get_parse_params());
+    if (doIndexing == Troolean::Yes) {
+        if (extend)
+            extend_index(trace, iparams, diags, get_parse_params());
+        else
+            run_indexer(trace, rebuild_params, diags, get_parse_params());
+    }
 }
 
 ParseParams TarmacUtilityBase::get_parse_params() const
@@ -226,8 +407,21 @@ void TarmacUtilityBase::setup_noexit()
 
     postProcessOptions();
 
+    // Set these up before indexing starts, because TarmacUtilityMT
+    // might index several traces at once on different threads.
+    reporter->set_indexing_verbosity(verbose);
+    reporter->set_indexing_progress(show_progress_meter);
+
     if (indexing != Troolean::No)
         setupIndex();
+
+    // The queries the tool makes of its index are reported on when
+    // it exits, wherever in the tool that happens. They're only
+    // counted from here on, so that indexing isn't slowed down.
+    if (idiags.show_stats && !onlyIndex) {
+        QueryStats::enable();
+        atexit([]() { QueryStats::report(std::cerr); });
+    }
 }
 
 void TarmacUtilityBase::setup()
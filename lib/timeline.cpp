@@ -0,0 +1,101 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#include "libtarmac/timeline.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <queue>
+
+using std::priority_queue;
+using std::size_t;
+using std::upper_bound;
+using std::vector;
+
+constexpr size_t MergedTimeline::checkpoint_interval;
+
+MergedTimeline::MergedTimeline(const vector<const IndexNavigator *> &sources)
+    : sources(sources)
+{
+    // One cursor per source, each at the next node of that source
+    // still to be merged. The heap holds the numbers of the sources
+    // that have any left; priority_queue puts the greatest element on
+    // top, so the comparison is reversed.
+    vector<IndexCursor> cursors;
+    for (const IndexNavigator *nav : sources)
+        cursors.emplace_back(*nav);
+    auto later = [&](unsigned a, unsigned b) {
+        Time ta = cursors[a].node().mod_time;
+        Time tb = cursors[b].node().mod_time;
+        return ta != tb ? ta > tb : a > b;
+    };
+    priority_queue<unsigned, vector<unsigned>, decltype(later)> heap(later);
+    for (unsigned i = 0; i < cursors.size(); i++)
+        if (cursors[i].goto_start())
+            heap.push(i);
+
+    vector<size_t> latest(sources.size(), SIZE_MAX);
+    while (!heap.empty()) {
+        unsigned source = heap.top();
+        heap.pop();
+
+        if (entries.size() % checkpoint_interval == 0)
+            checkpoints.push_back(latest);
+        latest[source] = entries.size();
+        entries.push_back({source, cursors[source].node()});
+
+        if (cursors[source].next())
+            heap.push(source);
+    }
+}
+
+size_t MergedTimeline::position_after(Time t) const
+{
+    return upper_bound(entries.begin(), entries.end(), t,
+                       [](Time t, const Entry &e) { return t < e.node.mod_time; }) -
+           entries.begin();
+}
+
+vector<const MergedTimeline::Entry *>
+MergedTimeline::entries_at_time(Time t) const
+{
+    vector<const Entry *> ret(sources.size(), nullptr);
+    size_t pos = position_after(t);
+    if (pos == 0)
+        return ret;
+
+    // Checkpoint number cp describes the entries before position
+    // cp * checkpoint_interval, so everything after that up to pos
+    // has to be scanned directly, latest first.
+    size_t cp = (pos - 1) / checkpoint_interval;
+    size_t found = 0;
+    for (size_t i = pos; i-- > cp * checkpoint_interval &&
+                         found < sources.size();) {
+        if (!ret[entries[i].source]) {
+            ret[entries[i].source] = &entries[i];
+            found++;
+        }
+    }
+
+    const vector<size_t> &checkpoint = checkpoints[cp];
+    for (size_t s = 0; s < sources.size(); s++)
+        if (!ret[s] && checkpoint[s] != SIZE_MAX)
+            ret[s] = &entries[checkpoint[s]];
+
+    return ret;
+}
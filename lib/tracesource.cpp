@@ -0,0 +1,631 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#include "libtarmac/tracesource.hh"
+#include "libtarmac/cmake.h"
+#include "libtarmac/intl.hh"
+#include "libtarmac/reporter.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#if defined __GNUC__ && defined __SSE2__
+#include <emmintrin.h>
+#define SPLIT_LINES_SSE2 1
+#elif defined __GNUC__ && defined __ARM_NEON
+#include <arm_neon.h>
+#define SPLIT_LINES_NEON 1
+#endif
+
+using std::ifstream;
+using std::min;
+using std::ofstream;
+using std::string;
+using std::unique_lock;
+using std::vector;
+
+const char *split_lines(const char *p, const char *end,
+                        vector<StringSpan> &lines)
+{
+    const char *linestart = p;
+
+#if SPLIT_LINES_SSE2
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, nl));
+        for (; mask; mask &= mask - 1) {
+            const char *found = p + __builtin_ctz(mask);
+            lines.emplace_back(linestart, found - linestart);
+            linestart = found + 1;
+        }
+    }
+#elif SPLIT_LINES_NEON
+    // NEON has no movemask, but narrowing each 16-bit lane of the
+    // comparison result by 4 bits leaves a 64-bit mask with 4 bits
+    // for each byte.
+    const uint8x16_t nl = vdupq_n_u8('\n');
+    for (; end - p >= 16; p += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *)p), nl);
+        uint64_t mask = vget_lane_u64(
+            vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        for (mask &= 0x8888888888888888ULL; mask; mask &= mask - 1) {
+            const char *found = p + (__builtin_ctzll(mask) >> 2);
+            lines.emplace_back(linestart, found - linestart);
+            linestart = found + 1;
+        }
+    }
+#endif
+
+    // Portable fallback, and the tail of the region after the vector
+    // loop above.
+    while (p < end) {
+        const char *found = (const char *)memchr(p, '\n', end - p);
+        if (!found)
+            break;
+        lines.emplace_back(linestart, found - linestart);
+        p = linestart = found + 1;
+    }
+
+    return linestart;
+}
+
+#if HAVE_ZLIB
+
+// Distance apart in the decompressed text that access points are put,
+// so that each frame is decompressed in one go. Each point costs a
+// 32KB window of the text before it, which compresses to a few KB.
+static const OFF_T GZIP_FRAME_SIZE = 4 * 1024 * 1024;
+static const unsigned GZIP_WINDOW_SIZE = 32768;
+
+/*
+ * Layout of a file of gzip access points: this header, then for each
+ * point its position in the decompressed text and in the compressed
+ * file (8 bytes each), the number of bits of the compressed byte
+ * before that which still have to be read (1 byte, with 0xFF meaning
+ * that the point is the start of a gzip member, so there's no
+ * unfinished byte and no window is needed), and the window of text
+ * before the point, compressed with zlib (its length in 4 bytes, then
+ * its data). The header includes a CRC-32 of everything after it.
+ * All integers are big-endian.
+ */
+static const char gzip_access_magic[16] = {
+    'T', 'a', 'r', 'm', 'a', 'c', 'G', 'z', 'A', 'c', 'c', 'V', '0', '0', '0', '1',
+};
+
+struct GzipAccessHeader {
+    char magic[16];
+    diskint<uint64_t> compressed_size;
+    diskint<uint64_t> size;
+    diskint<uint64_t> npoints;
+    diskint<uint32_t> checksum;
+};
+
+struct TraceSource::Gzip {
+    static const int MEMBER_START = 0xFF;
+
+    struct Point {
+        OFF_T out, in;
+        int bits;
+        string window; // compressed
+    };
+
+    // A frame is the text from one access point to the next, and is
+    // always in one of these states. Only the thread that set BUSY
+    // writes to it, and RESIDENT frames aren't written at all.
+    enum State : unsigned char { ABSENT, BUSY, RESIDENT };
+
+    string filename;
+    const unsigned char *data;
+    OFF_T insize, size;
+    vector<Point> points;
+    char *region;
+    std::unique_ptr<std::atomic<unsigned char>[]> state;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::atomic<size_t> discarded; // frames before this have been given back
+
+    Gzip(const string &filename, const unsigned char *data, OFF_T insize);
+    ~Gzip() { release_memory(region, size); }
+
+    void corrupt() const
+    {
+        reporter->errx(1, _("%s: compressed data is corrupt"),
+                       filename.c_str());
+    }
+
+    OFF_T frame_end(size_t i) const
+    {
+        return i + 1 < points.size() ? points[i + 1].out : size;
+    }
+
+    bool scan();
+    bool load(const string &access_filename);
+    bool save(const string &access_filename) const;
+    void fill(size_t i);
+    void decompress(size_t i);
+    void ensure(OFF_T lo, OFF_T hi);
+    void discard_before(OFF_T pos);
+};
+
+TraceSource::Gzip::Gzip(const string &filename, const unsigned char *data,
+                        OFF_T insize)
+    : filename(filename), data(data), insize(insize), size(0),
+      region(nullptr), discarded(0)
+{
+    string access_filename = default_gzip_access_filename(filename);
+    if (!load(access_filename)) {
+        if (!scan())
+            corrupt();
+        if (!save(access_filename))
+            reporter->warn(_("unable to write gzip access point file '%s'"),
+                           access_filename.c_str());
+    }
+
+    if (size > 0) {
+        region = (char *)reserve_memory(size);
+        if (!region)
+            reporter->errx(1, _("Out of memory"));
+    }
+    state.reset(new std::atomic<unsigned char>[points.size()]);
+    for (size_t i = 0; i < points.size(); i++)
+        state[i] = ABSENT;
+}
+
+// Decompress the whole file, without keeping the text, to find where
+// the access points can go: the start of each gzip member, and the
+// start of a deflate block once far enough past the previous point.
+bool TraceSource::Gzip::scan()
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 15 + 16) != Z_OK)
+        return false;
+
+    vector<unsigned char> window(GZIP_WINDOW_SIZE);
+    OFF_T in = 0, out = 0, last = 0;
+    points.push_back({0, 0, MEMBER_START, ""});
+    bool ok = false;
+    while (true) {
+        if (!strm.avail_in) {
+            if (in >= insize)
+                break; // truncated
+            strm.next_in = (Bytef *)data + in;
+            strm.avail_in = (uInt)min(insize - in, (OFF_T)1 << 30);
+            in += strm.avail_in;
+        }
+        if (!strm.avail_out) {
+            strm.next_out = window.data();
+            strm.avail_out = GZIP_WINDOW_SIZE;
+        }
+
+        uInt avail_out = strm.avail_out;
+        int ret = inflate(&strm, Z_BLOCK);
+        out += avail_out - strm.avail_out;
+        OFF_T inpos = in - strm.avail_in;
+
+        if (ret == Z_STREAM_END) {
+            // Another gzip member can follow. Anything else after the
+            // end is ignored, the same as gzip does.
+            if (insize - inpos < 2 || data[inpos] != 0x1f ||
+                data[inpos + 1] != 0x8b) {
+                ok = true;
+                break;
+            }
+            inflateReset(&strm);
+            points.push_back({out, inpos, MEMBER_START, ""});
+            last = out;
+            continue;
+        }
+        if (ret != Z_OK)
+            break;
+
+        // Bit 7 of data_type means inflate has stopped at the end of a
+        // block header, and bit 6 that it's the last block, after which
+        // there's no block to start from.
+        if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+            out - last >= GZIP_FRAME_SIZE) {
+            // The window is circular, so the most recent text ends
+            // where inflate will write next.
+            size_t split = GZIP_WINDOW_SIZE - strm.avail_out;
+            string text((const char *)window.data() + split,
+                        GZIP_WINDOW_SIZE - split);
+            text.append((const char *)window.data(), split);
+
+            uLongf len = compressBound(text.size());
+            string packed(len, '\0');
+            if (compress((Bytef *)&packed[0], &len, (const Bytef *)text.data(),
+                         text.size()) != Z_OK)
+                break;
+            packed.resize(len);
+            points.push_back({out, inpos, strm.data_type & 7, packed});
+            last = out;
+        }
+    }
+    inflateEnd(&strm);
+    size = out;
+    return ok;
+}
+
+static void put(unsigned long long val, unsigned bytes, string &out)
+{
+    for (unsigned i = bytes; i-- > 0;)
+        out.push_back((char)(val >> (8 * i)));
+}
+
+static unsigned long long get(const string &in, size_t &pos, unsigned bytes)
+{
+    unsigned long long val = 0;
+    for (unsigned i = 0; i < bytes; i++)
+        val = (val << 8) | (unsigned char)in[pos++];
+    return val;
+}
+
+bool TraceSource::Gzip::load(const string &access_filename)
+{
+    uint64_t trace_timestamp, access_timestamp;
+    if (!get_file_timestamp(filename, &trace_timestamp) ||
+        !get_file_timestamp(access_filename, &access_timestamp) ||
+        access_timestamp < trace_timestamp)
+        return false;
+
+    ifstream ifs(access_filename.c_str(), ifstream::binary);
+    GzipAccessHeader hdr;
+    if (!ifs.read((char *)&hdr, sizeof(hdr)) ||
+        memcmp(hdr.magic, gzip_access_magic, sizeof(hdr.magic)) ||
+        (OFF_T)hdr.compressed_size != insize)
+        return false;
+    string body((std::istreambuf_iterator<char>(ifs)),
+                std::istreambuf_iterator<char>());
+    if (crc32(0, (const Bytef *)body.data(), body.size()) != hdr.checksum)
+        return false;
+
+    // Check everything that decompress() relies on, so that a damaged
+    // file is just found again rather than trusted.
+    OFF_T new_size = hdr.size;
+    vector<Point> new_points;
+    size_t pos = 0;
+    for (uint64_t i = 0, n = hdr.npoints; i < n; i++) {
+        if (body.size() - pos < 21)
+            return false;
+        Point p;
+        p.out = get(body, pos, 8);
+        p.in = get(body, pos, 8);
+        p.bits = get(body, pos, 1);
+        size_t len = get(body, pos, 4);
+        if (body.size() - pos < len)
+            return false;
+        p.window = body.substr(pos, len);
+        pos += len;
+
+        bool member = p.bits == MEMBER_START;
+        if ((!member && (p.bits > 7 || p.window.empty())) ||
+            p.out > new_size || p.in >= insize || (!member && p.in == 0) ||
+            (new_points.empty() ? !member || p.out != 0 || p.in != 0
+                                : p.out < new_points.back().out ||
+                                      p.in <= new_points.back().in))
+            return false;
+        new_points.push_back(std::move(p));
+    }
+    if (new_points.empty() || pos != body.size())
+        return false;
+
+    size = new_size;
+    points.swap(new_points);
+    return true;
+}
+
+bool TraceSource::Gzip::save(const string &access_filename) const
+{
+    string tmp_filename = access_filename + ".tmp";
+    ofstream ofs(tmp_filename.c_str(), ofstream::binary);
+
+    string body;
+    for (const Point &p : points) {
+        put(p.out, 8, body);
+        put(p.in, 8, body);
+        put(p.bits, 1, body);
+        put(p.window.size(), 4, body);
+        body += p.window;
+    }
+
+    GzipAccessHeader hdr;
+    memcpy(hdr.magic, gzip_access_magic, sizeof(hdr.magic));
+    hdr.compressed_size = insize;
+    hdr.size = size;
+    hdr.npoints = points.size();
+    hdr.checksum = crc32(0, (const Bytef *)body.data(), body.size());
+    ofs.write((const char *)&hdr, sizeof(hdr));
+    ofs.write(body.data(), body.size());
+    ofs.close();
+
+    if (ofs.fail() || rename(tmp_filename.c_str(), access_filename.c_str())) {
+        remove(tmp_filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Decompress frame i into its place in the region.
+void TraceSource::Gzip::decompress(size_t i)
+{
+    const Point &p = points[i];
+    OFF_T len = frame_end(i) - p.out;
+    if (!len)
+        return;
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    bool member = p.bits == MEMBER_START;
+    if (inflateInit2(&strm, member ? 15 + 16 : -15) != Z_OK)
+        reporter->errx(1, _("Out of memory"));
+    OFF_T in = p.in;
+    if (!member) {
+        if (p.bits && inflatePrime(&strm, p.bits,
+                                   data[in - 1] >> (8 - p.bits)) != Z_OK)
+            corrupt();
+        string window(GZIP_WINDOW_SIZE, '\0');
+        uLongf wlen = window.size();
+        if (uncompress((Bytef *)&window[0], &wlen,
+                       (const Bytef *)p.window.data(),
+                       p.window.size()) != Z_OK ||
+            wlen != window.size() ||
+            inflateSetDictionary(&strm, (const Bytef *)window.data(),
+                                 wlen) != Z_OK)
+            corrupt();
+    }
+
+    commit_memory(region + p.out, len);
+    strm.next_out = (Bytef *)region + p.out;
+    OFF_T outpos = 0;
+    while (outpos < len) {
+        if (!strm.avail_in) {
+            if (in >= insize)
+                corrupt();
+            strm.next_in = (Bytef *)data + in;
+            strm.avail_in = (uInt)min(insize - in, (OFF_T)GZIP_FRAME_SIZE);
+            in += strm.avail_in;
+        }
+        strm.avail_out = (uInt)min(len - outpos, (OFF_T)1 << 30);
+        uInt avail_out = strm.avail_out;
+        int ret = inflate(&strm, Z_NO_FLUSH);
+        outpos += avail_out - strm.avail_out;
+        if (ret == Z_STREAM_END && outpos < len)
+            corrupt(); // the member ended before the next point
+        if (ret != Z_OK && ret != Z_STREAM_END)
+            corrupt();
+    }
+    inflateEnd(&strm);
+}
+
+void TraceSource::Gzip::fill(size_t i)
+{
+    {
+        unique_lock<std::mutex> lock(mutex);
+        while (state[i] == BUSY)
+            cond.wait(lock);
+        if (state[i] == RESIDENT)
+            return;
+        state[i] = BUSY;
+    }
+
+    // Frames are decompressed outside the lock, so that several
+    // threads reading different parts of the file can each do their
+    // own.
+    decompress(i);
+
+    unique_lock<std::mutex> lock(mutex);
+    state[i].store(RESIDENT, std::memory_order_release);
+    cond.notify_all();
+}
+
+void TraceSource::Gzip::ensure(OFF_T lo, OFF_T hi)
+{
+    auto cmp = [](OFF_T pos, const Point &p) { return pos < p.out; };
+    size_t i = std::upper_bound(points.begin(), points.end(), lo, cmp) -
+               points.begin() - 1;
+    for (; i < points.size() && points[i].out < hi; i++)
+        if (state[i].load(std::memory_order_acquire) != RESIDENT)
+            fill(i);
+}
+
+void TraceSource::Gzip::discard_before(OFF_T pos)
+{
+    // This is called for every line by a sequential reader, so check
+    // whether there's anything to do before taking the lock.
+    size_t i = discarded;
+    if (i >= points.size() || frame_end(i) > pos)
+        return;
+
+    unique_lock<std::mutex> lock(mutex);
+    for (; i < points.size() && frame_end(i) <= pos; i++) {
+        if (state[i] == RESIDENT) {
+            OFF_T start = points[i].out;
+            discard_memory(region + start, frame_end(i) - start);
+            state[i] = ABSENT;
+        }
+    }
+    discarded = i;
+}
+
+#else
+
+struct TraceSource::Gzip {
+    OFF_T size = 0;
+    char *region = nullptr;
+    void ensure(OFF_T, OFF_T) {}
+    void discard_before(OFF_T) {}
+};
+
+#endif // HAVE_ZLIB
+
+string default_gzip_access_filename(const string &trace_filename)
+{
+    return trace_filename + ".gzaccess";
+}
+
+TraceSource::TraceSource(const string &filename)
+    : file(filename, false), base(nullptr), filesize(file.curr_offset())
+{
+    if (filesize > 0)
+        base = file.getptr<char>(0);
+
+    // No Tarmac trace can start with the gzip magic number.
+    if (filesize >= 2 && (unsigned char)base[0] == 0x1f &&
+        (unsigned char)base[1] == 0x8b) {
+#if HAVE_ZLIB
+        gz.reset(new Gzip(filename, (const unsigned char *)base, filesize));
+        base = gz->region;
+        filesize = gz->size;
+#else
+        reporter->errx(1,
+                       _("%s: cannot read a compressed trace file without "
+                         "zlib support"),
+                       filename.c_str());
+#endif
+    }
+}
+
+TraceSource::~TraceSource() {}
+
+const char *TraceSource::ensure(OFF_T pos, OFF_T len) const
+{
+    if (gz && len > 0)
+        gz->ensure(pos, pos + len);
+    return base + pos;
+}
+
+void TraceSource::discard_before(OFF_T pos) const
+{
+    if (gz && pos > 0)
+        gz->discard_before(pos);
+}
+
+StringSpan TraceSource::span(OFF_T pos, OFF_T len) const
+{
+    if (pos >= filesize)
+        return StringSpan(base + filesize, 0);
+    if (len > filesize - pos)
+        len = filesize - pos;
+    return StringSpan(ensure(pos, len), len);
+}
+
+const char *TraceSource::find_newline(OFF_T pos) const
+{
+    // A compressed file is searched a block at a time, so that only as
+    // much of it is decompressed as the line needs.
+    while (pos < filesize) {
+        OFF_T len = gz ? min(filesize - pos, TraceLineReader::block_size)
+                       : filesize - pos;
+        const char *p = ensure(pos, len);
+        const char *nl = (const char *)memchr(p, '\n', len);
+        if (nl)
+            return nl;
+        pos += len;
+    }
+    return nullptr;
+}
+
+bool TraceSource::get_line(OFF_T pos, StringSpan &line, bool &terminated) const
+{
+    if (pos >= filesize)
+        return false;
+
+    const char *start = ensure(pos, 1);
+    const char *nl = find_newline(pos);
+    terminated = (nl != nullptr);
+    line = StringSpan(start, terminated ? nl - start : filesize - pos);
+    return true;
+}
+
+OFF_T TraceSource::next_line_start(OFF_T pos) const
+{
+    if (pos <= 0)
+        return 0;
+    if (pos >= filesize)
+        return filesize;
+
+    // A line starts at pos if the character before it is a newline.
+    const char *nl = find_newline(pos - 1);
+    return nl ? (nl - base) + 1 : filesize;
+}
+
+OFF_T TraceSource::complete_lines_end() const
+{
+    OFF_T pos = filesize;
+    while (pos > 0) {
+        OFF_T len = min(pos, TraceLineReader::block_size);
+        const char *p = ensure(pos - len, len) + len;
+        for (; len > 0; len--, pos--, p--)
+            if (p[-1] == '\n')
+                return pos;
+    }
+    return pos;
+}
+
+constexpr OFF_T TraceLineReader::block_size;
+
+void TraceLineReader::refill()
+{
+    lines.clear();
+    next = 0;
+
+    StringSpan block = src.span(pos, block_size);
+    const char *end = block.data + block.size;
+    const char *partial = split_lines(block.data, end, lines);
+
+    // A partial line at the end of the block is read again as the
+    // start of the next block, unless it's the end of the file, or
+    // there were no complete lines at all to return first (in which
+    // case it's an unusually long one, and it's simplest to find it
+    // separately).
+    bool at_eof = pos + block.size >= src.size();
+    if (partial < end && (at_eof || lines.empty())) {
+        StringSpan line;
+        bool terminated;
+        src.get_line(pos + (partial - block.data), line, terminated);
+        lines.push_back(line);
+    }
+}
+
+bool TraceLineReader::get_line(StringSpan &line, bool &terminated)
+{
+    if (next >= lines.size()) {
+        if (pos >= src.size())
+            return false;
+        refill();
+    }
+
+    // Only the last line of the file can be unterminated, and it runs
+    // right up to the end.
+    line = lines[next++];
+    pos += line.size;
+    terminated = (pos < src.size());
+    if (terminated)
+        pos++;
+    return true;
+}
@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+
+# Copyright 2026 Arm Limited. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# This file is part of Tarmac Trace Utilities
+
+# Helper for the tests of extending an index: simulate a trace file
+# that is still being written, by copying some or all of a complete
+# trace file into it. Also used to make gzip-compressed copies.
+
+import os
+import argparse
+import gzip
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Copy all or part of a trace file.")
+    parser.add_argument("source", help="Trace file to copy from.")
+    parser.add_argument("dest", help="Trace file to write.")
+    parser.add_argument("--bytes", type=int,
+                        help="Copy only this many bytes of the source file.")
+    parser.add_argument("--older", metavar="FILE",
+                        help="Afterwards, set the modification time of FILE "
+                        "to before that of the destination file.")
+    parser.add_argument("--gzip-members", type=int, metavar="N",
+                        help="Write the copy compressed with gzip, as N "
+                        "gzip members one after another, each starting at "
+                        "the start of a line.")
+    args = parser.parse_args()
+
+    with open(args.source, "rb") as f:
+        data = f.read()
+    if args.bytes is not None:
+        data = data[:args.bytes]
+    if args.gzip_members is not None:
+        members = []
+        start = 0
+        for i in range(1, args.gzip_members + 1):
+            end = len(data) * i // args.gzip_members
+            end = data.find(b"\n", end - 1) + 1 or len(data)
+            members.append(gzip.compress(data[start:end]))
+            start = max(start, end)
+        data = b"".join(members)
+    with open(args.dest, "wb") as f:
+        f.write(data)
+
+    if args.older is not None:
+        mtime = os.stat(args.dest).st_mtime - 60
+        os.utime(args.older, (mtime, mtime))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,219 @@
+#!/usr/bin/env python3
+
+# Copyright 2026 Arm Limited. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# This file is part of Tarmac Trace Utilities
+
+# Test client for tarmac-server: start the server, send it some
+# batches of queries, and print what comes back in readable form. The
+# protocol is described at the top of tools/server.cpp.
+
+import os
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import time
+import argparse
+
+def u8(v): return struct.pack(">B", v)
+def u32(v): return struct.pack(">I", v)
+def u64(v): return struct.pack(">Q", v)
+def string(s): return u32(len(s)) + s.encode()
+
+class Reply:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def get(self, fmt):
+        vals = struct.unpack_from(">" + fmt, self.data, self.pos)
+        self.pos += struct.calcsize(">" + fmt)
+        return vals if len(vals) > 1 else vals[0]
+
+    def bytes(self, n):
+        b = self.data[self.pos:self.pos + n]
+        self.pos += n
+        return b
+
+    def string(self):
+        return self.bytes(self.get("I")).decode()
+
+    def status(self):
+        if self.get("B") == 0:
+            return True
+        print("  error:", self.string())
+        return False
+
+def recv_all(sock, n):
+    data = b""
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise EOFError("server closed the connection")
+        data += chunk
+    return data
+
+def transact(sock, queries):
+    request = b"".join(queries)
+    sock.sendall(u32(len(request)) + request)
+    length = struct.unpack(">I", recv_all(sock, 4))[0]
+    return Reply(recv_all(sock, length))
+
+def print_node(r):
+    line, lines, t, pc, depth, pos, length = r.get("QIQQIQQ")
+    print("  node: line {} ({} lines), time {}, pc {:#x}, call depth {}, "
+          "file position {}".format(line, lines, t, pc, depth, pos))
+
+def print_mem(r, size):
+    data = r.bytes(size)
+    defined = r.bytes(size)
+    line = r.get("Q")
+    print("  " + " ".join("{:02x}".format(b) if d else ".."
+                          for b, d in zip(data, defined)) +
+          ", last written at line {}".format(line))
+    return data
+
+def run_queries(sock):
+    print("Batch 1")
+    r = transact(sock, [
+        b"i",
+        b"s" + u32(0) + string("quicksort"),
+        b"s" + u32(0) + string("no_such_symbol"),
+        b"l" + u32(0) + u64(1000),
+        b"t" + u32(0) + u64(1500),
+        b"l" + u32(0) + u64(99999999),
+        b"l" + u32(1) + u64(1000),
+    ])
+    print("traces:")
+    if r.status():
+        for i in range(r.get("I")):
+            print("  " + os.path.basename(r.string()))
+    print("symbol quicksort:")
+    if r.status():
+        addr, size = r.get("QQ")
+        print("  address {:#x}, size {}".format(addr, size))
+    print("symbol no_such_symbol:")
+    r.status()
+    print("node at line 1000:")
+    if r.status():
+        print_node(r)
+    print("node at time 1500:")
+    if r.status():
+        print_node(r)
+    print("node at line 99999999:")
+    r.status()
+    print("node at line 1000 of trace 1:")
+    r.status()
+
+    print("Batch 2")
+    r = transact(sock, [
+        b"r" + u32(0) + u64(1000) + string("x0"),
+        b"r" + u32(0) + u64(1000) + string("sp"),
+        b"r" + u32(0) + u64(1000) + string("bogus"),
+        b"r" + u32(0) + u64(99999999) + string("x0"),
+        b"v" + u32(0) + u64(addr),
+        b"p" + u32(0) + u64(addr) + u64(addr + size),
+        b"Z",
+        b"i",
+    ])
+    for name in ["x0", "sp", "bogus"]:
+        print("register {}:".format(name))
+        if r.status():
+            value = print_mem(r, r.get("I"))
+            if name == "sp":
+                sp = int.from_bytes(value, "little")
+    print("register x0 at line 99999999:")
+    r.status()
+    print("visits to quicksort:")
+    if r.status():
+        visits = [r.get("QQQ") for i in range(r.get("I"))]
+        print("  {} visits, first three:".format(len(visits)))
+        for t, line, pos in visits[:3]:
+            print("  time {}, line {}, file position {}".format(t, line, pos))
+    print("visits to any part of quicksort:")
+    if r.status():
+        print("  {}".format(r.get("Q")))
+    print("unknown opcode:")
+    r.status()
+    print("replies left over: {}".format(len(r.data) - r.pos))
+
+    print("Batch 3")
+    r = transact(sock, [
+        b"m" + u32(0) + u64(1000) + b"m" + u64(sp - 8) + u32(24),
+        b"m" + u32(0) + u64(1000) + b"q" + u64(sp) + u32(8),
+        b"m" + u32(0) + u64(0) + b"m" + u64(sp) + u32(8),
+    ])
+    print("memory around sp:")
+    if r.status():
+        print_mem(r, 24)
+    print("memory of unknown type:")
+    r.status()
+    print("memory at line 0:")
+    r.status()
+
+def connect(server, path):
+    # Wait for the server to finish indexing and start listening.
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    deadline = time.time() + 60
+    while True:
+        try:
+            sock.connect(path)
+            return sock
+        except (FileNotFoundError, ConnectionRefusedError):
+            if server.poll() is not None or time.time() > deadline:
+                sys.exit("server did not start")
+            time.sleep(0.1)
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Run tarmac-server and send it some queries.")
+    parser.add_argument("--socket", required=True,
+                        help="Socket for the server to listen on.")
+    parser.add_argument("command", nargs=argparse.REMAINDER,
+                        help="Command to run the server, without --socket.")
+    args = parser.parse_args()
+
+    # Leave a stale socket behind, as a server that crashed would, to
+    # check that a new server can still start on the same path.
+    if os.path.exists(args.socket):
+        os.remove(args.socket)
+    stale = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    stale.bind(args.socket)
+    stale.close()
+
+    server = subprocess.Popen(args.command + ["--socket", args.socket])
+    try:
+        sock = connect(server, args.socket)
+        run_queries(sock)
+
+        # A second client is served alongside the first.
+        sock2 = connect(server, args.socket)
+        print("Second connection")
+        r = transact(sock2, [b"p" + u32(0) + u64(0x8000) + u64(0x8100)])
+        if r.status():
+            print("  visits to 0x8000-0x8100: {}".format(r.get("Q")))
+        sock2.close()
+        sock.close()
+    finally:
+        server.send_signal(signal.SIGTERM)
+        server.wait()
+
+    if os.path.exists(args.socket):
+        sys.exit("server did not remove its socket")
+
+if __name__ == '__main__':
+    main()
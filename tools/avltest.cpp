@@ -20,6 +20,7 @@
 #include "libtarmac/disktree.hh"
 #include "libtarmac/reporter.hh"
 
+#include <algorithm>
 #include <functional>
 #include <iostream>
 #include <map>
@@ -31,6 +32,7 @@ using std::cout;
 using std::endl;
 using std::function;
 using std::map;
+using std::min;
 using std::set;
 using std::string;
 using std::vector;
@@ -51,10 +53,16 @@ struct TestPayload {
 enum class Test {
     Single,
     Clone,
+    Range,
+    Diff,
+    Iter,
 };
 map<string, Test> testnames = {
     {"single", Test::Single},
     {"clone", Test::Clone},
+    {"range", Test::Range},
+    {"diff", Test::Diff},
+    {"iter", Test::Iter},
 };
 
 class AVLTest {
@@ -70,6 +78,9 @@ class AVLTest {
     AVLTest(bool verbose);
     void test_single();
     void test_clone();
+    void test_range();
+    void test_diff();
+    void test_iter();
 };
 
 AVLTest::AVLTest(bool verbose) : arena(), tree(arena, true), verbose(verbose)
@@ -153,6 +164,160 @@ void AVLTest::test_clone()
     }
 }
 
+void AVLTest::test_range()
+{
+    OFF_T root = 0;
+
+    // Insert the multiples of 3 from 0 to 300, in a scrambled order.
+    int p = 101;
+    root = tree.insert(root, 0);
+    for (int i = 1; i < p; i++)
+        root = tree.insert(root, 3 * ((i * 37) % p));
+
+    for (int start = -1; start <= 302; start++) {
+        // Visit up to 10 values from 'start', and check they're the
+        // next multiples of 3 in order.
+        int first = start <= 0 ? 0 : (start + 2) / 3 * 3;
+        int available = first <= 300 ? (300 - first) / 3 + 1 : 0;
+        int expected = first, count = 0;
+        bool completed = tree.visit_from(
+            root, TestPayload(start), [&](const TestPayload &pl, OFF_T) {
+                if (verbose)
+                    cout << "from " << start << ": " << pl.value << endl;
+                assert(pl.value == expected);
+                expected += 3;
+                return ++count < 10;
+            });
+        assert(count == min(available, 10));
+        assert(completed == (available < 10));
+    }
+}
+
+void AVLTest::test_diff()
+{
+    // This uses a tree in the mode the indexer uses, where commit()
+    // makes every existing node immutable, so that the trees made by
+    // later changes share all the nodes they didn't have to copy.
+    Tree ptree(arena);
+    OFF_T rootA = 0;
+
+    // Insert the even numbers from 0 to 396 in a scrambled order.
+    int p = 199;
+    rootA = ptree.insert(rootA, 0);
+    for (int i = 1; i < p; i++)
+        rootA = ptree.insert(rootA, 2 * ((i * 71) % p));
+    ptree.commit();
+
+    for (int changes = 1; changes <= 8; changes++) {
+        // Make a version of the tree with a few values added and
+        // removed.
+        OFF_T rootB = rootA;
+        set<int> added, removed;
+        for (int i = 0; i < changes; i++) {
+            int add = 2 * ((i * 53 + changes * 17) % p) + 1;
+            int remove = 2 * ((i * 29 + changes * 31) % p);
+            if (!removed.count(remove)) {
+                bool found;
+                TestPayload payload;
+                rootB = ptree.remove(rootB, TestPayload(remove), &found,
+                                     &payload);
+                assert(found);
+                removed.insert(remove);
+            }
+            if (!added.count(add)) {
+                rootB = ptree.insert(rootB, add);
+                added.insert(add);
+            }
+        }
+        ptree.commit();
+
+        // Every value in only one tree must be reported from that
+        // tree, in order, without visiting most of the unchanged ones.
+        set<int> seen[2];
+        int last[2] = {-1, -1};
+        unsigned count = 0;
+        ptree.visit_differences(
+            rootA, rootB, [&](const TestPayload &pl, int side) {
+                if (verbose)
+                    cout << "diff " << changes << ": " << side << " "
+                         << pl.value << endl;
+                assert(pl.value > last[side]);
+                last[side] = pl.value;
+                seen[side].insert(pl.value);
+                count++;
+            });
+        for (int v : removed)
+            assert(seen[0].count(v) && !seen[1].count(v));
+        for (int v : added)
+            assert(seen[1].count(v) && !seen[0].count(v));
+        for (int v : seen[0])
+            assert(v % 2 == 0);
+        assert(count < 40 * changes);
+    }
+
+    // A tree compared with itself has no differences at all.
+    ptree.visit_differences(rootA, rootA, [&](const TestPayload &, int) {
+        assert(false && "identical trees should have no differences");
+    });
+}
+
+void AVLTest::test_iter()
+{
+    OFF_T root = 0;
+
+    // An empty tree has nothing between its beginning and its end.
+    assert(tree.begin(root) == tree.end(root));
+
+    // Insert the multiples of 5 from 0 to 500, in a scrambled order.
+    int p = 101;
+    root = tree.insert(root, 0);
+    for (int i = 1; i < p; i++)
+        root = tree.insert(root, 5 * ((i * 43) % p));
+
+    // Step forwards through the whole tree, and back again.
+    int expected = 0;
+    Tree::const_iterator it = tree.begin(root);
+    for (; it != tree.end(root); ++it, expected += 5) {
+        if (verbose)
+            cout << "forward: " << it->value << endl;
+        assert(it->value == expected);
+    }
+    assert(expected == 505);
+    while (it-- != tree.begin(root)) {
+        expected -= 5;
+        if (verbose)
+            cout << "backward: " << it->value << endl;
+        assert(it->value == expected);
+    }
+    assert(expected == 0);
+
+    // Stepping off either end gives end(), and stepping back from
+    // there returns to where we were.
+    it = tree.begin(root);
+    assert(--it == tree.end(root));
+    assert((++it)->value == 0);
+    it = tree.lower_bound(root, TestPayload(500));
+    assert(++it == tree.end(root));
+    assert((--it)->value == 500);
+
+    // lower_bound finds the first value not less than its key, and
+    // steps in both directions from there.
+    for (int start = -1; start <= 502; start++) {
+        int first = start <= 0 ? 0 : (start + 4) / 5 * 5;
+        it = tree.lower_bound(root, TestPayload(start));
+        if (first > 500) {
+            assert(it == tree.end(root));
+            continue;
+        }
+        assert(it->value == first);
+        Tree::const_iterator next = it, prev = it;
+        if (first < 500)
+            assert((++next)->value == first + 5);
+        if (first > 0)
+            assert((--prev)->value == first - 5);
+    }
+}
+
 void AVLTest::dump(OFF_T root)
 {
     if (!verbose)
@@ -242,6 +407,12 @@ int main(int argc, char **argv)
         t.test_single();
     if (tests_to_run.count(Test::Clone))
         t.test_clone();
+    if (tests_to_run.count(Test::Range))
+        t.test_range();
+    if (tests_to_run.count(Test::Diff))
+        t.test_diff();
+    if (tests_to_run.count(Test::Iter))
+        t.test_iter();
 
     return 0;
 }
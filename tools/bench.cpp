@@ -0,0 +1,712 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * tarmac-bench: time the library's hot paths on a synthetic trace (or
+ * a real one), and write the results out as JSON, so that they can be
+ * compared between versions.
+ *
+ * The synthetic trace is generated from a fixed pseudo-random seed, so
+ * the same options always give the same trace. Its program is a set
+ * of AArch64 functions calling each other to a bounded depth, with
+ * stack frames, loads and stores, occasional SVE register updates and
+ * semihosting calls, interspersed with stretches of AArch32 code
+ * making calls of its own.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/calltree.hh"
+#include "libtarmac/index.hh"
+#include "libtarmac/misc.hh"
+#include "libtarmac/parser.hh"
+#include "libtarmac/registers.hh"
+#include "libtarmac/reporter.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::function;
+using std::ifstream;
+using std::max;
+using std::min;
+using std::mt19937_64;
+using std::ostringstream;
+using std::set;
+using std::string;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+namespace {
+
+// Addresses used by the synthetic program.
+constexpr Addr A64_MAIN = 0x8000;
+constexpr Addr A64_FUNCS = 0x10000, A64_FUNC_STRIDE = 0x1000;
+constexpr Addr A32_BLOCK = 0x80000, A32_FUNC = 0x81000;
+constexpr Addr STACK_TOP = 0x100000;
+constexpr Addr DATA_BASE = 0x200000, DATA_SIZE = 0x10000;
+constexpr Addr SEMIHOST_BLOCK = 0x300000;
+
+constexpr unsigned NFUNCS = 48;
+constexpr unsigned MAX_DEPTH = 10;
+constexpr unsigned SVE_BITS = 256;
+
+class TraceGenerator {
+    FILE *fp;
+    mt19937_64 rng;
+    bool sve, a32;
+
+    unsigned long long budget; // instructions still to generate
+    unsigned long long insns = 0;
+
+    // The operations making up the body of each A64 function. Every
+    // call of a function executes the same sequence of instructions
+    // (apart from calls being skipped when they would go too deep),
+    // so the same PCs are visited over and over, as in a real
+    // program.
+    enum class Op { Alu, Load, Store, Sve, Semihost, Call };
+    struct Step {
+        Op op;
+        unsigned reg;
+        unsigned callee;
+    };
+    vector<vector<Step>> funcs;
+
+    Addr sp = STACK_TOP;
+
+    unsigned random(unsigned n) { return rng() % n; }
+    Addr data_addr() { return DATA_BASE + 8 * random(DATA_SIZE / 8); }
+
+    void insn(Addr pc, uint32_t enc, char iset, const char *disasm)
+    {
+        fprintf(fp, "%llu clk IT (%llu) %08llx %08x %c %s : %s\n", insns,
+                insns, (unsigned long long)pc, (unsigned)enc, iset,
+                iset == 'O' ? "EL3h_s" : "svc_s", disasm);
+        insns++;
+        if (budget)
+            budget--;
+    }
+    void reg64(const char *name, unsigned long long val)
+    {
+        fprintf(fp, "%llu clk R %s %016llx\n", insns - 1, name, val);
+    }
+    void xreg(unsigned n, unsigned long long val)
+    {
+        fprintf(fp, "%llu clk R X%u %016llx\n", insns - 1, n, val);
+    }
+    void rreg(unsigned n, unsigned long long val)
+    {
+        fprintf(fp, "%llu clk R r%u %08llx\n", insns - 1, n, val & 0xffffffff);
+    }
+    void mem(bool write, unsigned size, Addr addr, unsigned long long val)
+    {
+        fprintf(fp, "%llu clk M%c%u %08llx:%012llx ", insns - 1,
+                write ? 'W' : 'R', size, (unsigned long long)addr,
+                (unsigned long long)addr);
+        if (size == 8)
+            fprintf(fp, "%08llx_%08llx\n", val >> 32, val & 0xffffffff);
+        else
+            fprintf(fp, "%08llx\n", val & 0xffffffff);
+    }
+
+    void make_program()
+    {
+        funcs.resize(NFUNCS);
+        for (unsigned f = 0; f < NFUNCS; f++) {
+            unsigned len = 8 + random(48);
+            for (unsigned i = 0; i < len; i++) {
+                Step s{Op::Alu, random(29), 0};
+                unsigned r = random(100);
+                if (r < 30)
+                    s.op = Op::Load;
+                else if (r < 45)
+                    s.op = Op::Store;
+                else if (r < 50 && sve)
+                    s.op = Op::Sve;
+                else if (r < 51)
+                    s.op = Op::Semihost;
+                else if (r < 55 && f + 1 < NFUNCS) {
+                    s.op = Op::Call;
+                    s.callee = min(NFUNCS - 1, f + 1 + random(6));
+                }
+                funcs[f].push_back(s);
+            }
+        }
+    }
+
+    void semihost(Addr pc)
+    {
+        if (random(2)) {
+            // SYS_WRITE0, which doesn't write memory.
+            insn(pc, 0xd2800080, 'O', "MOV      x0,#4");
+            xreg(0, 4);
+        } else {
+            // SYS_READ, which makes the index mark its buffer as
+            // unknown, so write out its parameter block first.
+            Addr buf = data_addr() & ~(Addr)63;
+            insn(pc, 0xd28000c0, 'O', "MOV      x0,#6");
+            mem(true, 8, SEMIHOST_BLOCK, 1);
+            mem(true, 8, SEMIHOST_BLOCK + 8, buf);
+            mem(true, 8, SEMIHOST_BLOCK + 16, 64);
+            xreg(0, 6);
+            xreg(1, SEMIHOST_BLOCK);
+        }
+        insn(pc + 4, 0xd45e0000, 'O', "HLT      #0xf000");
+        xreg(0, 0);
+    }
+
+    // Run one call of A64 function f, returning to 'ret'. 'pc' is
+    // advanced past all the instructions of the body whether or not
+    // they're generated, so that addresses stay the same from one
+    // call to the next.
+    void a64_function(unsigned f, unsigned depth, Addr ret)
+    {
+        Addr pc = A64_FUNCS + f * A64_FUNC_STRIDE;
+
+        insn(pc, 0xa9bf7bfd, 'O', "STP      x29,x30,[sp,#-0x10]!");
+        mem(true, 8, sp - 16, rng());
+        mem(true, 8, sp - 8, ret);
+        sp -= 16;
+        reg64("SP_EL3", sp);
+        pc += 4;
+
+        for (const Step &s : funcs[f]) {
+            Addr here = pc;
+            pc += s.op == Op::Semihost ? 8 : 4;
+            if (!budget)
+                continue;
+
+            switch (s.op) {
+            case Op::Alu:
+                insn(here, 0x8b000000 | s.reg, 'O', "ADD      x0,x0,x0");
+                xreg(s.reg, rng());
+                break;
+            case Op::Load: {
+                unsigned long long val = rng();
+                insn(here, 0xf9400000 | s.reg, 'O', "LDR      x0,[x1]");
+                mem(false, 8, data_addr(), val);
+                xreg(s.reg, val);
+                break;
+            }
+            case Op::Store:
+                insn(here, 0xf9000000 | s.reg, 'O', "STR      x0,[x1]");
+                mem(true, 8, data_addr(), rng());
+                break;
+            case Op::Sve: {
+                insn(here, 0x04e00000 | s.reg, 'O', "ADD      z0.d,z0.d,z0.d");
+                fprintf(fp, "%llu clk R Z%u ", insns - 1, s.reg % 32);
+                for (unsigned i = 0; i < SVE_BITS / 32; i++)
+                    fprintf(fp, "%s%08x", i ? "_" : "", (unsigned)rng());
+                fprintf(fp, "\n%llu clk R P%u %08x\n", insns - 1, s.reg % 16,
+                        (unsigned)rng());
+                break;
+            }
+            case Op::Semihost:
+                semihost(here);
+                break;
+            case Op::Call:
+                if (depth >= MAX_DEPTH)
+                    // Pretend the call was skipped by a branch around it.
+                    insn(here, 0x14000002, 'O', "B        {pc}+8");
+                else {
+                    insn(here, 0x94000000, 'O', "BL       {pc}+0x1000");
+                    xreg(30, here + 4);
+                    a64_function(s.callee, depth + 1, here + 4);
+                }
+                break;
+            }
+        }
+
+        insn(pc, 0xa8c17bfd, 'O', "LDP      x29,x30,[sp],#0x10");
+        mem(false, 8, sp, rng());
+        mem(false, 8, sp + 8, ret);
+        xreg(30, ret);
+        sp += 16;
+        reg64("SP_EL3", sp);
+        insn(pc + 4, 0xd65f03c0, 'O', "RET");
+    }
+
+    // Run a stretch of AArch32 code, including a call to a small
+    // function and back.
+    void a32_block()
+    {
+        Addr pc = A32_BLOCK;
+        Addr a32_sp = STACK_TOP - 0x8000;
+        insn(pc, 0xe3a0d000, 'A', "MOV      sp,#0xf8000");
+        rreg(13, a32_sp);
+        pc += 4;
+
+        unsigned len = 16 + random(64);
+        for (unsigned i = 0; i < len && budget; i++, pc += 4) {
+            unsigned reg = random(13);
+            if (random(3) == 0) {
+                unsigned long long val = rng() & 0xffffffff;
+                insn(pc, 0xe5900000 | reg << 12, 'A', "LDR      r0,[r1,#0]");
+                mem(false, 4, data_addr(), val);
+                rreg(reg, val);
+            } else {
+                insn(pc, 0xe0800000 | reg << 12, 'A', "ADD      r0,r0,r0");
+                rreg(reg, rng());
+            }
+        }
+
+        insn(pc, 0xeb000000, 'A', "BL       {pc}+0x1000");
+        rreg(14, pc + 4);
+        insn(A32_FUNC, 0xe92d4000, 'A', "PUSH     {lr}");
+        mem(true, 4, a32_sp - 4, pc + 4);
+        rreg(13, a32_sp - 4);
+        insn(A32_FUNC + 4, 0xe2800001, 'A', "ADD      r0,r0,#1");
+        rreg(0, rng());
+        insn(A32_FUNC + 8, 0xe8bd8000, 'A', "POP      {pc}");
+        mem(false, 4, a32_sp - 4, pc + 4);
+        rreg(13, a32_sp);
+        insn(pc + 4, 0xe1a00000, 'A', "NOP");
+    }
+
+  public:
+    TraceGenerator(FILE *fp, unsigned long long seed, bool sve, bool a32)
+        : fp(fp), rng(seed), sve(sve), a32(a32)
+    {
+        make_program();
+    }
+
+    void generate(unsigned long long instructions)
+    {
+        budget = instructions;
+
+        insn(A64_MAIN, 0xd2a00200, 'O', "MOV      x0,#0x100000");
+        xreg(0, STACK_TOP);
+        insn(A64_MAIN + 4, 0x9100001f, 'O', "MOV      sp,x0");
+        reg64("SP_EL3", sp);
+
+        // The main loop calls one of the first few functions each
+        // time round, with the occasional AArch32 interlude.
+        while (budget) {
+            Addr pc = A64_MAIN + 8;
+            if (a32 && random(5) == 0) {
+                a32_block();
+                // Return to AArch64 as if from an exception.
+                insn(pc, 0xd503201f, 'O', "NOP");
+            }
+            insn(pc + 4, 0x94000000, 'O', "BL       {pc}+0x8000");
+            xreg(30, pc + 8);
+            a64_function(random(8), 0, pc + 8);
+            insn(pc + 8, 0x17fffffe, 'O', "B        {pc}-8");
+        }
+    }
+};
+
+void generate_trace(const string &filename, unsigned long long instructions,
+                    unsigned long long seed, bool sve, bool a32)
+{
+    FILE *fp = fopen_wrapper(filename.c_str(), "w");
+    if (!fp)
+        reporter->err(1, "%s: open", filename.c_str());
+    TraceGenerator(fp, seed, sve, a32).generate(instructions);
+    if (ferror(fp) || fclose(fp) != 0)
+        reporter->errx(1, "%s: error writing file", filename.c_str());
+}
+
+struct Result {
+    string name, unit;
+    unsigned long long ops;
+    vector<double> seconds;
+};
+
+// Time a function 'repeat' times, after setting it up afresh for
+// each run with 'setup' (which isn't timed).
+Result measure(const string &name, const string &unit,
+               unsigned long long ops, unsigned repeat,
+               const function<void()> &run,
+               const function<void()> &setup = nullptr)
+{
+    Result res{name, unit, ops, {}};
+    for (unsigned i = 0; i < repeat; i++) {
+        if (setup)
+            setup();
+        auto start = std::chrono::steady_clock::now();
+        run();
+        auto end = std::chrono::steady_clock::now();
+        res.seconds.push_back(std::chrono::duration<double>(end - start).count());
+    }
+    return res;
+}
+
+// Stop the compiler optimising away the lookups being timed.
+volatile unsigned long long sink;
+
+string json_string(const string &s)
+{
+    ostringstream oss;
+    oss << '"';
+    for (char c : s) {
+        if (c == '"' || c == '\\')
+            oss << '\\' << c;
+        else if ((unsigned char)c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", (unsigned)c);
+            oss << buf;
+        } else
+            oss << c;
+    }
+    oss << '"';
+    return oss.str();
+}
+
+string json_number(double d)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.9g", d);
+    return buf;
+}
+
+class NullVisitor : public CallTreeVisitor {
+  public:
+    using CallTreeVisitor::CallTreeVisitor;
+    unsigned long long calls = 0;
+    void onFunctionEntry(const TarmacSite &, const TarmacSite &) { calls++; }
+};
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    string trace_filename, index_filename, output_filename;
+    bool generate = true, generate_only = false, keep = false;
+    bool sve = true, a32 = true;
+    unsigned long long instructions = 1000000, seed = 1;
+    unsigned long long queries = 100000;
+    unsigned repeat = 3;
+    set<string> only;
+
+    const vector<string> all_benchmarks = {
+        "parse",        "index",        "node_at_line",  "node_at_time",
+        "getmem",       "find_next_mod", "lrt_translate", "calltree",
+        "calltree_walk", "concurrent_queries",
+    };
+
+    Argparse ap("tarmac-bench", argc, argv);
+    ap.optval({"--trace"}, "TRACEFILE",
+              "benchmark an existing trace file, instead of generating one",
+              [&](const string &s) {
+                  trace_filename = s;
+                  generate = false;
+              });
+    ap.optval({"--generate"}, "TRACEFILE",
+              "file to write the synthetic trace to (default "
+              "'tarmac-bench.tarmac')",
+              [&](const string &s) { trace_filename = s; });
+    ap.optnoval({"--generate-only"},
+                "write the synthetic trace and stop, without benchmarking",
+                [&]() { generate_only = true; });
+    ap.optval({"--index"}, "INDEXFILE",
+              "file to write the index to (default TRACEFILE.bench-index)",
+              [&](const string &s) { index_filename = s; });
+    ap.optnoval({"--keep"},
+                "don't delete the generated trace and the index afterwards",
+                [&]() { keep = true; });
+    ap.optval({"--instructions"}, "N",
+              "number of instructions in the synthetic trace (default "
+              "1000000)",
+              [&](const string &s) { instructions = stoull(s, nullptr, 0); });
+    ap.optval({"--seed"}, "N", "random seed for the synthetic trace",
+              [&](const string &s) { seed = stoull(s, nullptr, 0); });
+    ap.optnoval({"--no-sve"}, "leave SVE registers out of the synthetic trace",
+                [&]() { sve = false; });
+    ap.optnoval({"--no-aarch32"},
+                "leave AArch32 code out of the synthetic trace",
+                [&]() { a32 = false; });
+    ap.optval({"--queries"}, "N",
+              "number of lookups for each index query benchmark "
+              "(default 100000)",
+              [&](const string &s) { queries = stoull(s, nullptr, 0); });
+    ap.optval({"--repeat"}, "N",
+              "number of times to run each benchmark (default 3)",
+              [&](const string &s) {
+                  repeat = stoul(s, nullptr, 0);
+                  if (repeat < 1)
+                      throw ArgparseError("--repeat requires at least 1");
+              });
+    ap.optval({"--only"}, "NAME",
+              "run only this benchmark (can be repeated)",
+              [&](const string &s) {
+                  if (std::find(all_benchmarks.begin(), all_benchmarks.end(),
+                                s) == all_benchmarks.end())
+                      throw ArgparseError("unknown benchmark '" + s + "'");
+                  only.insert(s);
+              });
+    ap.optval({"-o", "--output"}, "JSONFILE",
+              "file to write the results to (default standard output)",
+              [&](const string &s) { output_filename = s; });
+    ap.parse();
+
+    if (trace_filename.empty())
+        trace_filename = "tarmac-bench.tarmac";
+    if (index_filename.empty())
+        index_filename = trace_filename + ".bench-index";
+    auto wanted = [&](const string &name) {
+        return only.empty() || only.count(name);
+    };
+
+    if (generate)
+        generate_trace(trace_filename, instructions, seed, sve, a32);
+    if (generate_only)
+        return 0;
+
+    vector<Result> results;
+
+    // Read the whole trace into memory, so that the parse benchmark
+    // doesn't measure I/O.
+    string contents;
+    {
+        ifstream ifs(trace_filename, std::ios::binary);
+        if (!ifs)
+            reporter->err(1, "%s: open", trace_filename.c_str());
+        ostringstream oss;
+        oss << ifs.rdbuf();
+        contents = oss.str();
+    }
+    unsigned long long nlines =
+        std::count(contents.begin(), contents.end(), '\n');
+
+    ParseParams pparams;
+    if (wanted("parse")) {
+        ParseReceiver receiver;
+        results.push_back(measure("parse", "line", nlines, repeat, [&]() {
+            TarmacLineParser parser(pparams, receiver);
+            for (size_t pos = 0; pos < contents.size();) {
+                size_t end = contents.find('\n', pos);
+                if (end == string::npos)
+                    end = contents.size();
+                try {
+                    parser.parse(contents.data() + pos, end - pos);
+                } catch (TarmacParseError) {
+                }
+                pos = end + 1;
+            }
+        }));
+    }
+    contents = string();
+
+    TracePair trace{trace_filename, true, index_filename, nullptr};
+    IndexerParams iparams;
+    IndexerDiagnostics idiags;
+    auto build_index = [&]() { run_indexer(trace, iparams, idiags, pparams); };
+    if (wanted("index"))
+        results.push_back(
+            measure("index", "line", nlines, repeat, build_index));
+    else
+        build_index();
+
+    {
+        IndexNavigator IN(trace);
+
+        SeqOrderPayload last;
+        if (!IN.find_buffer_limit(true, &last))
+            reporter->errx(1, "%s: trace is empty", trace_filename.c_str());
+        LineNo lines = last.trace_file_firstline + last.trace_file_lines;
+
+        // Choose all the inputs for the query benchmarks up front.
+        mt19937_64 rng(seed);
+        vector<LineNo> query_lines;
+        vector<SeqOrderPayload> query_nodes;
+        unsigned max_depth = 0;
+        for (unsigned long long i = 0; i < queries; i++) {
+            SeqOrderPayload node;
+            query_lines.push_back(1 + rng() % lines);
+            IN.node_at_line(query_lines.back(), &node);
+            query_nodes.push_back(node);
+            max_depth = max(max_depth, (unsigned)node.call_depth);
+        }
+        // Memory addresses are chosen from the synthetic program's data
+        // area. In a real trace they may not have been accessed at
+        // all, but the lookups still have to search the memory tree.
+        vector<Addr> query_addrs;
+        for (unsigned long long i = 0; i < queries; i++)
+            query_addrs.push_back(DATA_BASE + 8 * (rng() % (DATA_SIZE / 8)));
+
+        if (wanted("node_at_line"))
+            results.push_back(
+                measure("node_at_line", "query", queries, repeat, [&]() {
+                    SeqOrderPayload node;
+                    for (LineNo line : query_lines)
+                        if (IN.node_at_line(line, &node))
+                            sink += node.trace_file_pos;
+                }));
+
+        if (wanted("node_at_time"))
+            results.push_back(
+                measure("node_at_time", "query", queries, repeat, [&]() {
+                    SeqOrderPayload node;
+                    for (const SeqOrderPayload &q : query_nodes)
+                        if (IN.node_at_time(q.mod_time, &node))
+                            sink += node.trace_file_pos;
+                }));
+
+        if (wanted("getmem"))
+            results.push_back(
+                measure("getmem", "query", queries, repeat, [&]() {
+                    unsigned char data[8], def[8];
+                    for (size_t i = 0; i < query_nodes.size(); i++)
+                        sink += IN.getmem(query_nodes[i].memory_root, 'm',
+                                          query_addrs[i], 8, data, def);
+                }));
+
+        if (wanted("find_next_mod"))
+            results.push_back(
+                measure("find_next_mod", "query", queries, repeat, [&]() {
+                    // Look for a change to an address between each
+                    // node and the end of the trace.
+                    Addr lo, hi;
+                    for (size_t i = 0; i < query_nodes.size(); i++)
+                        if (IN.find_next_mod(last.memory_root, 'm',
+                                             query_addrs[i],
+                                             query_nodes[i].trace_file_firstline,
+                                             +1, lo, hi))
+                            sink += lo;
+                }));
+
+        if (wanted("concurrent_queries"))
+            results.push_back(measure(
+                "concurrent_queries", "query", queries, repeat, [&]() {
+                    // The node_at_line and getmem lookups, plus reading
+                    // the text of each node, shared out between
+                    // threads which all use the same IndexNavigator,
+                    // each with a cursor of its own.
+                    unsigned nthreads =
+                        max(2U, std::thread::hardware_concurrency());
+                    std::atomic<unsigned long long> total(0);
+                    vector<std::thread> threads;
+                    for (unsigned t = 0; t < nthreads; t++)
+                        threads.emplace_back([&, t]() {
+                            IndexCursor cursor(IN);
+                            unsigned char data[8], def[8];
+                            unsigned long long sum = 0;
+                            for (size_t i = t; i < query_lines.size();
+                                 i += nthreads) {
+                                if (!cursor.goto_line(query_lines[i]))
+                                    continue;
+                                sum += IN.getmem(cursor.node().memory_root,
+                                                 'm', query_addrs[i], 8, data,
+                                                 def);
+                                sum += cursor.lines().size();
+                            }
+                            total += sum;
+                        });
+                    for (auto &thread : threads)
+                        thread.join();
+                    sink += total;
+                }));
+
+        if (wanted("lrt_translate"))
+            results.push_back(
+                measure("lrt_translate", "query", queries, repeat, [&]() {
+                    // Count the lines at or below a varying depth
+                    // before each line, as the browser does when
+                    // folding calls.
+                    for (size_t i = 0; i < query_lines.size(); i++) {
+                        unsigned depth = query_addrs[i] % (max_depth + 2);
+                        sink += IN.lrt_translate(query_lines[i] - 1, 0,
+                                                 UINT_MAX, 0, depth);
+                    }
+                }));
+
+        if (wanted("calltree"))
+            results.push_back(measure("calltree", "line", lines, repeat, [&]() {
+                CallTree CT(IN);
+                sink += CT.getNumCalls();
+            }));
+
+        if (wanted("calltree_walk"))
+            results.push_back(
+                measure("calltree_walk", "line", lines, repeat, [&]() {
+                    CallTreeWalker CT(IN);
+                    NullVisitor V(CT);
+                    CT.walk(V);
+                    sink += V.calls;
+                }));
+    }
+
+    if (!keep) {
+        remove(index_filename.c_str());
+        if (generate)
+            remove(trace_filename.c_str());
+    }
+
+    ostringstream json;
+    json << "{\n";
+    json << "  \"tool\": \"tarmac-bench\",\n";
+    json << "  \"format\": 1,\n";
+    json << "  \"trace\": {\n";
+    json << "    \"file\": " << json_string(trace_filename) << ",\n";
+    json << "    \"generated\": " << (generate ? "true" : "false") << ",\n";
+    if (generate) {
+        json << "    \"instructions\": " << instructions << ",\n";
+        json << "    \"seed\": " << seed << ",\n";
+        json << "    \"sve\": " << (sve ? "true" : "false") << ",\n";
+        json << "    \"aarch32\": " << (a32 ? "true" : "false") << ",\n";
+    }
+    json << "    \"lines\": " << nlines << "\n";
+    json << "  },\n";
+    json << "  \"queries\": " << queries << ",\n";
+    json << "  \"repeat\": " << repeat << ",\n";
+    json << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &r = results[i];
+        double best = *std::min_element(r.seconds.begin(), r.seconds.end());
+        double total = 0;
+        for (double s : r.seconds)
+            total += s;
+        double mean = total / r.seconds.size();
+
+        json << (i ? ",\n" : "\n");
+        json << "    {\"name\": " << json_string(r.name)
+             << ", \"unit\": " << json_string(r.unit) << ", \"ops\": " << r.ops
+             << ", \"best_seconds\": " << json_number(best)
+             << ", \"mean_seconds\": " << json_number(mean)
+             << ", \"ns_per_op\": "
+             << json_number(r.ops ? best * 1e9 / r.ops : 0) << "}";
+    }
+    json << "\n  ]\n}\n";
+
+    if (output_filename.empty()) {
+        fputs(json.str().c_str(), stdout);
+    } else {
+        FILE *fp = fopen_wrapper(output_filename.c_str(), "w");
+        if (!fp)
+            reporter->err(1, "%s: open", output_filename.c_str());
+        fputs(json.str().c_str(), fp);
+        if (ferror(fp) || fclose(fp) != 0)
+            reporter->errx(1, "%s: error writing file",
+                           output_filename.c_str());
+    }
+
+    return 0;
+}
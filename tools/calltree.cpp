@@ -42,7 +42,7 @@ int main(int argc, char **argv)
     tu.setup();
 
     IndexNavigator IN(tu.trace, tu.image_filename, tu.load_offset);
-    CallTree CT(IN);
+    CallTreeWalker CT(IN);
     CT.setOptions(ctopts);
     CT.dump();
 }
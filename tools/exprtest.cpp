@@ -63,8 +63,18 @@ struct TestExecutionContext : ExecutionContext {
         out = 12345;
         return true;
     }
+
+    bool lookup_memory(uint64_t addr, size_t size, uint64_t &out) const
+    {
+        // Make the value depend on both the address and the size, so
+        // that the test output shows they were both passed through.
+        out = addr * 10 + size;
+        return true;
+    }
 };
 
+static bool simplify = false;
+
 static void test_parse_expression(const std::string &title,
                                   const std::string &str)
 {
@@ -81,6 +91,13 @@ static void test_parse_expression(const std::string &title,
     expr->dump(cout);
     cout << endl;
 
+    if (simplify) {
+        expr = simplify_expression(expr);
+        cout << title << ": simplification gives ";
+        expr->dump(cout);
+        cout << endl;
+    }
+
     TestExecutionContext tec;
     uint64_t val = expr->evaluate(tec);
     cout << title << ": evaluation gives " << val << endl;
@@ -97,6 +114,9 @@ int main(int argc, char **argv)
               "file of test expressions to parse,"
               " one per line",
               [&](const string &s) { infile = make_unique<string>(s); });
+    ap.optnoval({"--simplify"},
+                "fold constant subexpressions after parsing",
+                [&]() { simplify = true; });
     ap.positional("EXPR", "test expression to parse",
                   [&](const string &s) { expr = make_unique<string>(s); },
                   false /* not required */);
@@ -0,0 +1,181 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/lineindex.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/search.hh"
+#include "libtarmac/tarmacutil.hh"
+#include "libtarmac/tracesource.hh"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <ostream>
+#include <regex>
+#include <string>
+
+using std::cout;
+using std::max;
+using std::min;
+using std::ofstream;
+using std::ostream;
+using std::string;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+int main(int argc, char **argv)
+{
+    gettext_setup(true);
+
+    string output_filename("-"), line_index_filename, grep_pattern;
+    bool only_line_index = false;
+    unsigned interval = LineIndex::default_interval;
+    unsigned long long from_line = 1, to_line = 0;
+    Time from_time = 0, to_time = 0;
+    bool got_to_line = false, got_from_time = false, got_to_time = false;
+    bool got_grep = false;
+
+    Argparse ap("tarmac-extract", argc, argv);
+    TarmacUtilityNoIndex tu;
+    tu.cannot_use_image();
+    tu.add_options(ap);
+
+    ap.optval({"-o", "--output"}, _("FILE"),
+              _("file to write output to (default: standard output)"),
+              [&](const string &s) { output_filename = s; });
+    ap.optval({"--from-line"}, _("LINE"),
+              _("first line of the trace file to write"),
+              [&](const string &s) { from_line = stoull(s, nullptr, 0); });
+    ap.optval({"--to-line"}, _("LINE"),
+              _("last line of the trace file to write"),
+              [&](const string &s) {
+                  to_line = stoull(s, nullptr, 0);
+                  got_to_line = true;
+              });
+    ap.optval({"--from-time"}, _("TIME"),
+              _("write nothing timestamped earlier than this"),
+              [&](const string &s) {
+                  from_time = stoull(s, nullptr, 0);
+                  got_from_time = true;
+              });
+    ap.optval({"--to-time"}, _("TIME"),
+              _("write nothing timestamped later than this"),
+              [&](const string &s) {
+                  to_time = stoull(s, nullptr, 0);
+                  got_to_time = true;
+              });
+    ap.optval({"--line-index"}, _("FILE"),
+              _("line index file name (default: trace file name plus "
+                "'.lines')"),
+              [&](const string &s) { line_index_filename = s; });
+    ap.optval({"--interval"}, _("LINES"),
+              _("number of lines between entries in the line index "
+                "(default: 1024)"),
+              [&](const string &s) {
+                  interval = stoul(s, nullptr, 0);
+                  if (interval < 1)
+                      throw ArgparseError(_("--interval requires at least 1"));
+              });
+    ap.optval({"--grep"}, _("REGEX"),
+              _("write only the lines matching a regular expression, each "
+                "preceded by its line number"),
+              [&](const string &s) {
+                  grep_pattern = s;
+                  got_grep = true;
+              });
+    ap.optnoval({"--only-line-index"},
+                _("generate line index and do nothing else"),
+                [&]() { only_line_index = true; });
+
+    ap.parse();
+    tu.setup();
+
+    if (tu.tarmac_filename == "-")
+        reporter->errx(1, _("tarmac-extract cannot read from standard input"));
+    if (line_index_filename.empty())
+        line_index_filename = default_line_index_filename(tu.tarmac_filename);
+
+    TraceSource src(tu.tarmac_filename);
+    ParseParams pparams = tu.get_parse_params();
+    LineIndex lindex;
+    load_or_build_line_index(lindex, src, tu.tarmac_filename,
+                             line_index_filename, pparams, interval);
+    if (only_line_index)
+        return 0;
+
+    // Every option narrows the range of lines to write, so the result
+    // is the intersection of all of them.
+    // Positions and line numbers increase together, so narrowing by
+    // position narrows the line range too.
+    auto later = [](const LineAnchor &a, const LineAnchor &b) {
+        return a.pos < b.pos ? b : a;
+    };
+    auto earlier = [](const LineAnchor &a, const LineAnchor &b) {
+        return a.pos < b.pos ? a : b;
+    };
+    LineAnchor start = lindex.find_line(src, from_line);
+    LineAnchor end = lindex.get_anchors().back();
+    if (got_to_line && to_line < lindex.lines())
+        end = earlier(end, lindex.find_line(src, to_line + 1));
+    if (got_from_time)
+        start = later(start, lindex.find_time(src, pparams, from_time));
+    if (got_to_time && to_time + 1 > to_time)
+        end = earlier(end, lindex.find_time(src, pparams, to_time + 1));
+
+    std::unique_ptr<TraceSearch> search;
+    if (got_grep) {
+        SearchParams sparams;
+        sparams.pattern = grep_pattern;
+        sparams.regex = true;
+        try {
+            search.reset(new TraceSearch(src, sparams));
+        } catch (std::regex_error &) {
+            reporter->errx(1, _("invalid regular expression '%s'"),
+                           grep_pattern.c_str());
+        }
+    }
+
+    ofstream ofs;
+    ostream *osp = &cout;
+    if (output_filename != "-") {
+        ofs.open(output_filename.c_str(), ofstream::binary);
+        if (ofs.fail())
+            reporter->errx(1, _("unable to open output file '%s'"),
+                           output_filename.c_str());
+        osp = &ofs;
+    }
+    if (search) {
+        LineNo line = start.line - 1;
+        OFF_T pos;
+        while (search->find(line, +1, &line, &pos) && line < end.line) {
+            StringSpan text;
+            bool terminated;
+            src.get_line(pos, text, terminated);
+            *osp << line << ":";
+            osp->write(text.data, text.size);
+            *osp << "\n";
+        }
+    } else if (start.pos < end.pos) {
+        StringSpan data = src.span(start.pos, end.pos - start.pos);
+        osp->write(data.data, data.size);
+    }
+    return 0;
+}
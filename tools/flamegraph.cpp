@@ -46,21 +46,33 @@ int main(int argc, char **argv)
     iparams.record_memory = false;
 
     CallTreeOptions ctopts;
+    CallTreeWindowOptions wopts;
+    unsigned threads = 1;
 
     Argparse ap("tarmac-flamegraph", argc, argv);
     TarmacUtility tu;
     tu.set_indexer_params(iparams);
     tu.add_options(ap);
     ctopts.add_options(ap);
+    wopts.add_options(ap);
     ap.optval({"-o", "--output"}, _("OUTFILE"),
               _("write output to OUTFILE (default: standard output)"),
               [&](const string &s) { outfile = make_unique<string>(s); });
+    ap.optval({"--threads"}, _("N"),
+              _("use N threads to go through the calls in the trace"),
+              [&](const string &s) {
+                  unsigned long n = stoul(s, nullptr, 0);
+                  if (n < 1)
+                      throw ArgparseError(_("--threads requires at least 1"));
+                  threads = n;
+              });
     ap.parse();
     tu.setup();
 
     IndexNavigator IN(tu.trace, tu.image_filename, tu.load_offset);
-    CallTree CT(IN);
+    CallTreeWalker CT(IN);
     CT.setOptions(ctopts);
+    CT.setWindow(wopts);
 
     unique_ptr<ofstream> ofs;
     ostream *osp;
@@ -71,5 +83,5 @@ int main(int argc, char **argv)
         osp = &cout;
     }
 
-    CT.generate_flame_graph(*osp);
+    CT.generate_flame_graph(*osp, threads);
 }
@@ -17,6 +17,7 @@
  */
 
 #include "libtarmac/argparse.hh"
+#include "libtarmac/eventcache.hh"
 #include "libtarmac/index.hh"
 #include "libtarmac/intl.hh"
 #include "libtarmac/reporter.hh"
@@ -29,6 +30,7 @@
 #include <climits>
 #include <functional>
 #include <iostream>
+#include <sstream>
 #include <stack>
 #include <string>
 #include <vector>
@@ -45,7 +47,7 @@ using std::vector;
 
 static bool omit_index_offsets;
 
-static void dump_memory_at_line(const IndexNavigator &IN, unsigned trace_line,
+static void dump_memory_at_line(const IndexNavigator &IN, LineNo trace_line,
                                 const std::string &prefix);
 
 template <typename Payload, typename Annotation> class TreeDumper {
@@ -216,11 +218,14 @@ class SeqTreeDumper : public TreeDumper<SeqOrderPayload, SeqOrderAnnotation> {
                                  const SeqOrderPayload &node,
                                  const SeqOrderAnnotation &annotation) override
     {
-        auto *array = (const CallDepthArrayEntry *)IN.index.index_offset(
-            annotation.call_depth_array);
+        const void *array = IN.index.index_offset(
+            annotation.call_depth_array,
+            annotation.call_depth_arraylen *
+                call_depth_array_entry_size(annotation.call_depth_array_wide));
 
         for (unsigned i = 0, e = annotation.call_depth_arraylen; i < e; i++) {
-            const CallDepthArrayEntry &ent = array[i];
+            CallDepthArrayEntry ent = get_call_depth_entry(
+                array, annotation.call_depth_array_wide, i);
             cout << prefix << "LRT[" << i << "] = { ";
             if (ent.call_depth == SENTINEL_DEPTH)
                 cout << _("sentinel");
@@ -311,8 +316,7 @@ class MemSubtreeDumper
     }
 };
 
-class ByPCTreeDumper
-    : public TreeDumper<ByPCPayload, EmptyAnnotation<ByPCPayload>> {
+class ByPCTreeDumper : public TreeDumper<ByPCPayload, ByPCAnnotation> {
     using TreeDumper::TreeDumper;
 
     virtual void dump_payload(const string &prefix,
@@ -320,6 +324,17 @@ class ByPCTreeDumper
     {
         cout << prefix << "PC: " << hex << node.pc << dec << endl;
         cout << prefix << _("Line: ") << node.trace_file_firstline << endl;
+        cout << prefix << _("Modification time: ") << node.mod_time << endl;
+        cout << prefix << format(_("Byte position: {:#x}"), node.trace_file_pos)
+             << endl;
+    }
+
+    virtual void dump_annotation(const string &prefix,
+                                 const ByPCPayload &node,
+                                 const ByPCAnnotation &annotation) override
+    {
+        cout << prefix << _("Number of nodes in whole subtree: ")
+             << annotation.count << endl;
     }
 };
 
@@ -402,6 +417,7 @@ static void hexdump(const void *vdata, size_t size, Addr startaddr,
         linebuf[outlinelen] = '\0';
         cout << prefix << linebuf << endl;
 
+        data += linesize;
         startaddr += linesize;
         size -= linesize;
     }
@@ -423,7 +439,7 @@ static void regdump(const std::vector<unsigned char> &val,
     }
 }
 
-static void dump_memory_at_line(const IndexNavigator &IN, unsigned trace_line,
+static void dump_memory_at_line(const IndexNavigator &IN, LineNo trace_line,
                                 const std::string &prefix)
 {
     SeqOrderPayload node;
@@ -432,53 +448,174 @@ static void dump_memory_at_line(const IndexNavigator &IN, unsigned trace_line,
         exit(1);
     }
     OFF_T memroot = node.memory_root;
-    unsigned iflags = IN.get_iflags(memroot);
-
-    const void *outdata;
-    Addr outaddr;
-    size_t outsize;
-    unsigned outline;
-
-    Addr readaddr = 0;
-    size_t readsize = 0;
-    while (IN.getmem_next(memroot, 'm', readaddr, readsize, &outdata, &outaddr,
-                          &outsize, &outline)) {
-        cout << prefix << format(_("Memory last modified at line {}:"), outline)
-             << endl;
-        hexdump(outdata, outsize, outaddr, prefix);
-        readsize -= outaddr + outsize - readaddr;
-        readaddr = outaddr + outsize;
-        if (!readaddr)
-            break;
-    }
 
+    IN.visit_mem(memroot, 'm', 0, 0,
+                 [&](const IndexNavigator::MemoryExtent &ext) {
+                     cout << prefix
+                          << format(_("Memory last modified at line {}:"),
+                                    ext.line)
+                          << endl;
+                     hexdump(ext.data, ext.size, ext.addr, prefix);
+                     return true;
+                 });
+
+    vector<RegisterId> regs;
     for (const auto &regfam : reg_families) {
         for (unsigned i = 0; i < regfam.nregs; i++) {
             RegisterId reg{regfam.prefix, i};
-            size_t size = reg_size(reg);
-            if (size == 0)
+            if (reg_size(reg) == 0)
                 continue;              // it's a dummy register
-            vector<unsigned char> val(size), def(size);
+            regs.push_back(reg);
+        }
+    }
 
-            unsigned mod_line = IN.getmem(memroot, 'r', reg_offset(reg, iflags),
-                                          size, &val[0], &def[0]);
+    vector<RegisterValue> values = IN.get_regs(memroot, regs);
+    for (size_t i = 0; i < regs.size(); i++) {
+        const RegisterValue &value = values[i];
 
-            bool print = false;
-            for (auto c : def) {
-                if (c) {
-                    print = true;
-                    break;
-                }
+        bool print = false;
+        for (auto c : value.def) {
+            if (c) {
+                print = true;
+                break;
             }
+        }
+
+        if (print) {
+            cout << prefix << format(_("{}, last modified at line {}: "),
+                                     reg_name(regs[i]), value.line);
+            regdump(value.val, value.def);
+            cout << endl;
+        }
+    }
+}
+
+static void dump_diff(const IndexNavigator &IN, LineNo line_a, LineNo line_b)
+{
+    OFF_T memroots[2];
+    LineNo lines[2] = {line_a, line_b};
+    for (int i = 0; i < 2; i++) {
+        SeqOrderPayload node;
+        if (!IN.node_at_line(lines[i], &node)) {
+            cerr << format(_("Unable to find a node at line {}\n"), lines[i]);
+            exit(1);
+        }
+        memroots[i] = node.memory_root;
+    }
 
-            if (print) {
-                cout << prefix << format(_("{}, last modified at line {}: "),
-                                         reg_name(reg), mod_line);
-                regdump(val, def);
+    // Memory is shown as it changed. Register space is translated back
+    // into the registers overlapping each change, with their whole
+    // values before and after, as of the iflags in the later state.
+    vector<IndexNavigator::StateChange> regchanges;
+    IN.diff(memroots[0], memroots[1],
+            [&](const IndexNavigator::StateChange &change) {
+                if (change.type == 'r') {
+                    regchanges.push_back(change);
+                    return true;
+                }
+                cout << format(_("Memory at {:#x} ({} bytes), last modified "
+                                 "at line {}:"),
+                               change.addr, change.size, change.line)
+                     << endl;
+                cout << "  " << _("before: ");
+                regdump(change.before, change.before_def);
+                cout << endl << "  " << _("after:  ");
+                regdump(change.after, change.after_def);
                 cout << endl;
+                return true;
+            });
+
+    unsigned iflags = IN.get_iflags(memroots[1]);
+    vector<RegisterId> regs;
+    for (const auto &regfam : reg_families) {
+        for (unsigned i = 0; i < regfam.nregs; i++) {
+            RegisterId reg{regfam.prefix, i};
+            if (reg_size(reg) == 0)
+                continue; // it's a dummy register
+            Addr lo = reg_offset(reg, iflags), hi = lo + reg_size(reg);
+            for (const auto &change : regchanges) {
+                if (change.addr < hi && lo < change.addr + change.size) {
+                    regs.push_back(reg);
+                    break;
+                }
             }
         }
     }
+
+    vector<RegisterValue> before = IN.get_regs(memroots[0], regs);
+    vector<RegisterValue> after = IN.get_regs(memroots[1], regs);
+    for (size_t i = 0; i < regs.size(); i++) {
+        cout << format(_("{}, last modified at line {}: "), reg_name(regs[i]),
+                       after[i].line);
+        regdump(before[i].val, before[i].def);
+        cout << " -> ";
+        regdump(after[i].val, after[i].def);
+        cout << endl;
+    }
+}
+
+// Parse a condition for --find-condition, which can refer to
+// registers by name, but not to symbols, since indextool has no image.
+static ExprPtr parse_condition(const IndexNavigator &IN, const string &text)
+{
+    struct RegisterParseContext : TrivialParseContext {
+        bool aarch64;
+        bool lookup_register(const std::string &name, RegisterId &out) const
+        {
+            // The same special cases as the browsers recognise.
+            if (name == "pc")
+                out = REG_pc;
+            else if (name == "sp")
+                out = aarch64 ? REG_64_xsp : REG_32_sp;
+            else if (name == "lr")
+                out = aarch64 ? REG_64_xlr : REG_32_lr;
+            else
+                return lookup_reg_name(out, name);
+            return true;
+        }
+    } pc;
+    pc.aarch64 = IN.index.isAArch64();
+
+    std::ostringstream error;
+    ExprPtr expr = parse_expression(text, pc, error);
+    if (!expr)
+        reporter->errx(1, _("unable to parse condition '%s': %s"),
+                       text.c_str(), error.str().c_str());
+    return simplify_expression(expr);
+}
+
+static void dump_range_stats(const IndexNavigator &IN, LineNo first,
+                             LineNo last)
+{
+    IndexNavigator::RangeStats stats;
+    if (!IN.range_stats(first, last, &stats)) {
+        cerr << format(_("Unable to find nodes at lines {} and {}\n"), first,
+                       last);
+        exit(1);
+    }
+
+    cout << format(_("Lines: {}-{} ({} lines)"), stats.firstline,
+                   stats.firstline + stats.lines - 1, stats.lines)
+         << endl;
+    cout << format(_("Time: {}-{} ({} elapsed)"), stats.start_time,
+                   stats.end_time, stats.end_time - stats.start_time)
+         << endl;
+    cout << format(_("Instructions: {}"), stats.instructions) << endl;
+    cout << format(_("Memory reads: {}"), stats.memory_reads) << endl;
+    cout << format(_("Memory writes: {}"), stats.memory_writes) << endl;
+    cout << format(_("CPU exceptions: {}"), stats.cpu_exceptions) << endl;
+}
+
+static void find_condition(const IndexNavigator &IN, Expression &cond,
+                           bool backwards)
+{
+    SeqOrderPayload node;
+    if (!IN.find_buffer_limit(backwards, &node))
+        return;
+    while (IN.find_condition(node, cond, backwards ? -1 : +1, &node))
+        cout << format(_("Condition becomes true at line {} (time {})"),
+                       node.trace_file_firstline, node.mod_time)
+             << endl;
 }
 
 std::unique_ptr<Reporter> reporter = make_cli_reporter();
@@ -501,11 +638,20 @@ int main(int argc, char **argv)
         ByPCWalk,
         RegMap,
         FullMemByLine,
+        FindCondition,
+        Diff,
+        RangeStats,
+        MakeShard,
+        StitchShards,
     } mode = Mode::None;
     OFF_T root;
-    unsigned trace_line;
+    LineNo trace_line, line_pair[2];
+    string condition;
+    bool backwards = false;
     unsigned iflags = 0;
     bool got_iflags = false;
+    unsigned long long shard_index, shard_count;
+    vector<string> shard_files;
 
     Argparse ap("tarmac-indextool", argc, argv);
     TarmacUtility tu;
@@ -573,12 +719,86 @@ int main(int argc, char **argv)
                   mode = Mode::FullMemByLine;
                   trace_line = parseint(s);
               });
+    auto parse_line_pair = [&](const string &s) {
+        size_t comma = s.find(',');
+        if (comma == string::npos)
+            throw ArgparseError(format(_("'{}': expected two line numbers "
+                                         "separated by a comma"),
+                                       s));
+        line_pair[0] = parseint(s.substr(0, comma));
+        line_pair[1] = parseint(s.substr(comma + 1));
+    };
+    ap.optval({"--diff-lines"}, _("LINE,LINE"),
+              _("list every change to registers and memory between the "
+                "states at two lines of the trace file"),
+              [&](const string &s) {
+                  mode = Mode::Diff;
+                  parse_line_pair(s);
+              });
+    ap.optval({"--range-stats"}, _("LINE,LINE"),
+              _("count the instructions, time and events in the part of "
+                "the trace file between two lines"),
+              [&](const string &s) {
+                  mode = Mode::RangeStats;
+                  parse_line_pair(s);
+              });
+    ap.optval({"--find-condition"}, _("EXPR"),
+              _("list every point in the trace at which the expression "
+                "EXPR becomes true"),
+              [&](const string &s) {
+                  mode = Mode::FindCondition;
+                  condition = s;
+              });
+    ap.optnoval({"--backwards"},
+                _("(for --find-condition) search backwards from the end of "
+                  "the trace"),
+                [&]() { backwards = true; });
+    ap.optval({"--event-shard"}, _("K/N"),
+              _("divide the trace file into N parts, and parse part K "
+                "(counting from 0) into the event cache shard named by "
+                "--shard-file, instead of indexing it"),
+              [&](const string &s) {
+                  mode = Mode::MakeShard;
+                  size_t slash = s.find('/');
+                  if (slash == string::npos)
+                      throw ArgparseError(
+                          format(_("'{}': expected two numbers "
+                                   "separated by a slash"),
+                                 s));
+                  shard_index = parseint(s.substr(0, slash));
+                  shard_count = parseint(s.substr(slash + 1));
+                  if (shard_index >= shard_count)
+                      throw ArgparseError(
+                          format(_("'{}': part number must be less than "
+                                   "the number of parts"),
+                                 s));
+              });
+    ap.optnoval({"--stitch-event-shards"},
+                _("join the event cache shards named by --shard-file into "
+                  "the event cache for the trace file"),
+                [&]() { mode = Mode::StitchShards; });
+    ap.optval({"--shard-file"}, _("FILE"),
+              _("(for --event-shard and --stitch-event-shards) name of an "
+                "event cache shard"),
+              [&](const string &s) { shard_files.push_back(s); });
+    ap.optval({"--stop-after-lines"}, _("N"),
+              _("(for testing) if indexing, stop after N lines of the trace "
+                "file, as if interrupted, leaving a partial index"),
+              [&](const string &s) {
+                  tu.set_indexer_stop_after_lines(parseint(s));
+              });
 
     ap.parse([&]() {
         if (mode == Mode::None && !tu.only_index())
             throw ArgparseError(_("expected an option describing a query"));
         if (mode != Mode::RegMap && tu.trace.tarmac_filename.empty())
             throw ArgparseError(_("expected a trace file name"));
+        if (mode == Mode::MakeShard && shard_files.size() != 1)
+            throw ArgparseError(
+                _("--event-shard expects one --shard-file option"));
+        if (mode == Mode::StitchShards && shard_files.empty())
+            throw ArgparseError(_("--stitch-event-shards expects at least "
+                                  "one --shard-file option"));
     });
 
     cout << showbase; // ensure all hex values have a leading 0x
@@ -590,6 +810,29 @@ int main(int argc, char **argv)
         return 0;
     }
 
+    case Mode::MakeShard: {
+        TraceSource source(tu.trace.tarmac_filename);
+        OFF_T size = source.size();
+        if (!write_event_cache_shard(shard_files[0], source,
+                                     size * shard_index / shard_count,
+                                     size * (shard_index + 1) / shard_count,
+                                     tu.get_parse_params()))
+            reporter->errx(1, _("unable to write event cache file '%s'"),
+                           shard_files[0].c_str());
+        return 0;
+    }
+
+    case Mode::StitchShards: {
+        TraceSource source(tu.trace.tarmac_filename);
+        string filename =
+            default_event_cache_filename(tu.trace.tarmac_filename);
+        if (!stitch_event_cache_shards(filename, shard_files, source,
+                                       tu.get_parse_params()))
+            reporter->errx(1, _("unable to write event cache file '%s'"),
+                           filename.c_str());
+        return 0;
+    }
+
     default:
         // Exit this switch and go on to load the trace file
         break;
@@ -601,6 +844,8 @@ int main(int argc, char **argv)
     switch (mode) {
     case Mode::None:
     case Mode::RegMap:
+    case Mode::MakeShard:
+    case Mode::StitchShards:
         assert(false && "This should have been ruled out above");
 
     case Mode::Header: {
@@ -610,6 +855,16 @@ int main(int argc, char **argv)
              << (IN.index.isAArch64() ? "AArch64" : "AArch32") << endl;
         cout << _("Thumb only: ")
              << (IN.index.isThumbOnly() ? "yes" : "no") << endl;
+        cout << _("Memory contents recorded: ")
+             << (IN.index.hasMemory() ? "yes" : "no") << endl;
+        cout << _("Call depths recorded: ")
+             << (IN.index.hasCalls() ? "yes" : "no") << endl;
+        cout << _("Write history recorded: ")
+             << (IN.index.hasWrites() ? "yes" : "no") << endl;
+        cout << _("Can be extended: ")
+             << (IN.index.isResumable() ? "yes" : "no") << endl;
+        cout << _("Stopped before end of trace: ")
+             << (IN.index.isPartial() ? "yes" : "no") << endl;
         cout << _("Largest SVE vector register access: ")
              << IN.index.maxSVEBits() << " bits" << endl;
         cout << _("Root of sequential order tree: ") << IN.index.seqroot
@@ -675,6 +930,22 @@ int main(int argc, char **argv)
         dump_memory_at_line(IN, trace_line, "");
         break;
     }
+
+    case Mode::Diff: {
+        dump_diff(IN, line_pair[0], line_pair[1]);
+        break;
+    }
+
+    case Mode::RangeStats: {
+        dump_range_stats(IN, line_pair[0], line_pair[1]);
+        break;
+    }
+
+    case Mode::FindCondition: {
+        ExprPtr cond = parse_condition(IN, condition);
+        find_condition(IN, *cond, backwards);
+        break;
+    }
     }
 
     return 0;
@@ -26,6 +26,7 @@
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -39,6 +40,7 @@ using std::istream;
 using std::make_unique;
 using std::ofstream;
 using std::ostream;
+using std::ostringstream;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -136,6 +138,50 @@ void run_tests(istream &is, ostream &os)
     }
 }
 
+// Parse each line twice, once by the parser's fast path wherever it
+// can be used and once by the general parser alone, and report any
+// line for which the two disagree.
+void compare_fast_path(istream &is, ostream &os)
+{
+    ostringstream fast_os, general_os;
+    TestReceiver fast_recv(fast_os), general_recv(general_os);
+    TarmacLineParser fast_parser(parse_params, fast_recv);
+    TarmacLineParser general_parser(parse_params, general_recv);
+    fast_parser.set_fast_path(TarmacLineParser::FastPath::Always);
+    general_parser.set_fast_path(TarmacLineParser::FastPath::Never);
+
+    auto parse = [](const TarmacLineParser &parser, ostringstream &out,
+                    const string &line) {
+        out.str("");
+        try {
+            parser.parse(line);
+        } catch (TarmacParseError err) {
+            out << "Parse error: " << err.msg << endl;
+        }
+        return out.str();
+    };
+
+    string line;
+    unsigned long long lines = 0, differences = 0;
+    while (getline(is, line)) {
+        if (line.size() == 0 || line[0] == '#')
+            continue;
+        lines++;
+        string fast = parse(fast_parser, fast_os, line);
+        string general = parse(general_parser, general_os, line);
+        if (fast != general || !fast_parser.same_state_as(general_parser)) {
+            differences++;
+            os << "--- Tarmac line: " << line << endl
+               << "Fast path:" << endl
+               << fast << "General parser:" << endl
+               << general;
+        }
+    }
+    os << lines << " lines, " << fast_parser.fast_path_lines()
+       << " parsed by the fast path, " << differences << " differences"
+       << endl;
+}
+
 class HighlightReceiver : public ParseReceiver {
     string line;
     vector<HighlightClass> highlights;
@@ -154,6 +200,7 @@ class HighlightReceiver : public ParseReceiver {
         for (size_t i = start; i < end; i++)
             highlights[i] = hc;
     }
+    bool wants_highlights() const { return true; }
     void got_event(InstructionEvent &ev)
     {
         if (ev.effect != IE_EXECUTED)
@@ -235,6 +282,10 @@ int main(int argc, char **argv)
     Argparse ap("parsertest", argc, argv);
     ap.optnoval({"--highlight"}, "syntax-highlight the Tarmac input",
                 [&]() { do_stuff = syntax_highlight; });
+    ap.optnoval({"--compare-fast-path"},
+                "check that the parser's fast path gives the same results "
+                "as the general parser",
+                [&]() { do_stuff = compare_fast_path; });
     ap.optval({"-o", "--output"}, "OUTFILE",
               "write output to OUTFILE "
               "(default: standard output)",
@@ -1,5 +1,5 @@
 /*
- * Copyright 2016-2021 Arm Limited. All rights reserved.
+ * Copyright 2016-2021,2026 Arm Limited. All rights reserved.
  *
  * Licensed under the Apache License, Version 2.0 (the "License");
  * you may not use this file except in compliance with the License.
@@ -22,10 +22,15 @@
 #include "libtarmac/intl.hh"
 #include "libtarmac/reporter.hh"
 
+#include <algorithm>
+#include <atomic>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <map>
 #include <sstream>
+#include <unordered_map>
+#include <vector>
 
 using namespace std;
 
@@ -48,16 +53,23 @@ struct ProfileData {
     }
 };
 
+// How many shards of the call tree to make for each thread, so that
+// the threads still have roughly equal amounts of work to do if the
+// shards turn out to vary in how long they take.
+static const unsigned PROFILE_SHARDS_PER_THREAD = 16;
+
 class Profiler : public CallTreeVisitor {
     using CallTreeVisitor::CallTreeVisitor;
 
-    map<Addr, ProfileData> Prof;
+    // Kept in a hash table while we're accumulating it, because
+    // that's faster to update; sorted by address when we print it.
+    unordered_map<Addr, ProfileData> Prof;
 
   public:
     void onFunctionEntry(const TarmacSite &function_entry,
                          const TarmacSite &function_exit)
     {
-        map<Addr, ProfileData>::iterator it = Prof.find(function_entry.addr);
+        auto it = Prof.find(function_entry.addr);
         if (it == Prof.end())
             Prof.insert(make_pair(
                 function_entry.addr,
@@ -66,6 +78,20 @@ class Profiler : public CallTreeVisitor {
             it->second.addCall(function_exit.time - function_entry.time + 1);
     }
 
+    // Add in the profile accumulated by another Profiler.
+    void merge(const Profiler &other)
+    {
+        for (const auto &p : other.Prof) {
+            auto it = Prof.find(p.first);
+            if (it == Prof.end()) {
+                Prof.insert(p);
+            } else {
+                it->second.Count += p.second.Count;
+                it->second.CumulatedCycleCount += p.second.CumulatedCycleCount;
+            }
+        }
+    }
+
     void dump() const
     {
         cout << left << setw(12) << _("Address");
@@ -74,7 +100,7 @@ class Profiler : public CallTreeVisitor {
         cout << left << _("Function name");
         cout << '\n';
 
-        for (const auto &p : Prof) {
+        for (const auto &p : map<Addr, ProfileData>(Prof.begin(), Prof.end())) {
             ostringstream addr;
             addr << "0x" << hex << p.first;
 
@@ -87,16 +113,130 @@ class Profiler : public CallTreeVisitor {
     }
 };
 
-void ProfileInfo::run(const CallTreeOptions &ctopts)
+void ProfileInfo::run(const CallTreeOptions &ctopts,
+                      const CallTreeWindowOptions &wopts, unsigned threads)
 {
-    CallTree CT(*this);
+    CallTreeWalker CT(*this);
     CT.setOptions(ctopts);
+    CT.setWindow(wopts);
     Profiler P(CT);
-    CT.visit(P);
 
+    if (threads <= 1) {
+        CT.walk(P);
+        P.dump();
+        return;
+    }
+
+    // Divide the trace up into shards, and let each thread take the
+    // next one that nobody has started on, accumulating its own
+    // separate profile which we merge at the end. The profile only
+    // depends on each function call in isolation, so it doesn't
+    // matter which thread sees which call, or in what order.
+    vector<CallTreeWalker::Shard> shards =
+        CT.split(P, threads * PROFILE_SHARDS_PER_THREAD);
+
+    atomic<size_t> next_shard(0);
+    vector<Profiler> profiles(threads, Profiler(CT));
+    vector<future<void>> workers;
+    for (Profiler &profile : profiles) {
+        Profiler *WP = &profile;
+        workers.push_back(async(launch::async, [&, WP]() {
+            size_t i;
+            while ((i = next_shard++) < shards.size())
+                CT.walk_shard(*WP, shards[i]);
+        }));
+    }
+    for (auto &w : workers)
+        w.get();
+
+    for (const Profiler &WP : profiles)
+        P.merge(WP);
     P.dump();
 }
 
+void ProfileInfo::run_by_pc() const
+{
+    cout << left << setw(12) << _("Address");
+    cout << left << setw(12) << _("Count");
+    cout << left << _("Function name");
+    cout << '\n';
+
+    // The PC tree is sorted by PC, so we can step from each PC value
+    // to the next one in the tree, and its count annotations tell us
+    // how many visits each one had without looking at them all.
+    ByPCPayload key;
+    key.pc = 0;
+    key.trace_file_firstline = 0;
+    while (true) {
+        bool found = false;
+        index.bypctree.visit_from(index.bypcroot, key,
+                                  [&](const ByPCPayload &payload, OFF_T) {
+                                      key.pc = payload.pc;
+                                      found = true;
+                                      return false;
+                                  });
+        if (!found)
+            break;
+
+        Addr pc = key.pc;
+        key.pc = pc + 1;
+
+        // Skip the pseudo-PC that marks CPU exceptions.
+        if (pc == CPU_EXCEPTION_PC)
+            continue;
+
+        ostringstream addr;
+        addr << "0x" << hex << pc;
+
+        cout << left << setw(11) << addr.str() << ' ';
+        cout << left << setw(11) << count_pc_visits(pc, pc + 1) << ' ';
+        cout << left << get_symbolic_address(pc);
+        cout << '\n';
+    }
+}
+
+void ProfileInfo::run_by_function() const
+{
+    shared_ptr<Image> image = get_image();
+    if (!image)
+        reporter->errx(1, _("--by-function requires an image to find the "
+                            "functions in"));
+
+    vector<const Symbol *> funcs;
+    for (const Symbol *sym : image->find_all_symbols_starting_with(""))
+        if (sym->kind == Symbol::kind_type::function && sym->size > 0)
+            funcs.push_back(sym);
+    stable_sort(funcs.begin(), funcs.end(),
+                [](const Symbol *a, const Symbol *b) {
+                    return a->addr < b->addr;
+                });
+
+    cout << left << setw(12) << _("Address");
+    cout << left << setw(12) << _("Count");
+    cout << left << _("Function name");
+    cout << '\n';
+
+    // Each function covers a range of PC values, and the count
+    // annotations in the PC tree give the number of visits to any
+    // range with two searches, so there's no need to go through the
+    // trace or even the individual PCs. (The low bit of a Thumb
+    // function's address isn't part of any PC.)
+    for (const Symbol *sym : funcs) {
+        Addr lo = (sym->addr & ~(Addr)1) + get_load_offset();
+        LineNo count = count_pc_visits(lo, lo + sym->size);
+        if (!count)
+            continue;
+
+        ostringstream addr;
+        addr << "0x" << hex << lo;
+
+        cout << left << setw(11) << addr.str() << ' ';
+        cout << left << setw(11) << count << ' ';
+        cout << left << sym->getName();
+        cout << '\n';
+    }
+}
+
 #include "libtarmac/argparse.hh"
 #include "libtarmac/tarmacutil.hh"
 
@@ -110,17 +250,50 @@ int main(int argc, char **argv)
     iparams.record_memory = false;
 
     CallTreeOptions ctopts;
+    CallTreeWindowOptions wopts;
+    unsigned threads = 1;
+    bool by_pc = false, by_function = false;
 
     Argparse ap("tarmac-profile", argc, argv);
     TarmacUtility tu;
     tu.set_indexer_params(iparams);
     tu.add_options(ap);
     ctopts.add_options(ap);
+    wopts.add_options(ap);
+    ap.optval({"--threads"}, _("N"),
+              _("use N threads to go through the calls in the trace"),
+              [&](const string &s) {
+                  unsigned long n = stoul(s, nullptr, 0);
+                  if (n < 1)
+                      throw ArgparseError(_("--threads requires at least 1"));
+                  threads = n;
+              });
+    ap.optnoval({"--by-pc"},
+                _("count the number of times each instruction address "
+                  "was executed, instead of profiling functions"),
+                [&]() { by_pc = true; });
+    ap.optnoval({"--by-function"},
+                _("count the number of instructions executed inside each "
+                  "function in the image, instead of profiling calls"),
+                [&]() { by_function = true; });
     ap.parse();
+    if (by_pc && by_function)
+        reporter->errx(1, _("--by-pc and --by-function cannot be combined"));
+    if (by_pc && wopts.active())
+        reporter->errx(1, _("--by-pc cannot be combined with options "
+                            "selecting part of the trace"));
+    if (by_function && wopts.active())
+        reporter->errx(1, _("--by-function cannot be combined with options "
+                            "selecting part of the trace"));
     tu.setup();
 
     ProfileInfo PI(tu.trace, tu.image_filename, tu.load_offset);
-    PI.run(ctopts);
+    if (by_pc)
+        PI.run_by_pc();
+    else if (by_function)
+        PI.run_by_function();
+    else
+        PI.run(ctopts, wopts, threads);
 
     return 0;
 }
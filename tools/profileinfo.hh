@@ -25,11 +25,22 @@
 #include <string>
 
 struct CallTreeOptions;
+struct CallTreeWindowOptions;
 class ProfileInfo : public IndexNavigator {
     using IndexNavigator::IndexNavigator;
 
   public:
-    void run(const CallTreeOptions &);
+    // Profile the trace, or the part of it selected by the window
+    // options, using the given number of threads.
+    void run(const CallTreeOptions &, const CallTreeWindowOptions &,
+             unsigned threads = 1);
+
+    // Write out the number of times each PC value was executed.
+    void run_by_pc() const;
+
+    // Write out the number of instructions executed inside each
+    // function in the image.
+    void run_by_function() const;
 };
 
 #endif // TARMAC_PROFILEINFO_HH
@@ -0,0 +1,535 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * tarmac-server keeps the indexes of a set of trace files open, with
+ * their image, and answers queries about them over a Unix-domain
+ * socket. A script that makes thousands of small queries then only
+ * pays once for opening each index and reading the image's symbol
+ * table, and all its queries share the same warm mapping of the
+ * index, however many processes they come from.
+ *
+ * Each client connection is served by its own thread. The indexes
+ * are only ever read, so all the threads share the same
+ * IndexNavigators without any locking.
+ *
+ * The protocol is a sequence of frames in each direction, each a u32
+ * length followed by that many bytes. A request frame holds a batch
+ * of queries, one after another, and the server answers it with a
+ * frame holding one reply for each query, in the same order. As in an
+ * event cache file, integers are big-endian, and 'str' is a u32
+ * length followed by that many bytes.
+ *
+ * Every query starts with a one-byte opcode, and all but 'i' are then
+ * followed by a u32 giving the number of the trace to query, counting
+ * from 0 in the order the trace files were given on the command line:
+ *
+ *   'i'  list the traces
+ *        reply: u32 count, then str trace file name for each
+ *   'l'  node at a line: u64 line
+ *   't'  node at a time: u64 time
+ *        reply: u64 first line, u32 number of lines, u64 time, u64 pc,
+ *        u32 call depth, u64 file position, u64 length in bytes
+ *   'm'  memory contents: u64 line, u8 type ('m' for memory or 'r'
+ *        for register space), u64 address, u32 size
+ *        reply: size bytes of data, size bytes each 1 if that byte
+ *        is defined or 0 if not, u64 line that last wrote any of it
+ *   'r'  register contents: u64 line, str register name (as in the
+ *        trace, or one of the aliases pc, sp and lr)
+ *        reply: u32 size, then as for 'm'
+ *   's'  look up a symbol in the image: str name
+ *        reply: u64 address, u64 size
+ *   'v'  visits to a PC: u64 pc
+ *        reply: u32 count, then u64 time, u64 line, u64 file position
+ *        for each visit, in trace order
+ *   'p'  count the visits to any PC in a range: u64 lo, u64 hi
+ *        reply: u64 count
+ *
+ * Line numbers are line numbers in the trace file, counting from 1,
+ * and a last-written line of 0 means nothing wrote the data at all.
+ * The 'm' and 'r' queries look at the state just after the node
+ * containing the given line. They take a line rather than anything
+ * closer to the index's own representation, so that nothing a client
+ * sends can make the server follow a pointer into the index that
+ * didn't come from the index itself.
+ *
+ * Each reply starts with a status byte, 0 if the query succeeded, in
+ * which case the results follow, or 1 if it failed, in which case a
+ * str error message follows. If a query can't be decoded at all,
+ * because its opcode is unknown or the request ends partway through
+ * it, the server replies to it with an error and ignores the rest of
+ * the batch.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/image.hh"
+#include "libtarmac/index.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/registers.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/tarmacutil.hh"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+// Requests larger than this are refused, so that a garbled length
+// can't make the server try to allocate an absurd amount of memory.
+// Likewise for the size of a single memory query.
+static const size_t MAX_FRAME_SIZE = 64 << 20;
+static const size_t MAX_QUERY_SIZE = 1 << 20;
+
+// A query that was understood, but couldn't be answered.
+struct QueryError : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// A request that couldn't be decoded.
+struct ProtocolError : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+class Request {
+    const unsigned char *pos, *end;
+
+  public:
+    Request(const string &frame)
+        : pos((const unsigned char *)frame.data()), end(pos + frame.size())
+    {
+    }
+
+    bool empty() const { return pos == end; }
+
+    unsigned long long get(unsigned bytes)
+    {
+        if ((size_t)(end - pos) < bytes)
+            throw ProtocolError(_("request ends in the middle of a query"));
+        unsigned long long val = 0;
+        while (bytes-- > 0)
+            val = (val << 8) | *pos++;
+        return val;
+    }
+
+    string get_str()
+    {
+        size_t len = get(4);
+        if ((size_t)(end - pos) < len)
+            throw ProtocolError(_("request ends in the middle of a query"));
+        string s((const char *)pos, len);
+        pos += len;
+        return s;
+    }
+};
+
+static void put(unsigned long long val, unsigned bytes, string &out)
+{
+    while (bytes-- > 0)
+        out.push_back((char)(val >> (8 * bytes)));
+}
+
+static void put_str(const string &s, string &out)
+{
+    put(s.size(), 4, out);
+    out.append(s);
+}
+
+class QueryServer {
+    vector<unique_ptr<IndexNavigator>> navs;
+
+    const IndexNavigator &nav(unsigned long long trace) const;
+
+    // Convert a line number in the index into the line number in the
+    // trace file that the protocol uses, keeping 0 meaning 'none'.
+    static LineNo file_line(const IndexNavigator &IN, LineNo line)
+    {
+        return line ? line + IN.index.lineno_offset : 0;
+    }
+
+    // Find the node containing a line of the trace file, or throw a
+    // QueryError if there isn't one.
+    SeqOrderPayload node_at(const IndexNavigator &IN,
+                            unsigned long long line) const;
+
+    void put_node(const IndexNavigator &IN, const SeqOrderPayload &node,
+                  string &out) const;
+    void put_mem(const IndexNavigator &IN, OFF_T memroot, char type,
+                 Addr addr, size_t size, string &out) const;
+    void query(Request &req, string &out) const;
+
+  public:
+    QueryServer(const vector<TracePair> &traces, shared_ptr<Image> image,
+                uint64_t load_offset);
+
+    // Answer a whole request frame, returning the reply frame.
+    string answer(const string &request) const;
+
+    // Serve one client connection until it closes.
+    void serve(int fd) const;
+};
+
+QueryServer::QueryServer(const vector<TracePair> &traces,
+                         shared_ptr<Image> image, uint64_t load_offset)
+{
+    for (const TracePair &trace : traces)
+        navs.emplace_back(new IndexNavigator(trace, image, load_offset));
+}
+
+const IndexNavigator &QueryServer::nav(unsigned long long trace) const
+{
+    if (trace >= navs.size())
+        throw QueryError(format(_("no trace number {}"), trace));
+    return *navs[trace];
+}
+
+SeqOrderPayload QueryServer::node_at(const IndexNavigator &IN,
+                                     unsigned long long line) const
+{
+    SeqOrderPayload node;
+    if (line <= IN.index.lineno_offset ||
+        !IN.node_at_line(line - IN.index.lineno_offset, &node))
+        throw QueryError(format(_("no node at line {}"), line));
+    return node;
+}
+
+void QueryServer::put_node(const IndexNavigator &IN,
+                           const SeqOrderPayload &node, string &out) const
+{
+    put(file_line(IN, node.trace_file_firstline), 8, out);
+    put(node.trace_file_lines, 4, out);
+    put(node.mod_time, 8, out);
+    put(node.pc, 8, out);
+    put(node.call_depth, 4, out);
+    put(node.trace_file_pos, 8, out);
+    put(node.trace_file_len, 8, out);
+}
+
+void QueryServer::put_mem(const IndexNavigator &IN, OFF_T memroot, char type,
+                          Addr addr, size_t size, string &out) const
+{
+    vector<unsigned char> data(size), def(size);
+    LineNo line = IN.getmem(memroot, type, addr, size, data.data(),
+                            def.data());
+    out.append((const char *)data.data(), size);
+    for (unsigned char d : def)
+        out.push_back(d ? 1 : 0);
+    put(file_line(IN, line), 8, out);
+}
+
+void QueryServer::query(Request &req, string &out) const
+{
+    // Every query's arguments are read in full before anything is
+    // looked up, so that a query that fails leaves the request at
+    // the start of the next one.
+    unsigned op = req.get(1);
+    if (op == 'i') {
+        put(0, 1, out);
+        put(navs.size(), 4, out);
+        for (auto &IN : navs)
+            put_str(IN->get_tarmac_filename(), out);
+        return;
+    }
+
+    if (op == 0 || !strchr("ltmrsvp", op))
+        throw ProtocolError(format(_("unknown query opcode {}"), op));
+    unsigned long long trace = req.get(4);
+    string reply;
+    switch (op) {
+    case 'l':
+    case 't': {
+        unsigned long long key = req.get(8);
+        const IndexNavigator &IN = nav(trace);
+        SeqOrderPayload node;
+        if (op == 'l') {
+            node = node_at(IN, key);
+        } else {
+            if (!IN.node_at_time(key, &node))
+                throw QueryError(format(_("no node at time {}"), key));
+        }
+        put_node(IN, node, reply);
+        break;
+    }
+    case 'm': {
+        unsigned long long line = req.get(8);
+        unsigned type = req.get(1);
+        Addr addr = req.get(8);
+        size_t size = req.get(4);
+        const IndexNavigator &IN = nav(trace);
+        if (type != 'm' && type != 'r')
+            throw QueryError(
+                format(_("memory type must be 'm' or 'r', not {}"), type));
+        if (size > MAX_QUERY_SIZE)
+            throw QueryError(format(_("memory query of {} bytes is larger "
+                                      "than the limit of {}"),
+                                    size, MAX_QUERY_SIZE));
+        put_mem(IN, node_at(IN, line).memory_root, type, addr, size, reply);
+        break;
+    }
+    case 'r': {
+        unsigned long long line = req.get(8);
+        string name = req.get_str();
+        const IndexNavigator &IN = nav(trace);
+        // The same special cases as the browsers recognise.
+        RegisterId reg;
+        if (name == "pc")
+            reg = REG_pc;
+        else if (name == "sp")
+            reg = IN.index.isAArch64() ? REG_64_xsp : REG_32_sp;
+        else if (name == "lr")
+            reg = IN.index.isAArch64() ? REG_64_xlr : REG_32_lr;
+        else if (!lookup_reg_name(reg, name))
+            throw QueryError(format(_("unknown register name '{}'"), name));
+        OFF_T memroot = node_at(IN, line).memory_root;
+        RegisterValue value = IN.get_regs(memroot, {reg})[0];
+        put(value.val.size(), 4, reply);
+        reply.append((const char *)value.val.data(), value.val.size());
+        for (unsigned char d : value.def)
+            reply.push_back(d ? 1 : 0);
+        put(file_line(IN, value.line), 8, reply);
+        break;
+    }
+    case 's': {
+        string name = req.get_str();
+        const IndexNavigator &IN = nav(trace);
+        if (!IN.has_image())
+            throw QueryError(_("no image to look up symbols in"));
+        uint64_t addr;
+        size_t size;
+        if (!IN.lookup_symbol(name, addr, size))
+            throw QueryError(format(_("symbol '{}' not found"), name));
+        put(addr, 8, reply);
+        put(size, 8, reply);
+        break;
+    }
+    case 'v': {
+        Addr pc = req.get(8) & ~(Addr)1;
+        const IndexNavigator &IN = nav(trace);
+        string visits;
+        unsigned count = 0;
+        ByPCPayload key;
+        key.pc = pc;
+        key.trace_file_firstline = 0;
+        IN.index.bypctree.visit_from(
+            IN.index.bypcroot, key, [&](const ByPCPayload &found, OFF_T) {
+                if (found.pc != pc)
+                    return false;
+                put(found.mod_time, 8, visits);
+                put(file_line(IN, found.trace_file_firstline), 8, visits);
+                put(found.trace_file_pos, 8, visits);
+                count++;
+                return true;
+            });
+        put(count, 4, reply);
+        reply += visits;
+        break;
+    }
+    case 'p': {
+        Addr lo = req.get(8);
+        Addr hi = req.get(8);
+        const IndexNavigator &IN = nav(trace);
+        put(IN.count_pc_visits(lo, hi), 8, reply);
+        break;
+    }
+    }
+
+    put(0, 1, out);
+    out += reply;
+}
+
+string QueryServer::answer(const string &request) const
+{
+    Request req(request);
+    string out;
+    while (!req.empty()) {
+        try {
+            query(req, out);
+        } catch (QueryError &e) {
+            put(1, 1, out);
+            put_str(e.what(), out);
+        } catch (ProtocolError &e) {
+            put(1, 1, out);
+            put_str(e.what(), out);
+            break;
+        }
+    }
+    return out;
+}
+
+// Read or write exactly 'len' bytes, returning false at end of file
+// or on error.
+static bool read_all(int fd, void *buf, size_t len)
+{
+    char *p = (char *)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+void QueryServer::serve(int fd) const
+{
+    while (true) {
+        unsigned char lenbuf[4];
+        if (!read_all(fd, lenbuf, 4))
+            return;
+        size_t len = ((size_t)lenbuf[0] << 24) | ((size_t)lenbuf[1] << 16) |
+                     ((size_t)lenbuf[2] << 8) | lenbuf[3];
+        if (len > MAX_FRAME_SIZE)
+            return;
+        string request(len, '\0');
+        if (!read_all(fd, &request[0], len))
+            return;
+
+        string reply = answer(request);
+        string frame;
+        put(reply.size(), 4, frame);
+        frame += reply;
+        if (!write_all(fd, frame.data(), frame.size()))
+            return;
+    }
+}
+
+static string socket_path;
+
+static void remove_socket_and_exit(int)
+{
+    unlink(socket_path.c_str());
+    _exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    gettext_setup(true);
+
+    Argparse ap("tarmac-server", argc, argv);
+    TarmacUtilityMT tu;
+    tu.add_options(ap);
+
+    ap.optval({"--socket"}, _("PATH"),
+              _("listen for queries on the Unix-domain socket PATH"),
+              [&](const string &s) { socket_path = s; });
+
+    ap.parse([&]() {
+        if (socket_path.empty())
+            throw ArgparseError(_("expected a --socket option"));
+        if (tu.traces.empty())
+            throw ArgparseError(_("expected at least one trace file name"));
+    });
+    tu.setup();
+
+    shared_ptr<Image> image;
+    if (!tu.image_filename.empty())
+        image = make_shared<Image>(tu.image_filename);
+    QueryServer server(tu.traces, image, tu.load_offset);
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path))
+        reporter->errx(1, _("socket path '%s' is too long"),
+                       socket_path.c_str());
+    memcpy(addr.sun_path, socket_path.data(), socket_path.size());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+        reporter->err(1, _("unable to create socket"));
+    // A server that crashed, rather than being killed by a signal we
+    // catch, leaves its socket behind, and bind() would then fail.
+    // Remove it, but only if it is a socket and nothing is listening
+    // on it: a typo in --socket shouldn't delete some unrelated file,
+    // or take the socket away from another running server.
+    struct stat st;
+    if (lstat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool live = probe >= 0 &&
+                    connect(probe, (sockaddr *)&addr, sizeof(addr)) == 0;
+        if (probe >= 0)
+            close(probe);
+        if (live)
+            reporter->errx(1, _("another server is already listening on "
+                                "socket '%s'"),
+                           socket_path.c_str());
+        unlink(socket_path.c_str());
+    }
+    if (bind(listener, (sockaddr *)&addr, sizeof(addr)) < 0)
+        reporter->err(1, _("unable to bind socket '%s'"),
+                      socket_path.c_str());
+    if (listen(listener, SOMAXCONN) < 0)
+        reporter->err(1, _("unable to listen on socket '%s'"),
+                      socket_path.c_str());
+
+    // A client that goes away before reading its reply shouldn't
+    // take the whole server with it.
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, remove_socket_and_exit);
+    signal(SIGTERM, remove_socket_and_exit);
+
+    if (tu.is_verbose())
+        reporter->warnx(_("listening on socket '%s'"), socket_path.c_str());
+
+    while (true) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            reporter->err(1, _("unable to accept connection"));
+        }
+        std::thread([&server, fd]() {
+            server.serve(fd);
+            close(fd);
+        }).detach();
+    }
+}
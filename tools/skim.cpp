@@ -0,0 +1,357 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/image.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/parser.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/tarmacutil.hh"
+#include "libtarmac/tracesource.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using std::cout;
+using std::fixed;
+using std::hex;
+using std::left;
+using std::lround;
+using std::make_shared;
+using std::ostringstream;
+using std::pair;
+using std::setprecision;
+using std::setw;
+using std::shared_ptr;
+using std::sort;
+using std::sqrt;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+namespace {
+
+// The counts gathered from one sampled window of the trace file.
+struct Sample {
+    double bytes = 0, lines = 0, instructions = 0;
+};
+
+// An estimate of a ratio between two totals over the whole file,
+// such as instructions per byte, from the per-sample totals of the
+// numerator and denominator, with the half-width of its approximate
+// 95% confidence interval.
+//
+// The samples are treated as a simple random sample of clusters, and
+// the variance is that of the usual ratio estimator, reduced by the
+// finite population correction for the fraction of the file that was
+// read. (The samples are evenly spaced rather than random, which is
+// fine unless the trace is periodic with a period close to their
+// spacing.)
+struct Estimate {
+    double value, halfwidth;
+};
+
+Estimate ratio_estimate(const vector<double> &num, const vector<double> &den,
+                        double fraction_read)
+{
+    size_t n = num.size();
+    double sum_num = 0, sum_den = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum_num += num[i];
+        sum_den += den[i];
+    }
+    if (sum_den == 0)
+        return {0, 0};
+
+    double r = sum_num / sum_den;
+    if (n < 2 || fraction_read >= 1)
+        return {r, 0};
+
+    double ss = 0;
+    for (size_t i = 0; i < n; i++) {
+        double resid = num[i] - r * den[i];
+        ss += resid * resid;
+    }
+    double mean_den = sum_den / n;
+    double se = sqrt(ss / (n - 1) / n * (1 - fraction_read)) / mean_den;
+    return {r, 1.96 * se};
+}
+
+class Skimmer : ParseReceiver {
+    const ParseParams &pparams;
+    shared_ptr<Image> image;
+    uint64_t load_offset;
+
+    vector<Sample> samples;
+
+    // For each function that any sampled instruction was in, the
+    // number of instructions in it in each sample. Instructions not
+    // in any known function are counted under a null Symbol.
+    unordered_map<const Symbol *, vector<double>> functions;
+    unordered_map<Addr, const Symbol *> symbol_cache;
+
+    bool seen_time = false, seen_pc = false;
+    Time first_time = 0, last_time = 0;
+    Addr min_pc = 0, max_pc = 0;
+
+    void got_time(Time t)
+    {
+        if (!seen_time)
+            first_time = t;
+        last_time = t;
+        seen_time = true;
+    }
+
+    void got_event_view(const InstructionEventView &ev) override
+    {
+        got_time(ev.time);
+        samples.back().instructions++;
+
+        if (!seen_pc || ev.pc < min_pc)
+            min_pc = ev.pc;
+        if (!seen_pc || ev.pc > max_pc)
+            max_pc = ev.pc;
+        seen_pc = true;
+
+        if (image) {
+            auto it = symbol_cache.find(ev.pc);
+            if (it == symbol_cache.end())
+                it = symbol_cache
+                         .emplace(ev.pc,
+                                  image->find_symbol(ev.pc - load_offset))
+                         .first;
+            vector<double> &counts = functions[it->second];
+            counts.resize(samples.size(), 0);
+            counts.back()++;
+        }
+    }
+    void got_event_view(const RegisterEventView &ev) override
+    {
+        got_time(ev.time);
+    }
+    void got_event(MemoryEvent &ev) override { got_time(ev.time); }
+    void got_event(ExceptionEvent &ev) override { got_time(ev.time); }
+
+  public:
+    unsigned long long parse_errors = 0;
+
+    Skimmer(const ParseParams &pparams, shared_ptr<Image> image,
+            uint64_t load_offset)
+        : pparams(pparams), image(image), load_offset(load_offset)
+    {
+    }
+
+    // Read whole lines starting from 'pos', as one sample, until at
+    // least 'len' bytes have been read or 'limit' is reached. The
+    // parser is started afresh for each sample, so if 'pos' is partway
+    // through a multi-line event, the lines of it we see may not make
+    // sense on their own; any such errors are just counted.
+    void read_sample(const TraceSource &src, OFF_T pos, OFF_T len,
+                     OFF_T limit)
+    {
+        samples.emplace_back();
+        TarmacLineParser parser(pparams, *this);
+
+        TraceLineReader reader(src, pos);
+        StringSpan line;
+        bool terminated;
+        while (reader.position() - pos < len && reader.position() < limit &&
+               reader.get_line(line, terminated)) {
+            samples.back().bytes += line.size + (terminated ? 1 : 0);
+            samples.back().lines++;
+            try {
+                parser.parse(line.data, line.size);
+            } catch (TarmacParseError &) {
+                parse_errors++;
+            }
+        }
+    }
+
+    void report(double filesize, unsigned top) const;
+};
+
+string function_name(const Symbol *sym)
+{
+    return sym ? sym->getName() : _("(unknown)");
+}
+
+string format_count(const Estimate &e, double scale)
+{
+    ostringstream oss;
+    oss << fixed << setprecision(0) << e.value * scale;
+    if (e.halfwidth > 0)
+        oss << " +/- " << e.halfwidth * scale;
+    return oss.str();
+}
+
+void Skimmer::report(double filesize, unsigned top) const
+{
+    vector<double> bytes, lines, insns;
+    double bytes_read = 0;
+    for (const Sample &s : samples) {
+        bytes.push_back(s.bytes);
+        lines.push_back(s.lines);
+        insns.push_back(s.instructions);
+        bytes_read += s.bytes;
+    }
+    double fraction = filesize > 0 ? bytes_read / filesize : 1;
+    bool exact = fraction >= 1;
+
+    if (exact)
+        cout << _("Read the whole trace file") << "\n";
+    else
+        cout << format(_("Sampled {} windows, {} of {} bytes ({}%)"),
+                       samples.size(), (unsigned long long)bytes_read,
+                       (unsigned long long)filesize,
+                       lround(fraction * 100))
+             << "\n";
+    if (parse_errors)
+        cout << format(_("Lines that could not be parsed: {}"), parse_errors)
+             << "\n";
+
+    Estimate line_est = ratio_estimate(lines, bytes, fraction);
+    Estimate insn_est = ratio_estimate(insns, bytes, fraction);
+    cout << _("Lines: ") << format_count(line_est, filesize) << "\n";
+    cout << _("Instructions: ") << format_count(insn_est, filesize) << "\n";
+
+    if (seen_time)
+        cout << format(_("Time span: {} to {} ({})"), first_time, last_time,
+                       last_time - first_time)
+             << "\n";
+    if (seen_pc) {
+        ostringstream oss;
+        oss << hex << "0x" << min_pc << " - 0x" << max_pc;
+        cout << (exact ? _("PC range: ") : _("PC range seen: ")) << oss.str()
+             << "\n";
+    }
+
+    if (!image)
+        return;
+
+    // Each function's share of the instructions is a ratio of its
+    // count to the total instruction count, so it gets its own
+    // confidence interval in the same way.
+    vector<pair<const Symbol *, Estimate>> shares;
+    for (const auto &kv : functions) {
+        vector<double> counts = kv.second;
+        counts.resize(samples.size(), 0);
+        shares.emplace_back(kv.first, ratio_estimate(counts, insns, fraction));
+    }
+    sort(shares.begin(), shares.end(),
+         [](const pair<const Symbol *, Estimate> &a,
+            const pair<const Symbol *, Estimate> &b) {
+             if (a.second.value != b.second.value)
+                 return a.second.value > b.second.value;
+             return function_name(a.first) < function_name(b.first);
+         });
+    if (shares.size() > top)
+        shares.resize(top);
+
+    cout << "\n";
+    cout << left << setw(20) << _("Share") << _("Function name") << "\n";
+    for (const auto &s : shares) {
+        ostringstream share;
+        share << fixed << setprecision(2) << s.second.value * 100 << "%";
+        if (!exact)
+            share << " +/- " << s.second.halfwidth * 100 << "%";
+        cout << left << setw(20) << share.str() << function_name(s.first)
+             << "\n";
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    gettext_setup(true);
+
+    unsigned nsamples = 256, top = 20;
+    OFF_T sample_size = 64 << 10;
+
+    Argparse ap("tarmac-skim", argc, argv);
+    TarmacUtilityNoIndex tu;
+    tu.add_options(ap);
+    ap.optval({"--samples"}, _("N"),
+              _("number of evenly spaced parts of the trace file to read "
+                "(default: 256)"),
+              [&](const string &s) {
+                  nsamples = stoul(s, nullptr, 0);
+                  if (nsamples < 1)
+                      throw ArgparseError(_("--samples requires at least 1"));
+              });
+    ap.optval({"--sample-size"}, _("KBYTES"),
+              _("amount of the trace file to read for each sample "
+                "(default: 64)"),
+              [&](const string &s) {
+                  sample_size = (OFF_T)stoull(s, nullptr, 0) << 10;
+                  if (sample_size < 1)
+                      throw ArgparseError(
+                          _("--sample-size requires at least 1"));
+              });
+    ap.optval({"--top"}, _("N"),
+              _("number of functions to list, with --image (default: 20)"),
+              [&](const string &s) { top = stoul(s, nullptr, 0); });
+    ap.parse();
+    tu.setup();
+
+    if (tu.tarmac_filename == "-")
+        reporter->errx(1, _("tarmac-skim cannot read from standard input"));
+
+    shared_ptr<Image> image;
+    if (!tu.image_filename.empty())
+        image = make_shared<Image>(tu.image_filename);
+
+    TraceSource src(tu.tarmac_filename);
+    ParseParams pparams = tu.get_parse_params();
+    Skimmer sk(pparams, image, tu.load_offset);
+
+    // Ignore any partial line at the end, which the program writing
+    // the trace may still be in the middle of.
+    OFF_T size = src.complete_lines_end();
+
+    if ((OFF_T)nsamples * sample_size >= size) {
+        // Sampling would read all of it anyway.
+        sk.read_sample(src, 0, size, size);
+    } else {
+        // The first sample starts at the beginning of the file, and
+        // the last one finishes at the end, so that we see the first
+        // and last timestamps.
+        OFF_T span = size - sample_size;
+        for (unsigned i = 0; i < nsamples; i++) {
+            OFF_T pos = nsamples > 1 ? span / (nsamples - 1) * i : 0;
+            if (i == nsamples - 1)
+                pos = span;
+            if (pos > 0)
+                pos = src.next_line_start(pos);
+            sk.read_sample(src, pos, sample_size, size);
+        }
+    }
+
+    sk.report(size, top);
+    return 0;
+}
@@ -0,0 +1,290 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * tarmac-slice writes a window of a trace file out as a trace file of
+ * its own, which can be passed on and browsed without the original.
+ *
+ * Cutting the lines out of the trace isn't enough for that, because
+ * the registers and memory the window's code works on were mostly
+ * set up before it starts. So the window is preceded by a prologue of
+ * synthesised register and memory write lines, reproducing the whole
+ * state that the original trace's index knows about as of the end of
+ * the node just before the window. Indexing the slice then gives the
+ * same register and memory contents throughout the window as the
+ * original trace does, and because the state is in the slice itself
+ * rather than only in its index, the slice can be reindexed at any
+ * time without losing it.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/index.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/registers.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/tarmacutil.hh"
+#include "libtarmac/tracesource.hh"
+
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+using std::hex;
+using std::ofstream;
+using std::ostream;
+using std::setfill;
+using std::setw;
+using std::string;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+namespace {
+
+// The register families that occupy register space of their own,
+// rather than aliasing part of another family. Between them they
+// cover every byte of register space that a trace can write.
+const struct {
+    RegPrefix prefix;
+    unsigned nregs;
+} storage_families[] = {
+#define STORAGE_ENTRY(prefix, size, disp, nregs) {RegPrefix::prefix, nregs},
+#define ALIAS_ENTRY(prefix, size, disp, nregs)
+    REGPREFIXLIST(STORAGE_ENTRY, ALIAS_ENTRY)
+#undef STORAGE_ENTRY
+#undef ALIAS_ENTRY
+};
+
+// An SVE z-register of which only the low 128 bits are known (which
+// is all of it, in a trace that doesn't use SVE) is written as the
+// corresponding q-register, to keep the prologue readable.
+const size_t Q_REG_SIZE = 16;
+
+struct SliceUtility : TarmacUtility {
+    // Build an index for the slice, with the same indexer and parse
+    // parameters as the one for the original trace. Any index
+    // already there belongs to some previous slice, and must not be
+    // mistaken for one that only needs extending.
+    void index_slice(const string &filename) const
+    {
+        TracePair slice;
+        slice.tarmac_filename = filename;
+        slice.index_on_disk = true;
+        slice.index_filename = filename + ".index";
+        remove(slice.index_filename.c_str());
+        run_indexer(slice, iparams, idiags, get_parse_params());
+    }
+};
+
+// Write out the registers and memory defined in the state 'memroot'
+// as a series of trace lines timestamped 'time'.
+void write_prologue(ostream &os, const IndexNavigator &IN, OFF_T memroot,
+                    Time time)
+{
+    os << hex << setfill('0');
+
+    vector<RegisterId> regs;
+    for (const auto &fam : storage_families) {
+        for (unsigned i = 0; i < fam.nregs; i++) {
+            RegisterId reg{fam.prefix, i};
+            if (reg.prefix == RegPrefix::internal_flags || reg_size(reg) == 0)
+                continue; // not written by the trace, or a dummy register
+            regs.push_back(reg);
+        }
+    }
+
+    vector<RegisterValue> values = IN.get_regs(memroot, regs);
+    for (size_t i = 0; i < regs.size(); i++) {
+        RegisterId reg = regs[i];
+        const RegisterValue &value = values[i];
+
+        // Registers are written most significant byte first, with
+        // "--" for each byte whose value isn't known.
+        size_t size = 0;
+        for (size_t j = 0; j < value.def.size(); j++)
+            if (value.def[j])
+                size = j + 1;
+        if (!size)
+            continue;
+        if (reg.prefix == RegPrefix::z && size <= Q_REG_SIZE) {
+            reg.prefix = RegPrefix::q;
+            size = Q_REG_SIZE;
+        } else {
+            size = value.val.size();
+        }
+
+        os << std::dec << time << " clk R " << reg_name(reg) << " " << hex;
+        for (size_t j = size; j-- > 0;) {
+            if (value.def[j])
+                os << setw(2) << (unsigned)value.val[j];
+            else
+                os << "--";
+        }
+        os << "\n";
+    }
+
+    // Memory is written in naturally aligned pieces of up to 8 bytes,
+    // each given as an integer in the trace's byte order.
+    bool bigend = IN.index.isBigEndian();
+    IN.visit_mem(memroot, 'm', 0, 0,
+                 [&](const IndexNavigator::MemoryExtent &ext) {
+                     const unsigned char *data =
+                         static_cast<const unsigned char *>(ext.data);
+                     Addr addr = ext.addr;
+                     size_t left = ext.size;
+                     while (left > 0) {
+                         size_t size = 8;
+                         while (size > left || (addr & (size - 1)))
+                             size /= 2;
+
+                         unsigned long long value = 0;
+                         for (size_t j = 0; j < size; j++) {
+                             unsigned byte = data[bigend ? j : size - 1 - j];
+                             value = (value << 8) | byte;
+                         }
+                         os << std::dec << time << " clk MW" << size << " "
+                            << hex << setw(8) << addr << " "
+                            << setw(2 * size) << value << "\n";
+
+                         data += size;
+                         addr += size;
+                         left -= size;
+                     }
+                     return true;
+                 });
+
+    os << std::dec;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    gettext_setup(true);
+
+    string output_filename;
+    LineNo from_line = 0, to_line = 0;
+    Time from_time = 0, to_time = 0;
+    bool got_from_line = false, got_to_line = false;
+    bool got_from_time = false, got_to_time = false;
+    bool write_index = true;
+
+    Argparse ap("tarmac-slice", argc, argv);
+    SliceUtility tu;
+    tu.cannot_use_image();
+    tu.add_options(ap);
+
+    ap.optval({"-o", "--output"}, _("FILE"),
+              _("file to write the slice to (its index is written to FILE "
+                "plus '.index')"),
+              [&](const string &s) { output_filename = s; });
+    ap.optval({"--from-line"}, _("LINE"),
+              _("start the slice at the event containing this line"),
+              [&](const string &s) {
+                  from_line = stoull(s, nullptr, 0);
+                  got_from_line = true;
+              });
+    ap.optval({"--to-line"}, _("LINE"),
+              _("end the slice at the event containing this line"),
+              [&](const string &s) {
+                  to_line = stoull(s, nullptr, 0);
+                  got_to_line = true;
+              });
+    ap.optval({"--from-time"}, _("TIME"),
+              _("start the slice at the first event no earlier than this"),
+              [&](const string &s) {
+                  from_time = stoull(s, nullptr, 0);
+                  got_from_time = true;
+              });
+    ap.optval({"--to-time"}, _("TIME"),
+              _("end the slice at the last event no later than this"),
+              [&](const string &s) {
+                  to_time = stoull(s, nullptr, 0);
+                  got_to_time = true;
+              });
+    ap.optnoval({"--no-slice-index"},
+                _("write the slice without building an index for it"),
+                [&]() { write_index = false; });
+
+    ap.parse([&]() {
+        if (output_filename.empty())
+            throw ArgparseError(_("expected an output file name"));
+        if (got_from_line && got_from_time)
+            throw ArgparseError(
+                _("--from-line and --from-time cannot be used together"));
+        if (got_to_line && got_to_time)
+            throw ArgparseError(
+                _("--to-line and --to-time cannot be used together"));
+    });
+    tu.setup();
+
+    IndexNavigator IN(tu.trace);
+
+    // The slice is made of whole events, so each end of the window is
+    // widened to the boundary of the node it falls in.
+    SeqOrderPayload start, end;
+    bool ok;
+    if (got_from_line)
+        ok = IN.node_at_line(from_line, &start);
+    else if (got_from_time)
+        ok = IN.node_near_time(from_time, true, &start);
+    else
+        ok = IN.find_buffer_limit(false, &start);
+    if (!ok)
+        reporter->errx(1, _("unable to find the start of the slice"));
+    if (got_to_line)
+        ok = IN.node_at_line(to_line, &end);
+    else if (got_to_time)
+        ok = IN.node_near_time(to_time, false, &end);
+    else
+        ok = IN.find_buffer_limit(true, &end);
+    if (!ok || end.trace_file_firstline < start.trace_file_firstline)
+        reporter->errx(1, _("the slice contains no events"));
+
+    ofstream ofs(output_filename.c_str(), ofstream::binary);
+    if (ofs.fail())
+        reporter->errx(1, _("unable to open output file '%s'"),
+                       output_filename.c_str());
+
+    SeqOrderPayload prev;
+    if (IN.get_previous_node(start, &prev))
+        write_prologue(ofs, IN, prev.memory_root, prev.mod_time);
+
+    TraceSource src(tu.trace.tarmac_filename);
+    OFF_T pos = start.trace_file_pos;
+    OFF_T endpos = end.trace_file_pos + end.trace_file_len;
+    StringSpan data = src.span(pos, endpos - pos);
+    ofs.write(data.data, data.size);
+    if (data.size && data.data[data.size - 1] != '\n')
+        ofs << "\n";
+
+    ofs.close();
+    if (ofs.fail())
+        reporter->errx(1, _("error writing output file '%s'"),
+                       output_filename.c_str());
+
+    if (write_index)
+        tu.index_slice(output_filename);
+
+    return 0;
+}
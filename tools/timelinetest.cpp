@@ -0,0 +1,143 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Test of MergedTimeline: index several trace files, merge them into
+ * one timeline, and dump parts of it, and what every trace was doing
+ * at given times.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/index.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/tarmacutil.hh"
+#include "libtarmac/timeline.hh"
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::endl;
+using std::make_unique;
+using std::size_t;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+static unsigned long long parseint(const string &s)
+{
+    try {
+        size_t pos;
+        unsigned long long toret = stoull(s, &pos, 0);
+        if (pos < s.size())
+            throw ArgparseError(
+                format(_("'{}': unable to parse numeric value"), s));
+        return toret;
+    } catch (std::invalid_argument) {
+        throw ArgparseError(
+            format(_("'{}': unable to parse numeric value"), s));
+    } catch (std::out_of_range) {
+        throw ArgparseError(format(_("'{}': numeric value out of range"), s));
+    }
+}
+
+static void dump_entry(const MergedTimeline::Entry &e)
+{
+    cout << "source " << e.source << ": line " << e.node.trace_file_firstline
+         << ", time " << e.node.mod_time << endl;
+}
+
+int main(int argc, char **argv)
+{
+    gettext_setup(true);
+
+    struct Range {
+        size_t start, end;
+    };
+    vector<Range> ranges;
+    vector<Time> times;
+
+    Argparse ap("timelinetest", argc, argv);
+    TarmacUtilityMT tu;
+    tu.cannot_use_image();
+    tu.add_options(ap);
+
+    ap.optval({"--entries"}, _("POS,POS"),
+              _("dump the entries of the merged timeline from the first "
+                "position up to (not including) the second"),
+              [&](const string &s) {
+                  size_t comma = s.find(',');
+                  if (comma == string::npos)
+                      throw ArgparseError(
+                          format(_("'{}': expected two positions "
+                                   "separated by a comma"),
+                                 s));
+                  ranges.push_back({parseint(s.substr(0, comma)),
+                                    parseint(s.substr(comma + 1))});
+              });
+    ap.optval({"--at-time"}, _("TIME"),
+              _("show the latest node of every trace file at or before "
+                "TIME"),
+              [&](const string &s) { times.push_back(parseint(s)); });
+
+    ap.parse([&]() {
+        if (tu.traces.empty())
+            throw ArgparseError(_("expected at least one trace file name"));
+    });
+    tu.setup();
+
+    vector<unique_ptr<IndexNavigator>> navs;
+    vector<const IndexNavigator *> sources;
+    for (const TracePair &trace : tu.traces) {
+        navs.push_back(make_unique<IndexNavigator>(trace));
+        sources.push_back(navs.back().get());
+    }
+
+    MergedTimeline timeline(sources);
+    cout << timeline.size() << " entries from " << timeline.nsources()
+         << " sources" << endl;
+
+    for (const Range &r : ranges) {
+        cout << "entries " << r.start << " to " << r.end << ":" << endl;
+        for (size_t i = r.start; i < r.end && i < timeline.size(); i++) {
+            cout << "  " << i << ": ";
+            dump_entry(timeline[i]);
+        }
+    }
+
+    for (Time t : times) {
+        cout << "at time " << t << ", position "
+             << timeline.position_after(t) << ":" << endl;
+        vector<const MergedTimeline::Entry *> entries =
+            timeline.entries_at_time(t);
+        for (unsigned s = 0; s < entries.size(); s++) {
+            cout << "  ";
+            if (entries[s])
+                dump_entry(*entries[s]);
+            else
+                cout << "source " << s << ": nothing yet" << endl;
+        }
+    }
+
+    return 0;
+}
@@ -21,6 +21,7 @@
 #include "libtarmac/parser.hh"
 #include "libtarmac/reporter.hh"
 #include "libtarmac/tarmacutil.hh"
+#include "libtarmac/tracesource.hh"
 
 #include <algorithm>
 #include <deque>
@@ -55,10 +56,6 @@ std::unique_ptr<Reporter> reporter = make_cli_reporter();
 namespace {
 
 class Reader : ParseReceiver {
-    istream &is;
-    ostream &os;
-    string tarmac_filename;
-    int lineno = 0;
     TarmacLineParser parser;
 
     size_t pc_loop_limit = 16;
@@ -66,18 +63,27 @@ class Reader : ParseReceiver {
 
     vector<uint8_t> register_space;
 
+    // If this is set, we're starting partway through the trace, so
+    // we don't know what values the registers had before their first
+    // update. Treating those updates as changes means any loop
+    // detection depends only on what we've seen.
+    bool unknown_registers_changed;
+    vector<bool> register_known;
+
     deque<Addr> previous_pcs;
     deque<TextOnlyEvent> previous_text_events;
 
     bool still_reading = true;
-    unsigned iflags;
+    unsigned iflags = 0;
+
+    string error_msg;
 
     void register_changed() {
         // Clear the PC cache if a register changes
         previous_pcs.clear();
     }
 
-    void got_event(InstructionEvent &ev) override
+    void got_event_view(const InstructionEventView &ev) override
     {
         // Truncate on revisiting a PC since any event cleared the PC cache
         if (std::find(begin(previous_pcs), end(previous_pcs), ev.pc) !=
@@ -95,18 +101,28 @@ class Reader : ParseReceiver {
             iflags |= IFLAG_AARCH64;
     }
 
-    void got_event(RegisterEvent &ev) override
+    void got_event_view(const RegisterEventView &ev) override
     {
         size_t start = reg_offset(ev.reg, iflags) + ev.offset;
-        size_t size = ev.bytes.size();
+        size_t size = ev.nbytes;
         size_t end = start + size;
+        if (unknown_registers_changed) {
+            if (end > register_known.size())
+                register_known.resize(end, false);
+            if (std::find(register_known.begin() + start,
+                          register_known.begin() + end,
+                          false) != register_known.begin() + end)
+                register_changed();
+            std::fill(register_known.begin() + start,
+                      register_known.begin() + end, true);
+        }
         if (end > register_space.size()) {
             register_space.resize(end, 0);
         } else {
-            if (memcmp(register_space.data() + start, ev.bytes.data(), size))
+            if (memcmp(register_space.data() + start, ev.bytes, size))
                 register_changed();
         }
-        memcpy(register_space.data() + start, ev.bytes.data(), size);
+        memcpy(register_space.data() + start, ev.bytes, size);
 
         // Clear the text-event cache on any register update, change or not
         previous_text_events.clear();
@@ -160,41 +176,150 @@ class Reader : ParseReceiver {
     }
 
   public:
-    Reader(istream &is, ostream &os, string tarmac_filename,
-           const ParseParams &pparams)
-        : is(is), os(os), tarmac_filename(tarmac_filename),
-          parser(pparams, *this)
+    Reader(const ParseParams &pparams, bool unknown_registers_changed = false)
+        : parser(pparams, *this),
+          unknown_registers_changed(unknown_registers_changed)
     {
     }
 
-    bool read_one_trace_line()
+    enum class Result {
+        Continue, // keep this line, and carry on reading
+        Stop,     // keep this line, but nothing after it is interesting
+        Partial,  // discard this partial last line, and stop
+        Error,    // the line didn't parse: see error_message()
+    };
+
+    // Feed one line of the trace to the loop detector. 'last' is true
+    // if this is the last line of the input and had no terminating
+    // newline, in which case a parse error just means the program
+    // writing the trace didn't get to finish it.
+    Result read_line(const char *data, size_t len, bool last)
     {
-        lineno++;
+        try {
+            parser.parse(data, len);
+        } catch (TarmacParseError e) {
+            error_msg = e.msg;
+            return last ? Result::Partial : Result::Error;
+        }
+
+        return still_reading ? Result::Continue : Result::Stop;
+    }
+
+    const string &error_message() const { return error_msg; }
+};
 
-        string line;
+void report_partial_line(const string &filename, LineNo lineno,
+                         const string &msg)
+{
+    ostringstream oss;
+    oss << msg << endl
+        << _("ignoring parse error on partial last line "
+             "(trace truncated?)");
+    reporter->indexing_warning(filename, lineno, oss.str());
+}
+
+// Read the whole input from the start, and write out each line as
+// it goes, until it runs out or loop detection says to stop. This
+// works on a pipe, and stops reading as soon as it can.
+void truncate_streaming(istream &is, ostream &os, const string &filename,
+                        const ParseParams &pparams)
+{
+    Reader rdr(pparams);
+    LineNo lineno = 0;
+    string line;
+    while (true) {
+        lineno++;
         if (!getline(is, line))
-            return false;
+            break;
 
-        try {
-            parser.parse(line);
-        } catch (TarmacParseError e) {
-            if (is.eof()) {
-                ostringstream oss;
-                oss << e.msg << endl
-                    << _("ignoring parse error on partial last line "
-                         "(trace truncated?)");
-                reporter->indexing_warning(tarmac_filename, lineno, oss.str());
-                return false;
-            } else {
-                reporter->indexing_error(tarmac_filename, lineno, e.msg);
-            }
+        Reader::Result res = rdr.read_line(line.data(), line.size(), is.eof());
+        if (res == Reader::Result::Partial) {
+            report_partial_line(filename, lineno, rdr.error_message());
+            break;
         }
+        if (res == Reader::Result::Error)
+            reporter->indexing_error(filename, lineno, rdr.error_message());
 
         os << line << "\n";
 
-        return still_reading;
+        if (res == Reader::Result::Stop)
+            break;
     }
-};
+}
+
+// Find where to truncate a trace file by parsing only a window at the
+// end of it, and return the length of the part of the file to keep.
+// If the output should have a newline appended that the input didn't
+// have (because the last line kept was unterminated), 'add_newline'
+// is set.
+//
+// If loop detection fires so soon after the start of the window that
+// the loop might have begun before it, or the window is too small for
+// its failure to fire to mean anything, the window is doubled in size
+// and the search repeated, until the start of the loop is found or
+// the window covers the whole file. A window starting at the very
+// beginning of the file gives exactly the same answer as
+// truncate_streaming.
+OFF_T find_truncation_point(const TraceSource &src, const string &filename,
+                            const ParseParams &pparams, OFF_T window,
+                            bool &add_newline)
+{
+    // How many lines into the window loop detection must get before
+    // we believe it saw the start of the loop, and not just the first
+    // of its iterations to be inside the window. Detection needs at
+    // most a few dozen consecutive events in the loop, so this leaves
+    // plenty of margin.
+    const unsigned warmup_lines = 256;
+
+    OFF_T end = src.size();
+    while (true) {
+        OFF_T start = end > window ? src.next_line_start(end - window) : 0;
+        Reader rdr(pparams, start > 0);
+
+        // Line numbers are only needed for diagnostics, and counting
+        // the lines before the window means reading that part of the
+        // file, which is what we're trying to avoid. So only do it on
+        // demand.
+        auto lineno_at = [&](OFF_T pos) {
+            StringSpan prefix = src.span(0, pos);
+            return 1 + (LineNo)std::count(prefix.data,
+                                          prefix.data + prefix.size, '\n');
+        };
+
+        TraceLineReader reader(src, start);
+        OFF_T keep = start;
+        unsigned lines = 0;
+        add_newline = false;
+        StringSpan line;
+        bool terminated;
+        while (true) {
+            OFF_T pos = reader.position();
+            if (!reader.get_line(line, terminated))
+                break;
+            lines++;
+            OFF_T next = reader.position();
+            Reader::Result res =
+                rdr.read_line(line.data, line.size, !terminated);
+            if (res == Reader::Result::Partial) {
+                report_partial_line(filename, lineno_at(pos),
+                                    rdr.error_message());
+                break;
+            }
+            if (res == Reader::Result::Error)
+                reporter->indexing_error(filename, lineno_at(pos),
+                                         rdr.error_message());
+            keep = next;
+            add_newline = !terminated;
+            if (res == Reader::Result::Stop)
+                break;
+        }
+
+        if (start == 0 || lines > warmup_lines)
+            return keep;
+
+        window *= 2;
+    }
+}
 
 } // namespace
 
@@ -203,6 +328,8 @@ int main(int argc, char **argv)
     gettext_setup(true);
 
     string output_filename("-");
+    bool from_end = false, in_place = false;
+    OFF_T window = 16 << 20;
 
     Argparse ap("tarmac-truncate", argc, argv);
     TarmacUtilityNoIndex tu;
@@ -212,10 +339,80 @@ int main(int argc, char **argv)
     ap.optval({"-o", "--output"}, _("FILE"),
               _("file to write output to (default: standard output)"),
               [&](const string &s) { output_filename = s; });
+    ap.optnoval({"--from-end"},
+                _("find where to truncate by parsing only the end of the "
+                  "trace file"),
+                [&]() { from_end = true; });
+    ap.optval({"--window"}, _("KBYTES"),
+              _("amount of the trace file that --from-end parses to "
+                "begin with (default: 16384)"),
+              [&](const string &s) {
+                  window = (OFF_T)stoull(s, nullptr, 0) << 10;
+                  if (window < 1)
+                      throw ArgparseError(_("--window requires at least 1"));
+              });
+    ap.optnoval({"--in-place"},
+                _("truncate the input file itself, instead of writing "
+                  "output (implies --from-end)"),
+                [&]() { in_place = from_end = true; });
 
     ap.parse();
     tu.setup();
 
+    if (from_end && tu.tarmac_filename == "-")
+        reporter->errx(1, _("--from-end and --in-place cannot read from "
+                            "standard input"));
+    if (in_place && output_filename != "-")
+        reporter->errx(1, _("--in-place and --output cannot be used "
+                            "together"));
+
+    if (from_end) {
+        OFF_T keep;
+        bool add_newline;
+        {
+            // The trace file is unmapped again at the end of this
+            // block, before we shorten it or write the output.
+            TraceSource src(tu.tarmac_filename);
+            keep = find_truncation_point(src, tu.tarmac_filename,
+                                         tu.get_parse_params(), window,
+                                         add_newline);
+
+            if (!in_place && (output_filename == "-" ||
+                              !copy_file_prefix(tu.tarmac_filename,
+                                                output_filename, keep))) {
+                // Write the data straight from the mapped file, still
+                // without splitting it into lines.
+                ofstream ofs;
+                ostream *osp = &cout;
+                if (output_filename != "-") {
+                    ofs.open(output_filename.c_str(), ofstream::binary);
+                    if (ofs.fail())
+                        reporter->errx(1, _("unable to open output file '%s'"),
+                                       output_filename.c_str());
+                    osp = &ofs;
+                }
+                StringSpan data = src.span(0, keep);
+                osp->write(data.data, data.size);
+                if (add_newline)
+                    *osp << "\n";
+                return 0;
+            }
+        }
+
+        const string &dest = in_place ? tu.tarmac_filename : output_filename;
+        if (in_place && !truncate_file(dest, keep))
+            reporter->errx(1, _("unable to truncate file '%s': %s"),
+                           dest.c_str(), get_error_message().c_str());
+        if (add_newline) {
+            ofstream ofs(dest.c_str(), ofstream::binary | ofstream::app);
+            if (ofs.fail())
+                reporter->errx(1, _("unable to open output file '%s'"),
+                               dest.c_str());
+            ofs << "\n";
+        }
+        return 0;
+    }
+
     unique_ptr<ifstream> ifs;
     istream *isp;
     string input_filename;
@@ -243,9 +440,7 @@ int main(int argc, char **argv)
         osp = &cout;
     }
 
-    Reader rdr(*isp, *osp, input_filename, tu.get_parse_params());
-    while (rdr.read_one_trace_line())
-        ;
+    truncate_streaming(*isp, *osp, input_filename, tu.get_parse_params());
 
     return 0;
 }
@@ -17,15 +17,16 @@
  */
 
 #include "libtarmac/misc.hh"
+#include "libtarmac/reporter.hh"
 
 #include "vcd.hh"
 
 #include <cassert>
 #include <cstdio>
+#include <cstring>
 #include <ctime>
 
 using namespace VCD;
-using std::ofstream;
 using std::string;
 using std::to_string;
 
@@ -60,15 +61,15 @@ void VCDSignal::write(VCDFile &VCD) const
 
 void VCDSignal::writeValueChange(VCDFile &VCD, bool b) const
 {
-    string V(b ? "1" : "0");
-    VCD.writeValueChange(V + Repr);
+    VCD.Buffer += b ? '1' : '0';
+    VCD.Buffer += Repr;
+    VCD.endRecord();
 }
 
-static string VCDEscapeString(const string &str)
+static void VCDEscapeString(string &Res, const char *str, size_t len)
 {
-    string Res;
-
-    for (char c : str) {
+    for (const char *p = str; p < str + len; p++) {
+        char c = *p;
         switch (c) {
         case '\a':
             Res += "\\a";
@@ -117,20 +118,24 @@ static string VCDEscapeString(const string &str)
             break;
         }
     }
-
-    return Res;
 }
 
 void VCDSignal::writeValueChange(VCDFile &VCD, const char *str) const
 {
-    string V("s");
-    VCD.writeValueChange(V + VCDEscapeString(str) + ' ' + Repr);
+    VCD.Buffer += 's';
+    VCDEscapeString(VCD.Buffer, str, strlen(str));
+    VCD.Buffer += ' ';
+    VCD.Buffer += Repr;
+    VCD.endRecord();
 }
 
 void VCDSignal::writeValueChange(VCDFile &VCD, const std::string &str) const
 {
-    string V("s");
-    VCD.writeValueChange(V + VCDEscapeString(str) + ' ' + Repr);
+    VCD.Buffer += 's';
+    VCDEscapeString(VCD.Buffer, str.data(), str.size());
+    VCD.Buffer += ' ';
+    VCD.Buffer += Repr;
+    VCD.endRecord();
 }
 
 // The double flavour of writeValueChange makes use of the VCD specification
@@ -140,26 +145,41 @@ void VCDSignal::writeValueChange(VCDFile &VCD, const std::string &str) const
 // conversions.
 void VCDSignal::writeValueChange(VCDFile &VCD, double d) const
 {
-    string V("r");
     char real[32];
     snprintf(real, sizeof(real), "%.16g", d);
-    VCD.writeValueChange(V + real + ' ' + Repr);
+    VCD.Buffer += 'r';
+    VCD.Buffer += real;
+    VCD.Buffer += ' ';
+    VCD.Buffer += Repr;
+    VCD.endRecord();
 }
 
 void VCDSignal::writeValueChange(VCDFile &VCD,
                                  std::function<bool(unsigned)> bit) const
 {
-    string V("b");
-    string bits(BitWidth, '0');
+    VCD.Buffer += 'b';
+    size_t start = VCD.Buffer.size();
+    VCD.Buffer.append(BitWidth, '0');
     for (unsigned i = 0; i < BitWidth; i++)
-        bits[BitWidth - 1 - i] = '0' + bit(i);
-    VCD.writeValueChange(V + bits + ' ' + Repr);
+        VCD.Buffer[start + BitWidth - 1 - i] = '0' + bit(i);
+    VCD.Buffer += ' ';
+    VCD.Buffer += Repr;
+    VCD.endRecord();
 }
 
 void VCDSignal::writeValueChange(VCDFile &VCD, unsigned long long u) const
 {
-    writeValueChange(VCD,
-                     [u](unsigned n) { return n < 64 ? (1 & (u >> n)) : 0; });
+    // This is the common case, so it doesn't go through the
+    // std::function overload above.
+    VCD.Buffer += 'b';
+    size_t start = VCD.Buffer.size();
+    VCD.Buffer.append(BitWidth, '0');
+    char *bits = &VCD.Buffer[start];
+    for (unsigned i = 0; i < BitWidth && i < 64; i++)
+        bits[BitWidth - 1 - i] = '0' + (1 & (u >> i));
+    VCD.Buffer += ' ';
+    VCD.Buffer += Repr;
+    VCD.endRecord();
 }
 
 void VCDSignal::writeValueChange(VCDFile &VCD, unsigned long u) const
@@ -183,29 +203,18 @@ void VCDSignal::writeValueChange(VCDFile &VCD, ExtraState st) const
         }
         break;
 
-    case Type::Int: {
-        string V("b");
-        switch (st) {
-        case ExtraState::TriState:
-            V += string(BitWidth, 'z');
-            break;
-        case ExtraState::Undef:
-            V += string(BitWidth, 'u');
-            break;
-        }
-        VCD.writeValueChange(V + ' ' + Repr);
+    case Type::Int:
+        VCD.Buffer += 'b';
+        VCD.Buffer.append(BitWidth, st == ExtraState::TriState ? 'z' : 'u');
+        VCD.Buffer += ' ';
+        VCD.Buffer += Repr;
+        VCD.endRecord();
         break;
-    }
 
     case Type::Bool:
-        switch (st) {
-        case ExtraState::TriState:
-            VCD.writeValueChange('z' + Repr);
-            break;
-        case ExtraState::Undef:
-            VCD.writeValueChange('x' + Repr);
-            break;
-        }
+        VCD.Buffer += st == ExtraState::TriState ? 'z' : 'x';
+        VCD.Buffer += Repr;
+        VCD.endRecord();
         break;
 
     case Type::Float:
@@ -233,10 +242,17 @@ string VCDFile::chomp(string str)
     return str;
 }
 
+constexpr size_t VCDFile::FlushThreshold;
+
 VCDFile::VCDFile(const string &ModuleName, const string &Filename, bool NoDate)
-    : Output(Filename.c_str(), ofstream::out), Date(), Version(), Comment(),
-      Timescale(TimeScale::PS), VariableDefinition(ModuleName), Signals()
+    : Filename(Filename), Output(fopen_wrapper(Filename.c_str(), "w")),
+      Date(), Version(), Comment(), Timescale(TimeScale::PS),
+      VariableDefinition(ModuleName), Signals()
 {
+    if (!Output)
+        reporter->err(1, "%s: open", Filename.c_str());
+    Buffer.reserve(FlushThreshold + 4096);
+
     time_t tt;
     time(&tt);
     struct tm ti = localtime_wrapper(tt);
@@ -245,7 +261,40 @@ VCDFile::VCDFile(const string &ModuleName, const string &Filename, bool NoDate)
         Date = chomp(asctime_wrapper(ti));
 }
 
-VCDFile::~VCDFile() { addVCDKeyword("end"); }
+VCDFile::VCDFile(const VCDFile &Main, const string &Filename)
+    : Filename(Filename), Output(nullptr), Date(), Version(), Comment(),
+      Timescale(Main.Timescale), VariableDefinition(), Signals(Main.Signals)
+{
+}
+
+VCDFile::~VCDFile()
+{
+    if (!Output)
+        return;
+    addVCDKeyword("end");
+    flush();
+    if (fclose(Output) != 0)
+        reporter->err(1, "%s: close", Filename.c_str());
+}
+
+std::unique_ptr<VCDFile> VCDFile::makeSection() const
+{
+    return std::unique_ptr<VCDFile>(new VCDFile(*this, Filename));
+}
+
+void VCDFile::writeSection(VCDFile &Section)
+{
+    flush();
+    Buffer.swap(Section.Buffer);
+    flush();
+}
+
+void VCDFile::flush()
+{
+    if (fwrite(Buffer.data(), 1, Buffer.size(), Output) != Buffer.size())
+        reporter->err(1, "%s: write", Filename.c_str());
+    Buffer.clear();
+}
 
 // The identifier is the printable ASCII characters: ! to ~ (decimal 33 to 126).
 static string getVCDRepr(unsigned Id)
@@ -308,6 +357,15 @@ void VCDFile::writeVariableDefinition()
     addVCDKeywords("enddefinitions", "end");
 }
 
-void VCDFile::writeVCDStart() { Output << "$dumpvars" << '\n'; }
+void VCDFile::writeVCDStart()
+{
+    Buffer += "$dumpvars";
+    endRecord();
+}
 
-void VCDFile::writeTime(unsigned long t) { Output << '#' << t << '\n'; }
+void VCDFile::writeTime(unsigned long t)
+{
+    Buffer += '#';
+    appendDecimal(t);
+    endRecord();
+}
@@ -19,8 +19,9 @@
 #ifndef TARMAC_VCD_HH
 #define TARMAC_VCD_HH
 
-#include <fstream>
+#include <cstdio>
 #include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -175,8 +176,27 @@ class VCDFile {
         Signals[SigIdx].writeValueChange(*this, Val);
     }
 
+    // Make a VCDFile with no file of its own, which collects in memory
+    // the value changes of this file's signals written to it. This
+    // lets separate parts of the value change section be rendered
+    // independently, e.g. on different threads, and then written out
+    // in order with writeSection. All the signals must have been added
+    // before making a section.
+    std::unique_ptr<VCDFile> makeSection() const;
+    void writeSection(VCDFile &Section);
+
   private:
-    std::ofstream Output;
+    VCDFile(const VCDFile &Main, const std::string &Filename);
+
+    // Output is collected in Buffer, and only written to the file in
+    // large blocks. Records are appended to it directly, without
+    // constructing temporary strings or going through iostreams,
+    // because a large trace can generate a great many of them.
+    std::string Filename;
+    FILE *Output; // null for a section made by makeSection
+    std::string Buffer;
+    static constexpr size_t FlushThreshold = 1 << 20;
+
     std::string Date;
     std::string Version;
     std::string Comment;
@@ -187,7 +207,28 @@ class VCDFile {
     static std::string chomp(std::string str);
     VCDSignalIndex addSignal(const VCDSignal &Signal);
 
-    void writeValueChange(const std::string &v) { Output << v << '\n'; }
+    void flush();
+
+    // Finish a line of output.
+    void endRecord()
+    {
+        Buffer += '\n';
+        if (Output && Buffer.size() >= FlushThreshold)
+            flush();
+    }
+
+    // Append an unsigned integer to the buffer in decimal.
+    void appendDecimal(unsigned long long u)
+    {
+        char digits[20];
+        size_t n = 0;
+        do {
+            digits[n++] = '0' + u % 10;
+            u /= 10;
+        } while (u);
+        while (n > 0)
+            Buffer += digits[--n];
+    }
 
     void writeSignalDefinition(VCDSignalIndex Idx)
     {
@@ -196,13 +237,18 @@ class VCDFile {
 
     void addVCDKeyword(const char *kw, bool withCR = true)
     {
-        Output << '$' << kw;
+        Buffer += '$';
+        Buffer += kw;
         if (withCR)
-            Output << '\n';
+            endRecord();
     }
     void addVCDKeywords(const char *kw1, const char *kw2)
     {
-        Output << '$' << kw1 << " $" << kw2 << '\n';
+        Buffer += '$';
+        Buffer += kw1;
+        Buffer += " $";
+        Buffer += kw2;
+        endRecord();
     }
 
     void addVCDTextSection(const char *kw, const std::string &text,
@@ -210,9 +256,12 @@ class VCDFile {
     {
         addVCDKeyword(kw, withCR);
         if (!withCR)
-            Output << ' ';
-        Output << text;
-        Output << (withCR ? '\n' : ' ');
+            Buffer += ' ';
+        Buffer += text;
+        if (withCR)
+            endRecord();
+        else
+            Buffer += ' ';
         addVCDKeyword("end", true);
     }
 };
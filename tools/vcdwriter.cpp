@@ -25,10 +25,16 @@
 #include "vcd.hh"
 #include "vcdwriter.hh"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <cstdint>
 #include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 
-using std::ref;
 using std::string;
 using std::vector;
 
@@ -164,13 +170,94 @@ struct CPUDescription {
     }
 };
 
-class VCDVisitor : public ParseReceiver {
-    struct FunctionChange {
-        Time Cycle;
-        string Name;
-        FunctionChange(Time t, const string &n) : Cycle(t), Name(n) {}
-    };
+// The signals of the VCD file, other than the CPU's registers (which
+// are described by CPUDescription). They're added to the file once,
+// and then shared by everything that writes value changes to it.
+struct VCDSignals {
+    const CPUDescription CPU;
+    // The registers in CPU, in the order their changes are written.
+    vector<const CPUDescription::RegisterDesc *> TrackedRegs;
+    vector<RegisterId> TrackedRegIds;
+    const VCD::VCDSignalIndex Cycle;
+    const VCD::VCDSignalIndex Function;
+    const VCD::VCDSignalIndex Inst;
+    const VCD::VCDSignalIndex InstAsm;
+    const VCD::VCDSignalIndex InstExecuted;
+    const VCD::VCDSignalIndex PC;
+    const VCD::VCDSignalIndex MemReadWrite;
+    const VCD::VCDSignalIndex MemAddr;
+    const VCD::VCDSignalIndex MemData;
+
+    VCDSignals(VCD::VCDFile &VCD, bool AArch64)
+        : CPU(AArch64 ? CPUDescription::getV8A(VCD)
+                      : CPUDescription::getV7M(VCD)),
+          Cycle(VCD.addIntSignal("Cycle", 32)),
+          Function(VCD.addTextSignal("Function")),
+          Inst(VCD.addIntSignal("Inst", 32)),
+          InstAsm(VCD.addTextSignal("InstAsm")),
+          InstExecuted(VCD.addBoolSignal("InstExecuted")),
+          PC(VCD.addIntSignal("PC", CPU.AddressBusSize)),
+          MemReadWrite(VCD.addTextSignal("MemRW")),
+          MemAddr(VCD.addIntSignal("MemAddr", CPU.AddressBusSize)),
+          MemData(VCD.addIntSignal("MemData", CPU.DataBusSize))
+    {
+        for (const auto *Bank : {&CPU.CoreRegs, &CPU.SingleRegs, &CPU.DoubleRegs})
+            for (const auto &R : *Bank) {
+                TrackedRegs.push_back(&R);
+                TrackedRegIds.push_back(R.RegId);
+            }
+    }
+    VCDSignals(const VCDSignals &) = delete;
+};
+
+// How many subticks in a tick to represent memory accesses. An instruction
+// might be accessing multiple memory locations (e.g. LDM/STM). In order to
+// display those in the VCD viewer, the instruction duration (assumed to be
+// 1) is split in sub-ticks.
+const Time Timescale = 1000;
+
+struct FunctionChange {
+    Time Cycle;
+    string Name;
+    FunctionChange(Time t, const string &n) : Cycle(t), Name(n) {}
+};
+
+class FCVisitor : public CallTreeVisitor {
+    vector<FunctionChange> &FC;
+    FunctionNameTable Names;
+
+  public:
+    FCVisitor(const CallTreeBase &CT, vector<FunctionChange> &FC)
+        : CallTreeVisitor(CT), FC(FC), Names(CT)
+    {
+    }
+    void onFunctionEntry(const TarmacSite &function_entry,
+                         const TarmacSite &function_exit)
+    {
+        FC.emplace_back(function_entry.time,
+                        Names.getFunctionName(function_entry));
+    }
+    void onResumeSite(const TarmacSite &function_entry,
+                      const TarmacSite &function_exit,
+                      const TarmacSite &resume_site)
+    {
+        FC.emplace_back(resume_site.time,
+                        Names.getFunctionName(function_entry));
+    }
+};
 
+// A run of consecutive nodes of the trace whose value changes are
+// written together, and the state of the output just before them.
+struct VCDSlice {
+    SeqOrderPayload Start; // the first node
+    size_t Nodes;
+    Time Tick;
+    size_t NextFunction; // index in the list of function changes
+};
+
+// Writes the value changes for one VCDSlice, either straight to the
+// VCD file or to a section of it.
+class VCDVisitor : public ParseReceiver {
     struct MemoryAccess {
         Addr Address;
         unsigned long long Data;
@@ -181,59 +268,66 @@ class VCDVisitor : public ParseReceiver {
         }
     };
 
-    class FCVisitor : public CallTreeVisitor {
-        vector<FunctionChange> &FC;
+  public:
+    VCDVisitor(VCD::VCDFile &VCD, const IndexNavigator &IN,
+               const VCDSignals &S, const vector<FunctionChange> &Functions,
+               const VCDSlice &Slice, bool UseTarmacTimestamp)
+        : TLP(IN.index.parseParams(), *this), VCD(VCD), IN(IN), S(S),
+          Functions(Functions), NextFunction(Slice.NextFunction),
+          Tick(Slice.Tick), UseTarmacTimestamp(UseTarmacTimestamp),
+          Priming(false), PrevInstExecuted(), PrevInstPC(-1), PrevInst(-1),
+          hadMemoryAccesses(false)
+    {
+    }
 
-      public:
-        FCVisitor(const CallTree &CT, vector<FunctionChange> &FC)
-            : CallTreeVisitor(CT), FC(FC)
-        {
-        }
-        void onFunctionEntry(const TarmacSite &function_entry,
-                             const TarmacSite &function_exit)
-        {
-            FC.emplace_back(function_entry.time,
-                            CT.getFunctionName(function_entry));
-        }
-        void onResumeSite(const TarmacSite &function_entry,
-                          const TarmacSite &function_exit,
-                          const TarmacSite &resume_site)
-        {
-            FC.emplace_back(resume_site.time,
-                            CT.getFunctionName(function_entry));
-        }
-    };
+    // Recover the state that writing out the nodes before 'start'
+    // would have left: the last instruction, and whether the node just
+    // before had any memory accesses. This parses those nodes, without
+    // writing anything, from the last one with an instruction in it.
+    void prime(const SeqOrderPayload &start)
+    {
+        IndexCursor C(IN);
+        if (!C.goto_line(start.trace_file_firstline) || !C.prev())
+            return; // 'start' is the first node of the trace
+        while (C.node().pc == KNOWN_INVALID_PC && C.prev())
+            ;
+
+        Priming = true;
+        do {
+            parseNode(C.node());
+            hadMemoryAccesses = !MemoryAccesses.empty();
+            MemoryAccesses.clear();
+        } while (C.next() &&
+                 C.node().trace_file_firstline < start.trace_file_firstline);
+        Priming = false;
+    }
 
-  public:
-    VCDVisitor(VCD::VCDFile &VCD, IndexNavigator &IN, bool UseTarmacTimestamp,
-               const CallTreeOptions &ctopts)
-        : TLP(IN.index.parseParams(), *this), VCD(VCD), IN(IN),
-          CPU(IN.index.isAArch64() ? CPUDescription::getV8A(VCD)
-                                   : CPUDescription::getV7M(VCD)),
-          Functions(), Cycle(VCD.addIntSignal("Cycle", 32)),
-          Function(VCD.addTextSignal("Function")),
-          Inst(VCD.addIntSignal("Inst", 32)),
-          InstAsm(VCD.addTextSignal("InstAsm")),
-          InstExecuted(VCD.addBoolSignal("InstExecuted")),
-          PC(VCD.addIntSignal("PC", CPU.AddressBusSize)),
-          MemReadWrite(VCD.addTextSignal("MemRW")),
-          MemAddr(VCD.addIntSignal("MemAddr", CPU.AddressBusSize)),
-          MemData(VCD.addIntSignal("MemData", CPU.DataBusSize)),
-          Tick(UseTarmacTimestamp ? 0 : -1),
-          UseTarmacTimestamp(UseTarmacTimestamp), PrevInstExecuted(),
-          PrevInstPC(-1), PrevInst(-1), hadMemoryAccesses(false)
+    // Write the values the registers had just before 'start', and the
+    // last instruction before it, for a VCD file that starts part way
+    // through the trace. Should be called after prime(), and before
+    // writing any nodes.
+    void writeInitialState(const SeqOrderPayload &start)
     {
-        CallTree CT(IN);
-        CT.setOptions(ctopts);
-        FCVisitor FCV(CT, Functions);
-        CT.rvisit(FCV);
-        VCD.writeVariableDefinition();
-        VCD.writeVCDStart();
-        // If there were any initial state to write, this should be done here,
-        // in between the call to writeVCDStart and the first writeTime.
+        SeqOrderPayload node = start, prev;
+        if (!IN.get_previous_node(node, &prev))
+            return;
+
+        vector<RegisterValue> Values =
+            IN.get_regs(prev.memory_root, S.TrackedRegIds);
+        for (size_t i = 0; i < S.TrackedRegs.size(); i++)
+            if (std::find(Values[i].def.begin(), Values[i].def.end(), 0) ==
+                Values[i].def.end())
+                writeRegister(i, Values[i]);
+
+        if (PrevInstPC != (Addr)-1) {
+            VCD.writeValueChange(S.InstExecuted, PrevInstExecuted);
+            VCD.writeValueChange<long unsigned int>(S.PC, PrevInstPC);
+            VCD.writeValueChange<long unsigned int>(S.Inst, PrevInst);
+            VCD.writeValueChange(S.InstAsm, PrevInstAsm);
+        }
     }
 
-    void operator()(const SeqOrderPayload &sop, OFF_T)
+    void operator()(const SeqOrderPayload &sop)
     {
         if (UseTarmacTimestamp)
             tick(sop.mod_time);
@@ -241,34 +335,26 @@ class VCDVisitor : public ParseReceiver {
             tick();
 
         // Output current simulation cycle.
-        VCD.writeValueChange<long unsigned int>(Cycle, sop.mod_time);
-        vector<std::string> lines = IN.index.get_trace_lines(sop);
-        for (const string &line : lines) {
-            try {
-                TLP.parse(line);
-            } catch (TarmacParseError err) {
-                // Ignore parse failures; we just leave the output event
-                // fields set to null.
-            }
-        }
+        VCD.writeValueChange<long unsigned int>(S.Cycle, sop.mod_time);
+        parseNode(sop);
         // Output the name of the current function if it changed.
-        if (!Functions.empty() && Functions.back().Cycle == sop.mod_time) {
-            VCD.writeValueChange(Function, Functions.back().Name);
-            Functions.pop_back();
+        if (NextFunction < Functions.size() &&
+            Functions[NextFunction].Cycle == sop.mod_time) {
+            VCD.writeValueChange(S.Function, Functions[NextFunction].Name);
+            NextFunction++;
         }
 
         // Let's find the updated registers.
-        unsigned iflags = IN.get_iflags(sop.memory_root);
-        findRegisterChanges(CPU.CoreRegs, iflags, sop);
-        findRegisterChanges(CPU.SingleRegs, iflags, sop);
-        findRegisterChanges(CPU.DoubleRegs, iflags, sop);
+        findRegisterChanges(sop);
 
         // And the memory accesses...
         if (hadMemoryAccesses && MemoryAccesses.empty()) {
-            VCD.writeValueChange(MemReadWrite,
+            VCD.writeValueChange(S.MemReadWrite,
+                                 VCD::VCDSignal::ExtraState::TriState);
+            VCD.writeValueChange(S.MemAddr,
+                                 VCD::VCDSignal::ExtraState::TriState);
+            VCD.writeValueChange(S.MemData,
                                  VCD::VCDSignal::ExtraState::TriState);
-            VCD.writeValueChange(MemAddr, VCD::VCDSignal::ExtraState::TriState);
-            VCD.writeValueChange(MemData, VCD::VCDSignal::ExtraState::TriState);
         }
         hadMemoryAccesses = !MemoryAccesses.empty();
 
@@ -287,9 +373,9 @@ class VCDVisitor : public ParseReceiver {
                 if (ma > 0)
                     subtick(ma * Timescale / N);
                 const MemoryAccess &M = MemoryAccesses[ma];
-                VCD.writeValueChange(MemReadWrite, M.Read ? "R" : "W");
-                VCD.writeValueChange<long unsigned int>(MemAddr, M.Address);
-                VCD.writeValueChange<long unsigned int>(MemData, M.Data);
+                VCD.writeValueChange(S.MemReadWrite, M.Read ? "R" : "W");
+                VCD.writeValueChange<long unsigned int>(S.MemAddr, M.Address);
+                VCD.writeValueChange<long unsigned int>(S.MemData, M.Data);
             }
 
             MemoryAccesses.clear();
@@ -306,82 +392,80 @@ class VCDVisitor : public ParseReceiver {
 
     virtual void got_event(InstructionEvent &ev) override
     {
+        if (Priming) {
+            PrevInstExecuted = (ev.effect == IE_EXECUTED);
+            PrevInstPC = ev.pc;
+            PrevInst = ev.instruction;
+            PrevInstAsm = trimSpacesAndComment(ev.disassembly);
+            return;
+        }
+
         bool executed = (ev.effect == IE_EXECUTED);
         if (PrevInstExecuted != executed) {
-            VCD.writeValueChange(InstExecuted, executed);
+            VCD.writeValueChange(S.InstExecuted, executed);
             PrevInstExecuted = executed;
         }
 
         if (PrevInstPC != ev.pc) {
-            VCD.writeValueChange<long unsigned int>(PC, ev.pc);
+            VCD.writeValueChange<long unsigned int>(S.PC, ev.pc);
             PrevInstPC = ev.pc;
         }
 
         if (PrevInst != ev.instruction) {
-            VCD.writeValueChange<long unsigned int>(Inst, ev.instruction);
-            VCD.writeValueChange(InstAsm, trimSpacesAndComment(ev.disassembly));
+            VCD.writeValueChange<long unsigned int>(S.Inst, ev.instruction);
+            VCD.writeValueChange(S.InstAsm,
+                                 trimSpacesAndComment(ev.disassembly));
             PrevInst = ev.instruction;
         }
     }
 
-    void finish() { tick(); }
-
   private:
     TarmacLineParser TLP;
     VCD::VCDFile &VCD;
-    IndexNavigator &IN;
-    const CPUDescription CPU;
-    vector<FunctionChange> Functions;
+    const IndexNavigator &IN;
+    const VCDSignals &S;
+    const vector<FunctionChange> &Functions;
+    size_t NextFunction;
     vector<MemoryAccess> MemoryAccesses;
-    const VCD::VCDSignalIndex Cycle;
-    const VCD::VCDSignalIndex Function;
-    const VCD::VCDSignalIndex Inst;
-    const VCD::VCDSignalIndex InstAsm;
-    const VCD::VCDSignalIndex InstExecuted;
-    const VCD::VCDSignalIndex PC;
-    const VCD::VCDSignalIndex MemReadWrite;
-    const VCD::VCDSignalIndex MemAddr;
-    const VCD::VCDSignalIndex MemData;
     // Tick represent the time at which an instruction executes. It is either
     // the time of the previous instruction + 1 * Timescale, or when the
     // --use-tarmac-timestamps option is used, the timestamp of the instruction
     // (* Timescale). In its current form, the VCD writer can not represent
     // instructions executing with the same timestamp from the tarmac trace.
-    // Note: it is initialized to -1 so that the first instruction gets ticked
-    // to 0 (when not using tarmac timestamps).
     Time Tick;
-    // How many subticks in a tick to represent memory accesses. An instruction
-    // might be accessing multiple memory locations (e.g. LDM/STM). In order to
-    // display those in the VCD viewer, the instruction duration (assumed to be
-    // 1) is split in sub-ticks.
-    static const constexpr Time Timescale = 1000;
     bool UseTarmacTimestamp;
 
+    // Set while prime() is parsing nodes that aren't to be written.
+    bool Priming;
+
     bool PrevInstExecuted;
     Addr PrevInstPC;
     unsigned PrevInst;
+    string PrevInstAsm; // only kept by prime()
     bool hadMemoryAccesses;
 
+    void parseNode(const SeqOrderPayload &sop)
+    {
+        for (const StringSpan &line : IN.index.get_trace_line_spans(sop)) {
+            try {
+                TLP.parse(line.data, line.size);
+            } catch (TarmacParseError err) {
+                // Ignore parse failures; we just leave the output event
+                // fields set to null.
+            }
+        }
+    }
+
     void tick()
     {
         Tick += 1;
         VCD.writeTime(Tick * Timescale);
     }
 
+    // The timestamps have already been checked to be in order, by
+    // VCDWriter::run before any of the output was written.
     void tick(Time mod_time)
     {
-        if (mod_time < Tick)
-            reporter->errx(1,
-                           _("Error: tarmac trace is not "
-                             "chronologically ordered (time %llu follows "
-                             "time %llu)."),
-                           mod_time, Tick);
-        if (mod_time == Tick && Tick != 0)
-            reporter->warnx(
-                _("Warning: time is not increasing strictly monotonically "
-                  "between instructions at time %llu. You should consider "
-                  "*not* using option --use-tarmac-timestamps."),
-                mod_time);
         Tick = mod_time;
         VCD.writeTime(Tick * Timescale);
     }
@@ -393,42 +477,191 @@ class VCDVisitor : public ParseReceiver {
         VCD.writeTime(Tick * Timescale + delta);
     }
 
-    void
-    findRegisterChanges(const vector<CPUDescription::RegisterDesc> &RegBank,
-                        unsigned iflags, const SeqOrderPayload &sop)
+    void writeRegister(size_t i, const RegisterValue &V)
     {
-        for (const auto &R : RegBank) {
-            Addr roffset = reg_offset(R.RegId, iflags);
-            Addr diff_lo, diff_hi;
-            if (IN.find_next_mod(sop.memory_root, 'r', roffset,
-                                 sop.trace_file_firstline, +1, diff_lo,
-                                 diff_hi) &&
-                diff_lo < roffset + R.Size) {
-                vector<unsigned char> val(R.Size);
-                if (IN.get_reg_bytes(sop.memory_root, R.RegId, val))
-                    VCD.writeValueChange(R.VCDIdx, [&val](unsigned bit) {
-                        return bit / 8 < val.size()
-                                   ? (1 & (val[bit / 8] >> (bit % 8)))
-                                   : 0;
-                    });
-            }
+        VCD.writeValueChange(S.TrackedRegs[i]->VCDIdx, [&V](unsigned bit) {
+            return bit / 8 < V.val.size() ? (1 & (V.val[bit / 8] >> (bit % 8)))
+                                          : 0;
+        });
+    }
+
+    void findRegisterChanges(const SeqOrderPayload &sop)
+    {
+        // Read all the registers, and which of them this node
+        // modified, in one pass over the memory tree.
+        vector<RegisterValue> Values =
+            IN.get_regs(sop.memory_root, S.TrackedRegIds, sop.memory_root,
+                        sop.trace_file_firstline);
+        for (size_t i = 0; i < S.TrackedRegs.size(); i++) {
+            const RegisterValue &V = Values[i];
+            if (!V.changed || std::find(V.def.begin(), V.def.end(), 0) !=
+                                  V.def.end())
+                continue;
+            writeRegister(i, V);
         }
     }
 };
 
+// When the output is written by more than one thread, the trace is
+// divided into slices of this many nodes, and each thread writes a
+// slice at a time into memory. The slices are written to the file in
+// order, and threads don't get more than this many slices each ahead
+// of the one being written, which bounds the memory used.
+const size_t VCD_SLICE_NODES = 8192;
+const unsigned VCD_SLICES_AHEAD_PER_THREAD = 2;
+
 } // namespace
 
 void VCDWriter::run(const string &VCDFilename, bool NoDate,
-                    const CallTreeOptions &ctopts, bool UseTarmacTimestamp)
+                    const CallTreeOptions &ctopts, bool UseTarmacTimestamp,
+                    const CallTreeWindowOptions &wopts, unsigned Threads)
 {
     VCD::VCDFile VCD("CPU", VCDFilename, NoDate);
     VCD.setComment("Generated by tarmac-vcd.");
     VCD.setVersion("tarmac-vcd 0.0");
     VCD.writeHeader();
 
-    VCDVisitor V(VCD, *this, UseTarmacTimestamp, ctopts);
-    index.seqtree.visit(index.seqroot, ref(V));
-    V.finish();
+    const VCDSignals S(VCD, index.isAArch64());
+
+    // Find every change of the current function in advance.
+    vector<FunctionChange> Functions;
+    CallTreeWalker CT(*this);
+    CT.setOptions(ctopts);
+    CT.setWindow(wopts);
+    FCVisitor FCV(CT, Functions);
+    CT.walk(FCV);
+
+    SeqOrderPayload First, Last;
+    bool Windowed = CT.getWindow(First, Last);
+    if (Windowed) {
+        // Every call in progress at the start of the window is
+        // reported as entered at its first node, but only the
+        // innermost one is the current function there.
+        size_t n = 0;
+        while (n < Functions.size() && Functions[n].Cycle == First.mod_time)
+            n++;
+        if (n > 1)
+            Functions.erase(Functions.begin(), Functions.begin() + (n - 1));
+    }
+
+    VCD.writeVariableDefinition();
+    VCD.writeVCDStart();
+
+    // Go through the nodes to be written, checking their timestamps,
+    // and dividing them into slices. This only looks at the nodes'
+    // payloads, which is quick compared to writing them out.
+    index.advise(AccessPattern::Sequential);
+    vector<VCDSlice> Slices;
+    size_t SliceNodes = Threads > 1 ? VCD_SLICE_NODES : SIZE_MAX;
+    // Tick is initialized to -1 so that the first instruction gets
+    // ticked to 0 (when not using tarmac timestamps).
+    Time Tick = UseTarmacTimestamp ? 0 : -1;
+    size_t NextFunction = 0;
+    IndexCursor C(*this);
+    if (Windowed ? C.goto_line(First.trace_file_firstline)
+                 : (C.goto_start() && find_buffer_limit(true, &Last))) {
+        do {
+            const SeqOrderPayload &sop = C.node();
+            if (Slices.empty() || Slices.back().Nodes == SliceNodes)
+                Slices.push_back({sop, 0, Tick, NextFunction});
+            Slices.back().Nodes++;
+
+            if (!UseTarmacTimestamp) {
+                Tick++;
+            } else {
+                if (sop.mod_time < Tick)
+                    reporter->errx(1,
+                                   _("Error: tarmac trace is not "
+                                     "chronologically ordered (time %llu "
+                                     "follows time %llu)."),
+                                   sop.mod_time, Tick);
+                if (sop.mod_time == Tick && Tick != 0)
+                    reporter->warnx(
+                        _("Warning: time is not increasing strictly "
+                          "monotonically between instructions at time "
+                          "%llu. You should consider *not* using option "
+                          "--use-tarmac-timestamps."),
+                        sop.mod_time);
+                Tick = sop.mod_time;
+            }
+            if (NextFunction < Functions.size() &&
+                Functions[NextFunction].Cycle == sop.mod_time)
+                NextFunction++;
+        } while (C.node().trace_file_firstline < Last.trace_file_firstline &&
+                 C.next());
+    }
+
+    auto WriteSlice = [&](VCD::VCDFile &Out, size_t i) {
+        const VCDSlice &Slice = Slices[i];
+        VCDVisitor V(Out, *this, S, Functions, Slice, UseTarmacTimestamp);
+        V.prime(Slice.Start);
+        if (Windowed && i == 0)
+            V.writeInitialState(Slice.Start);
+        IndexCursor SC(*this);
+        SC.goto_line(Slice.Start.trace_file_firstline);
+        for (size_t n = 0; n < Slice.Nodes; n++) {
+            if (n > 0)
+                SC.next();
+            V(SC.node());
+        }
+    };
+
+    if (Threads <= 1 || Slices.size() <= 1) {
+        for (size_t i = 0; i < Slices.size(); i++)
+            WriteSlice(VCD, i);
+    } else {
+        // Each thread takes the next slice nobody has started on, and
+        // writes it into a section of its own, which this thread then
+        // writes to the file once all the slices before it are done.
+        struct Pending {
+            std::unique_ptr<VCD::VCDFile> Section;
+            bool Done = false;
+        };
+        vector<Pending> Sections(Slices.size());
+        std::mutex Mutex;
+        std::condition_variable Cond;
+        size_t Written = 0;
+        std::atomic<size_t> NextSlice(0);
+        size_t MaxAhead = Threads * VCD_SLICES_AHEAD_PER_THREAD;
+
+        vector<std::future<void>> Workers;
+        for (unsigned t = 0; t < Threads; t++) {
+            Workers.push_back(std::async(std::launch::async, [&]() {
+                size_t i;
+                while ((i = NextSlice++) < Slices.size()) {
+                    {
+                        std::unique_lock<std::mutex> Lock(Mutex);
+                        Cond.wait(Lock, [&]() { return i < Written + MaxAhead; });
+                    }
+                    std::unique_ptr<VCD::VCDFile> Section = VCD.makeSection();
+                    WriteSlice(*Section, i);
+                    {
+                        std::lock_guard<std::mutex> Lock(Mutex);
+                        Sections[i].Section = std::move(Section);
+                        Sections[i].Done = true;
+                    }
+                    Cond.notify_all();
+                }
+            }));
+        }
+
+        for (size_t i = 0; i < Slices.size(); i++) {
+            std::unique_ptr<VCD::VCDFile> Section;
+            {
+                std::unique_lock<std::mutex> Lock(Mutex);
+                Cond.wait(Lock, [&]() { return Sections[i].Done; });
+                Section = std::move(Sections[i].Section);
+                Written = i + 1;
+            }
+            Cond.notify_all();
+            VCD.writeSection(*Section);
+        }
+        for (auto &W : Workers)
+            W.get();
+    }
+
+    // Finish with one more tick after the last node.
+    VCD.writeTime((Tick + 1) * Timescale);
 }
 
 #include "libtarmac/argparse.hh"
@@ -448,12 +681,15 @@ int main(int argc, char **argv)
     iparams.record_memory = false;
 
     CallTreeOptions ctopts;
+    CallTreeWindowOptions wopts;
+    unsigned threads = 1;
 
     Argparse ap("tarmac-vcd", argc, argv);
     TarmacUtility tu;
     tu.set_indexer_params(iparams);
     tu.add_options(ap);
     ctopts.add_options(ap);
+    wopts.add_options(ap);
 
     ap.optval({"-o", "--output"}, _("VCDFILE"),
               _("VCD file name (default: tarmac_filename.vcd)"),
@@ -463,15 +699,28 @@ int main(int argc, char **argv)
     ap.optnoval({"--use-tarmac-timestamps"},
                 _("Use the instructions' timestamps from the tarmac trace."),
                 [&]() { use_tarmac_timestamp = true; });
-
-    ap.parse();
+    ap.optval({"--threads"}, _("N"),
+              _("use N threads to write the VCD file"),
+              [&](const string &s) {
+                  unsigned long n = stoul(s, nullptr, 0);
+                  if (n < 1)
+                      throw ArgparseError(_("--threads requires at least 1"));
+                  threads = n;
+              });
+
+    ap.parse([&]() {
+        if (!wopts.root_function.empty())
+            throw ArgparseError(
+                _("--root-function is not supported by tarmac-vcd"));
+    });
     tu.setup();
 
     if (vcd_filename.size() == 0)
         vcd_filename = tu.trace.tarmac_filename + ".vcd";
 
     VCDWriter VW(tu.trace, tu.image_filename, tu.load_offset);
-    VW.run(vcd_filename, no_date, ctopts, use_tarmac_timestamp);
+    VW.run(vcd_filename, no_date, ctopts, use_tarmac_timestamp, wopts,
+           threads);
 
     return 0;
 }
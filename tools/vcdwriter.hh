@@ -30,8 +30,12 @@ class VCDWriter : public IndexNavigator {
   public:
     VCDWriter(const VCDWriter &) = delete;
 
+    // Write the VCD file for the part of the trace selected by
+    // 'wopts', using 'Threads' threads. Its root_function option is
+    // not supported.
     void run(const std::string &VCDFilename, bool NoDate,
-             const CallTreeOptions &ctopts, bool UseTarmacTimestamp = false);
+             const CallTreeOptions &ctopts, bool UseTarmacTimestamp = false,
+             const CallTreeWindowOptions &wopts = {}, unsigned Threads = 1);
 };
 
 #endif // TARMAC_VCDWRITER_HH
@@ -0,0 +1,155 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/index.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/registers.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/tarmacutil.hh"
+
+#include <ctype.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::string;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+namespace {
+
+// A region of register or memory space to list the writes to, as
+// given on the command line.
+struct Region {
+    string spec;
+    char type;
+    Addr addr;
+    size_t size;
+};
+
+// Parse a region given as an address, with an optional size in bytes
+// after a '+' (default 1), or as a register name, or as the name of
+// a symbol in the image.
+bool parse_region(const IndexNavigator &IN, const string &spec, Region &r)
+{
+    r.spec = spec;
+
+    if (!spec.empty() && isdigit((unsigned char)spec[0])) {
+        size_t plus = spec.find('+');
+        try {
+            size_t pos;
+            r.type = 'm';
+            r.addr = stoull(spec.substr(0, plus), &pos, 0);
+            if (pos != spec.substr(0, plus).size())
+                return false;
+            r.size = 1;
+            if (plus != string::npos) {
+                r.size = stoull(spec.substr(plus + 1), &pos, 0);
+                if (pos != spec.size() - (plus + 1) || r.size == 0)
+                    return false;
+            }
+        } catch (std::logic_error &) {
+            return false;
+        }
+        return true;
+    }
+
+    RegisterId reg;
+    if (lookup_reg_name(reg, spec)) {
+        unsigned iflags = (IN.index.isAArch64() ? IFLAG_AARCH64 : 0) |
+                          (IN.index.isBigEndian() ? IFLAG_BIGEND : 0);
+        r.type = 'r';
+        r.addr = reg_offset(reg, iflags);
+        r.size = reg_size(reg);
+        return true;
+    }
+
+    uint64_t addr;
+    size_t size;
+    if (IN.lookup_symbol(spec, addr, size)) {
+        r.type = 'm';
+        r.addr = addr;
+        r.size = size ? size : 1;
+        return true;
+    }
+
+    return false;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    gettext_setup(true);
+
+    vector<string> specs;
+
+    IndexerParams iparams;
+    iparams.record_writes = true;
+
+    Argparse ap("tarmac-writes", argc, argv);
+    TarmacUtility tu;
+    tu.set_indexer_params(iparams);
+    tu.add_options(ap);
+
+    ap.positional_multiple(
+        _("REGION"),
+        _("register, symbol, or address with optional '+' and size in bytes, "
+          "to list the writes to"),
+        [&](const string &s) { specs.push_back(s); });
+
+    ap.parse([&]() {
+        if (specs.empty())
+            throw ArgparseError(_("expected at least one region"));
+    });
+    tu.setup();
+
+    IndexNavigator IN(tu.trace, tu.image_filename, tu.load_offset);
+
+    for (const string &spec : specs) {
+        Region r;
+        if (!parse_region(IN, spec, r)) {
+            reporter->warnx(_("unable to interpret '%s' as a register, symbol "
+                              "or address"),
+                            spec.c_str());
+            continue;
+        }
+
+        if (r.type == 'r')
+            cout << format(_("Writes to register {}:"), spec) << "\n";
+        else
+            cout << format(_("Writes to {} ({:#x}, {} bytes):"), spec, r.addr,
+                           r.size)
+                 << "\n";
+
+        for (const WritePayload &wp : IN.find_writes(r.type, r.addr, r.size)) {
+            cout << " - time: " << wp.mod_time
+                 << " (line:" << (wp.trace_file_firstline + IN.index.lineno_offset)
+                 << ", pos:" << wp.trace_file_pos << ")";
+            if (r.type == 'm')
+                cout << format(" {:#x}-{:#x}", wp.lo, wp.hi);
+            cout << "\n";
+        }
+    }
+
+    return 0;
+}